@@ -0,0 +1,75 @@
+﻿#ifndef __NGX_BINLOG_H__
+#define __NGX_BINLOG_H__
+
+// 二进制日志：高频事件（accept、踢人、CRC错误、flood）在worker里不做任何格式化，
+// 只把格式编号+原始参数写进日志缓冲区，由离线工具tools/ngx_binlog_decode展开成和文本日志一样的行
+// 本文件服务器和解码工具共用，只能包含格式表和记录结构，不要引入服务器的其他头文件
+
+#include <stdint.h>
+
+#include "ngx_macro.h"
+
+#define NGX_BINLOG_MAGIC "NGXBLOG1" // 二进制日志文件头
+#define NGX_BINLOG_VERSION 1		// 记录结构变了才改这个，格式表只追加不修改，不用改版本
+#define NGX_BINLOG_MAX_ARGS 8		// 一条记录最多这么多个参数
+
+// 格式表：X(格式编号, 日志等级, 格式串)
+// 格式串的写法和ngx_log_error_core()一样，但只支持整数类的格式：%d %ud %i %ui %L %uL %xd %Xd %P %p
+// 编号就是在表中的位置，已经用过的条目不能删除，也不能改参数的个数和类型，要改就在末尾加一条新的，否则老日志文件解出来就乱了
+#define NGX_BINLOG_FORMATS(X)                                                                                             \
+	X(NGX_BL_ACCEPT, NGX_LOG_NOTICE, "CSocket::ngx_event_accept()中accept了一个客户端连接，fd=%d，当前在线%d人")        \
+	X(NGX_BL_KICK_SENDQUEUE, NGX_LOG_STDERR, "CSocket::msgSend()中发现某用户%d积压了大量待发送数据包，切断与他的连接！") \
+	X(NGX_BL_CRC_ERROR, NGX_LOG_STDERR, "CLogicSocket::threadRecvProcFunc()中CRC错误[服务器:%d/客户端:%d]，丢弃数据!")   \
+	X(NGX_BL_FLOOD_KICK, NGX_LOG_WARN, "CSocket::ngx_read_request_handler()中发现用户%d发包太频繁(flood)，切断与他的连接！")
+
+#define NGX_BINLOG_ID(id, level, fmt) id,
+enum ngx_binlog_id_e
+{
+	NGX_BINLOG_FORMATS(NGX_BINLOG_ID)
+	NGX_BL_MAX
+};
+#undef NGX_BINLOG_ID
+
+typedef struct
+{
+	int level;		 // 日志等级，过滤和解码都用它
+	const char *fmt; // 格式串
+} ngx_binlog_format_t;
+
+#define NGX_BINLOG_FMT(id, level, fmt) {level, fmt},
+static constexpr ngx_binlog_format_t ngx_binlog_formats[] = {NGX_BINLOG_FORMATS(NGX_BINLOG_FMT)};
+#undef NGX_BINLOG_FMT
+
+// 文件头，日志文件为空时由master进程写入
+typedef struct
+{
+	char magic[8];	  // NGX_BINLOG_MAGIC，不带结尾的\0
+	uint32_t version; // NGX_BINLOG_VERSION
+	uint32_t recsize; // sizeof(ngx_binlog_rec_t)，解码时校验
+} ngx_binlog_filehdr_t;
+
+// 一条记录：固定24字节的头，后边紧跟nargs个int64_t参数，整条记录一次放进缓冲区，不会被别的记录插进来
+typedef struct
+{
+	uint64_t usec;	 // 时间，从1970年开始的微秒数
+	uint16_t id;	 // 格式编号，ngx_binlog_id_e
+	uint8_t nargs;	 // 参数个数
+	uint8_t level;	 // 日志等级
+	int32_t pid;	 // 进程id
+	int32_t err;	 // errno，0表示没有
+	uint32_t reserved;
+} ngx_binlog_rec_t;
+
+// 编译期数一数格式串中有几个参数，%%不算
+constexpr int ngx_binlog_argc(const char *s)
+{
+	return *s == 0 ? 0 : (*s != '%' ? ngx_binlog_argc(s + 1) : (s[1] == '%' ? ngx_binlog_argc(s + 2) : 1 + ngx_binlog_argc(s + 1)));
+}
+
+// 编译期检查格式串中有没有%s和%f，二进制日志只保存整数，字符串指针和浮点数解码时没法还原
+constexpr bool ngx_binlog_fmtok(const char *s, bool inspec)
+{
+	return *s == 0 ? true : (inspec ? ((*s == 's' || *s == 'f') ? false : (((*s >= '0' && *s <= '9') || *s == 'u' || *s == 'x' || *s == 'X') ? ngx_binlog_fmtok(s + 1, true) : ngx_binlog_fmtok(s + 1, false))) : ngx_binlog_fmtok(s + 1, *s == '%'));
+}
+
+#endif
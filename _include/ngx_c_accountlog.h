@@ -0,0 +1,90 @@
+﻿#ifndef __NGX_C_ACCOUNTLOG_H__
+#define __NGX_C_ACCOUNTLOG_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <vector>
+
+#include "ngx_c_accountstore.h"
+
+#define NGX_ACCOUNT_LOG_MAGIC 0x4e414332 // 每条日志记录的开头，"NAC2"，记录里保存的是凭据而不是明文密码
+#define NGX_ACCOUNT_LOG_REGISTER 1		 // 日志记录类型：注册
+
+// 账号日志(WAL)和快照文件中的一条记录，固定128字节，快照文件就是只有注册记录的日志文件
+typedef struct _ngx_account_logrec_s
+{
+	uint32_t magic;						 // NGX_ACCOUNT_LOG_MAGIC
+	int crc32;							 // 从op开始到记录结尾的crc32，用于发现写了一半的记录
+	int op;								 // 记录类型，NGX_ACCOUNT_LOG_XXX
+	int iType;							 // 注册时带过来的类型
+	int64_t regTime;					 // 注册时间
+	char username[NGX_ACCOUNT_NAME_LEN]; // 用户名
+	ngx_account_cred_t cred;			 // 凭据（盐+密码hash）
+} ngx_account_logrec_t, *lpngx_account_logrec_t;
+
+// 一条等待提交的记录
+typedef struct _ngx_account_pending_s
+{
+	ngx_account_logrec_t rec;
+	int *pResult; // 指向等待的注册线程栈上的变量，提交完了填进去：1落盘了，-1失败了；等超时了的是NULL
+} ngx_account_pending_t;
+
+// 账号存储的预写日志(write-ahead log)
+// 日志分段：每个worker进程启动时新建一个自己的日志段（AccountLogFile后边加.1、.2……），只有它的提交线程往里写，互不干扰
+// master进程启动时：映射快照文件和所有的日志段恢复账号存储，然后生成新快照、删掉日志段
+// worker进程中：注册请求把日志记录交给提交线程，提交线程把同一时间段内攒下的记录合并成一次write()+fdatasync()（组提交），
+//              记录落盘之后注册请求才返回，才给客户端回应答
+class CAccountLog
+{
+private:
+	CAccountLog();
+	~CAccountLog();
+	CAccountLog(const CAccountLog &);
+	CAccountLog &operator=(const CAccountLog &);
+
+public:
+	static CAccountLog *GetInstance()
+	{
+		static CAccountLog c;
+		return &c;
+	}
+
+public:
+	bool Open(const char *pLogName, const char *pSnapName); // master进程中执行：恢复数据，pLogName是日志段文件名的前缀
+	bool Start(int maxBatch, int groupWaitUs, int timeoutMs); // worker进程中执行：新建本进程的日志段，启动提交线程
+	void Stop();											// worker进程中执行：把没提交的提交完，停止提交线程
+	int RegisterAccount(const char *username, const lpngx_account_cred_t pCred, int iType, time_t regTime); // 注册一个账号，落盘之后才能登录，返回NGX_ACCOUNT_XXX
+	bool IsOpen() { return m_bOpen; }
+
+private:
+	static void *ServerCommitThread(void *threadData); // 提交线程
+	int AppendAndWait(const char *username, const lpngx_account_cred_t pCred, int iType, time_t regTime); // 写一条注册日志并等待它落盘，返回NGX_ACCOUNT_LOG_XXX
+	static void FillRecord(lpngx_account_logrec_t pRec, const char *username, const lpngx_account_cred_t pCred, int iType, time_t regTime);
+	static void SnapshotOneAccount(lpngx_account_t pAccount, void *arg);
+	int Replay(const char *pFileName, bool &iftorn); // 把一个日志/快照文件中的记录重放到账号存储中，返回重放的条数，文件不存在返回0，出错返回-1
+	bool WriteSnapshot(const char *pSnapName);		 // 把账号存储的全部内容写成新的快照文件
+	void ListSegments(std::vector<unsigned int> &segs); // 找出目录中现有的日志段，按序号从小到大排好
+	bool OpenSegment();								 // 新建一个日志段给本进程用
+
+private:
+	bool m_bOpen;			   // 开了账号日志，并且已经恢复完了
+	char m_szLogPrefix[256];   // 日志段文件名的前缀，日志段是"前缀.序号"
+	int m_fdLog;			   // 本进程的日志段的句柄，O_APPEND打开，只有提交线程写，-1表示没有可用的日志段
+	off_t m_iLogSize;		   // 日志段中已经落盘的长度，写失败时截回到这里
+	int m_iMaxBatch;		   // 一次组提交最多合并这么多条记录
+	int m_iGroupWaitUs;		   // 提交线程被唤醒后再多等这么多微秒，多攒一些记录再提交，0表示不等
+	int m_iTimeoutMs;		   // 注册请求最多等这么多毫秒，还没落盘就算失败
+	bool m_bStop;			   // 提交线程退出标志
+	bool m_bStarted;		   // 提交线程是否已经启动
+	pthread_t m_hCommitThread; // 提交线程句柄
+
+	pthread_mutex_t m_logMutex;	   // 保护下边这些成员
+	pthread_cond_t m_commitCond;   // 有新记录了，通知提交线程
+	pthread_cond_t m_durableCond;  // 一批记录提交完了，通知等待的注册线程
+	std::vector<ngx_account_pending_t> m_pending; // 等待提交的记录
+	std::vector<int *> m_inflight; // 正在写盘的这一批记录的结果放在哪里，和提交线程手里的记录一一对应，等超时了的改成NULL
+};
+
+#endif
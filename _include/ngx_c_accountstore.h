@@ -0,0 +1,105 @@
+﻿#ifndef __NGX_C_ACCOUNTSTORE_H__
+#define __NGX_C_ACCOUNTSTORE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define NGX_ACCOUNT_NAME_LEN 56 // 用户名长度，和STRUCT_REGISTER/STRUCT_LOGIN中的username一致
+#define NGX_ACCOUNT_PASS_LEN 40 // 密码长度，和STRUCT_REGISTER/STRUCT_LOGIN中的password一致
+#define NGX_ACCOUNT_SALT_LEN 12 // 盐的长度
+#define NGX_ACCOUNT_HASH_LEN 32 // 密码hash值的长度（PBKDF2-HMAC-SHA256）
+
+// 账号存储操作的结果
+#define NGX_ACCOUNT_OK 0		// 成功
+#define NGX_ACCOUNT_EXISTS 1	// 注册时用户名已经存在
+#define NGX_ACCOUNT_NOTFOUND 2	// 登录时用户名不存在
+#define NGX_ACCOUNT_BADPASS 3	// 登录时密码不对
+#define NGX_ACCOUNT_FULL 4		// 账号数量达到上限（内存上限）
+#define NGX_ACCOUNT_IOERR 5		// 注册记录没能落盘
+
+// 账号凭据：不保存明文密码，只保存加盐的慢hash，迭代次数随凭据一起保存，调整配置后老账号照样能登录
+typedef struct _ngx_account_cred_s
+{
+	uint32_t iterations;						// PBKDF2迭代次数
+	unsigned char salt[NGX_ACCOUNT_SALT_LEN];	// 盐，注册时随机生成
+	unsigned char hash[NGX_ACCOUNT_HASH_LEN];	// PBKDF2-HMAC-SHA256(密码, 盐, 迭代次数)
+} ngx_account_cred_t, *lpngx_account_cred_t;
+
+// 一条账号记录，固定128字节，不跨缓存行边界
+// 槽位一旦发布（tag写上）就只会改tag和lastLoginTime，删除只是把tag改成墓碑，槽位不复用，所以登录不用加锁
+// tag的最低两位是槽位的状态：01正常，11占住了还没落盘（登录看不到），10墓碑
+typedef struct _ngx_account_s
+{
+	uint32_t tag;						   // 用户名hash值的高32位+状态，0表示空槽位，比较用户名前先比较这个
+	int iType;							   // 注册时带过来的类型
+	time_t regTime;						   // 注册时间
+	time_t lastLoginTime;				   // 上次登录时间，登录时不加锁原子地写
+	char username[NGX_ACCOUNT_NAME_LEN];   // 用户名
+	ngx_account_cred_t cred;			   // 凭据
+} ngx_account_t, *lpngx_account_t;
+
+// 一个分片：一张开放寻址(线性探测)的hash表 + 一把互斥量，分片结构本身占满一个缓存行，防止不同分片的锁互相干扰
+// 只有注册/删除要加锁，登录完全不加锁；锁是健壮(robust)的，持有它的worker进程死了，下一个加锁的进程接手，不会把大家都卡死
+typedef struct _ngx_account_shard_s
+{
+	pthread_mutex_t mutex;	 // 进程间共享的健壮互斥量
+	uint32_t mask;			 // 槽位数量-1，槽位数量是2的幂
+	uint32_t count;			 // 已经使用的槽位数量，包括墓碑
+	uint32_t limit;			 // 本分片最多允许放这么多条记录（包括墓碑），保证装载因子不超过0.75
+	uint32_t dead;			 // 墓碑数量，重启后写快照时就清掉了
+	uint64_t slotsOffset;	 // 槽位数组在共享内存中的偏移，不存指针：平滑升级后新的master进程把同一块内存映射在别的地址上
+} ngx_account_shard_t, *lpngx_account_shard_t;
+
+// 账号/会话存储类：以用户名为key，按hash分片
+// 全部内存在master进程fork()之前用共享内存（memfd）一次性分配，所有worker进程共用，worker进程重启不丢数据；
+// 平滑升级时memfd交给新的master进程接着用，新老两代进程看到的是同一份账号
+class CAccountStore
+{
+private:
+	CAccountStore();
+	~CAccountStore();
+	CAccountStore(const CAccountStore &);
+	CAccountStore &operator=(const CAccountStore &);
+
+public:
+	static CAccountStore *GetInstance()
+	{
+		static CAccountStore c;
+		return &c;
+	}
+
+public:
+	bool Init(unsigned int maxAccounts, unsigned int shardCount); // 分配共享内存（平滑升级时接过老的master进程的），fork()子进程之前调用
+	int Register(const char *username, const lpngx_account_cred_t pCred, int iType, time_t regTime, bool ifreserve); // 注册，返回NGX_ACCOUNT_XXX
+	bool Publish(const char *username);					   // 占住的账号落盘了，让登录能看到
+	int Login(const char *username, const char *password, unsigned int iterations); // 登录校验，返回NGX_ACCOUNT_XXX，不加锁
+	bool Unregister(const char *username);				   // 删除一个账号（包括占住的），注册后写日志失败时用来撤销
+	void Traverse(void (*pfn)(lpngx_account_t pAccount, void *arg), void *arg); // 遍历所有账号，不加锁
+	unsigned int GetCount();							   // 当前账号数量（不加锁，近似值）
+	size_t GetMemSize() { return m_iMemSize; }			   // 共享内存总大小
+	int GetFd() { return m_fd; }						   // 共享内存的memfd，平滑升级时交给新的master进程
+	bool IsInherited() { return m_bInherited; }			   // 共享内存是不是平滑升级时从老的master进程接过来的，是的话账号已经都在里边了
+
+	// 凭据相关，都很耗CPU（每次几毫秒），不持有任何锁
+	static bool MakeCredential(const char *password, unsigned int iterations, lpngx_account_cred_t pCred); // 生成随机盐并计算hash，取不到随机数返回false
+	static bool CheckCredential(const lpngx_account_cred_t pCred, const char *password);				// 校验密码
+
+private:
+	static uint64_t Hash(const char *username);
+	static void LockShard(lpngx_account_shard_t pShard);
+	bool Attach(int fd); // 映射老的master进程交过来的memfd
+	lpngx_account_t Slots(lpngx_account_shard_t pShard) { return (lpngx_account_t)((char *)m_pMem + pShard->slotsOffset); }
+	lpngx_account_t FindSlot(lpngx_account_shard_t pShard, uint64_t hash, const char *username, bool &iffind); // 不用加锁
+
+private:
+	void *m_pMem;						// 共享内存首地址
+	size_t m_iMemSize;					// 共享内存大小
+	int m_fd;							// 共享内存的memfd
+	bool m_bInherited;					// 共享内存是从老的master进程接过来的
+	unsigned int m_iShardCount;			// 分片数量，2的幂
+	lpngx_account_shard_t m_pShards;	// 分片数组
+};
+
+#endif
@@ -0,0 +1,46 @@
+﻿#ifndef __NGX_C_ADMIN_H__
+#define __NGX_C_ADMIN_H__
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define NGX_ADMIN_BUFSIZE (256 * 1024) // 一次应答最多这么大，统计项再多也够用
+#define NGX_ADMIN_TIMEOUT 2			   // 读请求、写应答最多等这么多秒，防止一个慢客户端一直占着管理端口
+
+// 管理端口：master进程中单独一个线程，用极简的HTTP/1.0回应GET /metrics，内容是统计信息共享内存中所有worker进程的合计，Prometheus文本格式
+// 由master进程服务，服务器空闲、worker进程忙或者正在重启时照样能抓取
+// 线程里只读共享内存、往事先分配好的缓冲区里格式化，不分配内存、不加锁，master进程在这个线程运行期间fork()worker进程也没问题
+class CAdminServer
+{
+private:
+	CAdminServer();
+	~CAdminServer();
+	CAdminServer(const CAdminServer &);
+	CAdminServer &operator=(const CAdminServer &);
+
+public:
+	static CAdminServer *GetInstance()
+	{
+		static CAdminServer c;
+		return &c;
+	}
+
+public:
+	bool Start();		  // master进程中执行：按配置打开管理端口并启动线程，没配置管理端口时什么也不做；要在master进程屏蔽了信号之后调用
+	void CloseInChild(); // worker进程中执行：关掉继承来的管理端口
+	int GetFd() { return m_fd; } // 平滑升级时交给新的master进程，-1表示没有开管理端口
+
+private:
+	int TakeInherited(const struct sockaddr_in *pAddr); // 取平滑升级时老的master进程交过来的管理端口socket，地址和配置的不一样就关掉
+	static void *ServerAdminThread(void *threadData); // 管理端口线程
+	void HandleRequest(int fd);						  // 处理一个连接
+
+private:
+	int m_fd;			 // 监听的socket，-1表示没有开管理端口
+	int m_iPort;		 // 监听的端口
+	pthread_t m_hThread; // 线程句柄
+	u_char *m_pBuf;		 // 应答缓冲区
+};
+
+#endif
@@ -0,0 +1,54 @@
+﻿#ifndef __NGX_C_CAPTURE_H__
+#define __NGX_C_CAPTURE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ngx_capture.h"
+#include "ngx_c_conf.h"
+
+// 流量录制：worker进程把收到的完整包（时间、连接、包头、包体）写进内存映射的文件，布局见ngx_capture.h
+// 只在epoll线程（收包状态机）中写，一个进程一个文件，不加锁；写一条就是一次memcpy，按CaptureRateLimit限定每秒录多少字节
+// 文件在worker进程启动时建好并映射，录不录由CaptureEnable决定，运行中可以随时打开、关闭
+class CCapture
+{
+private:
+	CCapture();
+	~CCapture();
+	CCapture(const CCapture &);
+	CCapture &operator=(const CCapture &);
+
+public:
+	static CCapture *GetInstance()
+	{
+		static CCapture c;
+		return &c;
+	}
+
+public:
+	void Init();  // master进程中fork()之前调用：登记运行中可调整的配置项，kill -HUP时才能刷新到worker进程
+	bool Open();  // worker进程中执行：建录制文件并映射，没配置CaptureFile时什么也不做
+	void Close(); // worker进程中执行：解除映射，把文件截到实际用到的长度
+
+	// 收完一个完整包时调用，pMsgBuf是消息头+包头+包体，不接管这块内存
+	void Record(const char *pMsgBuf)
+	{
+		if (m_pHdr != NULL && ngx_conf_get(m_hEnable) == 1)
+			Write(pMsgBuf);
+	}
+
+private:
+	void Write(const char *pMsgBuf);
+
+private:
+	int m_fd;						 // 录制文件句柄
+	ngx_capture_filehdr_t *m_pHdr;	 // 映射的文件头，NULL表示没开录制功能
+	char *m_pRecs;					 // 记录区
+	uint64_t m_iUsed;				 // 记录区用了多少字节，和m_pHdr->used一样，只有本线程写
+	uint64_t m_iWindowStart;		 // 限速：当前这一秒从什么时候开始（单调时钟，微秒）
+	int64_t m_iWindowBytes;			 // 限速：这一秒里已经录了多少字节
+	struct _ngx_conf_tunable_s *m_hEnable;	  // 是否录制，运行中可调整
+	struct _ngx_conf_tunable_s *m_hRateLimit; // 每秒最多录这么多字节，0表示不限，运行中可调整
+};
+
+#endif
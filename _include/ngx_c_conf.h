@@ -1,10 +1,37 @@
 ﻿#ifndef __NGX_CONF_H__
 #define __NGX_CONF_H__
 
+#include <stdint.h>
 #include <vector>
+#include <string>
+#include <atomic>
 
 #include "ngx_global.h"
 
+// 配置项的类型，决定怎么解析配置文件中的字符串
+#define NGX_CONF_INT 0		// 整数
+#define NGX_CONF_BOOL 1		// 开关：1/0、on/off、yes/no、true/false
+#define NGX_CONF_DURATION 2 // 时间：数字后边可以跟ms/s/m/h/d，统一换算成毫秒，不带单位时按取值时给的单位
+#define NGX_CONF_SIZE 3		// 大小：数字后边可以跟k/m/g（1024进位），统一换算成字节
+
+#define NGX_CONF_MAX_TUNABLES 128 // 最多这么多个运行中可调整的配置项
+
+// 运行中可调整的配置项（tunable）：放在master进程fork()之前分配的共享内存里，worker进程中随时读，O(1)，不加锁
+// 收到SIGHUP重新加载配置时由master进程改写value，所有worker进程立即看到新值，不用重启worker进程，连接不受影响
+typedef struct _ngx_conf_tunable_s
+{
+	std::atomic<int64_t> value; // 当前值，时间是毫秒，大小是字节，开关是0/1
+	int type;					// NGX_CONF_XXX
+	int64_t def;				// 配置文件中没有这一项或者值不对时用的缺省值
+	int64_t unit;				// 时间类型不带单位时的单位，毫秒数
+	int64_t minval;				// 取值范围，超出范围就限制到边界上
+	int64_t maxval;
+	char name[50];				// 配置项名字，和CConfItem.ItemName一样长
+} ngx_conf_tunable_t, *lpngx_conf_tunable_t;
+
+// 读一个可调整配置项的当前值
+#define ngx_conf_get(h) ((h)->value.load(std::memory_order_relaxed))
+
 class CConfig
 {
 private:
@@ -22,11 +49,41 @@ public:
 
 public:
 	bool Load(const char *pconfName);
+	bool Reload(const char *pconfName); // master进程中执行：重新读配置文件，刷新可调整配置项，读失败时保留原来的配置
 	const char *GetString(const char *p_itemname);
 	int GetIntDefault(const char *p_itemname, const int def);
 
+	// 带类型的读取，值不对时写日志并返回缺省值
+	bool GetBool(const char *p_itemname, bool def);
+	int64_t GetDurationMs(const char *p_itemname, int64_t defMs, int64_t unitMs = 1); // 不带单位的数字乘以unitMs
+	int64_t GetSize(const char *p_itemname, int64_t def);
+	std::vector<std::string> GetList(const char *p_itemname); // 逗号或者空白分隔的列表
+
+	// 运行中可调整的配置项，只能在master进程fork()之前调用，同一个名字多次调用返回同一个
+	lpngx_conf_tunable_t GetIntHandle(const char *p_itemname, int64_t def, int64_t minval = INT64_MIN, int64_t maxval = INT64_MAX);
+	lpngx_conf_tunable_t GetBoolHandle(const char *p_itemname, bool def);
+	lpngx_conf_tunable_t GetDurationHandle(const char *p_itemname, int64_t defMs, int64_t unitMs = 1, int64_t minMs = 0, int64_t maxMs = INT64_MAX);
+	lpngx_conf_tunable_t GetSizeHandle(const char *p_itemname, int64_t def, int64_t minval = 0, int64_t maxval = INT64_MAX);
+
+	static bool ParseBool(const char *pvalue, bool &ret);
+	static bool ParseDurationMs(const char *pvalue, int64_t unitMs, int64_t &ret);
+	static bool ParseSize(const char *pvalue, int64_t &ret);
+
+private:
+	static uint32_t Hash(const char *p_itemname);
+	void BuildIndex();
+	LPCConfItem Find(const char *p_itemname);
+	bool IsTunable(const char *p_itemname);
+	lpngx_conf_tunable_t GetHandle(int type, const char *p_itemname, int64_t def, int64_t unit, int64_t minval, int64_t maxval);
+	int64_t Resolve(lpngx_conf_tunable_t pTunable); // 按当前配置算出一个可调整配置项的值
+
 public:
 	std::vector<LPCConfItem> m_ConfigItemList;
+
+private:
+	std::vector<LPCConfItem> m_index;	   // 按名字(不区分大小写)hash的开放寻址表，大小是2的幂，空槽位是NULL
+	lpngx_conf_tunable_t m_pTunables;	   // 共享内存中的可调整配置项数组
+	int m_iTunableCount;				   // 已经用了多少个
 };
 
 #endif
@@ -0,0 +1,78 @@
+﻿#ifndef __NGX_C_IPLIMIT_H__
+#define __NGX_C_IPLIMIT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#define NGX_IPLIMIT_PROBE 8 // 一个地址只在hash位置起连续这么多个槽位里找，找不到也放不下就不限制它
+#define NGX_IPLIMIT_CHUNK_SHIFT 10 // worker进程那一行按1024个槽位（4KB）一块记哪些块用过，回收worker进程时只看用过的块
+
+// ngx_event_accept()中CIpLimit::Acquire()的结果
+#define NGX_IPLIMIT_OK 0	// 可以接受这个连接
+#define NGX_IPLIMIT_CONNS 1 // 这个地址的连接数到上限了
+#define NGX_IPLIMIT_RATE 2	// 这个地址连得太快了
+#define NGX_IPLIMIT_FULL 3	// 表里没有空位，不限制、也不记这个连接
+
+// 一个来源地址占一个槽位，32字节，所有字段都是原子的，读不加锁
+// 令牌桶装在一个64位整数里，用CAS更新：高32位是上次补充令牌的时间（单调时钟的毫秒数截成32位，差值不超过49天就能算对），
+// 低32位是有符号的令牌数，以千分之一个为单位；整个是0表示新的桶，是满的
+typedef struct _ngx_iplimit_slot_s
+{
+	std::atomic<uint64_t> key;			// 高32位是IPv4地址（网络字节序），低32位是当前连接数，0表示空槽位；地址和连接数放一起，淘汰槽位和连接数+1才能都用一次CAS
+	std::atomic<uint64_t> acceptBucket; // accept速度的令牌桶
+	std::atomic<uint64_t> pktBucket;	// 收包速度的令牌桶
+	std::atomic<uint32_t> lastSeen;		// 上次accept或者断开连接的时间（单调时钟，秒），表里没空位时淘汰最久没动静的
+	uint32_t reserve;
+} ngx_iplimit_slot_t, *lpngx_iplimit_slot_t;
+
+// 按来源IP限制连接：同时连接数、accept速度、收包速度（收包速度在Flood攻击检测里用）
+// 一张开放寻址的hash表，master进程fork()之前用共享内存分配，所有worker进程共用，限制是对整个服务器的
+// 不加锁：查找只读key，连接数和令牌桶都用CAS更新；两个进程同时插入同一个新地址时这个地址可能占两个槽位，限制稍微放宽一点，不要紧
+// 每个worker进程另外记着自己在每个槽位上算了几个连接，worker进程异常退出时master进程据此把它的连接数减掉
+class CIpLimit
+{
+private:
+	CIpLimit();
+	~CIpLimit();
+	CIpLimit(const CIpLimit &);
+	CIpLimit &operator=(const CIpLimit &);
+
+public:
+	static CIpLimit *GetInstance()
+	{
+		static CIpLimit c;
+		return &c;
+	}
+
+public:
+	bool Init(unsigned int slotCount); // 分配共享内存，fork()子进程之前调用，slotCount会被向上调整为2的幂
+	void AttachWorker(int slot);	   // worker进程启动时调用，之后本进程的连接都记在slot名下
+	void WorkerExited(int slot);	   // master进程回收了一个worker进程后调用（在信号处理函数中），把它没来得及减掉的连接数减掉
+
+	// accept()之后、分配连接池中的连接之前调用，addr是网络字节序的IPv4地址；maxConns、acceptRate为0表示不限
+	// 返回NGX_IPLIMIT_XXX，返回NGX_IPLIMIT_OK时连接数已经+1，*pSlot是槽位号，连接关闭时要用它调用Release()；其他情况*pSlot是-1
+	int Acquire(uint32_t addr, uint64_t nowMs, int64_t maxConns, int64_t acceptRate, int64_t acceptBurst, int *pSlot);
+	void Release(int slot); // 连接关闭时调用，连接数-1
+	// 收完一个包时调用，按这个地址的收包速度扣一个令牌；不够扣返回false，owe为true时照样扣（欠成负数），*pWait返回令牌补回来要等多少毫秒
+	bool TakePkt(int slot, uint64_t nowMs, int64_t rate, int64_t burst, bool owe, int64_t *pWait);
+	unsigned int GetUsed(unsigned int *pConns); // 用着的槽位数和其中的总连接数（不加锁，近似值）
+	unsigned int GetSlotCount() { return m_iMask + 1; }
+
+private:
+	static bool Take(std::atomic<uint64_t> &bucket, uint64_t nowMs, int64_t rate, int64_t burst, bool owe, int64_t *pWait);
+	int FindOrInsert(uint32_t addr, uint32_t nowSec); // 找到或者占一个槽位，返回槽位号，表里没有位置返回-1
+
+private:
+	void *m_pMem;						   // 共享内存首地址
+	size_t m_iMemSize;					   // 共享内存大小
+	uint32_t m_iMask;					   // 槽位数量-1
+	lpngx_iplimit_slot_t m_pSlots;		   // 槽位数组，NULL表示没有初始化（基准测试、模糊测试程序），什么都不限制
+	std::atomic<uint32_t> *m_pWorkerConns; // 各个worker进程在各个槽位上算了几个连接，[worker槽位号][槽位号]
+	std::atomic<uint32_t> *m_pMyConns;	   // 本worker进程那一行，没有AttachWorker()时是NULL
+	std::atomic<uint64_t> *m_pWorkerChunks; // 各个worker进程那一行用过哪些块，每块一位，[worker槽位号][m_iChunkWords]
+	std::atomic<uint64_t> *m_pMyChunks;	   // 本worker进程用过哪些块
+	uint32_t m_iChunkWords;				   // 一行的位图有几个uint64_t
+};
+
+#endif
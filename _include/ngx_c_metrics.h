@@ -0,0 +1,82 @@
+﻿#ifndef __NGX_C_METRICS_H__
+#define __NGX_C_METRICS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "ngx_metrics.h"
+
+// 统计信息类：master进程fork()之前创建共享内存，worker进程用自己槽位上那一块
+// 配置了MetricsFile时共享内存映射到这个文件上，tools/bin/ngx_metrics_dump可以在外边直接读，不用和服务器通讯
+class CMetrics
+{
+private:
+	CMetrics();
+	~CMetrics();
+	CMetrics(const CMetrics &);
+	CMetrics &operator=(const CMetrics &);
+
+public:
+	static CMetrics *GetInstance()
+	{
+		static CMetrics c;
+		return &c;
+	}
+
+public:
+	bool Init(const char *pFileName); // master进程中fork()之前调用，pFileName为NULL或者空串时用匿名共享内存
+	void AttachWorker(int slot);	  // worker进程启动时调用，之后本进程的统计都记到slot这一块
+	void WorkerExited(int slot);	  // master进程回收了一个worker进程后调用（在信号处理函数中），清掉它的当前值
+	void Aggregate(ngx_metrics_snap_t *pSnap); // 把所有worker进程的统计加起来，只在管理端口线程（或者单线程）中调用
+	u_char *WriteText(u_char *buf, u_char *last); // 按Prometheus的文本格式输出汇总后的统计，返回写完之后的位置
+	lpngx_metrics_shm_t GetShm() { return m_pShm; }
+
+private:
+	static u_char *WriteHist(u_char *buf, u_char *last, const char *name, const char *labels, const ngx_metrics_hist_snap_t *pHist);
+
+private:
+	ngx_metrics_snap_t *m_pSnap; // WriteText()用的快照，几十KB，不放在栈上
+	ngx_metrics_snap_t *m_pOne;	 // 汇总时的临时快照
+
+private:
+	lpngx_metrics_shm_t m_pShm; // 共享内存首地址
+	size_t m_iMemSize;			// 共享内存大小
+};
+
+// 本进程的统计块：没有Init()/AttachWorker()之前（master进程、基准测试程序）指向进程自己的一块内存，写了也没人看，热点路径上就不用判断
+extern lpngx_metrics_block_t ngx_metrics_self;
+
+// 计数器加n
+inline void ngx_metrics_add(int id, int64_t n = 1)
+{
+	ngx_metrics_self->counters[id].fetch_add(n, std::memory_order_relaxed);
+}
+
+// 设置一个当前值
+inline void ngx_metrics_set(int id, int64_t v)
+{
+	ngx_metrics_self->gauges[id].store(v, std::memory_order_relaxed);
+}
+
+// 往直方图里记一个值（微秒）
+inline void ngx_metrics_observe(int id, uint64_t us)
+{
+	ngx_metrics_hist_t &h = ngx_metrics_self->hists[id];
+	h.count.fetch_add(1, std::memory_order_relaxed);
+	h.sum.fetch_add(us, std::memory_order_relaxed);
+	h.buckets[ngx_metrics_hist_bucket(us)].fetch_add(1, std::memory_order_relaxed);
+}
+
+// 按消息代码记一个阶段的延迟（微秒），消息代码超出范围的算在最后一个里
+inline void ngx_metrics_stage(unsigned short msgCode, int stage, uint64_t us)
+{
+	if (msgCode >= NGX_METRICS_MSGCODES)
+		msgCode = NGX_METRICS_MSGCODES - 1;
+	ngx_metrics_hist_t &h = ngx_metrics_self->stages[msgCode][stage];
+	h.count.fetch_add(1, std::memory_order_relaxed);
+	h.sum.fetch_add(us, std::memory_order_relaxed);
+	h.buckets[ngx_metrics_hist_bucket(us)].fetch_add(1, std::memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,37 @@
+﻿#ifndef __NGX_C_SHA256_H__
+#define __NGX_C_SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NGX_SHA256_DIGEST_LEN 32 // SHA-256摘要长度
+#define NGX_SHA256_BLOCK_LEN 64	 // SHA-256分组长度
+
+// SHA-256摘要计算类，用法：Init() -> Update()若干次 -> Final()
+// 另外提供HMAC-SHA256和PBKDF2-HMAC-SHA256，用来对密码加盐做慢hash
+class CSHA256
+{
+public:
+	CSHA256() { Init(); }
+
+public:
+	void Init();
+	void Update(const void *data, size_t len);
+	void Final(unsigned char digest[NGX_SHA256_DIGEST_LEN]);
+
+	static void Hmac(const void *key, size_t keylen, const void *data, size_t datalen, unsigned char mac[NGX_SHA256_DIGEST_LEN]);
+	// 只输出一个分组（32字节）的PBKDF2，iterations越大越耗CPU
+	static void Pbkdf2(const void *pass, size_t passlen, const void *salt, size_t saltlen, unsigned int iterations,
+					   unsigned char out[NGX_SHA256_DIGEST_LEN]);
+
+private:
+	void Transform(const unsigned char *block);
+
+private:
+	uint32_t m_state[8];
+	uint64_t m_iTotalLen;						// 已经输入的字节数
+	unsigned char m_buf[NGX_SHA256_BLOCK_LEN]; // 不够一个分组的数据先放在这里
+	size_t m_iBufLen;
+};
+
+#endif
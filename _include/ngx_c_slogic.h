@@ -2,6 +2,7 @@
 #define __NGX_C_SLOGIC_H__
 
 #include <sys/socket.h>
+#include <vector>
 #include "ngx_c_socket.h"
 
 class CLogicSocket : public CSocket
@@ -9,13 +10,14 @@ class CLogicSocket : public CSocket
 public:
 	CLogicSocket();
 	virtual ~CLogicSocket();
-	virtual void Initialize();
-	// virtual bool Initialize_subproc(); // 初始化函数[子进程中执行]
-	// virtual void Shutdown_subproc();   // 关闭退出函数[子进程中执行]
+	virtual bool Initialize();
+	virtual bool Initialize_subproc(); // 初始化函数[子进程中执行]
+	virtual void Shutdown_subproc();   // 关闭退出函数[子进程中执行]
 
 public:
 	// 通用收发数据相关函数
 	void SendNoBodyPkgToClient(LPSTRUC_MSG_HEADER pMsgHeader, unsigned short iMsgCode);
+	void SendToClientLocked(lpngx_connection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char *pSendBuf, unsigned short iMsgCode); // 加连接的互斥量后发应答
 
 	// 各种业务逻辑相关函数都在之类
 	bool _HandleRegister(lpngx_connection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char *pPkgBody, unsigned short iBodyLength);
@@ -26,6 +28,11 @@ public:
 
 public:
 	virtual void threadRecvProcFunc(char *pMsgBuf);
+	virtual void inRecvMsgQueue(char *pMsgBuf); // 按消息代码把消息分到g_threadpool或者g_cpupool
+
+private:
+	unsigned int m_iHashIterations;		// 注册时密码hash的迭代次数
+	std::vector<struct _ngx_conf_tunable_s *> m_hDeadline; // 各个消息代码的处理期限（毫秒），0表示不限，重新加载配置时可以改
 };
 
 #endif
@@ -12,10 +12,18 @@
 
 #include "ngx_comm.h"
 
+class CThreadPool;
+struct _ngx_conf_tunable_s;
+
 // 一些宏定义放在这里
 #define NGX_LISTEN_BACKLOG 511 // 已完成连接队列，nginx给511，按照这个来
 #define NGX_MAX_EVENTS 512	   // epoll_wait一次最多接收这么多个事件，nginx中缺省是512
 
+// 连接收包超过Flood限速（Sock_FloodAction）时的处理方式
+#define NGX_FLOOD_DELAY 0 // 包照收，暂停读这个连接，令牌补回来再接着读
+#define NGX_FLOOD_DROP 1  // 丢掉超限的包
+#define NGX_FLOOD_KICK 2  // 踢掉这个连接
+
 typedef struct ngx_listening_s ngx_listening_t, *lpngx_listening_t;
 typedef struct ngx_connection_s ngx_connection_t, *lpngx_connection_t;
 typedef class CSocket CSocket;
@@ -56,6 +64,7 @@ struct ngx_connection_s
 	char *precvbuf;					   // 接收数据的缓冲区的头指针，收到数据后放到这
 	unsigned int irecvlen;			   // 还要收到多少数据，和precvbuf配套使用
 	char *precvMemPointer;			   // new出来的用于收包的内存首地址，释放用的
+	uint64_t irecvStartTime;		   // 当前这个包收到第一个字节的时间（单调时钟，微秒），统计收包阶段的延迟用
 
 	pthread_mutex_t logicPorcMutex; // 逻辑处理相关的互斥量
 
@@ -68,8 +77,12 @@ struct ngx_connection_s
 
 	time_t lastPingTime; // 上次ping（接收心跳包）的时间
 
-	uint64_t FloodkickLastTime;	 // Flood攻击上次收到包的时间
-	int FloodAttackCount;		 // Flood攻击在该时间内收到包的次数统计
+	// Flood攻击检测（令牌桶限速）用，令牌数以千分之一个包/字节为单位，Sock_FloodAction为0（推迟读）时可以欠成负数
+	int64_t iFloodPktTokens;	 // 包数令牌桶中的令牌数
+	int64_t iFloodByteTokens;	 // 字节数令牌桶中的令牌数
+	uint64_t iFloodTokenTime;	 // 上次补充令牌的时间（粗粒度单调时钟，毫秒），0表示还没收过包，桶是满的
+	uint64_t iFloodResumeTime;	 // 超限后暂停读，到这个时间（粗粒度单调时钟，毫秒）恢复，0表示没有暂停
+	std::atomic<int> iIpSlot;	 // 来源地址在CIpLimit表中的槽位号，关闭连接时据此把这个地址的连接数-1，-1表示没有记
 	std::atomic<int> iSendCount; // 发送队列中有的数据条目数，若client只发不收，则可能造成此数过大，依据此数做出踢出处理
 };
 
@@ -78,28 +91,42 @@ typedef struct _STRUC_MSG_HEADER
 {
 	lpngx_connection_t pConn; // 记录对应的连接，注意这是个指针
 	uint64_t iCurrsequence;	  // 收到数据包时记录对应连接的序号，将来能用于比较是否连接已经作废用
+	uint64_t iEnqueueTime;	  // 入接收消息队列的时间（单调时钟，微秒），用来统计消息在队列中等了多久
+	// 以下是统计各阶段延迟用的时间点（单调时钟，微秒），应答的消息头是从请求拷贝过来的，所以应答发完时这些都还在
+	uint64_t iRecvTime;		  // 收到包头第一个字节的时间
+	uint64_t iSendQueueTime;  // 应答入发送消息队列的时间
+	uint64_t iSendStartTime;  // 发送线程开始发这个应答的时间
+	unsigned short iMsgCode;  // 请求的消息代码（已经转成本机字节序），按消息代码分别统计
 } STRUC_MSG_HEADER, *LPSTRUC_MSG_HEADER;
 
 // socket相关类
 class CSocket
 {
+	friend class CSocketBench; // 基准测试、模糊测试程序（bench/、fuzz/下）直接测连接池、时间队列、收包状态机这些私有成员函数
+
 public:
 	CSocket();						   
 	virtual ~CSocket();				  
-	virtual void Initialize();		   // 初始化函数[父进程中执行]
+	virtual bool Initialize();		   // 初始化函数[父进程中执行]
 	virtual bool Initialize_subproc(); // 初始化函数[子进程中执行]
 	virtual void Shutdown_subproc();   // 关闭退出函数[子进程中执行]
 
 	void printTDInfo(); // 打印统计信息
+	void printLaneInfo(const char *pName, CThreadPool *pPool); // 打印一个线程池各个通道的统计信息
+	void publishMetrics(); // 把连接池、各个队列的当前大小写到统计信息共享内存中
 
 public:
 	virtual void threadRecvProcFunc(char *pMsgBuf); // 处理客户端请求，虚函数，因为将来可以考虑自己来写子类继承本类
+	virtual void inRecvMsgQueue(char *pMsgBuf);		// 把收到的完整消息交给线程池，子类可以按消息代码选择线程池
 	virtual void procPingTimeOutChecking(LPSTRUC_MSG_HEADER tmpmsg, time_t cur_time);
 	// 心跳包检测时间到，该去检测心跳包是否超时的事宜，本函数只是把内存释放，子类应该重新事先该函数以实现具体的判断动作
 
 public:
 	bool ngx_open_listening_sockets();	// 监听必须的端口（支持多个端口）
 	void ngx_close_listening_sockets(); // 关闭监听套接字
+	void ngx_stop_accepting();			// worker进程优雅退出时不再accept，监听套接字从epoll中去掉并关闭
+	int GetListenFds(int *fds, int max); // 取得所有监听套接字，平滑升级时交给新的master进程，返回个数
+	int GetOnlineUserCount() { return m_onlineUserCount; }
 
 	int ngx_epoll_init(); // epoll功能初始化
 	int ngx_epoll_process_events(int timer); // epoll等待接收和处理事件
@@ -109,10 +136,12 @@ public:
 protected:
 	// 数据发送相关
 	void msgSend(char *psendbuf);					   // 把数据扔到待发送对列中
+	void sendPkgDone(lpngx_connection_t pConn);		   // 一个应答的最后一个字节交给了内核，记统计
 	void zdClosesocketProc(lpngx_connection_t p_Conn); // 主动关闭一个连接时的要做些善后的处理函数
 
 private:
 	void ReadConf();					// 专门用于读各种配置项
+	int ngx_take_inherited_socket(std::vector<int> &inherited, int iport); // 从平滑升级时继承来的监听socket中找出监听iport端口的
 	bool setnonblocking(int sockfd);	// 设置非阻塞套接字
 
 	// 一些业务处理函数handler
@@ -123,8 +152,9 @@ private:
 	// 通用连接关闭函数，资源用这个函数释放
 
 	ssize_t recvproc(lpngx_connection_t pConn, char *buff, ssize_t buflen); // 接收从客户端来的数据专用函数
-	void ngx_wait_request_handler_proc_p1(lpngx_connection_t pConn, bool &isflood);
-	// 包头收完整后的处理，称为包处理阶段1：写成函数，方便复用
+	bool ngx_recv_advance(lpngx_connection_t pConn, size_t reco, bool &isflood); // 收包状态机，precvbuf处放进来reco个字节后推进状态，不碰socket，返回false表示该断开连接
+	bool ngx_wait_request_handler_proc_p1(lpngx_connection_t pConn, bool &isflood);
+	// 包头收完整后的处理，称为包处理阶段1：写成函数，方便复用，包头不合法返回false
 	void ngx_wait_request_handler_proc_plast(lpngx_connection_t pConn, bool &isflood);
 	// 收到一个完整包后的处理，放到一个函数中，方便调用
 	void clearMsgSendQueue(); // 处理发送消息队列
@@ -153,7 +183,9 @@ private:
 	void clearAllFromTimerQueue();						 // 清理时间队列中所有内容
 
 	// 和网络安全有关
-	bool TestFlood(lpngx_connection_t pConn); // 测试是否flood攻击成立，成立则返回true，否则返回false
+	bool TestFlood(lpngx_connection_t pConn, unsigned int pkgLen); // 收完一个包时按令牌桶限速，这个包要丢掉（或者踢人）返回true，否则返回false
+	void ngx_flood_pause(lpngx_connection_t pConn);				   // 超限后暂停读这个连接，到pConn->iFloodResumeTime再恢复
+	void ngx_flood_resume();									   // 恢复到时间了的暂停读的连接，epoll每轮调用一次
 
 	// 线程相关函数
 	static void *ServerSendQueueThread(void *threadData);		  // 专门用来发送数据的线程
@@ -165,9 +197,12 @@ protected:
 	size_t m_iLenPkgHeader; // sizeof(COMM_PKG_HEADER);
 	size_t m_iLenMsgHeader; // sizeof(STRUC_MSG_HEADER);
 
-	// 时间相关
-	int m_ifTimeOutKick; // 为一时当时间到达Sock_MaxWaitTime指定的时间时，立刻把客户端踢出去，不管是否有ping包，只有当Sock_WaitTimeEnable = 1时，本项才有用
-	int m_iWaitTime;	 // 多少秒检测一次是否心跳超时，只有当Sock_WaitTimeEnable = 1时，本项才有用
+	// 时间相关，都是运行中可调整的配置项，用ngx_conf_get()读
+	struct _ngx_conf_tunable_s *m_hTimeOutKick; // 为一时当时间到达Sock_MaxWaitTime指定的时间时，立刻把客户端踢出去，不管是否有ping包，只有当Sock_WaitTimeEnable = 1时，本项才有用
+	struct _ngx_conf_tunable_s *m_hWaitTime;	// 多久检测一次是否心跳超时（毫秒），只有当Sock_WaitTimeEnable = 1时，本项才有用
+
+	// 统计用途
+	std::atomic<int> m_iShedMsgCount; // 因为在队列里等得太久而没有处理的消息数量
 
 private:
 	struct ThreadItem
@@ -194,6 +229,7 @@ private:
 	std::list<lpngx_connection_t> m_recyconnectionList; // 将要释放的连接放这里
 	std::atomic<int> m_totol_recyconnection_n;			// 待释放连接队列大小
 	int m_RecyConnectionWaitTime;						// 等待这么些秒后才回收连接
+	int m_iSendBufSize;									// 新连接的发送缓冲区大小（字节），0表示由内核自动调整
 
 
 	std::vector<lpngx_listening_t> m_ListenSocketList; // 监听套接字队列
@@ -216,10 +252,28 @@ private:
 
 	// 在线用户相关
 	std::atomic<int> m_onlineUserCount; // 当前在线用户数统计
-	// 网络安全相关
-	int m_floodAkEnable;			  // Flood攻击检测是否开启,1：开启   0：不开启
-	unsigned int m_floodTimeInterval; // 表示每次收到数据包的时间间隔是100(毫秒)
-	int m_floodKickCount;			  // 累积多少次踢出此人
+	// 网络安全相关，都是运行中可调整的配置项，用ngx_conf_get()读
+	struct _ngx_conf_tunable_s *m_hFloodAkEnable;	// Flood攻击检测是否开启,1：开启   0：不开启
+	struct _ngx_conf_tunable_s *m_hFloodPktRate;	// 每个连接每秒最多收多少个包，0表示不限
+	struct _ngx_conf_tunable_s *m_hFloodPktBurst;	// 包数令牌桶的容量，最多能连着收多少个包
+	struct _ngx_conf_tunable_s *m_hFloodByteRate;	// 每个连接每秒最多收多少字节（包头+包体），0表示不限
+	struct _ngx_conf_tunable_s *m_hFloodByteBurst;	// 字节数令牌桶的容量
+	struct _ngx_conf_tunable_s *m_hFloodAction;		// 超限了怎么办，NGX_FLOOD_DELAY、NGX_FLOOD_DROP、NGX_FLOOD_KICK
+	int m_iIpLimitSlots;							// 按来源IP限制的表有多少个槽位
+	struct _ngx_conf_tunable_s *m_hIpMaxConns;		// 同一个来源IP最多同时有多少个连接，0表示不限
+	struct _ngx_conf_tunable_s *m_hIpAcceptRate;	// 同一个来源IP每秒最多接受多少个新连接，0表示不限
+	struct _ngx_conf_tunable_s *m_hIpAcceptBurst;	// accept速度令牌桶的容量
+	struct _ngx_conf_tunable_s *m_hIpPktRate;		// 同一个来源IP的所有连接每秒最多收多少个包，0表示不限，Flood攻击检测开启时才有用
+	struct _ngx_conf_tunable_s *m_hIpPktBurst;		// 收包速度令牌桶的容量
+	// 超限后暂停读的连接，只有epoll线程用，不用互斥；连接关闭、复用后靠序号认出来，不用从这里抠
+	struct ngx_flood_paused_t
+	{
+		lpngx_connection_t pConn;
+		uint64_t iCurrsequence; // 暂停时连接的序号
+	};
+	std::vector<ngx_flood_paused_t> m_floodPaused;
+	uint64_t m_iNowMsec;			  // 粗粒度单调时钟（毫秒），epoll_wait()每次返回时取一次，收包路径上用它，不用每个包都取时间
+	pthread_mutex_t m_epollEventMutex; // EPOLL_CTL_MOD的互斥量：发送线程和epoll线程都会改同一个连接的events
 
 	// 统计用途
 	time_t m_lastprintTime;		// 上次打印统计信息的时间(10秒钟打印一次)
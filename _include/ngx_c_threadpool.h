@@ -4,6 +4,24 @@
 #include <vector>
 #include <pthread.h>
 #include <atomic>
+#include <stdint.h>
+
+// 接收消息队列分成几个优先级通道（lane），按消息代码选择通道，0号通道优先级最高
+#define NGX_THREADPOOL_LANES 3
+
+// 通道的出队方式
+#define NGX_LANE_STRICT 0   // 严格优先级：高优先级通道有消息就先取，低优先级通道可能饿死
+#define NGX_LANE_WEIGHTED 1 // 加权轮转：每轮每个通道最多取“权重”条消息，低优先级通道也能按比例得到处理
+
+// 一个通道的统计信息
+struct ThreadPoolLaneStat
+{
+    int depth;         // 当前排队的消息数量
+    uint64_t count;    // 统计周期内出队的消息数量
+    uint64_t waitSum;  // 统计周期内出队消息在队列中等待的总时间（微秒）
+    uint64_t waitMax;  // 统计周期内出队消息在队列中等待的最长时间（微秒）
+    uint64_t rejected; // 统计周期内因为通道满被拒绝的消息数量
+};
 
 // 线程池相关类
 class CThreadPool
@@ -14,16 +32,21 @@ public:
     ~CThreadPool();
 
 public:
-    bool Create(int threadNum); // 创建该线程池中的所有线程
+    bool Create(int threadNum, int maxQueueSize = 0); // 创建该线程池中的所有线程，maxQueueSize>0时限制每个通道的消息队列长度
+    void SetLanePolicy(int mode, const int *weights); // 设置通道的出队方式和权重，Create()之前调用
     void StopAll();             // 使线程池中的所有线程退出
 
-    void inMsgRecvQueueAndSignal(char *buf);                    // 收到一个完整消息后，入消息队列，并触发线程池中线程来处理该消息
+    bool inMsgRecvQueueAndSignal(char *buf, int lane = 0);      // 收到一个完整消息后，入消息队列，并触发线程池中线程来处理该消息，通道满返回false
+    void GetLaneStat(int lane, ThreadPoolLaneStat *pStat);      // 取一个通道的统计信息，取完后统计周期内的计数清零
     void Call();                                                // 来任务了，调一个线程池中的线程下来干活
     int getRecvMsgQueueCount() { return m_iRecvMsgQueueCount; } // 获取接收消息队列大小
+    int getThreadNum() { return m_iThreadNum; }                 // 线程数量，没有Create()过就是0
+    int getRejectCount() { return m_iRejectCount; }             // 因为队列满被拒绝的消息数量
 
 private:
     static void *ThreadFunc(void *threadData); // 新线程的线程回调函数
     void clearMsgRecvQueue();                  // 清理接收消息队列
+    int selectLane();                          // 按出队方式选一个有消息的通道，调用者负责加锁
 
 private:
     // 定义一个 线程池中的 线程 的结构，以后可能做功能扩展，所以引入这么个结构来代表线程
@@ -38,20 +61,32 @@ private:
     };
 
 private:
-    static pthread_mutex_t m_pthreadMutex; // 线程同步互斥量/也叫线程同步锁
-    static pthread_cond_t m_pthreadCond;   // 线程同步条件变量
-    static bool m_shutdown;                // 线程退出标志，false不退出，true退出
+    // 每个线程池对象各有一套，一个进程中可以有多个线程池（比如专门处理耗CPU消息的线程池）
+    pthread_mutex_t m_pthreadMutex; // 线程同步互斥量/也叫线程同步锁
+    pthread_cond_t m_pthreadCond;   // 线程同步条件变量
+    bool m_shutdown;                // 线程退出标志，false不退出，true退出
 
-    int m_iThreadNum; // 要创建的线程数量
+    int m_iThreadNum;    // 要创建的线程数量
+    int m_iMaxQueueSize; // 消息队列最大长度，0表示不限制
+    std::atomic<int> m_iRejectCount; // 因为队列满被拒绝的消息数量
 
     std::atomic<int> m_iRunningThreadNum; // 线程数, 运行中的线程数，原子操作
     time_t m_iLastEmgTime;                // 上次发生线程不够用【紧急事件】的时间,防止日志报的太频繁
 
     std::vector<ThreadItem *> m_threadVector; // 线程 容器，容器里就是各个线程了
 
-    // 接收消息队列相关
-    std::list<char *> m_MsgRecvQueue; // 接收数据消息队列
-    int m_iRecvMsgQueueCount;         // 收消息队列大小
+    // 接收消息队列相关，每个通道一个队列
+    struct Lane
+    {
+        std::list<char *> queue; // 本通道的消息队列
+        int size;                // 队列大小，std::list的size()在老版本的库中是O(n)
+        int weight;              // 加权轮转时的权重
+        int credit;              // 本轮还能从这个通道取几条
+        ThreadPoolLaneStat stat; // 统计信息
+    };
+    Lane m_lanes[NGX_THREADPOOL_LANES];
+    int m_iLaneMode;          // 出队方式，NGX_LANE_STRICT或NGX_LANE_WEIGHTED
+    int m_iRecvMsgQueueCount; // 收消息队列大小，所有通道之和
 };
 
 #endif
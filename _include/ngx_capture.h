@@ -0,0 +1,41 @@
+﻿#ifndef __NGX_CAPTURE_H__
+#define __NGX_CAPTURE_H__
+
+// 流量录制文件的布局：worker进程把收到的每个完整包原样写进内存映射的文件，离线工具tools/ngx_capture_replay照着时间和连接重放
+// 每个worker进程一个文件，文件名是CaptureFile后边加.进程id，文件头后边是一条接一条的记录
+// 本文件服务器和工具共用，只能包含布局，不要引入服务器的其他头文件
+
+#include <stdint.h>
+
+#define NGX_CAPTURE_MAGIC "NGXCAP01" // 文件头
+#define NGX_CAPTURE_VERSION 1		 // 布局变了就改这个，工具发现版本不对就不读
+#define NGX_CAPTURE_ALIGN 8			 // 每条记录按8字节对齐
+
+// 文件头，64字节
+typedef struct
+{
+	char magic[8];		  // NGX_CAPTURE_MAGIC，不带结尾的\0
+	uint32_t version;	  // NGX_CAPTURE_VERSION
+	uint32_t hdrsize;	  // sizeof(ngx_capture_filehdr_t)，记录区从这里开始
+	uint32_t recsize;	  // sizeof(ngx_capture_rec_t)
+	int32_t pid;		  // 录制的worker进程
+	uint64_t capacity;	  // 记录区的大小，写满就不再录
+	uint64_t used;		  // 记录区已经用了多少字节，一条记录写完才更新，进程中途崩溃也只会读到完整的记录
+	uint64_t dropped;	  // 因为限速或者写满没有录的包数
+	uint64_t startUsec;	  // 开始录制时的单调时钟（微秒），和记录中的时间同一个时钟，几个worker进程的文件可以合在一起按时间排
+	uint64_t startRealUsec; // 开始录制时的墙上时间（从1970年开始的微秒数），只用来显示
+} ngx_capture_filehdr_t;
+
+// 一条记录：24字节的头，后边紧跟len字节的包（包头COMM_PKG_HEADER+包体，网络字节序，和客户端发来的一样），再补齐到8字节
+typedef struct
+{
+	uint64_t usec; // 收到包头第一个字节的时间，单调时钟（微秒）
+	uint64_t conn; // 连接对象的地址，和seq一起区分连接：连接对象是复用的，每次分配出去seq都不一样
+	uint32_t seq;  // 连接的序号iCurrsequence（低32位）
+	uint32_t len;  // 包的长度（包头+包体）
+} ngx_capture_rec_t;
+
+// 一条记录占的字节数（含对齐）
+#define ngx_capture_reclen(len) ((sizeof(ngx_capture_rec_t) + (len) + NGX_CAPTURE_ALIGN - 1) & ~(uint64_t)(NGX_CAPTURE_ALIGN - 1))
+
+#endif
@@ -2,6 +2,14 @@
 #ifndef __NGX_FUNC_H__
 #define __NGX_FUNC_H__
 
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <type_traits>
+
+#include "ngx_binlog.h"
+
 // 字符串相关函数
 void Rtrim(char *string);
 void Ltrim(char *string);
@@ -18,10 +26,148 @@ u_char *ngx_log_errno(u_char *buf, u_char *last, int err);
 u_char *ngx_snprintf(u_char *buf, size_t max, const char *fmt, ...);
 u_char *ngx_slprintf(u_char *buf, u_char *last, const char *fmt, ...);
 u_char *ngx_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args);
+u_char *ngx_sprintf_num(u_char *buf, u_char *last, uint64_t ui64, u_char zero, uintptr_t hexadecimal, uintptr_t width);
+void ngx_log_async_start();
+void ngx_log_thread_init();
+void ngx_log_async_stop();
+bool ngx_log_async_write(const u_char *buf, size_t len);
+uint64_t ngx_log_dropped_count();
+void ngx_log_binary_write(ngx_binlog_rec_t *pRec, size_t len);
+bool ngx_log_ratelimit(struct _ngx_log_ratelimit_s *pRl, const char *site);
+
+// 类型安全的格式化，新代码推荐用：ngx_slcat(buf, last, "连接", fd, "的地址是", ngx_hex(p), ...)
+// 没有格式串，每个参数按自己的类型转换，不会出现格式串和参数对不上的问题，不支持的类型（浮点数、对象等）编译不过
+// 整数按十进制，字符串原样拷贝，指针和%p一样按十六进制显示；要十六进制或者定宽就用ngx_hex()/ngx_width()包一下
+// 返回值和ngx_slprintf()一样，是写完之后的位置，不会超过last
+typedef struct
+{
+	uint64_t v;
+	bool neg;		 // 负数
+	uintptr_t hex;	 // 0：十进制，1：十六进制a-f小写，2：十六进制A-F大写
+	uintptr_t width; // 最少显示这么多位，不够的前边填充zero
+	u_char zero;
+} ngx_fmt_num_t;
+
+template <typename T>
+inline ngx_fmt_num_t ngx_width(T v, uintptr_t width, u_char zero = '0')
+{
+	static_assert(std::is_integral<T>::value, "ngx_width()只能用于整数");
+	ngx_fmt_num_t n = {(v < 0) ? 0 - (uint64_t)v : (uint64_t)v, v < 0, 0, width, zero};
+	return n;
+}
+template <typename T>
+inline ngx_fmt_num_t ngx_hex(T v, uintptr_t width = 0, bool upper = false)
+{
+	static_assert(std::is_integral<T>::value, "ngx_hex()只能用于整数");
+	ngx_fmt_num_t n = {(uint64_t)v, false, upper ? (uintptr_t)2 : (uintptr_t)1, width, '0'};
+	return n;
+}
+
+inline u_char *ngx_slcat_one(u_char *buf, u_char *last, const ngx_fmt_num_t &n)
+{
+	if (n.neg && buf < last)
+	{
+		*buf++ = '-';
+	}
+	return ngx_sprintf_num(buf, last, n.v, n.zero, n.hex, (n.neg && n.width) ? n.width - 1 : n.width);
+}
+inline u_char *ngx_slcat_one(u_char *buf, u_char *last, const char *s)
+{
+	size_t len = strnlen(s, last - buf);
+	return ((u_char *)memcpy(buf, s, len)) + len;
+}
+inline u_char *ngx_slcat_one(u_char *buf, u_char *last, const u_char *s)
+{
+	return ngx_slcat_one(buf, last, (const char *)s);
+}
+inline u_char *ngx_slcat_one(u_char *buf, u_char *last, const void *p)
+{
+	return ngx_sprintf_num(buf, last, (uintptr_t)p, '0', 2, 2 * sizeof(void *));
+}
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value, u_char *>::type ngx_slcat_one(u_char *buf, u_char *last, T v)
+{
+	if (v < 0)
+	{
+		if (buf < last)
+		{
+			*buf++ = '-';
+		}
+		return ngx_sprintf_num(buf, last, 0 - (uint64_t)v, ' ', 0, 0);
+	}
+	return ngx_sprintf_num(buf, last, (uint64_t)v, ' ', 0, 0);
+}
+
+inline u_char *ngx_slcat(u_char *buf, u_char *)
+{
+	return buf;
+}
+template <typename T, typename... Rest>
+inline u_char *ngx_slcat(u_char *buf, u_char *last, const T &v, const Rest &...rest)
+{
+	return ngx_slcat(ngx_slcat_one(buf, last, v), last, rest...);
+}
+
+// 二进制日志的参数都按int64_t保存，只接受整数、枚举和指针
+template <typename T>
+inline int64_t ngx_binlog_arg(T v)
+{
+	static_assert(std::is_integral<T>::value || std::is_enum<T>::value, "二进制日志的参数只能是整数、枚举或者指针");
+	return (int64_t)v;
+}
+template <typename T>
+inline int64_t ngx_binlog_arg(T *v)
+{
+	static_assert(!std::is_same<typename std::remove_cv<T>::type, char>::value &&
+					  !std::is_same<typename std::remove_cv<T>::type, u_char>::value,
+				  "二进制日志不能记录字符串");
+	return (int64_t)(uintptr_t)v;
+}
+inline void ngx_binlog_pack(int64_t *) {}
+template <typename T, typename... Rest>
+inline void ngx_binlog_pack(int64_t *p, T v, Rest... rest)
+{
+	*p = ngx_binlog_arg(v);
+	ngx_binlog_pack(p + 1, rest...);
+}
+
+// 写一条二进制日志：只取时间、拷贝参数，不做格式化；格式编号是模板参数，参数个数和格式串对不上编译不过
+// 一般不直接调用，用ngx_global.h中的ngx_log_binary()宏，它会先判断日志等级
+template <int id, typename... Args>
+void ngx_log_binary_core(int err, Args... args)
+{
+	static_assert(id >= 0 && id < NGX_BL_MAX, "二进制日志格式编号不对");
+	static_assert(ngx_binlog_argc(ngx_binlog_formats[id].fmt) == (int)sizeof...(Args), "二进制日志的参数个数和格式串不一致");
+	static_assert(ngx_binlog_fmtok(ngx_binlog_formats[id].fmt, false), "二进制日志的格式串中不能有%s和%f");
+	static_assert(sizeof...(Args) <= NGX_BINLOG_MAX_ARGS, "二进制日志的参数太多");
+
+	struct
+	{
+		ngx_binlog_rec_t hdr;
+		int64_t args[sizeof...(Args) + 1];
+	} rec;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts); // 毫秒级精度就够了，比CLOCK_REALTIME便宜
+	rec.hdr.usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	rec.hdr.id = (uint16_t)id;
+	rec.hdr.nargs = (uint8_t)sizeof...(Args);
+	rec.hdr.level = (uint8_t)ngx_binlog_formats[id].level;
+	rec.hdr.pid = 0; // 由ngx_log_binary_write()填
+	rec.hdr.err = err;
+	rec.hdr.reserved = 0;
+	ngx_binlog_pack(rec.args, args...);
+	ngx_log_binary_write(&rec.hdr, sizeof(ngx_binlog_rec_t) + sizeof...(Args) * sizeof(int64_t));
+}
+
+// 和时间相关
+uint64_t ngx_monotonic_usec();
+uint64_t ngx_monotonic_coarse_msec();
+u_char *ngx_cpy_log_time(u_char *buf, time_t now);
 
 // 和信号/主流程相关相关
 int ngx_init_signals();
 void ngx_master_process_cycle();
+bool ngx_process_exited(pid_t pid);
 int ngx_daemon();
 void ngx_process_events_and_timers();
 
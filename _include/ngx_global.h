@@ -2,6 +2,8 @@
 #define __NGX_GBLDEF_H__
 
 #include <signal.h>
+#include <stdint.h>
+#include <atomic>
 
 #include "ngx_c_slogic.h"
 #include "ngx_c_threadpool.h"
@@ -17,24 +19,91 @@ typedef struct
 {
 	int log_level; // 日志级别 或者日志类型，ngx_macro.h里分0-8共9个级别
 	int fd;		   // 日志文件描述符
+	int binfd;	   // 二进制日志文件描述符，-1表示没开二进制日志
+	struct _ngx_conf_tunable_s *hRateLimit; // 限速的日志每个调用点每秒最多写这么多条，0表示不限速，重新加载配置时可以改
 
 } ngx_log_t;
 
+// 一个日志调用点的限速状态，用在调用点的静态变量里，零初始化就能用
+typedef struct _ngx_log_ratelimit_s
+{
+	std::atomic<uint64_t> window;	  // 高32位是当前计数的是哪一秒（单调时钟），低32位是这一秒已经写了几条，两个一起CAS
+	std::atomic<uint64_t> suppressed; // 被省略、还没有报告的条数
+} ngx_log_ratelimit_t;
+
 // 外部全局量声明
 extern size_t g_argvneedmem;
 extern size_t g_envneedmem;
 extern int g_os_argc;
 extern char **g_os_argv;
+extern char *g_binary_path;
 extern char *gp_envmem;
 extern int g_daemonized;
 extern CLogicSocket g_socket;
 extern CThreadPool g_threadpool;
+extern CThreadPool g_cpupool;
 
 extern pid_t ngx_pid;
 extern pid_t ngx_parent;
 extern ngx_log_t ngx_log;
+
+// 先判断日志等级再调用ngx_log_error_core()，不打印的日志连参数都不会求值，只有一次比较
+// 热点路径上（epoll循环、accept、收发包）的低等级日志都应该用它
+#define ngx_log_error(level, err, ...)                         \
+	do                                                         \
+	{                                                          \
+		if ((level) <= ngx_log.log_level)                      \
+			ngx_log_error_core((level), (err), __VA_ARGS__);   \
+	} while (0)
+
+// 高频事件写日志用这个，id是ngx_binlog.h格式表中的编号，参数只能是整数/指针
+// 开了二进制日志时只记录编号和原始参数，没开时按格式表中的格式串照常写文本日志
+#define ngx_log_binary(id, err, ...)                                                                                          \
+	do                                                                                                                        \
+	{                                                                                                                         \
+		if (ngx_binlog_formats[id].level <= ngx_log.log_level)                                                                \
+		{                                                                                                                     \
+			static ngx_log_ratelimit_t ngx_log_rl_;                                                                           \
+			if (ngx_log.binfd != -1)                                                                                          \
+				ngx_log_binary_core<id>((err), ##__VA_ARGS__);                                                                \
+			else if (!ngx_log_ratelimit(&ngx_log_rl_, NGX_LOG_SITE))                                                          \
+				;                                                                                                             \
+			else if (ngx_binlog_formats[id].level == NGX_LOG_STDERR)                                                          \
+				ngx_log_stderr((err), ngx_binlog_formats[id].fmt, ##__VA_ARGS__);                                             \
+			else                                                                                                              \
+				ngx_log_error_core(ngx_binlog_formats[id].level, (err), ngx_binlog_formats[id].fmt, ##__VA_ARGS__);           \
+		}                                                                                                                     \
+	} while (0)
+
+// 限速的日志：每个调用点每秒最多写LogRateLimit条，多出来的只计数，这个调用点下次再写日志时补一行省略了多少条
+// 出错路径上客户端能反复触发的日志（收发包出错、包校验不对、踢人等）都用它，恶意客户端刷不爆日志
+#define NGX_LOG_STR_(x) #x
+#define NGX_LOG_STR(x) NGX_LOG_STR_(x)
+#define NGX_LOG_SITE __FILE__ ":" NGX_LOG_STR(__LINE__)
+
+#define ngx_log_error_limited(level, err, ...)                        \
+	do                                                                \
+	{                                                                 \
+		static ngx_log_ratelimit_t ngx_log_rl_;                       \
+		if ((level) <= ngx_log.log_level &&                           \
+			ngx_log_ratelimit(&ngx_log_rl_, NGX_LOG_SITE))            \
+			ngx_log_error_core((level), (err), __VA_ARGS__);          \
+	} while (0)
+
+#define ngx_log_stderr_limited(err, ...)                              \
+	do                                                                \
+	{                                                                 \
+		static ngx_log_ratelimit_t ngx_log_rl_;                       \
+		if (ngx_log_ratelimit(&ngx_log_rl_, NGX_LOG_SITE))            \
+			ngx_log_stderr((err), __VA_ARGS__);                       \
+	} while (0)
 extern int ngx_process;
 extern sig_atomic_t ngx_reap;
+extern sig_atomic_t ngx_reconfigure;
+extern sig_atomic_t ngx_quit;
+extern sig_atomic_t ngx_noaccept;
+extern sig_atomic_t ngx_change_binary;
+extern pid_t ngx_new_binary;
 extern int g_stopEvent;
 extern sig_atomic_t ngx_working_subprocess;
 
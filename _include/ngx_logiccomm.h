@@ -4,9 +4,15 @@
 // 收发命令宏定义
 #define _CMD_START 0
 #define _CMD_PING _CMD_START + 0	 // ping命令【心跳包】
+#define _CMD_SERVER_BUSY _CMD_START + 1 // 服务器忙【只由服务器发出】：请求没有被处理，客户端稍后重试
 #define _CMD_REGISTER _CMD_START + 5 // 注册
 #define _CMD_LOGIN _CMD_START + 6	 // 登录
 
+// 注册/登录的应答约定：
+// 成功：回送同样的结构（STRUCT_REGISTER/STRUCT_LOGIN），其中password清空
+// 失败（用户名已存在、用户名不存在、密码不对、账号已满）：回送一个同样消息代码、只有包头没有包体的包
+// 服务器忙（处理耗CPU消息的线程池队列满，或者请求排队超过了处理期限）：回送一个_CMD_SERVER_BUSY、只有包头没有包体的包
+
 // 逻辑业务方面的结构
 #pragma pack(1)
 
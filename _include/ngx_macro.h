@@ -26,11 +26,20 @@
 #define NGX_LOG_INFO 7   // 信息 【info】
 #define NGX_LOG_DEBUG 8  // 调试 【debug】：最低级别
 
+#define NGX_CONF_PATH "nginx.conf"      // 配置文件名，启动和收到SIGHUP重新加载时都读它
 #define NGX_ERROR_LOG_PATH "error.log" // 定义日志存放的路径和文件名
+#define NGX_BINLOG_PATH "error.binlog"  // 二进制日志缺省的文件名
+#define NGX_METRICS_PATH "metrics.shm"  // 统计信息共享内存缺省映射到的文件名
+#define NGX_LOG_TIME_LEN (sizeof("1970/01/01 00:00:00") - 1) // 日志中时间字符串的长度
 
 // 进程相关
 // 标记当前进程类型
 #define NGX_PROCESS_MASTER 0 // master进程，管理进程
 #define NGX_PROCESS_WORKER 1 // worker进程，工作进程
 
+#define NGX_MAX_PROCESSES 1024				 // master进程最多管理这么多个worker进程
+#define NGX_LISTEN_FDS_ENV "NGX_LISTEN_FDS" // 平滑升级时老的master进程用这个环境变量把监听socket传给新的master进程，格式"fd;fd;"
+#define NGX_ADMIN_FD_ENV "NGX_ADMIN_FD"		// 平滑升级时老的master进程用这个环境变量把管理端口的socket传给新的master进程，格式"fd"
+#define NGX_ACCOUNT_STORE_ENV "NGX_ACCOUNT_STORE" // 平滑升级时老的master进程用这个环境变量把账号存储的memfd传给新的master进程，格式"fd"
+
 #endif
@@ -0,0 +1,285 @@
+﻿#ifndef __NGX_METRICS_H__
+#define __NGX_METRICS_H__
+
+// 统计信息共享内存的布局：master进程fork()之前创建，每个worker进程一块，worker进程只写自己那块，不加锁，用relaxed原子操作
+// master进程、管理端口和离线工具tools/ngx_metrics_dump随时读，把各块加起来就是整个服务器的统计
+// 本文件服务器和工具共用，只能包含布局和纯内联的函数，不要引入服务器的其他头文件
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+#define NGX_METRICS_MAGIC "NGXMET01" // 文件头
+#define NGX_METRICS_VERSION 6		 // 布局变了就改这个，工具发现版本不对就不读
+#define NGX_METRICS_MAX_WORKERS 64	 // 最多这么多块，worker进程按槽位号用，重启后的worker进程接着用原来那块
+#define NGX_METRICS_CACHELINE 64
+#define NGX_METRICS_MSGCODES 8		 // 按消息代码分开统计延迟，消息代码0~6各一份，>=7的（包括不认识的）都算在7里
+
+// 计数器：只增不减，worker进程重启后接着累加；X(编号, 名字, 说明)，名字按Prometheus的习惯起
+#define NGX_METRICS_COUNTERS(X)                                                                              \
+	X(NGX_MC_ACCEPTED, "connections_accepted_total", "accept()成功并开始服务的连接数")                        \
+	X(NGX_MC_REFUSED, "connections_refused_total", "连接数到上限、连接池不够用或者短时间内连接太多而直接关闭的连接数") \
+	X(NGX_MC_REFUSED_CHURN, "connections_refused_churn_total", "其中因为短时间内连接/断开太多、连接池膨胀而关闭的连接数") \
+	X(NGX_MC_REFUSED_IP_CONNS, "connections_refused_ip_conns_total", "其中因为同一个来源IP的连接数到了上限而关闭的连接数") \
+	X(NGX_MC_REFUSED_IP_RATE, "connections_refused_ip_rate_total", "其中因为同一个来源IP连得太快而关闭的连接数") \
+	X(NGX_MC_IPLIMIT_FULL, "iplimit_table_full_total", "按IP限制的表中没有位置、不受按IP限制的连接数")      \
+	X(NGX_MC_CLOSED, "connections_closed_total", "关闭(进入回收队列)的连接数")                                 \
+	X(NGX_MC_RECV_BYTES, "received_bytes_total", "收到的字节数")                                              \
+	X(NGX_MC_RECV_PKGS, "received_packets_total", "收到的完整数据包数")                                       \
+	X(NGX_MC_BAD_PKGS, "malformed_packets_total", "包头中的长度不对而断开的连接数")                           \
+	X(NGX_MC_CRC_ERRORS, "crc_errors_total", "crc校验不对而丢弃的数据包数")                                   \
+	X(NGX_MC_FLOOD_KICKS, "flood_kicks_total", "发包太频繁而被踢掉的连接数")                                  \
+	X(NGX_MC_FLOOD_DROPS, "flood_drops_total", "发包超过限速而丢弃的数据包数")                                \
+	X(NGX_MC_FLOOD_DELAYS, "flood_delays_total", "发包超过限速而暂停读连接的次数")                            \
+	X(NGX_MC_PING_KICKS, "ping_timeout_kicks_total", "心跳超时而被踢掉的连接数")                              \
+	X(NGX_MC_SENT_BYTES, "sent_bytes_total", "发出去的字节数")                                                \
+	X(NGX_MC_SENT_PKGS, "sent_packets_total", "发送完成的数据包数")                                           \
+	X(NGX_MC_SEND_BLOCKED, "send_blocked_total", "发送缓冲区满、转由epoll驱动继续发送的次数")                 \
+	X(NGX_MC_SEND_DISCARDED, "send_discarded_total", "发送队列太长或者连接积压太多而丢弃的待发送数据包数")    \
+	X(NGX_MC_SENDQ_KICKS, "send_queue_kicks_total", "积压太多待发送数据包而被踢掉的连接数")                   \
+	X(NGX_MC_MSG_PROCESSED, "messages_processed_total", "线程池处理过的消息数")                              \
+	X(NGX_MC_MSG_SHED, "messages_shed_total", "排队超过处理期限而回复服务器忙的消息数")                       \
+	X(NGX_MC_MSG_REJECTED, "messages_rejected_total", "线程池队列满而拒绝的消息数")                           \
+	X(NGX_MC_MEM_ALLOCS, "memory_allocs_total", "CMemory::AllocMemory()调用次数")                           \
+	X(NGX_MC_MEM_ALLOC_BYTES, "memory_alloc_bytes_total", "CMemory::AllocMemory()分配的字节数")             \
+	X(NGX_MC_MEM_FREES, "memory_frees_total", "CMemory::FreeMemory()调用次数")                              \
+	X(NGX_MC_LOG_DROPPED, "log_dropped_total", "日志缓冲区满而丢弃的日志行数")                               \
+	X(NGX_MC_CAPTURED_PKGS, "captured_packets_total", "录制到流量录制文件中的数据包数")                       \
+	X(NGX_MC_CAPTURE_DROPPED, "capture_dropped_total", "超过录制速度上限或者录制文件写满而没有录的数据包数")
+
+// 当前值：worker进程定时刷新，worker进程退出后由master进程清零
+#define NGX_METRICS_GAUGES(X)                                                             \
+	X(NGX_MG_ONLINE, "online_connections", "当前在线的连接数")                             \
+	X(NGX_MG_CONN_POOL, "connection_pool_size", "连接池中的连接总数")                      \
+	X(NGX_MG_CONN_FREE, "connection_pool_free", "连接池中的空闲连接数")                    \
+	X(NGX_MG_CONN_RECY, "connection_recycle_pending", "等待延迟回收的连接数")              \
+	X(NGX_MG_TIMER_QUEUE, "timer_queue_size", "时间队列中的连接数")                        \
+	X(NGX_MG_RECV_QUEUE, "recv_queue_depth", "线程池接收消息队列中排队的消息数")           \
+	X(NGX_MG_CPU_QUEUE, "cpu_queue_depth", "耗CPU消息线程池中排队的消息数")                \
+	X(NGX_MG_SEND_QUEUE, "send_queue_depth", "发送消息队列中排队的消息数")                \
+	X(NGX_MG_RSS, "resident_memory_bytes", "worker进程的常驻内存(字节)")
+
+// 延迟直方图，单位微秒
+#define NGX_METRICS_HISTOGRAMS(X)                                                         \
+	X(NGX_MH_QUEUE_WAIT, "queue_wait_us", "消息在接收消息队列中等待的时间(微秒)")          \
+	X(NGX_MH_PROCESS, "process_us", "线程池处理一个消息的耗时(微秒)")                     \
+	X(NGX_MH_SENDQ_SCAN, "send_queue_scan_us", "发送线程持锁扫描一遍发送消息队列的耗时(微秒)")
+
+// 一个请求从收包到回应答的各个阶段，按消息代码分别统计，单位微秒
+// 时间点都记在消息头STRUC_MSG_HEADER里，应答的消息头是从请求拷贝过来的，所以应答发完时能算出整个过程
+#define NGX_METRICS_STAGES(X)                                                                  \
+	X(NGX_MS_RECV, "recv", "从收到包头的第一个字节到收完整个包")                                \
+	X(NGX_MS_QUEUE, "queue", "在接收消息队列中等待")                                          \
+	X(NGX_MS_HANDLER, "handler", "处理函数执行")                                              \
+	X(NGX_MS_SEND_WAIT, "send_wait", "应答在发送消息队列中等待")                              \
+	X(NGX_MS_WIRE, "wire", "从第一次send()到应答的最后一个字节交给内核，发送缓冲区满时要等epoll") \
+	X(NGX_MS_TOTAL, "total", "从收到包头的第一个字节到应答的最后一个字节交给内核")
+
+#define NGX_METRICS_ID(id, name, help) id,
+enum ngx_metrics_counter_e
+{
+	NGX_METRICS_COUNTERS(NGX_METRICS_ID)
+	NGX_MC_MAX
+};
+enum ngx_metrics_gauge_e
+{
+	NGX_METRICS_GAUGES(NGX_METRICS_ID)
+	NGX_MG_MAX
+};
+enum ngx_metrics_hist_e
+{
+	NGX_METRICS_HISTOGRAMS(NGX_METRICS_ID)
+	NGX_MH_MAX
+};
+enum ngx_metrics_stage_e
+{
+	NGX_METRICS_STAGES(NGX_METRICS_ID)
+	NGX_MS_MAX
+};
+#undef NGX_METRICS_ID
+
+typedef struct
+{
+	const char *name;
+	const char *help;
+} ngx_metrics_desc_t;
+
+#define NGX_METRICS_DESC(id, name, help) {name, help},
+static const ngx_metrics_desc_t ngx_metrics_counter_desc[] = {NGX_METRICS_COUNTERS(NGX_METRICS_DESC)};
+static const ngx_metrics_desc_t ngx_metrics_gauge_desc[] = {NGX_METRICS_GAUGES(NGX_METRICS_DESC)};
+static const ngx_metrics_desc_t ngx_metrics_hist_desc[] = {NGX_METRICS_HISTOGRAMS(NGX_METRICS_DESC)};
+static const ngx_metrics_desc_t ngx_metrics_stage_desc[] = {NGX_METRICS_STAGES(NGX_METRICS_DESC)};
+#undef NGX_METRICS_DESC
+
+// 直方图的桶：对数-线性分桶（HDR直方图的做法），小于4的值一个值一个桶，之后每个2的幂区间再均分成4个桶
+// 相对误差不超过25%，桶号用一次clz算出来，记录一个值只有3次relaxed原子加，可以一直开着
+#define NGX_METRICS_HIST_SUB_BITS 2
+#define NGX_METRICS_HIST_SUB (1 << NGX_METRICS_HIST_SUB_BITS)
+#define NGX_METRICS_HIST_BUCKETS ((32 - NGX_METRICS_HIST_SUB_BITS + 1) * NGX_METRICS_HIST_SUB) // 最大到2^32微秒，再大的都算进最后一个桶
+
+inline int ngx_metrics_hist_bucket(uint64_t v)
+{
+	if (v < NGX_METRICS_HIST_SUB)
+		return (int)v;
+	int msb = 63 - __builtin_clzll(v);
+	int b = (msb - NGX_METRICS_HIST_SUB_BITS + 1) * NGX_METRICS_HIST_SUB + (int)((v >> (msb - NGX_METRICS_HIST_SUB_BITS)) & (NGX_METRICS_HIST_SUB - 1));
+	return (b < NGX_METRICS_HIST_BUCKETS) ? b : NGX_METRICS_HIST_BUCKETS - 1;
+}
+
+// 桶的下界（含）
+inline uint64_t ngx_metrics_hist_lower(int b)
+{
+	if (b < NGX_METRICS_HIST_SUB)
+		return (uint64_t)b;
+	int msb = b / NGX_METRICS_HIST_SUB - 1 + NGX_METRICS_HIST_SUB_BITS;
+	return (uint64_t)(NGX_METRICS_HIST_SUB + b % NGX_METRICS_HIST_SUB) << (msb - NGX_METRICS_HIST_SUB_BITS);
+}
+
+// 桶的上界（含），最后一个桶没有上界
+inline uint64_t ngx_metrics_hist_upper(int b)
+{
+	return (b + 1 < NGX_METRICS_HIST_BUCKETS) ? ngx_metrics_hist_lower(b + 1) - 1 : UINT64_MAX;
+}
+
+typedef struct
+{
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sum; // 所有值之和，算平均值用
+	std::atomic<uint64_t> buckets[NGX_METRICS_HIST_BUCKETS];
+} ngx_metrics_hist_t;
+
+// 一个worker进程的统计块，按缓存行对齐，不同worker进程写的东西不会落在同一个缓存行里
+typedef struct alignas(NGX_METRICS_CACHELINE) _ngx_metrics_block_s
+{
+	std::atomic<int32_t> pid;		// 正在用这块的worker进程，0表示没有（worker进程退出后master进程清零）
+	std::atomic<uint32_t> spawns;	// 这个槽位上先后启动过几个worker进程
+	std::atomic<int64_t> startTime; // 当前worker进程的启动时间
+
+	alignas(NGX_METRICS_CACHELINE) std::atomic<int64_t> counters[NGX_MC_MAX];
+	alignas(NGX_METRICS_CACHELINE) std::atomic<int64_t> gauges[NGX_MG_MAX];
+	alignas(NGX_METRICS_CACHELINE) ngx_metrics_hist_t hists[NGX_MH_MAX];
+	ngx_metrics_hist_t stages[NGX_METRICS_MSGCODES][NGX_MS_MAX]; // 按消息代码、按阶段的延迟
+} ngx_metrics_block_t, *lpngx_metrics_block_t;
+
+// 共享内存的开头，后边紧跟maxWorkers个ngx_metrics_block_t
+typedef struct alignas(NGX_METRICS_CACHELINE) _ngx_metrics_shm_s
+{
+	char magic[8];		 // NGX_METRICS_MAGIC，不带结尾的\0
+	uint32_t version;	 // NGX_METRICS_VERSION
+	uint32_t blockSize;	 // sizeof(ngx_metrics_block_t)，工具读之前校验
+	uint32_t maxWorkers; // 统计块的个数
+	uint32_t counters;	 // NGX_MC_MAX
+	uint32_t gauges;	 // NGX_MG_MAX
+	uint32_t hists;		 // NGX_MH_MAX
+	uint32_t msgcodes;	 // NGX_METRICS_MSGCODES
+	uint32_t stages;	 // NGX_MS_MAX
+	int32_t masterPid;	 // 创建者
+	int64_t startTime;	 // master进程的启动时间
+} ngx_metrics_shm_t, *lpngx_metrics_shm_t;
+
+inline lpngx_metrics_block_t ngx_metrics_block(lpngx_metrics_shm_t pShm, int slot)
+{
+	return (lpngx_metrics_block_t)((char *)pShm + sizeof(ngx_metrics_shm_t)) + slot;
+}
+
+inline size_t ngx_metrics_shm_size(int maxWorkers)
+{
+	return sizeof(ngx_metrics_shm_t) + sizeof(ngx_metrics_block_t) * maxWorkers;
+}
+
+// 汇总后的结果，普通内存
+typedef struct
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[NGX_METRICS_HIST_BUCKETS];
+} ngx_metrics_hist_snap_t;
+
+typedef struct
+{
+	int workers; // 活着的worker进程数
+	int64_t counters[NGX_MC_MAX];
+	int64_t gauges[NGX_MG_MAX];
+	ngx_metrics_hist_snap_t hists[NGX_MH_MAX];
+	ngx_metrics_hist_snap_t stages[NGX_METRICS_MSGCODES][NGX_MS_MAX];
+} ngx_metrics_snap_t;
+
+inline void ngx_metrics_read_hist(ngx_metrics_hist_t *pHist, ngx_metrics_hist_snap_t *pSnap)
+{
+	pSnap->count = pHist->count.load(std::memory_order_relaxed);
+	pSnap->sum = pHist->sum.load(std::memory_order_relaxed);
+	for (int b = 0; b < NGX_METRICS_HIST_BUCKETS; b++)
+		pSnap->buckets[b] = pHist->buckets[b].load(std::memory_order_relaxed);
+}
+
+inline void ngx_metrics_add_hist(ngx_metrics_hist_snap_t *pDst, const ngx_metrics_hist_snap_t *pSrc)
+{
+	pDst->count += pSrc->count;
+	pDst->sum += pSrc->sum;
+	for (int b = 0; b < NGX_METRICS_HIST_BUCKETS; b++)
+		pDst->buckets[b] += pSrc->buckets[b];
+}
+
+// 取一块的快照
+inline void ngx_metrics_read_block(lpngx_metrics_block_t pBlock, ngx_metrics_snap_t *pSnap)
+{
+	memset(pSnap, 0, sizeof(ngx_metrics_snap_t));
+	pSnap->workers = (pBlock->pid.load(std::memory_order_relaxed) != 0) ? 1 : 0;
+	for (int i = 0; i < NGX_MC_MAX; i++)
+		pSnap->counters[i] = pBlock->counters[i].load(std::memory_order_relaxed);
+	for (int i = 0; i < NGX_MG_MAX; i++)
+		pSnap->gauges[i] = pBlock->gauges[i].load(std::memory_order_relaxed);
+	for (int i = 0; i < NGX_MH_MAX; i++)
+		ngx_metrics_read_hist(&pBlock->hists[i], &pSnap->hists[i]);
+	for (int c = 0; c < NGX_METRICS_MSGCODES; c++)
+		for (int i = 0; i < NGX_MS_MAX; i++)
+			ngx_metrics_read_hist(&pBlock->stages[c][i], &pSnap->stages[c][i]);
+}
+
+// 把所有块加起来：计数器和直方图包括已经退出的worker进程留下的，当前值只算活着的（退出的已经被master进程清零了）
+// 不加锁，读的同时worker进程还在写，各项之间可能差几个，统计用途无所谓
+// pOne是临时用的，和pSnap一样大，快照比较大（几十KB），由调用者准备，不放在栈上
+inline void ngx_metrics_aggregate(lpngx_metrics_shm_t pShm, ngx_metrics_snap_t *pSnap, ngx_metrics_snap_t *pOne)
+{
+	memset(pSnap, 0, sizeof(ngx_metrics_snap_t));
+	for (uint32_t w = 0; w < pShm->maxWorkers; w++)
+	{
+		lpngx_metrics_block_t pBlock = ngx_metrics_block(pShm, (int)w);
+		if (pBlock->spawns.load(std::memory_order_relaxed) == 0)
+			continue; // 没用过的槽位全是0
+		ngx_metrics_read_block(pBlock, pOne);
+		pSnap->workers += pOne->workers;
+		for (int i = 0; i < NGX_MC_MAX; i++)
+			pSnap->counters[i] += pOne->counters[i];
+		for (int i = 0; i < NGX_MG_MAX; i++)
+			pSnap->gauges[i] += pOne->gauges[i];
+		for (int i = 0; i < NGX_MH_MAX; i++)
+			ngx_metrics_add_hist(&pSnap->hists[i], &pOne->hists[i]);
+		for (int c = 0; c < NGX_METRICS_MSGCODES; c++)
+			for (int i = 0; i < NGX_MS_MAX; i++)
+				ngx_metrics_add_hist(&pSnap->stages[c][i], &pOne->stages[c][i]);
+	}
+}
+
+// 直方图的分位数，q在0到1之间，返回所在桶的上界，没有数据返回0
+inline uint64_t ngx_metrics_hist_percentile(const ngx_metrics_hist_snap_t *pHist, double q)
+{
+	uint64_t total = 0;
+	for (int b = 0; b < NGX_METRICS_HIST_BUCKETS; b++)
+		total += pHist->buckets[b];
+	if (total == 0)
+		return 0;
+	uint64_t rank = (uint64_t)(q * (double)total);
+	if (rank >= total)
+		rank = total - 1;
+	uint64_t seen = 0;
+	for (int b = 0; b < NGX_METRICS_HIST_BUCKETS; b++)
+	{
+		seen += pHist->buckets[b];
+		if (seen > rank)
+			return (b + 1 < NGX_METRICS_HIST_BUCKETS) ? ngx_metrics_hist_upper(b) : ngx_metrics_hist_lower(b);
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,83 @@
+﻿#ifndef __NGX_PROBE_H__
+#define __NGX_PROBE_H__
+
+// 静态跟踪点（USDT）：和sys/sdt.h生成的东西一样，一条nop指令加一条.note.stapsdt段中的记录，provider都是ngx
+// 没有人跟踪时只多一条nop（参数已经在寄存器里或者栈上，不额外取值），可以一直开着；perf、bpftrace、systemtap直接按名字挂上去，不用重新编译
+//   列出跟踪点：readelf -n nginx | grep -A3 stapsdt，或者 bpftrace -l 'usdt:./nginx:*'
+//   例子脚本在tools/bpftrace/下
+// 不依赖sys/sdt.h（不是所有机器都装了systemtap-sdt-dev），参数统一按有符号64位整数传，指针也一样
+// 编译时定义NGX_NO_PROBES可以把跟踪点全部去掉；目前只支持x86_64和aarch64，其他平台上是空的
+
+#include <stdint.h>
+
+#if !defined(NGX_NO_PROBES) && (defined(__x86_64__) || defined(__aarch64__))
+
+// 一条记录：跟踪点地址、基地址（用来算预链接后的偏移）、信号量地址（不用，给0）、provider、名字、参数格式
+// 参数格式是"-8@位置"，-8表示有符号8字节，位置由编译器填（寄存器、内存或者立即数）
+// 记录放在和所在函数相同的段组里（"?"），内联函数被去重时记录跟着一起去掉
+#define _NGX_PROBE_ASM(name, args)                                  \
+	"990:	nop\n"                                                   \
+	".pushsection .note.stapsdt,\"?\",\"note\"\n"                    \
+	".balign 4\n"                                                    \
+	".4byte 992f-991f, 994f-993f, 3\n"                               \
+	"991:	.asciz \"stapsdt\"\n"                                      \
+	"992:	.balign 4\n"                                               \
+	"993:	.8byte 990b\n"                                             \
+	".8byte _.stapsdt.base\n"                                        \
+	".8byte 0\n"                                                     \
+	".asciz \"ngx\"\n"                                               \
+	".asciz \"" #name "\"\n"                                         \
+	".asciz \"" args "\"\n"                                          \
+	"994:	.balign 4\n"                                               \
+	".popsection\n"                                                  \
+	".ifndef _.stapsdt.base\n"                                       \
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n"                                         \
+	".hidden _.stapsdt.base\n"                                       \
+	"_.stapsdt.base: .space 1\n"                                     \
+	".size _.stapsdt.base, 1\n"                                      \
+	".popsection\n"                                                  \
+	".endif\n"
+
+#define _NGX_PROBE_ARG(n, x) [_a##n] "nor"((int64_t)(x))
+
+#define NGX_PROBE0(name) \
+	__asm__ __volatile__(_NGX_PROBE_ASM(name, "")::)
+#define NGX_PROBE1(name, a1) \
+	__asm__ __volatile__(_NGX_PROBE_ASM(name, "-8@%[_a1]")::_NGX_PROBE_ARG(1, a1))
+#define NGX_PROBE2(name, a1, a2) \
+	__asm__ __volatile__(_NGX_PROBE_ASM(name, "-8@%[_a1] -8@%[_a2]")::_NGX_PROBE_ARG(1, a1), _NGX_PROBE_ARG(2, a2))
+#define NGX_PROBE3(name, a1, a2, a3)                                                  \
+	__asm__ __volatile__(_NGX_PROBE_ASM(name, "-8@%[_a1] -8@%[_a2] -8@%[_a3]")::_NGX_PROBE_ARG(1, a1), \
+						 _NGX_PROBE_ARG(2, a2), _NGX_PROBE_ARG(3, a3))
+#define NGX_PROBE4(name, a1, a2, a3, a4)                                                          \
+	__asm__ __volatile__(_NGX_PROBE_ASM(name, "-8@%[_a1] -8@%[_a2] -8@%[_a3] -8@%[_a4]")::_NGX_PROBE_ARG(1, a1), \
+						 _NGX_PROBE_ARG(2, a2), _NGX_PROBE_ARG(3, a3), _NGX_PROBE_ARG(4, a4))
+
+#else
+
+#define NGX_PROBE0(name) ((void)0)
+#define NGX_PROBE1(name, a1) ((void)0)
+#define NGX_PROBE2(name, a1, a2) ((void)0)
+#define NGX_PROBE3(name, a1, a2, a3) ((void)0)
+#define NGX_PROBE4(name, a1, a2, a3, a4) ((void)0)
+
+#endif
+
+// 跟踪点一览（参数都是64位整数）：
+//   accept(fd, conn)                          ngx_event_accept()中新连接开始服务
+//   get_connection(fd, conn, sequence)        从连接池取出一个连接
+//   pkg_header(fd, conn, msgCode, pkgLen)     收完一个合法的包头
+//   enqueue(msgbuf, msgCode, lane, queued)    消息入线程池队列，queued是入队后的总排队数
+//   dequeue(msgbuf, msgCode, waitUs)          线程池取出消息，waitUs是排队时间
+//   handler_entry(fd, msgCode, msgbuf)        进入statusHandler[]中的处理函数
+//   handler_return(fd, msgCode, result)       处理函数返回，result是它的返回值
+//   msg_send(fd, sendbuf, msgCode, queued)    应答入发送消息队列
+//   send_partial(fd, conn, sent, size)        send()没能一次发完（sent为0表示发送缓冲区本来就是满的）
+//   send_done(fd, conn, msgCode, totalUs)     一个应答的最后一个字节交给了内核，totalUs是从收包开始的全程时间
+//   close(fd, conn)                           zdClosesocketProc()主动关闭连接
+//   ping_kick(fd, conn)                       心跳超时踢人
+//   recycle(fd, conn)                         连接进入延迟回收队列
+//   conn_free(conn)                           连接归还连接池
+
+#endif
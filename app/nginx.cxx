@@ -4,6 +4,7 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
 
@@ -15,6 +16,8 @@
 #include "ngx_c_threadpool.h" //和多线程有关
 #include "ngx_c_crc32.h"	  //和crc32校验算法有关
 #include "ngx_c_slogic.h"	  //和socket通讯相关
+#include "ngx_c_metrics.h"	  //和统计信息有关
+#include "ngx_c_capture.h"	  //和流量录制有关
 
 static void freeresource();
 
@@ -23,11 +26,13 @@ size_t g_argvneedmem = 0; // 保存下这些argv参数所需要的内存大小
 size_t g_envneedmem = 0;  // 环境变量所占内存大小
 int g_os_argc;			  // 参数个数
 char **g_os_argv;		  // 原始命令行参数数组,在main中会被赋值
+char *g_binary_path = NULL; // 启动时可执行文件的绝对路径，平滑升级时exec它
 char *gp_envmem = NULL;	  // 指向自己分配的env环境变量的内存，在ngx_init_setproctitle()函数中会被分配内存
 int g_daemonized = 0;	  // 守护进程标记，标记是否启用了守护进程模式，0：未启用，1：启用了
 
 CLogicSocket g_socket;	  // socket全局对象
 CThreadPool g_threadpool; // 线程池全局对象
+CThreadPool g_cpupool;    // 专门处理耗CPU消息（比如密码hash）的线程池，和g_threadpool分开，耗CPU的消息再多也不会耽误心跳包
 
 // 和进程本身有关的全局量
 pid_t ngx_pid;		 // pid
@@ -39,6 +44,16 @@ sig_atomic_t ngx_working_subprocess = 0; // 运行中的子进程数量
 
 sig_atomic_t ngx_reap;
 // 标记子进程状态变化(一般是子进程发来SIGCHLD信号表示退出)
+sig_atomic_t ngx_reconfigure;
+// 标记要重新加载配置文件(master进程收到SIGHUP信号)
+sig_atomic_t ngx_quit;
+// 标记优雅退出(收到SIGQUIT信号)：worker进程不再accept，已有连接处理完再退出；master进程等worker进程都退出了再退出
+sig_atomic_t ngx_noaccept;
+// 标记让worker进程优雅退出并且不再重新创建(master进程收到SIGWINCH信号)，平滑升级时让老的worker进程退出用
+sig_atomic_t ngx_change_binary;
+// 标记要平滑升级(master进程收到SIGUSR2信号)：exec新的可执行文件，把监听socket传给它
+pid_t ngx_new_binary = 0;
+// 平滑升级时新的master进程的pid，0表示没有
 
 int main(int argc, char *const *argv)
 {
@@ -64,17 +79,35 @@ int main(int argc, char *const *argv)
 
 	g_os_argc = argc;		   // 保存参数个数
 	g_os_argv = (char **)argv; // 保存参数指针
+	// 用/proc/self/exe而不是argv[0]：argv[0]可能是靠PATH找到的不带路径的名字，execv()不会去PATH里找，相对路径在chdir()之后也不对了
+	// 部署时替换掉文件之后，/proc/self/exe会变成"路径 (deleted)"，所以要在启动时就取出来
+	{
+		char exepath[PATH_MAX];
+		ssize_t len = readlink("/proc/self/exe", exepath, sizeof(exepath) - 1);
+		if (len > 0)
+		{
+			exepath[len] = 0;
+			g_binary_path = strdup(exepath);
+		}
+		else
+			g_binary_path = strdup(argv[0]);
+	}
 
 	// 全局量有必要初始化的
 	ngx_log.fd = -1;				  //-1：表示日志文件尚未打开；因为后边ngx_log_stderr要用所以这里先给-1
+	ngx_log.binfd = -1;				  //-1：没有开二进制日志
 	ngx_process = NGX_PROCESS_MASTER; // 先标记本进程是master进程
 	ngx_reap = 0;					  // 标记子进程没有发生变化
+	ngx_reconfigure = 0;			  // 标记不需要重新加载配置文件
+	ngx_quit = 0;
+	ngx_noaccept = 0;
+	ngx_change_binary = 0;
 
 	CConfig *p_config = CConfig::GetInstance();
-	if (p_config->Load("nginx.conf") == false) // 把配置文件内容载入到内存
+	if (p_config->Load(NGX_CONF_PATH) == false) // 把配置文件内容载入到内存
 	{
 		ngx_log_init(); // 初始化日志
-		ngx_log_stderr(0, "配置文件[%s]载入失败，退出!", "nginx.conf");
+		ngx_log_stderr(0, "配置文件[%s]载入失败，退出!", NGX_CONF_PATH);
 		// exit(0)表示程序正常, exit(1)/exit(-1)表示程序异常退出，exit(2)表示表示系统找不到指定的文件
 		exitcode = 2; // 标记找不到文件
 		goto lblexit;
@@ -87,18 +120,39 @@ int main(int argc, char *const *argv)
 	// 一些必须事先准备好的资源，先初始化
 	ngx_log_init(); // 日志初始化(创建/打开日志文件)，这个需要配置项，所以必须放配置文件载入的后边
 
+	// 平滑升级时由老的master进程exec起来的，老的master进程已经是守护进程了，本进程不用再fork()一次，也要留在它下边让它能回收
+	bool inherited;
+	inherited = (getenv(NGX_LISTEN_FDS_ENV) != NULL);
+
 	// 一些初始化函数，准备放这里
 	if (ngx_init_signals() != 0) // 信号初始化
 	{
 		exitcode = 1;
 		goto lblexit;
 	}
-	g_socket.Initialize(); // 初始化socket
+	// 统计信息共享内存，fork()之前创建，worker进程重启也不丢
+	const char *pmetricsname;
+	pmetricsname = p_config->GetString("MetricsFile");
+	if (CMetrics::GetInstance()->Init(pmetricsname ? pmetricsname : NGX_METRICS_PATH) == false)
+	{
+		exitcode = 1;
+		goto lblexit;
+	}
+	CCapture::GetInstance()->Init(); // 流量录制的可调整配置项也要在fork()之前登记
+	if (g_socket.Initialize() == false) // 初始化socket
+	{
+		exitcode = 1;
+		goto lblexit;
+	}
 
 	ngx_init_setproctitle(); // 把环境变量搬家
 
 	// 创建守护进程
-	if (p_config->GetIntDefault("Daemon", 0) == 1)
+	if (p_config->GetIntDefault("Daemon", 0) == 1 && inherited)
+	{
+		g_daemonized = 1;
+	}
+	else if (p_config->GetIntDefault("Daemon", 0) == 1)
 	{
 		// 按守护进程方式运行
 		int cdaemonresult = ngx_daemon();
@@ -135,10 +189,21 @@ void freeresource()
 		gp_envmem = NULL;
 	}
 
+	if (g_binary_path)
+	{
+		free(g_binary_path);
+		g_binary_path = NULL;
+	}
+
 	// 关闭日志文件
 	if (ngx_log.fd != STDERR_FILENO && ngx_log.fd != -1)
 	{
 		close(ngx_log.fd); // 不用判断结果了
 		ngx_log.fd = -1;   // 标记下，防止被再次close
 	}
+	if (ngx_log.binfd != -1)
+	{
+		close(ngx_log.binfd);
+		ngx_log.binfd = -1;
+	}
 }
\ No newline at end of file
@@ -1,13 +1,19 @@
 ﻿#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/mman.h>
 #include <vector>
 
 #include "ngx_func.h"	
 #include "ngx_c_conf.h"
+#include "ngx_macro.h"
 
 CConfig::CConfig()
 {
+	m_pTunables = NULL;
+	m_iTunableCount = 0;
 }
 
 CConfig::~CConfig()
@@ -79,28 +85,389 @@ bool CConfig::Load(const char *pconfName)
 	}
 
 	fclose(fp);
+	BuildIndex();
 	return true;
 }
 
-// 根据ItemName获取配置信息字符串，不修改不用互斥
-const char *CConfig::GetString(const char *p_itemname)
+// 重新装载配置文件：先读到新的列表里，读成功了才替换原来的配置
+// 可调整配置项按新配置重新算值并写进共享内存，worker进程马上就用上新值；其他配置项只在进程启动时读，改了要重启才生效，这里只写日志提示
+bool CConfig::Reload(const char *pconfName)
 {
-	std::vector<LPCConfItem>::iterator pos;
-	for (pos = m_ConfigItemList.begin(); pos != m_ConfigItemList.end(); ++pos)
+	std::vector<LPCConfItem> oldList;
+	oldList.swap(m_ConfigItemList);
+	if (Load(pconfName) == false)
+	{
+		m_ConfigItemList.swap(oldList);
+		ngx_log_error_core(NGX_LOG_ERR, errno, "CConfig::Reload()中配置文件[%s]载入失败，继续使用原来的配置!", pconfName);
+		return false;
+	}
+
+	// 可调整配置项：值有变化的写进共享内存
+	for (int i = 0; i < m_iTunableCount; i++)
+	{
+		lpngx_conf_tunable_t pTunable = &m_pTunables[i];
+		int64_t newValue = Resolve(pTunable);
+		int64_t oldValue = pTunable->value.exchange(newValue, std::memory_order_relaxed);
+		if (oldValue != newValue)
+		{
+			ngx_log_error_core(NGX_LOG_NOTICE, 0, "配置项%s由%L改为%L，立即生效", pTunable->name, oldValue, newValue);
+		}
+	}
+
+	// 其他配置项：新增、修改、删除了的，提示要重启才生效
+	for (size_t i = 0; i < m_ConfigItemList.size(); i++)
+	{
+		LPCConfItem p_item = m_ConfigItemList[i];
+		if (Find(p_item->ItemName) != p_item || IsTunable(p_item->ItemName))
+			continue; // 重复的配置项以前边的为准，后边的不用看
+		const char *pOld = NULL;
+		for (size_t j = 0; j < oldList.size(); j++)
+		{
+			if (strcasecmp(oldList[j]->ItemName, p_item->ItemName) == 0)
+			{
+				pOld = oldList[j]->ItemContent;
+				break;
+			}
+		}
+		if (pOld == NULL || strcmp(pOld, p_item->ItemContent) != 0)
+		{
+			ngx_log_error_core(NGX_LOG_WARN, 0, "配置项%s改为[%s]，要重启才生效", p_item->ItemName, p_item->ItemContent);
+		}
+	}
+	for (size_t j = 0; j < oldList.size(); j++)
+	{
+		if (Find(oldList[j]->ItemName) == NULL && !IsTunable(oldList[j]->ItemName))
+		{
+			ngx_log_error_core(NGX_LOG_WARN, 0, "配置项%s被删除，要重启才生效", oldList[j]->ItemName);
+		}
+		delete oldList[j];
+	}
+	return true;
+}
+
+// 是不是已经登记过的可调整配置项
+bool CConfig::IsTunable(const char *p_itemname)
+{
+	for (int i = 0; i < m_iTunableCount; i++)
+	{
+		if (strcasecmp(m_pTunables[i].name, p_itemname) == 0)
+			return true;
+	}
+	return false;
+}
+
+// 名字的hash值，不区分大小写（FNV-1a）
+uint32_t CConfig::Hash(const char *p_itemname)
+{
+	uint32_t h = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *)p_itemname; *p; p++)
 	{
-		if (strcasecmp((*pos)->ItemName, p_itemname) == 0)
-			return (*pos)->ItemContent;
+		h ^= (uint32_t)tolower(*p);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// 配置文件读完之后建立按名字的hash索引，之后每次按名字取配置都是O(1)
+// 同名的配置项以前边的为准，和原来从头找的结果一样
+void CConfig::BuildIndex()
+{
+	size_t size = 16;
+	while (size < m_ConfigItemList.size() * 2)
+		size <<= 1;
+	m_index.assign(size, (LPCConfItem)NULL);
+	for (size_t i = 0; i < m_ConfigItemList.size(); i++)
+	{
+		LPCConfItem p_item = m_ConfigItemList[i];
+		size_t pos = Hash(p_item->ItemName) & (size - 1);
+		bool ifdup = false;
+		while (m_index[pos] != NULL)
+		{
+			if (strcasecmp(m_index[pos]->ItemName, p_item->ItemName) == 0)
+			{
+				ifdup = true;
+				break;
+			}
+			pos = (pos + 1) & (size - 1);
+		}
+		if (!ifdup)
+			m_index[pos] = p_item;
+	}
+	return;
+}
+
+LPCConfItem CConfig::Find(const char *p_itemname)
+{
+	if (m_index.empty())
+		return NULL;
+	size_t mask = m_index.size() - 1;
+	size_t pos = Hash(p_itemname) & mask;
+	while (m_index[pos] != NULL)
+	{
+		if (strcasecmp(m_index[pos]->ItemName, p_itemname) == 0)
+			return m_index[pos];
+		pos = (pos + 1) & mask;
 	}
 	return NULL;
 }
+
+// 根据ItemName获取配置信息字符串，不修改不用互斥
+const char *CConfig::GetString(const char *p_itemname)
+{
+	LPCConfItem p_item = Find(p_itemname);
+	return p_item ? p_item->ItemContent : NULL;
+}
 // 根据ItemName获取数字类型配置信息，不修改不用互斥
 int CConfig::GetIntDefault(const char *p_itemname, const int def)
 {
-	std::vector<LPCConfItem>::iterator pos;
-	for (pos = m_ConfigItemList.begin(); pos != m_ConfigItemList.end(); ++pos)
+	LPCConfItem p_item = Find(p_itemname);
+	return p_item ? atoi(p_item->ItemContent) : def;
+}
+
+// 解析开关：1/0、on/off、yes/no、true/false，不区分大小写
+bool CConfig::ParseBool(const char *pvalue, bool &ret)
+{
+	static const char *trues[] = {"1", "on", "yes", "true"};
+	static const char *falses[] = {"0", "off", "no", "false"};
+	for (size_t i = 0; i < sizeof(trues) / sizeof(trues[0]); i++)
 	{
-		if (strcasecmp((*pos)->ItemName, p_itemname) == 0)
-			return atoi((*pos)->ItemContent);
+		if (strcasecmp(pvalue, trues[i]) == 0)
+		{
+			ret = true;
+			return true;
+		}
+		if (strcasecmp(pvalue, falses[i]) == 0)
+		{
+			ret = false;
+			return true;
+		}
 	}
-	return def;
-}
\ No newline at end of file
+	return false;
+}
+
+// 解析时间，如"100ms"、"30s"、"5m"、"1h"、"1d"，不带单位的数字乘以unitMs，结果是毫秒
+bool CConfig::ParseDurationMs(const char *pvalue, int64_t unitMs, int64_t &ret)
+{
+	char *pend;
+	errno = 0;
+	long long n = strtoll(pvalue, &pend, 10);
+	if (pend == pvalue || errno != 0)
+		return false;
+	while (*pend == ' ' || *pend == '\t')
+		pend++;
+	int64_t unit;
+	if (*pend == 0)
+		unit = unitMs;
+	else if (strcasecmp(pend, "ms") == 0)
+		unit = 1;
+	else if (strcasecmp(pend, "s") == 0)
+		unit = 1000;
+	else if (strcasecmp(pend, "m") == 0)
+		unit = 60 * 1000;
+	else if (strcasecmp(pend, "h") == 0)
+		unit = 3600 * 1000;
+	else if (strcasecmp(pend, "d") == 0)
+		unit = 86400 * 1000LL;
+	else
+		return false;
+	ret = (int64_t)n * unit;
+	return true;
+}
+
+// 解析大小，如"64k"、"16M"、"1g"、"4096"，后边可以再跟个b，1024进位，结果是字节数
+bool CConfig::ParseSize(const char *pvalue, int64_t &ret)
+{
+	char *pend;
+	errno = 0;
+	long long n = strtoll(pvalue, &pend, 10);
+	if (pend == pvalue || errno != 0)
+		return false;
+	while (*pend == ' ' || *pend == '\t')
+		pend++;
+	int shift = 0;
+	switch (tolower((unsigned char)*pend))
+	{
+	case 0:
+	case 'b':
+		break;
+	case 'k':
+		shift = 10;
+		break;
+	case 'm':
+		shift = 20;
+		break;
+	case 'g':
+		shift = 30;
+		break;
+	default:
+		return false;
+	}
+	if (*pend != 0 && shift != 0)
+		pend++;
+	if (tolower((unsigned char)*pend) == 'b')
+		pend++;
+	if (*pend != 0)
+		return false;
+	ret = (int64_t)n << shift;
+	return true;
+}
+
+bool CConfig::GetBool(const char *p_itemname, bool def)
+{
+	const char *pvalue = GetString(p_itemname);
+	bool ret;
+	if (pvalue == NULL)
+		return def;
+	if (!ParseBool(pvalue, ret))
+	{
+		ngx_log_stderr(0, "配置项%s的值[%s]不是开关，使用缺省值%d", p_itemname, pvalue, (int)def);
+		return def;
+	}
+	return ret;
+}
+
+int64_t CConfig::GetDurationMs(const char *p_itemname, int64_t defMs, int64_t unitMs)
+{
+	const char *pvalue = GetString(p_itemname);
+	int64_t ret;
+	if (pvalue == NULL)
+		return defMs;
+	if (!ParseDurationMs(pvalue, unitMs, ret))
+	{
+		ngx_log_stderr(0, "配置项%s的值[%s]不是时间，使用缺省值%Lms", p_itemname, pvalue, defMs);
+		return defMs;
+	}
+	return ret;
+}
+
+int64_t CConfig::GetSize(const char *p_itemname, int64_t def)
+{
+	const char *pvalue = GetString(p_itemname);
+	int64_t ret;
+	if (pvalue == NULL)
+		return def;
+	if (!ParseSize(pvalue, ret))
+	{
+		ngx_log_stderr(0, "配置项%s的值[%s]不是大小，使用缺省值%L", p_itemname, pvalue, def);
+		return def;
+	}
+	return ret;
+}
+
+std::vector<std::string> CConfig::GetList(const char *p_itemname)
+{
+	std::vector<std::string> ret;
+	const char *p = GetString(p_itemname);
+	if (p == NULL)
+		return ret;
+	while (*p)
+	{
+		while (*p == ',' || *p == ' ' || *p == '\t')
+			p++;
+		const char *begin = p;
+		while (*p && *p != ',' && *p != ' ' && *p != '\t')
+			p++;
+		if (p > begin)
+			ret.push_back(std::string(begin, p - begin));
+	}
+	return ret;
+}
+
+// 按当前的配置内容算出可调整配置项的值：解析、值不对用缺省值、限制在取值范围内
+int64_t CConfig::Resolve(lpngx_conf_tunable_t pTunable)
+{
+	int64_t value = pTunable->def;
+	const char *pvalue = GetString(pTunable->name);
+	if (pvalue != NULL)
+	{
+		bool ok = true;
+		bool b;
+		switch (pTunable->type)
+		{
+		case NGX_CONF_BOOL:
+			ok = ParseBool(pvalue, b);
+			if (ok)
+				value = b ? 1 : 0;
+			break;
+		case NGX_CONF_DURATION:
+			ok = ParseDurationMs(pvalue, pTunable->unit, value);
+			break;
+		case NGX_CONF_SIZE:
+			ok = ParseSize(pvalue, value);
+			break;
+		default:
+		{
+			char *pend;
+			long long n = strtoll(pvalue, &pend, 10);
+			ok = (pend != pvalue && *pend == 0);
+			if (ok)
+				value = n;
+			break;
+		}
+		}
+		if (!ok)
+		{
+			ngx_log_stderr(0, "配置项%s的值[%s]不对，使用缺省值%L", pTunable->name, pvalue, pTunable->def);
+			value = pTunable->def;
+		}
+	}
+	if (value < pTunable->minval)
+		value = pTunable->minval;
+	if (value > pTunable->maxval)
+		value = pTunable->maxval;
+	return value;
+}
+
+lpngx_conf_tunable_t CConfig::GetHandle(int type, const char *p_itemname, int64_t def, int64_t unit, int64_t minval, int64_t maxval)
+{
+	for (int i = 0; i < m_iTunableCount; i++)
+	{
+		if (strcasecmp(m_pTunables[i].name, p_itemname) == 0)
+			return &m_pTunables[i];
+	}
+	if (m_pTunables == NULL)
+	{
+		// 第一次用到时分配，master进程fork()之前分配的匿名共享内存，worker进程继承后和master进程看到的是同一份
+		void *pMem = mmap(NULL, sizeof(ngx_conf_tunable_t) * NGX_CONF_MAX_TUNABLES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (pMem == MAP_FAILED)
+		{
+			ngx_log_stderr(errno, "CConfig::GetHandle()中mmap()失败，退出!");
+			exit(1);
+		}
+		m_pTunables = (lpngx_conf_tunable_t)pMem; // 匿名映射的内存全是0，atomic全0就是值为0
+	}
+	if (m_iTunableCount >= NGX_CONF_MAX_TUNABLES)
+	{
+		ngx_log_stderr(0, "CConfig::GetHandle()中可调整配置项超过%d个，退出!", NGX_CONF_MAX_TUNABLES);
+		exit(1);
+	}
+	lpngx_conf_tunable_t pTunable = &m_pTunables[m_iTunableCount++];
+	pTunable->type = type;
+	pTunable->def = def;
+	pTunable->unit = unit;
+	pTunable->minval = minval;
+	pTunable->maxval = maxval;
+	strncpy(pTunable->name, p_itemname, sizeof(pTunable->name) - 1);
+	pTunable->value.store(Resolve(pTunable), std::memory_order_relaxed);
+	return pTunable;
+}
+
+lpngx_conf_tunable_t CConfig::GetIntHandle(const char *p_itemname, int64_t def, int64_t minval, int64_t maxval)
+{
+	return GetHandle(NGX_CONF_INT, p_itemname, def, 1, minval, maxval);
+}
+
+lpngx_conf_tunable_t CConfig::GetBoolHandle(const char *p_itemname, bool def)
+{
+	return GetHandle(NGX_CONF_BOOL, p_itemname, def ? 1 : 0, 1, 0, 1);
+}
+
+lpngx_conf_tunable_t CConfig::GetDurationHandle(const char *p_itemname, int64_t defMs, int64_t unitMs, int64_t minMs, int64_t maxMs)
+{
+	return GetHandle(NGX_CONF_DURATION, p_itemname, defMs, unitMs, minMs, maxMs);
+}
+
+lpngx_conf_tunable_t CConfig::GetSizeHandle(const char *p_itemname, int64_t def, int64_t minval, int64_t maxval)
+{
+	return GetHandle(NGX_CONF_SIZE, p_itemname, def, 1, minval, maxval);
+}
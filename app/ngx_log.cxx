@@ -8,6 +8,12 @@
 #include <time.h>	  
 #include <fcntl.h>	  
 #include <errno.h>	  
+#include <pthread.h>
+#include <semaphore.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <atomic>
 
 #include "ngx_global.h"
 #include "ngx_macro.h"
@@ -29,6 +35,47 @@ static u_char err_levels[][20] =
 };
 ngx_log_t ngx_log;
 
+// 异步日志相关
+// worker进程中，每个写日志的线程有一个自己的环形缓冲区（单生产者单消费者，无锁），组合好的日志行放进去就返回，
+// 由后台的写日志线程把所有环形缓冲区中的内容攒成一次writev()写到日志文件，磁盘再慢也不会卡住epoll线程和线程池中的线程
+// 缓冲区满了就丢弃这一行并计数，不会阻塞；写文件失败时内容留在缓冲区里下次重试，一直写不进去缓冲区就会满，新的日志照样丢弃计数
+// 文本日志和二进制日志是两个通道，各自有各自的环形缓冲区，写到各自的文件，共用一个写日志线程
+#define NGX_LOG_MAX_RINGS 1024			// 每个通道最多这么多个线程可以有环形缓冲区，再多的线程写日志只能丢弃
+#define NGX_LOG_FLUSH_INTERVAL_MS 10	// 写日志线程最多隔这么多毫秒写一次
+
+#define NGX_LOG_CHANNEL_TEXT 0	 // 文本日志
+#define NGX_LOG_CHANNEL_BINARY 1 // 二进制日志
+#define NGX_LOG_CHANNELS 2
+
+typedef struct
+{
+	std::atomic<uint64_t> head; // 生产者（写日志的线程）写到的位置，只增不减
+	std::atomic<uint64_t> tail; // 消费者（写日志线程）读到的位置，只增不减
+	uint64_t size;				// 缓冲区大小，2的幂
+	bool busy;					// 本线程正在往缓冲区中写，信号处理函数中又写日志时用来防止重入
+	u_char *buf;
+} ngx_log_ring_t;
+
+typedef struct
+{
+	ngx_log_ring_t *rings[NGX_LOG_MAX_RINGS]; // 本通道所有环形缓冲区，写日志线程按顺序遍历
+	std::atomic<int> ring_count;			  // 已经注册的环形缓冲区数量
+	std::atomic<uint64_t> dropped;			  // 因为缓冲区满而丢弃的条数
+	bool failing;							  // 上次写文件失败了，只由写日志线程访问，失败时只报告一次
+	int fd;									  // 写到这个文件
+	const char *name;						  // 报告丢弃条数时用
+} ngx_log_channel_t;
+
+static ngx_log_channel_t ngx_log_channels[NGX_LOG_CHANNELS];
+static thread_local ngx_log_ring_t *ngx_log_tring[NGX_LOG_CHANNELS]; // 本线程在各个通道的环形缓冲区
+static size_t ngx_log_ring_size = 65536;							 // 每个环形缓冲区的大小
+static std::atomic<bool> ngx_log_async(false);						 // 是否处于异步写日志状态
+static bool ngx_log_async_stop_flag = false;						 // 写日志线程退出标志
+static pthread_t ngx_log_writer_tid;
+static sem_t ngx_log_sem; // 某个缓冲区过半了，叫醒写日志线程
+
+static void ngx_log_write_sync(const u_char *buf, size_t len);
+
 void ngx_log_stderr(int err, const char *fmt, ...)
 {
 	va_list args;						  // 创建一个va_list类型变量
@@ -107,38 +154,23 @@ u_char *ngx_log_errno(u_char *buf, u_char *last, int err)
 // ngx_log_error_core(5,8,"这个XXX工作的有问题,显示的结果是=%s","YYYY");
 void ngx_log_error_core(int level, int err, const char *fmt, ...)
 {
+	if (level > ngx_log.log_level)
+	{
+		// 等级数字太大，比配置文件中的数字大
+		// 这种日志就不打印了，在做任何格式化之前就返回
+		return;
+	}
+
 	u_char *last;
-	u_char errstr[NGX_MAX_ERROR_STR + 1];
+	u_char errstr[NGX_MAX_ERROR_STR + 1]; // 只用到p为止，不需要清0
 
-	memset(errstr, 0, sizeof(errstr));
 	last = errstr + NGX_MAX_ERROR_STR;
 
-	struct timeval tv;
-	struct tm tm;
-	time_t sec; // 秒
 	u_char *p;	// 指向当前要拷贝数据到其中的内存位置
 	va_list args;
 
-	memset(&tv, 0, sizeof(struct timeval));
-	memset(&tm, 0, sizeof(struct tm));
-
-	gettimeofday(&tv, NULL); // 获取当前时间，返回自1970-01-01 00:00:00到现在经历的秒数
-
-	sec = tv.tv_sec;		// 秒
-	localtime_r(&sec, &tm); // 把参数1的time_t转换为本地时间，保存到参数2中去
-	tm.tm_mon++;			// 月份要调整下正常
-	tm.tm_year += 1900;		// 年份要调整下才正常
-
-	u_char strcurrtime[40] = {0}; // 先组合出一个当前时间字符串
-	ngx_slprintf(strcurrtime,
-				 (u_char *)-1,					 // 若用一个u_char *接一个 (u_char *)-1,则 得到的结果是 0xffffffff....，这个值足够大
-				 "%4d/%02d/%02d %02d:%02d:%02d", // 格式是 年/月/日 时:分:秒
-				 tm.tm_year, tm.tm_mon,
-				 tm.tm_mday, tm.tm_hour,
-				 tm.tm_min, tm.tm_sec);
-	p = ngx_cpymem(errstr, strcurrtime, strlen((const char *)strcurrtime)); // 日期增加进来
-	p = ngx_slprintf(p, last, " [%s] ", err_levels[level]);					// 日志级别增加进来
-	p = ngx_slprintf(p, last, "%P: ", ngx_pid);								// 支持%P格式，进程id增加进来
+	p = ngx_cpy_log_time(errstr, time(NULL));				// 日期增加进来，同一秒内共用缓存的时间字符串
+	p = ngx_slcat(p, last, " [", err_levels[level], "] ", ngx_pid, ": "); // 日志级别、进程id增加进来，不用解析格式串
 
 	va_start(args, fmt);				   // 使args指向起始的参数
 	p = ngx_vslprintf(p, last, fmt, args); // 把fmt和args参数弄进去，组合出来这个字符串
@@ -155,40 +187,383 @@ void ngx_log_error_core(int level, int err, const char *fmt, ...)
 	}
 	*p++ = '\n'; // 增加个换行符
 
-	ssize_t n;
-	while (1)
+	// 异步状态下放进本线程的环形缓冲区就返回
+	if (ngx_log_async.load(std::memory_order_acquire) && ngx_log_async_write(errstr, p - errstr))
 	{
-		if (level > ngx_log.log_level)
+		return;
+	}
+
+	// 写日志文件
+	ngx_log_write_sync(errstr, p - errstr);
+	return;
+}
+
+// 同步写日志文件，写失败时考虑写到标准错误
+static void ngx_log_write_sync(const u_char *buf, size_t len)
+{
+	ssize_t n = write(ngx_log.fd, buf, len);
+	if (n == -1)
+	{
+		// 写失败有问题
+		if (errno == ENOSPC) // 写失败，且原因是磁盘没空间了
 		{
-			// 等级数字太大，比配置文件中的数字大
-			// 这种日志就不打印了
-			break;
+			// 磁盘没空间了
+			// do nothing
+		}
+		else
+		{
+			// 这是有其他错误，考虑把这个错误显示到标准错误设备
+			if (ngx_log.fd != STDERR_FILENO) // 当前是定位到文件的，则条件成立
+			{
+				n = write(STDERR_FILENO, buf, len);
+			}
 		}
+	}
+	return;
+}
 
-		// 写日志文件
-		n = write(ngx_log.fd, errstr, p - errstr);
-		if (n == -1)
+// 给本线程分配channel通道的环形缓冲区并注册，分配不了（线程太多）就还是NULL，本线程在这个通道上同步写
+static void ngx_log_ring_attach(int channel)
+{
+	ngx_log_channel_t *pChannel = &ngx_log_channels[channel];
+	if (ngx_log_tring[channel] != NULL || pChannel->ring_count.load(std::memory_order_relaxed) >= NGX_LOG_MAX_RINGS)
+		return;
+	ngx_log_ring_t *ring = new ngx_log_ring_t;
+	ring->head.store(0, std::memory_order_relaxed);
+	ring->tail.store(0, std::memory_order_relaxed);
+	ring->size = ngx_log_ring_size;
+	ring->busy = false;
+	ring->buf = new u_char[ring->size];
+	int idx = pChannel->ring_count.fetch_add(1);
+	if (idx >= NGX_LOG_MAX_RINGS)
+	{
+		delete[] ring->buf;
+		delete ring;
+		return;
+	}
+	pChannel->rings[idx] = ring; // 写日志线程只看count以内、已经填好的槽位
+	ngx_log_tring[channel] = ring;
+}
+
+// 写日志的线程开始时调用，给本线程分配各个通道的环形缓冲区；没调用过的线程同步写
+// 写日志的路径上不分配内存：信号处理函数也写日志，在那里new不安全
+void ngx_log_thread_init()
+{
+	if (!ngx_log_async.load(std::memory_order_acquire))
+		return;
+	for (int c = 0; c < NGX_LOG_CHANNELS; c++)
+	{
+		if (ngx_log_channels[c].fd != -1)
+			ngx_log_ring_attach(c);
+	}
+}
+
+// 把一条日志放进本线程在channel通道的环形缓冲区
+// 返回true表示已经处理（放进去了，或者缓冲区满了丢弃了），返回false表示要调用者同步写
+static bool ngx_log_ring_put(int channel, const void *buf, size_t len)
+{
+	ngx_log_channel_t *pChannel = &ngx_log_channels[channel];
+	ngx_log_ring_t *ring = ngx_log_tring[channel];
+	if (ring == NULL)
+		return false; // 本线程没有调用过ngx_log_thread_init()，同步写
+
+	if (ring->busy)
+		return false; // 信号处理函数打断了本线程的写日志过程，这一条同步写
+
+	ring->busy = true;
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	uint64_t tail = ring->tail.load(std::memory_order_acquire);
+	uint64_t used = head - tail;
+	if (ring->size - used < len)
+	{
+		// 满了，丢弃这一条，不等待；写日志线程过半时已经叫醒过了，这里不再sem_post()，否则每丢一条信号量就多计一次，写日志线程会空转
+		ring->busy = false;
+		++pChannel->dropped;
+		return true;
+	}
+
+	// 写到环形缓冲区里，可能要分两段
+	size_t pos = head & (ring->size - 1);
+	size_t first = ring->size - pos;
+	if (first > len)
+		first = len;
+	memcpy(ring->buf + pos, buf, first);
+	if (len > first)
+		memcpy(ring->buf, (const u_char *)buf + first, len - first);
+	ring->head.store(head + len, std::memory_order_release); // 整条写完才发布，写日志线程看到的都是完整的行/记录
+	ring->busy = false;
+
+	if ((used + len) * 2 > ring->size && (used * 2) <= ring->size)
+	{
+		sem_post(&ngx_log_sem); // 刚过半，叫醒写日志线程尽快写
+	}
+	return true;
+}
+
+// 把一行文本日志放进本线程的环形缓冲区
+// 返回true表示已经处理（放进去了，或者缓冲区满了丢弃了），返回false表示要调用者同步写
+bool ngx_log_async_write(const u_char *buf, size_t len)
+{
+	return ngx_log_ring_put(NGX_LOG_CHANNEL_TEXT, buf, len);
+}
+
+// 写一条二进制日志记录，由ngx_log_binary_core()调用，记录已经填好，这里补上进程id
+void ngx_log_binary_write(ngx_binlog_rec_t *pRec, size_t len)
+{
+	pRec->pid = ngx_pid;
+	if (ngx_log_async.load(std::memory_order_acquire) && ngx_log_ring_put(NGX_LOG_CHANNEL_BINARY, pRec, len))
+	{
+		return;
+	}
+	// O_APPEND打开的文件，一条记录一次write()，多个进程同时写也不会互相插到对方记录中间
+	if (write(ngx_log.binfd, pRec, len) == -1)
+	{
+		// 二进制日志写不进去就算了，这种日志量很大，不往标准错误上写
+	}
+	return;
+}
+
+// 把channel通道所有环形缓冲区中现有的内容写到文件里，只在写日志线程中调用
+// 返回写了多少字节，没有要写的返回0，写失败返回-1，这时内容还留在缓冲区里，下次接着写
+static ssize_t ngx_log_flush_rings(int channel)
+{
+	ngx_log_channel_t *pChannel = &ngx_log_channels[channel];
+	struct iovec iov[IOV_MAX];
+	uint64_t heads[NGX_LOG_MAX_RINGS];
+	size_t total = 0;
+	int niov = 0;
+	int nring = pChannel->ring_count.load(std::memory_order_acquire);
+	if (nring > NGX_LOG_MAX_RINGS)
+		nring = NGX_LOG_MAX_RINGS;
+
+	int last = 0; // 本次处理了前边多少个缓冲区
+	for (int i = 0; i < nring && niov + 2 <= IOV_MAX; i++, last = i)
+	{
+		ngx_log_ring_t *ring = pChannel->rings[i];
+		if (ring == NULL) // 注册到一半
 		{
-			// 写失败有问题
-			if (errno == ENOSPC) // 写失败，且原因是磁盘没空间了
+			heads[i] = 0;
+			continue;
+		}
+		uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		heads[i] = head;
+		if (head == tail)
+			continue;
+		size_t pos = tail & (ring->size - 1);
+		size_t len = head - tail;
+		size_t first = ring->size - pos;
+		if (first > len)
+			first = len;
+		iov[niov].iov_base = ring->buf + pos;
+		iov[niov++].iov_len = first;
+		if (len > first)
+		{
+			iov[niov].iov_base = ring->buf;
+			iov[niov++].iov_len = len - first;
+		}
+		total += len;
+	}
+	if (niov == 0)
+		return 0;
+
+	ssize_t n = writev(pChannel->fd, iov, niov);
+	if (n == -1)
+	{
+		if (errno != EINTR && errno != EAGAIN && !pChannel->failing)
+		{
+			pChannel->failing = true;
+			ngx_log_stderr(errno, "写%s失败，留在缓冲区中稍后重试，缓冲区满了之后的日志会被丢弃!", pChannel->name);
+		}
+		return -1;
+	}
+	pChannel->failing = false;
+
+	// 按顺序把写出去的部分从各个缓冲区中去掉，只写了一部分时，剩下的下次接着写，顺序不会乱
+	size_t left = n;
+	for (int i = 0; i < last && left > 0; i++)
+	{
+		ngx_log_ring_t *ring = pChannel->rings[i];
+		if (ring == NULL)
+			continue;
+		uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+		size_t len = heads[i] - tail;
+		if (len > left)
+			len = left;
+		ring->tail.store(tail + len, std::memory_order_release);
+		left -= len;
+	}
+	return n;
+}
+
+// 把channel通道所有环形缓冲区中剩下的内容扔掉，退出时还写不进去才调用，返回扔掉了多少字节
+static size_t ngx_log_discard_rings(int channel)
+{
+	ngx_log_channel_t *pChannel = &ngx_log_channels[channel];
+	size_t total = 0;
+	int nring = pChannel->ring_count.load(std::memory_order_acquire);
+	if (nring > NGX_LOG_MAX_RINGS)
+		nring = NGX_LOG_MAX_RINGS;
+	for (int i = 0; i < nring; i++)
+	{
+		ngx_log_ring_t *ring = pChannel->rings[i];
+		if (ring == NULL)
+			continue;
+		uint64_t head = ring->head.load(std::memory_order_acquire);
+		total += head - ring->tail.load(std::memory_order_relaxed);
+		ring->tail.store(head, std::memory_order_release);
+	}
+	return total;
+}
+
+// 写日志线程
+static void *ngx_log_writer_thread(void *)
+{
+	// 信号只由主线程处理，本线程不接收任何信号
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	uint64_t reported[NGX_LOG_CHANNELS] = {0}; // 各通道已经报告过的丢弃条数
+	for (;;)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += NGX_LOG_FLUSH_INTERVAL_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		sem_timedwait(&ngx_log_sem, &ts);
+
+		bool ifstop = __atomic_load_n(&ngx_log_async_stop_flag, __ATOMIC_ACQUIRE);
+		for (int c = 0; c < NGX_LOG_CHANNELS; c++)
+		{
+			if (ngx_log_channels[c].fd == -1)
+				continue;
+			ssize_t n;
+			while ((n = ngx_log_flush_rings(c)) > 0)
+				; // 写到没有为止，退出前也要写干净
+			if (n == -1 && ifstop)
 			{
-				// 磁盘没空间了
-				// do nothing
+				// 要退出了还写不进去，只能扔掉，但要报告扔了多少
+				u_char errstr[200];
+				u_char *p = ngx_snprintf(errstr, sizeof(errstr) - 1, "%P: 退出时%s写不进去，丢弃了缓冲区中剩下的%uL字节\n",
+										 ngx_pid, ngx_log_channels[c].name, (uint64_t)ngx_log_discard_rings(c));
+				ngx_log_write_sync(errstr, p - errstr);
 			}
-			else
+
+			uint64_t dropped = ngx_log_channels[c].dropped.load(std::memory_order_relaxed);
+			if (dropped != reported[c])
 			{
-				// 这是有其他错误，考虑把这个错误显示到标准错误设备
-				if (ngx_log.fd != STDERR_FILENO) // 当前是定位到文件的，则条件成立
-				{
-					n = write(STDERR_FILENO, errstr, p - errstr);
-				}
+				// 丢弃的情况都报告到文本日志里
+				u_char errstr[200];
+				u_char *p = ngx_snprintf(errstr, sizeof(errstr) - 1, "%P: %s缓冲区满，丢弃了%uL条，累计丢弃%uL条\n",
+										 ngx_pid, ngx_log_channels[c].name, dropped - reported[c], dropped);
+				ngx_log_write_sync(errstr, p - errstr);
+				reported[c] = dropped;
 			}
 		}
-		break;
+		if (ifstop)
+			break;
+	}
+	return (void *)0;
+}
+
+// 开始异步写日志，worker进程中创建其他线程之前调用
+// master进程一直同步写：fork()时不能有写日志线程，也不能有没写完的缓冲区
+void ngx_log_async_start()
+{
+	CConfig *p_config = CConfig::GetInstance();
+	if (p_config->GetIntDefault("LogAsync", 1) != 1)
+		return;
+	int ringsize = p_config->GetIntDefault("LogRingSize", 65536);
+	ngx_log_ring_size = 4096;
+	while ((int)ngx_log_ring_size < ringsize && ngx_log_ring_size < (1 << 26))
+		ngx_log_ring_size <<= 1; // 2的幂，取下标时用与运算
+
+	ngx_log_channels[NGX_LOG_CHANNEL_TEXT].fd = ngx_log.fd;
+	ngx_log_channels[NGX_LOG_CHANNEL_TEXT].name = "日志";
+	ngx_log_channels[NGX_LOG_CHANNEL_BINARY].fd = ngx_log.binfd;
+	ngx_log_channels[NGX_LOG_CHANNEL_BINARY].name = "二进制日志";
+	ngx_log_channels[NGX_LOG_CHANNEL_TEXT].failing = false;
+	ngx_log_channels[NGX_LOG_CHANNEL_BINARY].failing = false;
+
+	if (sem_init(&ngx_log_sem, 0, 0) == -1)
+	{
+		ngx_log_stderr(errno, "ngx_log_async_start()中sem_init()失败，继续同步写日志!");
+		return;
 	}
+	ngx_log_async_stop_flag = false;
+	int err = pthread_create(&ngx_log_writer_tid, NULL, ngx_log_writer_thread, NULL);
+	if (err != 0)
+	{
+		ngx_log_stderr(err, "ngx_log_async_start()中pthread_create()失败，继续同步写日志!");
+		return;
+	}
+	ngx_log_async.store(true, std::memory_order_release);
+	ngx_log_thread_init(); // 调用者是主线程，信号处理函数就在这个线程上跑，要先把缓冲区分配好
+	return;
+}
+
+// 停止异步写日志，把缓冲区中剩下的都写到文件中，worker进程退出前、其他线程都结束之后调用
+void ngx_log_async_stop()
+{
+	if (!ngx_log_async.load(std::memory_order_acquire))
+		return;
+	ngx_log_async.store(false, std::memory_order_release); // 之后的日志都同步写
+	__atomic_store_n(&ngx_log_async_stop_flag, true, __ATOMIC_RELEASE);
+	sem_post(&ngx_log_sem);
+	pthread_join(ngx_log_writer_tid, NULL);
+	sem_destroy(&ngx_log_sem);
 	return;
 }
 
+// 因为缓冲区满而丢弃的日志条数，文本日志和二进制日志加在一起
+uint64_t ngx_log_dropped_count()
+{
+	uint64_t dropped = 0;
+	for (int c = 0; c < NGX_LOG_CHANNELS; c++)
+		dropped += ngx_log_channels[c].dropped.load(std::memory_order_relaxed);
+	return dropped;
+}
+
+// 日志限速：返回true表示这一条可以写，false表示这一秒本调用点写得太多了，省略掉
+// 进入新的一秒时，如果上一段时间有省略的，先补写一行报告省略了多少条
+bool ngx_log_ratelimit(struct _ngx_log_ratelimit_s *pRl, const char *site)
+{
+	int limit = (ngx_log.hRateLimit != NULL) ? (int)ngx_conf_get(ngx_log.hRateLimit) : 0;
+	if (limit <= 0)
+		return true;
+
+	// 粗粒度单调时钟走vDSO读内核缓存的时间，比time(NULL)便宜，改系统时间也不会让窗口乱跳
+	uint64_t now = (ngx_monotonic_coarse_msec() / 1000) & 0xffffffff;
+	uint64_t window = pRl->window.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		if ((window >> 32) != now)
+		{
+			// 换成新的一秒，这一条算新一秒的第一条；秒和计数一起CAS，不会有别的线程在换窗口的同时数到旧窗口里去
+			if (!pRl->window.compare_exchange_weak(window, (now << 32) | 1, std::memory_order_relaxed))
+				continue; // window已经是最新值了
+			// 只有换成功的线程报告省略条数
+			uint64_t suppressed = pRl->suppressed.exchange(0, std::memory_order_relaxed);
+			if (suppressed > 0)
+			{
+				ngx_log_error_core(NGX_LOG_WARN, 0, "%s处的日志超过每秒%d条的限速，省略了%uL条", site, limit, suppressed);
+			}
+			return true;
+		}
+		if ((window & 0xffffffff) >= (uint64_t)limit)
+			break; // 这一秒的额度用完了，不用再改window
+		if (pRl->window.compare_exchange_weak(window, window + 1, std::memory_order_relaxed))
+			return true;
+	}
+	pRl->suppressed.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
 // 描述：日志初始化
 void ngx_log_init()
 {
@@ -204,6 +579,7 @@ void ngx_log_init()
 		plogname = (u_char *)NGX_ERROR_LOG_PATH; //"logs/error.log" ,logs目录需要提前建立出来
 	}
 	ngx_log.log_level = p_config->GetIntDefault("LogLevel", NGX_LOG_NOTICE); // 缺省日志等级为6，如果读失败，就给缺省日志等级
+	ngx_log.hRateLimit = p_config->GetIntHandle("LogRateLimit", 10, 0, INT_MAX); // 出错路径上的日志每个调用点每秒最多写多少条
 
 	ngx_log.fd = open((const char *)plogname, O_WRONLY | O_APPEND | O_CREAT, 0644);
 	if (ngx_log.fd == -1) // 如果有错误，则直接定位到 标准错误上去
@@ -211,5 +587,32 @@ void ngx_log_init()
 		ngx_log_stderr(errno, "[alert] could not open error log file: open() \"%s\" failed", plogname);
 		ngx_log.fd = STDERR_FILENO; // 直接定位到标准错误去了
 	}
+
+	// 二进制日志，高频事件只记录格式编号和原始参数，用tools/ngx_binlog_decode解成文本
+	if (ngx_log.binfd == -1 && p_config->GetIntDefault("LogBinary", 0) == 1)
+	{
+		const char *pbinname = p_config->GetString("LogBinaryFile");
+		if (pbinname == NULL)
+			pbinname = NGX_BINLOG_PATH;
+		ngx_log.binfd = open(pbinname, O_WRONLY | O_APPEND | O_CREAT, 0644);
+		if (ngx_log.binfd == -1)
+		{
+			ngx_log_stderr(errno, "[alert] could not open binary log file: open() \"%s\" failed，高频事件改写文本日志", pbinname);
+		}
+		else if (lseek(ngx_log.binfd, 0, SEEK_END) == 0)
+		{
+			// 新文件，先写文件头
+			ngx_binlog_filehdr_t hdr;
+			memcpy(hdr.magic, NGX_BINLOG_MAGIC, sizeof(hdr.magic));
+			hdr.version = NGX_BINLOG_VERSION;
+			hdr.recsize = sizeof(ngx_binlog_rec_t);
+			if (write(ngx_log.binfd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr))
+			{
+				ngx_log_stderr(errno, "[alert] 写二进制日志文件\"%s\"的文件头失败，高频事件改写文本日志", pbinname);
+				close(ngx_log.binfd);
+				ngx_log.binfd = -1;
+			}
+		}
+	}
 	return;
 }
\ No newline at end of file
@@ -8,7 +8,32 @@
 #include "ngx_macro.h"
 #include "ngx_func.h"
 
-static u_char *ngx_sprintf_num(u_char *buf, u_char *last, uint64_t ui64, u_char zero, uintptr_t hexadecimal, uintptr_t width);
+// 两位一组的十进制数字表，"00" "01" ... "99"，转换数字时一次除以100出两位
+static const char ngx_digits2[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// 十进制数字的位数，先算出位数就能直接往目标缓冲区里从后往前写，不用经过临时数组
+static inline uintptr_t ngx_dec_width(uint64_t v)
+{
+    uintptr_t n = 1;
+    for (;;)
+    {
+        if (v < 10)
+            return n;
+        if (v < 100)
+            return n + 1;
+        if (v < 1000)
+            return n + 2;
+        if (v < 10000)
+            return n + 3;
+        v /= 10000;
+        n += 4;
+    }
+}
 
 // 该函数针对ngx_vslprintf()函数包装了一下
 u_char *ngx_slprintf(u_char *buf, u_char *last, const char *fmt, ...)
@@ -168,7 +193,7 @@ u_char *ngx_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args)
 
                 while (*p && buf < last) // 没遇到字符串结束标记，并且buf值够装得下这个参数
                 {
-                    *buf++ = *p++; 
+                    *buf++ = *p++;
                 }
 
                 fmt++;
@@ -253,8 +278,14 @@ u_char *ngx_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args)
         }
         else // 当成正常字符，源【fmt】拷贝到目标【buf】里
         {
-            // 用fmt当前指向的字符赋给buf当前指向的位置，然后buf往前走一个字符位置，fmt当前走一个字符位置
-            *buf++ = *fmt++; //*和++优先级相同，结合性从右到左，所以先求的是buf++以及fmt++，但++是先用后加；
+            // 一直到下一个%之前都是普通字符，找到下一个%之后一次拷贝过去，不用一个字符一个字符地走循环
+            size_t len = strchrnul(fmt + 1, '%') - fmt;
+            if (len > (size_t)(last - buf))
+            {
+                len = last - buf;
+            }
+            buf = ngx_cpymem(buf, fmt, len);
+            fmt += len;
         } // end if (*fmt == '%')
     } // end while (*fmt && buf < last)
 
@@ -268,71 +299,67 @@ u_char *ngx_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args)
 // last：放的数据不要超过这里
 // ui64：显示的数字
 // zero:显示内容时，格式字符%后边接的是否是个'0',如果是zero = '0'，否则zero = ' ' 【一般显示的数字位数不足要求的，则用这个字符填充】，比如要显示10位，而实际只有7位，则后边填充3个这个字符；
-// hexadecimal：是否显示成十六进制数字 0：不
+// hexadecimal：是否显示成十六进制数字 0：不 1：是，a-f小写 2：是，A-F大写
 // width:显示内容时，格式化字符%后接的如果是个数字比如%16，那么width=16，所以这个是希望显示的宽度值【如果实际显示的内容不够，则后头用0填充】
-static u_char *ngx_sprintf_num(u_char *buf, u_char *last, uint64_t ui64, u_char zero, uintptr_t hexadecimal, uintptr_t width)
+// 先算出数字的位数，再直接在buf中从后往前写，十进制一次写两位
+u_char *ngx_sprintf_num(u_char *buf, u_char *last, uint64_t ui64, u_char zero, uintptr_t hexadecimal, uintptr_t width)
 {
-    // temp[21]
-    u_char *p, temp[NGX_INT64_LEN + 1]; // #define NGX_INT64_LEN   (sizeof("-9223372036854775808") - 1)     = 20   ，注意这里是sizeof是包括末尾的\0，不是strlen；
-    size_t len;
-    uint32_t ui32;
+    static const u_char hex[] = "0123456789abcdef"; // 跟把一个10进制数显示成16进制有关，%xd格式符显示的16进制数中a-f小写
+    static const u_char HEX[] = "0123456789ABCDEF"; // 跟把一个10进制数显示成16进制有关，%Xd格式符显示的16进制数中A-F大写
 
-    static u_char hex[] = "0123456789abcdef"; // 跟把一个10进制数显示成16进制有关，%xd格式符显示的16进制数中a-f小写
-    static u_char HEX[] = "0123456789ABCDEF"; // 跟把一个10进制数显示成16进制有关，%Xd格式符显示的16进制数中A-F大写
+    uintptr_t len; // 数字的位数
+    if (hexadecimal == 0)
+    {
+        len = ngx_dec_width(ui64);
+    }
+    else
+    {
+        len = (64 - __builtin_clzll(ui64 | 1) + 3) / 4; // 最高的非0位决定有几个十六进制位，0也要显示一位
+    }
 
-    p = temp + NGX_INT64_LEN; // NGX_INT64_LEN = 20,所以 p指向的是temp[20]那个位置，也就是数组最后一个元素位置
+    // 宽度不够的前边填充
+    while (width > len && buf < last)
+    {
+        *buf++ = zero;
+        width--;
+    }
+
+    u_char temp[NGX_INT64_LEN + 1]; // 剩下的地方放不下整个数字时，先写到这里再截断拷贝
+    bool direct = ((uintptr_t)(last - buf) >= len); // 放得下就直接写到buf里
+    u_char *p = direct ? buf + len : temp + len;
 
     if (hexadecimal == 0)
     {
-        if (ui64 <= (uint64_t)NGX_MAX_UINT32_VALUE) // NGX_MAX_UINT32_VALUE :最大的32位无符号数：十进制是‭4294967295‬
+        while (ui64 >= 100)
         {
-            ui32 = (uint32_t)ui64; // 能保存下
-            do                     // 这个循环能够把诸如 7654321这个数字保存成：temp[13]=7,temp[14]=6,temp[15]=5,temp[16]=4,temp[17]=3,temp[18]=2,temp[19]=1
-               // 而且的包括temp[0..12]以及temp[20]都是不确定的值
-            {
-                *--p = (u_char)(ui32 % 10 + '0'); // 把屁股后边这个数字拿出来往数组里装，并且是倒着装：屁股后的也往数组下标大的位置装；
-            } while (ui32 /= 10); // 每次缩小10倍等于去掉屁股后边这个数字
+            uint32_t i = (uint32_t)(ui64 % 100) * 2;
+            ui64 /= 100;
+            *--p = ngx_digits2[i + 1];
+            *--p = ngx_digits2[i];
         }
-        else
+        if (ui64 >= 10)
         {
-            do
-            {
-                *--p = (u_char)(ui64 % 10 + '0');
-            } while (ui64 /= 10); // 每次缩小10倍等于去掉屁股后边这个数字
+            uint32_t i = (uint32_t)ui64 * 2;
+            *--p = ngx_digits2[i + 1];
+            *--p = ngx_digits2[i];
         }
-    }
-    else if (hexadecimal == 1) // 如果显示一个十六进制数字，格式符为：%xd，则这个条件成立，要以16进制数字形式显示出来这个十进制数,a-f小写
-    {
-        do
+        else
         {
-            // 0xf就是二进制的1111,ui64 & 0xf，把一个数的最末尾的4个二进制位拿出来；
-            // ui64 & 0xf  就能分别得到这个16进制数也就是 7,8,6,D,2,1这个数字，转成 (uint32_t) ，然后以这个为hex的下标，找到这几个数字的对应的能够显示的字符；
-            *--p = hex[(uint32_t)(ui64 & 0xf)];
-        } while (ui64 >>= 4);
+            *--p = (u_char)('0' + ui64);
+        }
     }
-    else // hexadecimal == 2    //如果显示一个十六进制数字，格式符为：%Xd，则这个条件成立，要以16进制数字形式显示出来这个十进制数,A-F大写
+    else
     {
+        const u_char *digits = (hexadecimal == 1) ? hex : HEX;
         do
         {
-            *--p = HEX[(uint32_t)(ui64 & 0xf)];
+            *--p = digits[(uint32_t)(ui64 & 0xf)];
         } while (ui64 >>= 4);
     }
 
-    len = (temp + NGX_INT64_LEN) - p; // 得到这个数字的宽度，比如 “7654321”这个数字 ,len = 7
-
-    while (len++ < width && buf < last)
+    if (direct)
     {
-        *buf++ = zero; // 填充0进去到buffer中（往末尾增加），比如用格式
-                       // ngx_log_stderr(0, "invalid option: %10d\n", 21);
-                       // 显示的结果是：nginx: invalid option:         21  ---21前面有8个空格，这8个弄个，就是在这里添加进去的；
+        return buf + len;
     }
-
-    len = (temp + NGX_INT64_LEN) - p; // 还原这个len，也就是要显示的数字的实际宽度
-
-    if ((buf + len) >= last)
-    {
-        len = last - buf; // 剩余的buf有多少就拷贝多少
-    }
-
-    return ngx_cpymem(buf, p, len); // 把最新buf返回去
+    return ngx_cpymem(buf, temp, last - buf); // 剩余的buf有多少就拷贝多少
 }
@@ -0,0 +1,71 @@
+﻿// 和时间有关的函数
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/types.h>
+#include <atomic>
+
+#include "ngx_macro.h"
+#include "ngx_func.h"
+
+// 日志时间字符串的缓存，所有线程共用，每秒钟只格式化一次
+// 更新时写到下一个槽位再切换指针，读的线程拿到的总是一个完整的字符串；槽位要64秒之后才会被重用，读的线程早就拷贝完了
+#define NGX_TIME_SLOTS 64
+
+static u_char ngx_log_time_slots[NGX_TIME_SLOTS][NGX_LOG_TIME_LEN + 1];
+static std::atomic<time_t> ngx_log_time_sec(-1);		  // 当前缓存的是哪一秒
+static std::atomic<u_char *> ngx_log_time_str(NULL);	  // 当前缓存的时间字符串
+static std::atomic<unsigned int> ngx_log_time_slot(0);	  // 下一个可用的槽位
+static std::atomic_flag ngx_log_time_lock = ATOMIC_FLAG_INIT; // 同一时刻只让一个线程去更新
+
+// 单调时钟的当前时间（单位：微秒），不受修改系统时间的影响，用来计算时间间隔
+uint64_t ngx_monotonic_usec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 粗粒度的单调时钟（单位：毫秒），精度是一个时钟节拍（几毫秒），走vDSO读内核缓存的时间，比ngx_monotonic_usec()还便宜
+// epoll每轮取一次给收包路径用，不用每个包都取一次时间
+uint64_t ngx_monotonic_coarse_msec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 把now对应的日志时间字符串（年/月/日 时:分:秒）拷贝到buf中，返回拷贝后的终点位置
+// 同一秒内只有第一次调用需要localtime_r()和格式化，其他调用只是拷贝19个字节
+u_char *ngx_cpy_log_time(u_char *buf, time_t now)
+{
+	u_char *p = ngx_log_time_str.load(std::memory_order_acquire);
+	if (p == NULL || ngx_log_time_sec.load(std::memory_order_relaxed) != now)
+	{
+		if (!ngx_log_time_lock.test_and_set(std::memory_order_acquire))
+		{
+			// 抢到了更新权，格式化到下一个槽位后发布
+			struct tm tm;
+			localtime_r(&now, &tm);
+			u_char *slot = ngx_log_time_slots[ngx_log_time_slot.fetch_add(1, std::memory_order_relaxed) % NGX_TIME_SLOTS];
+			ngx_slprintf(slot, slot + NGX_LOG_TIME_LEN, "%4d/%02d/%02d %02d:%02d:%02d",
+						 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+			slot[NGX_LOG_TIME_LEN] = 0;
+			ngx_log_time_str.store(slot, std::memory_order_release);
+			ngx_log_time_sec.store(now, std::memory_order_relaxed);
+			ngx_log_time_lock.clear(std::memory_order_release);
+			p = slot;
+		}
+		else if (p == NULL)
+		{
+			// 第一次就有别的线程正在更新，只能自己格式化一次
+			struct tm tm;
+			localtime_r(&now, &tm);
+			return ngx_slprintf(buf, buf + NGX_LOG_TIME_LEN, "%4d/%02d/%02d %02d:%02d:%02d",
+								tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+		}
+		// 别的线程正在更新，先用上一秒的，最多差1秒
+	}
+	return ngx_cpymem(buf, p, NGX_LOG_TIME_LEN);
+}
@@ -0,0 +1,127 @@
+﻿// 账号存储CAccountStore的基准测试
+// 用法：bench/bin/bench_accountstore [--accounts=10000000] [--threads=8] [--shards=256] [--iterations=1]
+// 先多线程注册accounts个账号，再多线程随机登录同样次数，最后跑一轮95%登录+5%注册的混合负载
+// 注册时所有账号共用一份事先算好的凭据；登录每次都要算一次密码hash，iterations默认为1，这样测的主要是存储本身
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <vector>
+
+#include "ngx_c_accountstore.h"
+#include "ngx_bench.h"
+
+#define BENCH_NAME "accountstore"
+
+struct BenchThread
+{
+    pthread_t handle;
+    int index;
+    int threads;
+    long long accounts;
+    int mode; // 0：注册，1：登录，2：混合
+    long long fails;
+};
+
+static ngx_account_cred_t g_cred; // 所有账号共用的凭据
+static int g_iterations;          // 密码hash的迭代次数
+
+static void make_name(char *buf, long long n)
+{
+    snprintf(buf, NGX_ACCOUNT_NAME_LEN, "user%lld", n);
+}
+
+static void *bench_thread(void *arg)
+{
+    BenchThread *t = (BenchThread *)arg;
+    CAccountStore *p_store = CAccountStore::GetInstance();
+    char username[NGX_ACCOUNT_NAME_LEN];
+    unsigned long long seed = 88172645463325252ULL ^ (unsigned long long)(t->index + 1);
+
+    // 每个线程负责[begin,end)这一段
+    long long begin = t->accounts * t->index / t->threads;
+    long long end = t->accounts * (t->index + 1) / t->threads;
+
+    for (long long i = begin; i < end; i++)
+    {
+        int iRet;
+        if (t->mode == 0)
+        {
+            make_name(username, i);
+            iRet = p_store->Register(username, &g_cred, 0, 0, false);
+        }
+        else
+        {
+            // xorshift随机数，随机挑一个已注册的账号登录
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            if (t->mode == 2 && (seed % 100) < 5)
+            {
+                make_name(username, t->accounts + i); // 混合负载中的注册，用新的用户名
+                iRet = p_store->Register(username, &g_cred, 0, 0, false);
+            }
+            else
+            {
+                make_name(username, (long long)(seed % (unsigned long long)t->accounts));
+                iRet = p_store->Login(username, "password", g_iterations);
+            }
+        }
+        if (iRet != NGX_ACCOUNT_OK)
+            t->fails++;
+    }
+    return NULL;
+}
+
+static void run(const char *name, int mode, int threads, long long accounts)
+{
+    std::vector<BenchThread> vt(threads);
+    uint64_t start = ngx_bench_nsec();
+    for (int i = 0; i < threads; i++)
+    {
+        vt[i].index = i;
+        vt[i].threads = threads;
+        vt[i].accounts = accounts;
+        vt[i].mode = mode;
+        vt[i].fails = 0;
+        pthread_create(&vt[i].handle, NULL, bench_thread, &vt[i]);
+    }
+    long long fails = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(vt[i].handle, NULL);
+        fails += vt[i].fails;
+    }
+    ngx_bench_report(BENCH_NAME, name, threads, accounts, ngx_bench_nsec() - start);
+    if (fails)
+        fprintf(stderr, "%s: %lld次操作失败\n", name, fails);
+}
+
+int main(int argc, char **argv)
+{
+    long long accounts = ngx_bench_arg(argc, argv, "accounts", 10000000);
+    int threads = (int)ngx_bench_arg(argc, argv, "threads", 8);
+    int shards = (int)ngx_bench_arg(argc, argv, "shards", 256);
+    int iterations = (int)ngx_bench_arg(argc, argv, "iterations", 1);
+    g_iterations = iterations;
+    if (CAccountStore::MakeCredential("password", iterations, &g_cred) == false)
+    {
+        fprintf(stderr, "CAccountStore::MakeCredential()失败\n");
+        return 1;
+    }
+
+    // 混合负载里还要再注册5%，上限多给一些
+    if (CAccountStore::GetInstance()->Init((unsigned int)(accounts + accounts / 10), shards) == false)
+    {
+        fprintf(stderr, "CAccountStore::Init()失败\n");
+        return 1;
+    }
+    fprintf(stderr, "共享内存%lluMB，分片%d，线程%d\n",
+            (unsigned long long)(CAccountStore::GetInstance()->GetMemSize() >> 20), shards, threads);
+
+    run("register", 0, threads, accounts);
+    run("login", 1, threads, accounts);
+    run("login1", 1, 1, accounts / 10); // 单线程登录，用来和多线程对比看扩展性
+    run("mixed_95_5", 2, threads, accounts);
+    return 0;
+}
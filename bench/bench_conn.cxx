@@ -0,0 +1,97 @@
+﻿// 连接池的基准测试
+// 用法：bench/bin/bench_conn [--ops=2000000] [--threads=4] [--conns=10000]
+// get_new：连接池里没有空闲连接，ngx_get_connection()新建一个，连接池从0涨到--conns个
+// churn：从连接池取一个连接马上还回去，就是短连接一连一断时连接池做的事，先单线程再--threads个线程一起（服务器里是epoll线程取、回收线程还）
+// churn_hold64：每个线程先取64个再一起还回去，空闲连接列表是先进先出的，取到的连接不在缓存里
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <vector>
+
+#include "ngx_global.h"
+#include "ngx_c_socket.h"
+#include "ngx_bench.h"
+
+#define BENCH_NAME "conn"
+
+#define HOLD 64
+
+// CSocket的友元，连接池相关的成员函数都是私有的
+class CSocketBench
+{
+public:
+    // 只做连接池用到的那部分初始化：初始化互斥量，不开监听端口、不起线程
+    static void Init(CSocket *pSocket) { pthread_mutex_init(&pSocket->m_connectionMutex, NULL); }
+    static lpngx_connection_t Get(CSocket *pSocket, int fd) { return pSocket->ngx_get_connection(fd); }
+    static void Free(CSocket *pSocket, lpngx_connection_t pConn) { pSocket->ngx_free_connection(pConn); }
+};
+
+struct BenchThread
+{
+    pthread_t handle;
+    int mode;
+    long long ops;
+};
+
+static void *bench_thread(void *arg)
+{
+    BenchThread *t = (BenchThread *)arg;
+    lpngx_connection_t hold[HOLD];
+    if (t->mode == 0)
+    {
+        for (long long i = 0; i < t->ops; i++)
+            CSocketBench::Free(&g_socket, CSocketBench::Get(&g_socket, (int)i));
+    }
+    else
+    {
+        for (long long i = 0; i < t->ops; i += HOLD)
+        {
+            for (int j = 0; j < HOLD; j++)
+                hold[j] = CSocketBench::Get(&g_socket, j);
+            for (int j = 0; j < HOLD; j++)
+                CSocketBench::Free(&g_socket, hold[j]);
+        }
+    }
+    return NULL;
+}
+
+static void run(const char *name, int mode, int threads, long long ops)
+{
+    std::vector<BenchThread> vt(threads);
+    long long per = ops / threads / HOLD * HOLD;
+    uint64_t start = ngx_bench_nsec();
+    for (int i = 0; i < threads; i++)
+    {
+        vt[i].mode = mode;
+        vt[i].ops = per;
+        pthread_create(&vt[i].handle, NULL, bench_thread, &vt[i]);
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(vt[i].handle, NULL);
+    ngx_bench_report(BENCH_NAME, name, threads, per * threads, ngx_bench_nsec() - start);
+}
+
+int main(int argc, char **argv)
+{
+    long long ops = ngx_bench_arg(argc, argv, "ops", 2000000);
+    int threads = (int)ngx_bench_arg(argc, argv, "threads", 4);
+    int conns = (int)ngx_bench_arg(argc, argv, "conns", 10000);
+
+    CSocketBench::Init(&g_socket);
+
+    // 连接池先涨到conns个，再全部还回去，后边的测试都是从空闲列表中取
+    std::vector<lpngx_connection_t> all(conns);
+    uint64_t start = ngx_bench_nsec();
+    for (int i = 0; i < conns; i++)
+        all[i] = CSocketBench::Get(&g_socket, i);
+    ngx_bench_report(BENCH_NAME, "get_new", 1, conns, ngx_bench_nsec() - start);
+    for (int i = 0; i < conns; i++)
+        CSocketBench::Free(&g_socket, all[i]);
+
+    run("churn", 0, 1, ops);
+    run("churn", 0, threads, ops);
+    run("churn_hold64", 1, 1, ops);
+    run("churn_hold64", 1, threads, ops);
+    return 0;
+}
@@ -0,0 +1,46 @@
+﻿// CRC32的基准测试
+// 用法：bench/bin/bench_crc [--bytes=256000000]
+// crc_N：CCRC32::Get_CRC()算N字节的crc值，N从16字节（只有很短包体的包）到_PKG_MAX_LENGTH附近
+// 每个大小算的总字节数大致相同，ops_per_sec乘以N就是吞吐量
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ngx_global.h"
+#include "ngx_c_crc32.h"
+#include "ngx_bench.h"
+
+#define BENCH_NAME "crc"
+
+int main(int argc, char **argv)
+{
+    long long bytes = ngx_bench_arg(argc, argv, "bytes", 256000000);
+    static const int sizes[] = {16, 64, 256, 1024, 4096, 29000};
+
+    CCRC32 *p_crc32 = CCRC32::GetInstance();
+    unsigned char *buf = new unsigned char[29000];
+    for (int i = 0; i < 29000; i++)
+        buf[i] = (unsigned char)(i * 131 + 7);
+
+    unsigned int total = 0; // 防止被优化掉
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int size = sizes[s];
+        long long ops = bytes / size;
+        if (ops < 1)
+            ops = 1;
+        uint64_t start = ngx_bench_nsec();
+        for (long long i = 0; i < ops; i++)
+        {
+            buf[0] = (unsigned char)i; // 每次内容都不一样
+            total += p_crc32->Get_CRC(buf, size);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "crc_%d", size);
+        ngx_bench_report(BENCH_NAME, name, 1, ops, ngx_bench_nsec() - start);
+    }
+
+    fprintf(stderr, "crc累加值%u\n", total);
+    delete[] buf;
+    return 0;
+}
@@ -0,0 +1,658 @@
+﻿// 端到端压测：多线程、每个线程一个epoll，按固定速率（开环）往服务器发心跳/注册/登录，统计吞吐量和延迟分位数
+// 用法：bench/bin/bench_load [--host=127.0.0.1] [--port=8080] [--conns=64] [--threads=4] [--rate=5000] [--duration=10] [--warmup=2]
+//                            [--ping=80] [--register=10] [--login=10] [--timeout=2000]
+// rate是所有连接加起来每秒发多少个请求，每个连接每隔 conns/rate 秒发一个，不管上一个应答回来没有（开环）
+// 延迟从请求“本该发出”的时刻算起，而不是实际发出的时刻：服务器卡住时后边排着没发出去的请求也算上等待时间，
+// 不会因为压测程序自己被拖慢而少算延迟（coordinated omission）；另外也统计从实际发出算起的服务时间，两者差得多说明压测程序跟不上
+// ping/register/login是三种请求的比例；注册每次用新的用户名，登录用建连接时注册好的账号
+// 前warmup秒的请求不统计；duration秒后停止发送，再等最多timeout毫秒收剩下的应答，收不到的算unanswered
+// 结果每行一个JSON对象打印到标准输出，case为total、ping、register、login；人看的汇总打印到标准错误
+// 注意：服务器缺省开着Flood攻击检测（一个连接每秒超过10个包，攒下的20个包的余量用完就踢），每个连接每秒超过10个请求时要先在配置中把Sock_FloodAttackKickEnable改成0
+// 所有连接都从本机连过来，按IP限制缺省同时最多64个连接、最多连着接受50个，连接数多时要先把Sock_IpMaxConns、Sock_IpAcceptRate改成0
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <deque>
+
+#include "ngx_comm.h"
+#include "ngx_logiccomm.h"
+#include "ngx_c_crc32.h"
+#include "ngx_bench.h"
+
+#define BENCH_NAME "load"
+
+#define REQ_PING 0
+#define REQ_REGISTER 1
+#define REQ_LOGIN 2
+#define REQ_TYPES 3
+
+static const char *g_reqName[REQ_TYPES] = {"ping", "register", "login"};
+static const unsigned short g_reqCode[REQ_TYPES] = {_CMD_PING, _CMD_REGISTER, _CMD_LOGIN};
+
+// 延迟直方图（纳秒）：和服务器统计用的一样是对数-线性分桶，但每个2的幂区间分成128个桶，相对误差不到1%，比较两次压测结果时够用
+#define LAT_SUB_BITS 7
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((40 - LAT_SUB_BITS + 1) * LAT_SUB) // 最大到2^40纳秒（约18分钟），再大的都算进最后一个桶
+
+struct LatHist
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[LAT_BUCKETS];
+};
+
+static int lat_bucket(uint64_t v)
+{
+    if (v < LAT_SUB)
+        return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int b = (msb - LAT_SUB_BITS + 1) * LAT_SUB + (int)((v >> (msb - LAT_SUB_BITS)) & (LAT_SUB - 1));
+    return (b < LAT_BUCKETS) ? b : LAT_BUCKETS - 1;
+}
+
+// 桶的上界（含）
+static uint64_t lat_upper(int b)
+{
+    b++;
+    if (b < LAT_SUB)
+        return (uint64_t)b - 1;
+    int msb = b / LAT_SUB - 1 + LAT_SUB_BITS;
+    return ((uint64_t)(LAT_SUB + b % LAT_SUB) << (msb - LAT_SUB_BITS)) - 1;
+}
+
+static void lat_record(LatHist *h, uint64_t ns)
+{
+    h->count++;
+    h->sum += ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->buckets[lat_bucket(ns)]++;
+}
+
+static void lat_merge(LatHist *dst, const LatHist *src)
+{
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    for (int b = 0; b < LAT_BUCKETS; b++)
+        dst->buckets[b] += src->buckets[b];
+}
+
+// 分位数，返回所在桶的上界（不超过最大值），单位纳秒
+static uint64_t lat_percentile(const LatHist *h, double q)
+{
+    if (h->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * (double)h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++)
+    {
+        seen += h->buckets[b];
+        if (seen > rank)
+            return (lat_upper(b) < h->max) ? lat_upper(b) : h->max;
+    }
+    return h->max;
+}
+
+// 一个线程（或者合计）的统计，只统计预热之后本该发出的请求
+struct LoadStat
+{
+    uint64_t sent[REQ_TYPES];
+    uint64_t done[REQ_TYPES];   // 收到了应答（包括业务上失败的）
+    uint64_t failed[REQ_TYPES]; // 注册/登录失败（应答只有包头）
+    uint64_t busy[REQ_TYPES];   // 服务器回了服务器忙
+    uint64_t unmatched;         // 对不上请求的应答
+    uint64_t errors;            // 连接断开时还没收到应答的请求
+    uint64_t unanswered;        // 压测结束时还没收到应答的请求
+    uint64_t connLost;          // 中途断开的连接数
+    LatHist lat[REQ_TYPES];     // 从本该发出的时刻算起
+    LatHist svc[REQ_TYPES];     // 从实际交给内核的时刻算起
+};
+
+struct Pending
+{
+    int type;
+    bool counted;      // 是不是预热之后的请求
+    uint64_t intended; // 本该发出的时刻
+    uint64_t sent;     // 实际交给内核（或者放进发送缓冲区）的时刻
+};
+
+struct LoadConn
+{
+    int fd;
+    uint64_t next;                // 下一个请求本该发出的时刻
+    std::deque<Pending> pending;  // 发出去还没收到应答的请求
+    std::vector<char> out;        // 内核发送缓冲区满时没发出去的数据
+    size_t outOff;
+    bool wantOut;                 // 是否在等EPOLLOUT
+    char in[4096];                // 服务器的应答都很小
+    size_t inLen;
+    char user[56];                // 建连接时注册的账号
+};
+
+struct LoadThread
+{
+    pthread_t handle;
+    int index;
+    int firstConn; // 本线程负责的连接在全部连接中的起始序号
+    int nConns;
+    LoadStat *pStat;
+    uint64_t seed;
+    uint64_t regSeq;
+};
+
+// 参数，main()中设置好后各线程只读
+static struct sockaddr_in g_addr;
+static int g_conns;
+static int g_mix[REQ_TYPES];
+static int g_mixTotal;
+static uint64_t g_interval;   // 每个连接两个请求的间隔（纳秒）
+static uint64_t g_start;      // 开始发送的时刻
+static uint64_t g_measure;    // 从这个时刻起本该发出的请求才统计
+static uint64_t g_end;        // 停止发送的时刻
+static uint64_t g_drain;      // 停止发送后最多等多久（纳秒）
+static pthread_barrier_t g_barrier;
+static int g_setupFailed = 0;
+
+static uint64_t xorshift(uint64_t &s)
+{
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return s;
+}
+
+// 拼一个请求包：包头+包体，包体的crc用服务器同样的CCRC32算
+static size_t build_pkg(char *buf, int type, const char *username)
+{
+    LPCOMM_PKG_HEADER pHeader = (LPCOMM_PKG_HEADER)buf;
+    char *pBody = buf + sizeof(COMM_PKG_HEADER);
+    size_t bodyLen = 0;
+    if (type == REQ_REGISTER)
+    {
+        LPSTRUCT_REGISTER p = (LPSTRUCT_REGISTER)pBody;
+        memset(p, 0, sizeof(STRUCT_REGISTER));
+        p->iType = htonl(1);
+        strncpy(p->username, username, sizeof(p->username) - 1);
+        strcpy(p->password, "bench");
+        bodyLen = sizeof(STRUCT_REGISTER);
+    }
+    else if (type == REQ_LOGIN)
+    {
+        LPSTRUCT_LOGIN p = (LPSTRUCT_LOGIN)pBody;
+        memset(p, 0, sizeof(STRUCT_LOGIN));
+        strncpy(p->username, username, sizeof(p->username) - 1);
+        strcpy(p->password, "bench");
+        bodyLen = sizeof(STRUCT_LOGIN);
+    }
+    pHeader->pkgLen = htons((unsigned short)(sizeof(COMM_PKG_HEADER) + bodyLen));
+    pHeader->msgCode = htons(g_reqCode[type]);
+    pHeader->crc32 = bodyLen ? htonl(CCRC32::GetInstance()->Get_CRC((unsigned char *)pBody, bodyLen)) : 0;
+    return sizeof(COMM_PKG_HEADER) + bodyLen;
+}
+
+static void close_conn(LoadConn *c, LoadStat *pStat)
+{
+    if (c->fd == -1)
+        return;
+    close(c->fd);
+    c->fd = -1;
+    pStat->connLost++;
+    for (size_t i = 0; i < c->pending.size(); i++)
+    {
+        if (c->pending[i].counted)
+            pStat->errors++;
+    }
+    c->pending.clear();
+}
+
+// 把发送缓冲区里的数据尽量发出去，连接断了返回false
+static bool flush_conn(LoadConn *c, int epfd)
+{
+    while (c->outOff < c->out.size())
+    {
+        ssize_t n = send(c->fd, &c->out[c->outOff], c->out.size() - c->outOff, MSG_NOSIGNAL);
+        if (n > 0)
+        {
+            c->outOff += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN)
+        {
+            if (!c->wantOut)
+            {
+                struct epoll_event ev;
+                ev.events = EPOLLIN | EPOLLOUT;
+                ev.data.ptr = c;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+                c->wantOut = true;
+            }
+            return true;
+        }
+        return false;
+    }
+    c->out.clear();
+    c->outOff = 0;
+    if (c->wantOut)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->wantOut = false;
+    }
+    return true;
+}
+
+// 处理收到的应答，按消息代码对上最早发出的同类请求（同一个连接的请求可能被线程池中不同的线程处理，应答不一定按顺序回来）
+// 服务器忙的应答看不出是哪个请求的，算在最早发出的那个请求上，之后那个请求真正的应答就对不上了，只计数，不算协议错误
+static void on_reply(LoadConn *c, LPCOMM_PKG_HEADER pHeader, LoadStat *pStat, uint64_t now)
+{
+    unsigned short code = ntohs(pHeader->msgCode);
+    unsigned short len = ntohs(pHeader->pkgLen);
+    std::deque<Pending>::iterator pos = c->pending.begin();
+    if (code != _CMD_SERVER_BUSY)
+    {
+        for (; pos != c->pending.end(); ++pos)
+        {
+            if (g_reqCode[pos->type] == code)
+                break;
+        }
+    }
+    if (pos == c->pending.end())
+    {
+        pStat->unmatched++;
+        return;
+    }
+
+    Pending p = *pos;
+    c->pending.erase(pos);
+    if (!p.counted)
+        return;
+    if (code == _CMD_SERVER_BUSY)
+    {
+        pStat->busy[p.type]++; // 被服务器拒绝的请求不算进延迟
+        return;
+    }
+    pStat->done[p.type]++;
+    if (p.type != REQ_PING && len == sizeof(COMM_PKG_HEADER))
+        pStat->failed[p.type]++;
+    lat_record(&pStat->lat[p.type], now - p.intended);
+    lat_record(&pStat->svc[p.type], now - p.sent);
+}
+
+// 收数据并拆包，连接断了或者出错返回false
+static bool read_conn(LoadConn *c, LoadStat *pStat)
+{
+    for (;;)
+    {
+        ssize_t n = recv(c->fd, c->in + c->inLen, sizeof(c->in) - c->inLen, 0);
+        if (n == 0)
+            return false;
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN;
+        }
+        c->inLen += n;
+        uint64_t now = ngx_bench_nsec();
+        size_t off = 0;
+        while (c->inLen - off >= sizeof(COMM_PKG_HEADER))
+        {
+            LPCOMM_PKG_HEADER pHeader = (LPCOMM_PKG_HEADER)(c->in + off);
+            unsigned short len = ntohs(pHeader->pkgLen);
+            if (len < sizeof(COMM_PKG_HEADER) || len > sizeof(c->in))
+                return false;
+            if (c->inLen - off < len)
+                break;
+            on_reply(c, pHeader, pStat, now);
+            off += len;
+        }
+        memmove(c->in, c->in + off, c->inLen - off);
+        c->inLen -= off;
+    }
+}
+
+// 本该在intended时刻发出的一个请求，放进发送缓冲区
+static void queue_request(LoadThread *t, LoadConn *c, uint64_t intended, uint64_t now)
+{
+    uint64_t r = xorshift(t->seed) % g_mixTotal;
+    int type = REQ_PING;
+    if (r >= (uint64_t)g_mix[REQ_PING])
+        type = (r < (uint64_t)(g_mix[REQ_PING] + g_mix[REQ_REGISTER])) ? REQ_REGISTER : REQ_LOGIN;
+
+    char buf[sizeof(COMM_PKG_HEADER) + sizeof(STRUCT_REGISTER)];
+    char username[56];
+    if (type == REQ_REGISTER)
+        snprintf(username, sizeof(username), "lr%d_%d_%llu", (int)getpid(), t->index, (unsigned long long)t->regSeq++);
+    size_t len = build_pkg(buf, type, type == REQ_REGISTER ? username : c->user);
+    c->out.insert(c->out.end(), buf, buf + len);
+
+    Pending p;
+    p.type = type;
+    p.counted = (intended >= g_measure);
+    p.intended = intended;
+    p.sent = now;
+    c->pending.push_back(p);
+    if (p.counted)
+        t->pStat->sent[type]++;
+}
+
+// 建连接并注册本连接登录用的账号，阻塞方式，失败返回false
+static bool setup_conn(LoadThread *t, LoadConn *c, int gi)
+{
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd == -1 || connect(c->fd, (struct sockaddr *)&g_addr, sizeof(g_addr)) == -1)
+    {
+        fprintf(stderr, "连接%d connect()失败: %s\n", gi, strerror(errno));
+        return false;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval tv = {5, 0};
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    snprintf(c->user, sizeof(c->user), "lu%d_%d", (int)getpid(), gi);
+    char buf[sizeof(COMM_PKG_HEADER) + sizeof(STRUCT_REGISTER)];
+    size_t len = build_pkg(buf, REQ_REGISTER, c->user);
+    if (send(c->fd, buf, len, MSG_NOSIGNAL) != (ssize_t)len)
+    {
+        fprintf(stderr, "连接%d注册账号时send()失败\n", gi);
+        return false;
+    }
+    // 应答：注册成功是包头+STRUCT_REGISTER，失败或者服务器忙只有包头
+    size_t got = 0;
+    while (got < sizeof(COMM_PKG_HEADER) || got < ntohs(((LPCOMM_PKG_HEADER)buf)->pkgLen))
+    {
+        ssize_t n = recv(c->fd, buf + got, sizeof(buf) - got, 0);
+        if (n <= 0)
+        {
+            fprintf(stderr, "连接%d注册账号时没有收到应答\n", gi);
+            return false;
+        }
+        got += n;
+    }
+    if (ntohs(((LPCOMM_PKG_HEADER)buf)->pkgLen) == sizeof(COMM_PKG_HEADER))
+        fprintf(stderr, "连接%d注册账号%s失败，登录请求都会失败\n", gi, c->user);
+
+    if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) == -1)
+        return false;
+    c->inLen = 0;
+    c->outOff = 0;
+    c->wantOut = false;
+    return true;
+}
+
+static void *load_thread(void *arg)
+{
+    LoadThread *t = (LoadThread *)arg;
+    LoadStat *pStat = t->pStat;
+    std::vector<LoadConn> conns(t->nConns);
+    int epfd = epoll_create1(0);
+
+    bool ok = true;
+    for (int i = 0; i < t->nConns && ok; i++)
+    {
+        conns[i].fd = -1;
+        ok = setup_conn(t, &conns[i], t->firstConn + i);
+    }
+    if (!ok)
+        __sync_fetch_and_add(&g_setupFailed, 1);
+    for (int i = 0; i < t->nConns && ok; i++)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conns[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+    }
+
+    pthread_barrier_wait(&g_barrier); // 所有连接都建好了
+    pthread_barrier_wait(&g_barrier); // main()定好了开始时刻
+    if (g_setupFailed)
+    {
+        for (int i = 0; i < t->nConns; i++)
+            if (conns[i].fd != -1)
+                close(conns[i].fd);
+        close(epfd);
+        return NULL;
+    }
+
+    // 各个连接的发送时刻均匀错开
+    for (int i = 0; i < t->nConns; i++)
+        conns[i].next = g_start + g_interval * (uint64_t)(t->firstConn + i) / (uint64_t)g_conns;
+
+    struct epoll_event events[256];
+    for (;;)
+    {
+        uint64_t now = ngx_bench_nsec();
+        bool sending = (now < g_end);
+        uint64_t earliest = UINT64_MAX;
+        size_t outstanding = 0;
+        for (int i = 0; i < t->nConns; i++)
+        {
+            LoadConn *c = &conns[i];
+            if (c->fd == -1)
+                continue;
+            if (sending)
+            {
+                while (c->next <= now && c->next < g_end)
+                {
+                    queue_request(t, c, c->next, now);
+                    c->next += g_interval;
+                }
+                if (c->next < earliest)
+                    earliest = c->next;
+                if (c->outOff < c->out.size() && !c->wantOut && !flush_conn(c, epfd))
+                    close_conn(c, pStat);
+            }
+            if (c->fd != -1)
+                outstanding += c->pending.size();
+        }
+        if (!sending && (outstanding == 0 || now >= g_end + g_drain))
+            break;
+
+        // 等到下一个请求该发的时刻；epoll_wait()只能精确到毫秒，不到1毫秒就不睡，宁可多转几圈也不要发晚了
+        int timeout = 10;
+        if (sending && earliest != UINT64_MAX)
+            timeout = (earliest > now) ? (int)((earliest - now) / 1000000) : 0;
+        int n = epoll_wait(epfd, events, 256, timeout);
+        for (int i = 0; i < n; i++)
+        {
+            LoadConn *c = (LoadConn *)events[i].data.ptr;
+            if (c->fd == -1)
+                continue;
+            if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !read_conn(c, pStat))
+            {
+                close_conn(c, pStat);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && !flush_conn(c, epfd))
+                close_conn(c, pStat);
+        }
+    }
+
+    for (int i = 0; i < t->nConns; i++)
+    {
+        LoadConn *c = &conns[i];
+        if (c->fd == -1)
+            continue;
+        for (size_t k = 0; k < c->pending.size(); k++)
+        {
+            if (c->pending[k].counted)
+                pStat->unanswered++;
+        }
+        close(c->fd);
+    }
+    close(epfd);
+    return NULL;
+}
+
+static void print_lat(const char *name, const LatHist *h)
+{
+    printf(",\"%s\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"p9999\":%.1f,\"max\":%.1f}", name,
+           h->count ? (double)h->sum / h->count / 1000.0 : 0.0, lat_percentile(h, 0.5) / 1000.0, lat_percentile(h, 0.9) / 1000.0,
+           lat_percentile(h, 0.99) / 1000.0, lat_percentile(h, 0.999) / 1000.0, lat_percentile(h, 0.9999) / 1000.0, h->max / 1000.0);
+}
+
+// 输出一行结果，type为-1表示所有请求合计
+static void report(const LoadStat *pStat, int type, int threads, double rate, uint64_t windowNs)
+{
+    LatHist *pLat = new LatHist();
+    LatHist *pSvc = new LatHist();
+    uint64_t sent = 0, done = 0, failed = 0, busy = 0;
+    for (int i = 0; i < REQ_TYPES; i++)
+    {
+        if (type != -1 && type != i)
+            continue;
+        sent += pStat->sent[i];
+        done += pStat->done[i];
+        failed += pStat->failed[i];
+        busy += pStat->busy[i];
+        lat_merge(pLat, &pStat->lat[i]);
+        lat_merge(pSvc, &pStat->svc[i]);
+    }
+    const char *name = (type == -1) ? "total" : g_reqName[type];
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",\"threads\":%d,\"conns\":%d,\"target_rate\":%.0f,\"ops\":%llu,\"ns\":%llu,\"ops_per_sec\":%.0f,"
+           "\"sent\":%llu,\"failed\":%llu,\"busy\":%llu",
+           BENCH_NAME, name, threads, g_conns, rate, (unsigned long long)done, (unsigned long long)windowNs,
+           windowNs ? (double)done * 1e9 / (double)windowNs : 0.0, (unsigned long long)sent, (unsigned long long)failed, (unsigned long long)busy);
+    if (type == -1)
+        printf(",\"errors\":%llu,\"unanswered\":%llu,\"unmatched\":%llu,\"conn_lost\":%llu", (unsigned long long)pStat->errors,
+               (unsigned long long)pStat->unanswered, (unsigned long long)pStat->unmatched, (unsigned long long)pStat->connLost);
+    print_lat("lat_us", pLat);
+    print_lat("svc_us", pSvc);
+    printf("}\n");
+
+    fprintf(stderr, "%-8s 完成%llu个(%.0f/秒) 失败%llu 服务器忙%llu  延迟(微秒) p50=%.0f p90=%.0f p99=%.0f p999=%.0f max=%.0f  服务时间p99=%.0f\n",
+            name, (unsigned long long)done, windowNs ? (double)done * 1e9 / (double)windowNs : 0.0, (unsigned long long)failed,
+            (unsigned long long)busy, lat_percentile(pLat, 0.5) / 1000.0, lat_percentile(pLat, 0.9) / 1000.0,
+            lat_percentile(pLat, 0.99) / 1000.0, lat_percentile(pLat, 0.999) / 1000.0, pLat->max / 1000.0,
+            lat_percentile(pSvc, 0.99) / 1000.0);
+    fflush(stdout);
+    delete pLat;
+    delete pSvc;
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = ngx_bench_arg_str(argc, argv, "host", "127.0.0.1");
+    int port = (int)ngx_bench_arg(argc, argv, "port", 8080);
+    g_conns = (int)ngx_bench_arg(argc, argv, "conns", 64);
+    int threads = (int)ngx_bench_arg(argc, argv, "threads", 4);
+    double rate = (double)ngx_bench_arg(argc, argv, "rate", 5000);
+    long long duration = ngx_bench_arg(argc, argv, "duration", 10);
+    long long warmup = ngx_bench_arg(argc, argv, "warmup", 2);
+    g_mix[REQ_PING] = (int)ngx_bench_arg(argc, argv, "ping", 80);
+    g_mix[REQ_REGISTER] = (int)ngx_bench_arg(argc, argv, "register", 10);
+    g_mix[REQ_LOGIN] = (int)ngx_bench_arg(argc, argv, "login", 10);
+    g_drain = (uint64_t)ngx_bench_arg(argc, argv, "timeout", 2000) * 1000000ULL;
+    g_mixTotal = g_mix[REQ_PING] + g_mix[REQ_REGISTER] + g_mix[REQ_LOGIN];
+
+    if (threads < 1)
+        threads = 1;
+    if (g_conns < threads)
+        g_conns = threads;
+    if (rate <= 0 || duration <= warmup || g_mixTotal <= 0 || g_mix[REQ_PING] < 0 || g_mix[REQ_REGISTER] < 0 || g_mix[REQ_LOGIN] < 0)
+    {
+        fprintf(stderr, "参数不对：要求rate>0，duration>warmup，三种请求的比例不能为负、不能全为0\n");
+        return 1;
+    }
+    memset(&g_addr, 0, sizeof(g_addr));
+    g_addr.sin_family = AF_INET;
+    g_addr.sin_port = htons((unsigned short)port);
+    if (inet_pton(AF_INET, host, &g_addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "host=%s不是合法的IPv4地址\n", host);
+        return 1;
+    }
+    g_interval = (uint64_t)(1e9 * g_conns / rate);
+    if (rate / g_conns > 10)
+        fprintf(stderr, "每个连接每秒%.1f个请求，服务器开着Flood攻击检测时连接会被踢，请先把Sock_FloodAttackKickEnable改成0\n", rate / g_conns);
+    if (g_conns > 50)
+        fprintf(stderr, "%d个连接都从同一个地址连过去，服务器开着按IP限制时会被拒绝一部分，请先把Sock_IpMaxConns、Sock_IpAcceptRate改成0\n", g_conns);
+    CCRC32::GetInstance(); // 先把表建好，线程里只读
+
+    std::vector<LoadThread> vt(threads);
+    std::vector<LoadStat *> stats(threads);
+    pthread_barrier_init(&g_barrier, NULL, threads + 1);
+    int first = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        vt[i].index = i;
+        vt[i].firstConn = first;
+        vt[i].nConns = g_conns / threads + (i < g_conns % threads ? 1 : 0);
+        first += vt[i].nConns;
+        stats[i] = new LoadStat();
+        vt[i].pStat = stats[i];
+        vt[i].seed = 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1);
+        vt[i].regSeq = 0;
+        pthread_create(&vt[i].handle, NULL, load_thread, &vt[i]);
+    }
+    pthread_barrier_wait(&g_barrier);
+    g_start = ngx_bench_nsec() + 10 * 1000000ULL;
+    g_measure = g_start + (uint64_t)warmup * 1000000000ULL;
+    g_end = g_start + (uint64_t)duration * 1000000000ULL;
+    if (!g_setupFailed)
+        fprintf(stderr, "%d个连接、%d个线程，每秒%.0f个请求（ping:register:login=%d:%d:%d），预热%lld秒，共%lld秒\n", g_conns, threads, rate,
+                g_mix[REQ_PING], g_mix[REQ_REGISTER], g_mix[REQ_LOGIN], warmup, duration);
+    pthread_barrier_wait(&g_barrier);
+
+    LoadStat *pTotal = new LoadStat();
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(vt[i].handle, NULL);
+        for (int k = 0; k < REQ_TYPES; k++)
+        {
+            pTotal->sent[k] += stats[i]->sent[k];
+            pTotal->done[k] += stats[i]->done[k];
+            pTotal->failed[k] += stats[i]->failed[k];
+            pTotal->busy[k] += stats[i]->busy[k];
+            lat_merge(&pTotal->lat[k], &stats[i]->lat[k]);
+            lat_merge(&pTotal->svc[k], &stats[i]->svc[k]);
+        }
+        pTotal->errors += stats[i]->errors;
+        pTotal->unanswered += stats[i]->unanswered;
+        pTotal->unmatched += stats[i]->unmatched;
+        pTotal->connLost += stats[i]->connLost;
+        delete stats[i];
+    }
+    pthread_barrier_destroy(&g_barrier);
+    if (g_setupFailed)
+    {
+        fprintf(stderr, "有连接没建起来，不压测了\n");
+        delete pTotal;
+        return 1;
+    }
+
+    uint64_t windowNs = g_end - g_measure;
+    report(pTotal, -1, threads, rate, windowNs);
+    for (int k = 0; k < REQ_TYPES; k++)
+    {
+        if (g_mix[k] > 0)
+            report(pTotal, k, threads, rate * g_mix[k] / g_mixTotal, windowNs);
+    }
+    if (pTotal->errors || pTotal->unanswered || pTotal->connLost || pTotal->unmatched)
+        fprintf(stderr, "断开%llu个连接，%llu个请求因连接断开没有应答，%llu个请求到最后也没有应答，%llu个应答对不上请求\n",
+                (unsigned long long)pTotal->connLost, (unsigned long long)pTotal->errors, (unsigned long long)pTotal->unanswered,
+                (unsigned long long)pTotal->unmatched);
+    delete pTotal;
+    return 0;
+}
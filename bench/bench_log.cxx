@@ -0,0 +1,130 @@
+﻿// 日志的基准测试
+// 用法：bench/bin/bench_log [--ops=2000000] [--threads=4]
+// suppressed_macro：日志等级不够，用ngx_log_error()宏，只有一次比较
+// suppressed_core：日志等级不够，直接调用ngx_log_error_core()，一次函数调用后马上返回
+// legacy_suppressed：按改动前ngx_log_error_core()的做法，先清缓冲区、取时间、格式化，最后才判断等级，用来对比
+// log_time：取日志时间字符串（缓存）
+// enabled_sync/enabled_async：真正写日志（写到/dev/null），同步和异步两种方式
+// binary_sync/binary_async：同样内容写二进制日志（写到/dev/null），只记录格式编号和参数，不格式化
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <vector>
+
+#include "ngx_global.h"
+#include "ngx_macro.h"
+#include "ngx_func.h"
+#include "ngx_bench.h"
+
+#define BENCH_NAME "log"
+
+// 改动前的ngx_log_error_core()：等级判断放在最后
+static void legacy_log_error_core(int level, int err, const char *fmt, ...)
+{
+    u_char errstr[NGX_MAX_ERROR_STR + 1];
+    memset(errstr, 0, sizeof(errstr));
+    u_char *last = errstr + NGX_MAX_ERROR_STR;
+
+    struct timeval tv;
+    struct tm tm;
+    gettimeofday(&tv, NULL);
+    time_t sec = tv.tv_sec;
+    localtime_r(&sec, &tm);
+    u_char *p = ngx_slprintf(errstr, last, "%4d/%02d/%02d %02d:%02d:%02d", tm.tm_year + 1900, tm.tm_mon + 1,
+                             tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    p = ngx_slprintf(p, last, " [%s] %P: ", "debug", ngx_pid);
+
+    va_list args;
+    va_start(args, fmt);
+    p = ngx_vslprintf(p, last, fmt, args);
+    va_end(args);
+    if (level > ngx_log.log_level)
+        return;
+    write(ngx_log.fd, errstr, p - errstr);
+}
+
+struct BenchThread
+{
+    pthread_t handle;
+    int mode;
+    long long ops;
+};
+
+static void *bench_thread(void *arg)
+{
+    BenchThread *t = (BenchThread *)arg;
+    u_char buf[64];
+    ngx_log_thread_init(); // 异步写日志开着时用本线程的环形缓冲区
+    for (long long i = 0; i < t->ops; i++)
+    {
+        switch (t->mode)
+        {
+        case 0:
+            ngx_log_error(NGX_LOG_DEBUG, 0, "CSocket::ngx_epoll_process_events()中遇到了fd=-1的过期事件: %p", t);
+            break;
+        case 1:
+            ngx_log_error_core(NGX_LOG_DEBUG, 0, "CSocket::ngx_epoll_process_events()中遇到了fd=-1的过期事件: %p", t);
+            break;
+        case 2:
+            legacy_log_error_core(NGX_LOG_DEBUG, 0, "CSocket::ngx_epoll_process_events()中遇到了fd=-1的过期事件: %p", t);
+            break;
+        case 3:
+            ngx_cpy_log_time(buf, time(NULL));
+            __asm__ __volatile__("" ::"r"(buf) : "memory"); // 防止被优化掉
+            break;
+        case 5:
+            ngx_log_binary(NGX_BL_KICK_SENDQUEUE, 0, (int)i);
+            break;
+        default:
+            ngx_log_error(NGX_LOG_NOTICE, 0, "CSocket::msgSend()中发现某用户%d积压了大量待发送数据包，切断与他的连接！", (int)i);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void run(const char *name, int mode, int threads, long long ops)
+{
+    std::vector<BenchThread> vt(threads);
+    uint64_t start = ngx_bench_nsec();
+    for (int i = 0; i < threads; i++)
+    {
+        vt[i].mode = mode;
+        vt[i].ops = ops / threads;
+        pthread_create(&vt[i].handle, NULL, bench_thread, &vt[i]);
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(vt[i].handle, NULL);
+    ngx_bench_report(BENCH_NAME, name, threads, (ops / threads) * threads, ngx_bench_nsec() - start);
+}
+
+int main(int argc, char **argv)
+{
+    long long ops = ngx_bench_arg(argc, argv, "ops", 2000000);
+    int threads = (int)ngx_bench_arg(argc, argv, "threads", 4);
+
+    ngx_log.fd = open("/dev/null", O_WRONLY);
+    ngx_log.binfd = -1;
+    ngx_log.log_level = NGX_LOG_NOTICE;
+
+    run("suppressed_macro", 0, threads, ops);
+    run("suppressed_core", 1, threads, ops);
+    run("legacy_suppressed", 2, threads, ops);
+    run("log_time", 3, threads, ops);
+    run("enabled_sync", 4, threads, ops);
+    ngx_log_async_start(); // 没有配置文件，LogAsync按缺省值1
+    run("enabled_async", 4, threads, ops);
+    ngx_log_async_stop();
+    ngx_log.binfd = open("/dev/null", O_WRONLY);
+    run("binary_sync", 5, threads, ops);
+    ngx_log_async_start();
+    run("binary_async", 5, threads, ops);
+    ngx_log_async_stop();
+    fprintf(stderr, "异步写日志丢弃%llu条\n", (unsigned long long)ngx_log_dropped_count());
+    return 0;
+}
@@ -0,0 +1,96 @@
+﻿// CMemory的基准测试
+// 用法：bench/bin/bench_memory [--ops=4000000] [--threads=4]
+// alloc_free_N：每次AllocMemory()一块N字节的内存马上FreeMemory()，N是常见的消息大小（消息头加包头，加上注册/登录包体，以及接近最大包）
+// alloc_free_memset_N：同上，要求清零（ngx_get_connection()新建连接时就是这样）
+// batch_N：先连续分配64块再一起释放，接近收包后排队等待处理时的情形
+// 每个项目都先单线程跑一次，再用--threads个线程一起跑一次，看多线程下的争用
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <vector>
+
+#include "ngx_global.h"
+#include "ngx_c_memory.h"
+#include "ngx_bench.h"
+
+#define BENCH_NAME "memory"
+
+#define BATCH 64
+
+struct BenchThread
+{
+    pthread_t handle;
+    int mode;
+    int size;
+    long long ops;
+};
+
+static void *bench_thread(void *arg)
+{
+    BenchThread *t = (BenchThread *)arg;
+    CMemory *p_memory = CMemory::GetInstance();
+    void *batch[BATCH];
+    switch (t->mode)
+    {
+    case 0:
+        for (long long i = 0; i < t->ops; i++)
+        {
+            void *p = p_memory->AllocMemory(t->size, false);
+            __asm__ __volatile__("" ::"r"(p) : "memory"); // 防止被优化掉
+            p_memory->FreeMemory(p);
+        }
+        break;
+    case 1:
+        for (long long i = 0; i < t->ops; i++)
+            p_memory->FreeMemory(p_memory->AllocMemory(t->size, true));
+        break;
+    default:
+        for (long long i = 0; i < t->ops; i += BATCH)
+        {
+            for (int j = 0; j < BATCH; j++)
+                batch[j] = p_memory->AllocMemory(t->size, false);
+            for (int j = 0; j < BATCH; j++)
+                p_memory->FreeMemory(batch[j]);
+        }
+        break;
+    }
+    return NULL;
+}
+
+static void run(const char *name, int mode, int size, int threads, long long ops)
+{
+    std::vector<BenchThread> vt(threads);
+    long long per = ops / threads / BATCH * BATCH; // batch项目一次就是BATCH个
+    uint64_t start = ngx_bench_nsec();
+    for (int i = 0; i < threads; i++)
+    {
+        vt[i].mode = mode;
+        vt[i].size = size;
+        vt[i].ops = per;
+        pthread_create(&vt[i].handle, NULL, bench_thread, &vt[i]);
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(vt[i].handle, NULL);
+    char fullname[64];
+    snprintf(fullname, sizeof(fullname), "%s_%d", name, size);
+    ngx_bench_report(BENCH_NAME, fullname, threads, per * threads, ngx_bench_nsec() - start);
+}
+
+int main(int argc, char **argv)
+{
+    long long ops = ngx_bench_arg(argc, argv, "ops", 4000000);
+    int threads = (int)ngx_bench_arg(argc, argv, "threads", 4);
+    static const int sizes[] = {64, 256, 1024, 30000};
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        run("alloc_free", 0, sizes[s], 1, ops);
+        run("alloc_free", 0, sizes[s], threads, ops);
+        run("alloc_free_memset", 1, sizes[s], 1, ops);
+        run("alloc_free_memset", 1, sizes[s], threads, ops);
+        run("batch", 2, sizes[s], 1, ops);
+        run("batch", 2, sizes[s], threads, ops);
+    }
+    return 0;
+}
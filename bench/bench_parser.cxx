@@ -0,0 +1,161 @@
+﻿// 收包状态机（CSocket::ngx_recv_advance()）的吞吐量测试：不走socket，把一段字节流按recv()的样子分段拷进precvbuf，全速喂给状态机
+// 用法：bench/bin/bench_parser [--pkgs=200000] [--corpus=目录] [--rounds=5]
+// 缺省的字节流是生成的：一半心跳包那样只有包头的，其余包体64、512、4096字节各占一部分
+// --corpus给出模糊测试（fuzz/）的语料目录时改为重放其中每个文件（第一个字节是拆包方式，这里跳过，其余是字节流），断开的流从头再来
+// 每种字节流按recv()每次最多给1、7、1448（以太网上一个TCP段）、65536字节各测一遍，状态机要的比这少时只给它要的
+// 输出两条：xxx/pkgs 每个完整包的耗时，xxx/bytes 每字节的耗时
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+
+#include "ngx_global.h"
+#include "ngx_comm.h"
+#include "ngx_c_socket.h"
+#include "ngx_c_memory.h"
+#include "ngx_bench.h"
+
+#define BENCH_NAME "parser"
+
+// CSocket的友元，读配置项、收包状态机都是私有的
+class CSocketBench
+{
+public:
+    // 没有配置文件，配置项全是缺省值（Flood攻击检测不开）
+    static void Init(CSocket *pSocket) { pSocket->ReadConf(); }
+    static bool Advance(CSocket *pSocket, lpngx_connection_t pConn, size_t reco)
+    {
+        bool isflood = false;
+        return pSocket->ngx_recv_advance(pConn, reco, isflood);
+    }
+};
+
+// 收完整的包不入线程池，计个数就释放
+class CBenchSocket : public CSocket
+{
+public:
+    uint64_t m_pkgs;
+    CBenchSocket() : m_pkgs(0) {}
+    virtual void inRecvMsgQueue(char *pMsgBuf)
+    {
+        m_pkgs++;
+        CMemory::GetInstance()->FreeMemory(pMsgBuf);
+    }
+};
+
+static CBenchSocket s_socket;
+
+// 把一个字节流喂完，每次最多给maxRead个字节，返回喂进去的字节数
+static uint64_t feed(lpngx_connection_t pConn, const std::string &stream, size_t maxRead)
+{
+    size_t pos = 0;
+    pConn->GetOneToUse();
+    while (pos < stream.size())
+    {
+        size_t n = pConn->irecvlen;
+        if (n > maxRead)
+            n = maxRead;
+        if (n > stream.size() - pos)
+            n = stream.size() - pos;
+        memcpy(pConn->precvbuf, stream.data() + pos, n); // 相当于recv()
+        pos += n;
+        if (CSocketBench::Advance(&s_socket, pConn, n) == false)
+            break; // 包头不对，服务器会断开连接，这个流就到这里
+    }
+    pConn->PutOneToFree();
+    return pos;
+}
+
+static void append_pkg(std::string &s, size_t pkgLen, unsigned short msgCode)
+{
+    COMM_PKG_HEADER hdr;
+    hdr.pkgLen = htons((unsigned short)pkgLen);
+    hdr.msgCode = htons(msgCode);
+    hdr.crc32 = htonl(0);
+    s.append((const char *)&hdr, sizeof(hdr));
+    s.append(pkgLen - sizeof(hdr), 'x');
+}
+
+static void load_corpus(const char *pDir, std::vector<std::string> &streams)
+{
+    DIR *pD = opendir(pDir);
+    if (pD == NULL)
+    {
+        fprintf(stderr, "打不开目录%s\n", pDir);
+        exit(1);
+    }
+    struct dirent *pEnt;
+    while ((pEnt = readdir(pD)) != NULL)
+    {
+        std::string path = std::string(pDir) + "/" + pEnt->d_name;
+        struct stat st;
+        if (pEnt->d_name[0] == '.' || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 2)
+            continue;
+        FILE *fp = fopen(path.c_str(), "rb");
+        if (fp == NULL)
+            continue;
+        std::string s(st.st_size, '\0');
+        size_t n = fread(&s[0], 1, s.size(), fp);
+        fclose(fp);
+        streams.push_back(s.substr(1, n - 1));
+    }
+    closedir(pD);
+}
+
+static void run(const char *name, const std::vector<std::string> &streams, size_t maxRead, int rounds)
+{
+    ngx_connection_t conn;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < streams.size(); i++) // 先跑一遍热身，内存池里的块也分好了
+        feed(&conn, streams[i], maxRead);
+    s_socket.m_pkgs = 0;
+    uint64_t start = ngx_bench_nsec();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (size_t i = 0; i < streams.size(); i++)
+            bytes += feed(&conn, streams[i], maxRead);
+    }
+    uint64_t nsec = ngx_bench_nsec() - start;
+
+    char caseName[128];
+    snprintf(caseName, sizeof(caseName), "%s/read%zu/pkgs", name, maxRead);
+    ngx_bench_report(BENCH_NAME, caseName, 1, s_socket.m_pkgs, nsec);
+    snprintf(caseName, sizeof(caseName), "%s/read%zu/bytes", name, maxRead);
+    ngx_bench_report(BENCH_NAME, caseName, 1, bytes, nsec);
+}
+
+int main(int argc, char **argv)
+{
+    long long pkgs = ngx_bench_arg(argc, argv, "pkgs", 200000);
+    int rounds = (int)ngx_bench_arg(argc, argv, "rounds", 5);
+    const char *pCorpus = ngx_bench_arg_str(argc, argv, "corpus", NULL);
+
+    CSocketBench::Init(&s_socket);
+
+    std::vector<std::string> streams;
+    const char *name;
+    if (pCorpus != NULL)
+    {
+        load_corpus(pCorpus, streams);
+        name = "corpus";
+    }
+    else
+    {
+        // 一个连接上连着发的一串包
+        static const size_t bodies[] = {0, 0, 0, 0, 64, 64, 512, 4096};
+        std::string s;
+        for (long long i = 0; i < pkgs; i++)
+            append_pkg(s, sizeof(COMM_PKG_HEADER) + bodies[i % 8], (unsigned short)(i % 8));
+        streams.push_back(s);
+        name = "mixed";
+    }
+
+    static const size_t reads[] = {1, 7, 1448, 65536};
+    for (size_t i = 0; i < sizeof(reads) / sizeof(reads[0]); i++)
+        run(name, streams, reads[i], rounds);
+    return 0;
+}
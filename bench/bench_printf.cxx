@@ -0,0 +1,298 @@
+﻿// 格式化函数的基准测试
+// 用法：bench/bin/bench_printf [--ops=2000000]
+// 先用改动前的ngx_vslprintf()（legacy_xxx，原样搬过来的）和现在的版本格式化一批数字和格式，结果必须一字不差，然后再计时
+// legacy_line/line：一行典型的日志（时间、等级、pid、内容里几个数字和一个指针），分别用老的和新的ngx_vslprintf()
+// slcat_line：同样一行用类型安全的ngx_slcat()组合
+// legacy_num/num：只格式化一个20位的大数
+// str/hex/float：新的ngx_vslprintf()格式化%s、%xd、%.3f，日志里常见的另外几种格式
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "ngx_global.h"
+#include "ngx_macro.h"
+#include "ngx_func.h"
+#include "ngx_bench.h"
+
+#define BENCH_NAME "printf"
+
+// 改动前的ngx_sprintf_num()：逐位转换到临时数组再拷贝
+static u_char *legacy_sprintf_num(u_char *buf, u_char *last, uint64_t ui64, u_char zero, uintptr_t hexadecimal, uintptr_t width)
+{
+    u_char *p, temp[NGX_INT64_LEN + 1];
+    size_t len;
+    uint32_t ui32;
+    static u_char hex[] = "0123456789abcdef";
+    static u_char HEX[] = "0123456789ABCDEF";
+
+    p = temp + NGX_INT64_LEN;
+    if (hexadecimal == 0)
+    {
+        if (ui64 <= (uint64_t)NGX_MAX_UINT32_VALUE)
+        {
+            ui32 = (uint32_t)ui64;
+            do
+            {
+                *--p = (u_char)(ui32 % 10 + '0');
+            } while (ui32 /= 10);
+        }
+        else
+        {
+            do
+            {
+                *--p = (u_char)(ui64 % 10 + '0');
+            } while (ui64 /= 10);
+        }
+    }
+    else if (hexadecimal == 1)
+    {
+        do
+        {
+            *--p = hex[(uint32_t)(ui64 & 0xf)];
+        } while (ui64 >>= 4);
+    }
+    else
+    {
+        do
+        {
+            *--p = HEX[(uint32_t)(ui64 & 0xf)];
+        } while (ui64 >>= 4);
+    }
+    len = (temp + NGX_INT64_LEN) - p;
+    while (len++ < width && buf < last)
+    {
+        *buf++ = zero;
+    }
+    len = (temp + NGX_INT64_LEN) - p;
+    if ((buf + len) >= last)
+    {
+        len = last - buf;
+    }
+    return ngx_cpymem(buf, p, len);
+}
+
+// 改动前的ngx_vslprintf()：普通字符一个一个拷贝，去掉了没用到的%f
+static u_char *legacy_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args)
+{
+    u_char zero;
+    uintptr_t width, sign, hex;
+    int64_t i64;
+    uint64_t ui64;
+    u_char *p;
+
+    while (*fmt && buf < last)
+    {
+        if (*fmt == '%')
+        {
+            zero = (u_char)((*++fmt == '0') ? '0' : ' ');
+            width = 0;
+            sign = 1;
+            hex = 0;
+            i64 = 0;
+            ui64 = 0;
+            while (*fmt >= '0' && *fmt <= '9')
+            {
+                width = width * 10 + (*fmt++ - '0');
+            }
+            for (;;)
+            {
+                switch (*fmt)
+                {
+                case 'u':
+                    sign = 0;
+                    fmt++;
+                    continue;
+                case 'X':
+                    hex = 2;
+                    sign = 0;
+                    fmt++;
+                    continue;
+                case 'x':
+                    hex = 1;
+                    sign = 0;
+                    fmt++;
+                    continue;
+                default:
+                    break;
+                }
+                break;
+            }
+            switch (*fmt)
+            {
+            case '%':
+                *buf++ = '%';
+                fmt++;
+                continue;
+            case 'd':
+                if (sign)
+                    i64 = (int64_t)va_arg(args, int);
+                else
+                    ui64 = (uint64_t)va_arg(args, u_int);
+                break;
+            case 'i':
+                if (sign)
+                    i64 = (int64_t)va_arg(args, intptr_t);
+                else
+                    ui64 = (uint64_t)va_arg(args, uintptr_t);
+                break;
+            case 'L':
+                if (sign)
+                    i64 = va_arg(args, int64_t);
+                else
+                    ui64 = va_arg(args, uint64_t);
+                break;
+            case 'p':
+                ui64 = (uintptr_t)va_arg(args, void *);
+                hex = 2;
+                sign = 0;
+                zero = '0';
+                width = 2 * sizeof(void *);
+                break;
+            case 's':
+                p = va_arg(args, u_char *);
+                while (*p && buf < last)
+                {
+                    *buf++ = *p++;
+                }
+                fmt++;
+                continue;
+            case 'P':
+                i64 = (int64_t)va_arg(args, pid_t);
+                sign = 1;
+                break;
+            default:
+                *buf++ = *fmt++;
+                continue;
+            }
+            if (sign)
+            {
+                if (i64 < 0)
+                {
+                    *buf++ = '-';
+                    ui64 = (uint64_t)-i64;
+                }
+                else
+                {
+                    ui64 = (uint64_t)i64;
+                }
+            }
+            buf = legacy_sprintf_num(buf, last, ui64, zero, hex, width);
+            fmt++;
+        }
+        else
+        {
+            *buf++ = *fmt++;
+        }
+    }
+    return buf;
+}
+
+static u_char *legacy_slprintf(u_char *buf, u_char *last, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    u_char *p = legacy_vslprintf(buf, last, fmt, args);
+    va_end(args);
+    return p;
+}
+
+#define LINE_FMT "%4d/%02d/%02d %02d:%02d:%02d [%s] %P: CSocket::msgSend()中发现某用户%d积压了大量待发送数据包，切断与他的连接！积压%ud个，连接%p"
+
+// 新老两个版本格式化同样的内容，结果必须一样，缓冲区不够长时截断的结果也要一样
+static int verify()
+{
+    static const uint64_t values[] = {0, 1, 9, 10, 99, 100, 999, 1000, 9999, 10000, 65535, 99999999, 100000000,
+                                      4294967295ULL, 4294967296ULL, 999999999999ULL, 18446744073709551615ULL};
+    int bad = 0;
+    u_char a[128], b[128];
+    for (size_t lim = 1; lim <= 40; lim += 13) // 有一些情况缓冲区不够长
+    {
+        for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        {
+            uint64_t v = values[i];
+            u_char *pa = legacy_slprintf(a, a + lim, "x=%d,%ud,%08d,%uL,%L,%xd,%Xd,%016xd,%i,%p,%s%%", (int)v, (u_int)v, (int)v, v, (int64_t)v,
+                                         (u_int)v, (u_int)v, (u_int)v, (intptr_t)v, (void *)(uintptr_t)v, "abc");
+            u_char *pb = ngx_slprintf(b, b + lim, "x=%d,%ud,%08d,%uL,%L,%xd,%Xd,%016xd,%i,%p,%s%%", (int)v, (u_int)v, (int)v, v, (int64_t)v,
+                                      (u_int)v, (u_int)v, (u_int)v, (intptr_t)v, (void *)(uintptr_t)v, "abc");
+            if (pa - a != pb - b || memcmp(a, b, pa - a) != 0)
+            {
+                fprintf(stderr, "结果不一致：值%llu，缓冲区%zu\n  老：%.*s\n  新：%.*s\n", (unsigned long long)v, lim,
+                        (int)(pa - a), a, (int)(pb - b), b);
+                bad++;
+            }
+        }
+    }
+
+    // ngx_slcat()和ngx_slprintf()组合出来的一行也要一样
+    u_char *pa = ngx_slprintf(a, a + sizeof(a), "[%s] %P: fd=%d,%uL,%08xd,%p", "debug", (pid_t)-123, -45, 12345678901ULL, 0xbeefu, (void *)a);
+    u_char *pb = ngx_slcat(b, b + sizeof(b), "[", "debug", "] ", (pid_t)-123, ": fd=", -45, ",", 12345678901ULL, ",",
+                           ngx_hex(0xbeefu, 8), ",", (const void *)a);
+    if (pa - a != pb - b || memcmp(a, b, pa - a) != 0)
+    {
+        fprintf(stderr, "ngx_slcat()结果不一致\n  ngx_slprintf：%.*s\n  ngx_slcat：%.*s\n", (int)(pa - a), a, (int)(pb - b), b);
+        bad++;
+    }
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    long long ops = ngx_bench_arg(argc, argv, "ops", 2000000);
+    if (verify() != 0)
+        return 1;
+
+    u_char buf[NGX_MAX_ERROR_STR + 1];
+    u_char *last = buf + NGX_MAX_ERROR_STR;
+    uint64_t start;
+    size_t total = 0; // 防止被优化掉
+
+    start = ngx_bench_nsec();
+    for (long long i = 0; i < ops; i++)
+        total += legacy_slprintf(buf, last, LINE_FMT, 2026, 10, 19, 14, 35, 58, "notice", (pid_t)7034, (int)i, (u_int)(i & 511), (void *)buf) - buf;
+    ngx_bench_report(BENCH_NAME, "legacy_line", 1, ops, ngx_bench_nsec() - start);
+
+    start = ngx_bench_nsec();
+    for (long long i = 0; i < ops; i++)
+        total += ngx_slprintf(buf, last, LINE_FMT, 2026, 10, 19, 14, 35, 58, "notice", (pid_t)7034, (int)i, (u_int)(i & 511), (void *)buf) - buf;
+    ngx_bench_report(BENCH_NAME, "line", 1, ops, ngx_bench_nsec() - start);
+
+    start = ngx_bench_nsec();
+    for (long long i = 0; i < ops; i++)
+        total += ngx_slcat(buf, last, ngx_width(2026, 4, ' '), "/", ngx_width(10, 2), "/", ngx_width(19, 2), " ", ngx_width(14, 2), ":",
+                           ngx_width(35, 2), ":", ngx_width(58, 2), " [", "notice", "] ", (pid_t)7034,
+                           ": CSocket::msgSend()中发现某用户", (int)i, "积压了大量待发送数据包，切断与他的连接！积压", (u_int)(i & 511), "个，连接",
+                           (const void *)buf) -
+                 buf;
+    ngx_bench_report(BENCH_NAME, "slcat_line", 1, ops, ngx_bench_nsec() - start);
+
+    start = ngx_bench_nsec();
+    for (long long i = 0; i < ops; i++)
+        total += legacy_slprintf(buf, last, "%uL", 18446744073709551615ULL - (uint64_t)i) - buf;
+    ngx_bench_report(BENCH_NAME, "legacy_num", 1, ops, ngx_bench_nsec() - start);
+
+    start = ngx_bench_nsec();
+    for (long long i = 0; i < ops; i++)
+        total += ngx_slprintf(buf, last, "%uL", 18446744073709551615ULL - (uint64_t)i) - buf;
+    ngx_bench_report(BENCH_NAME, "num", 1, ops, ngx_bench_nsec() - start);
+
+    start = ngx_bench_nsec();
+    for (long long i = 0; i < ops; i++)
+        total += ngx_slprintf(buf, last, "%s", "CLogicSocket::_HandleRegister()") - buf;
+    ngx_bench_report(BENCH_NAME, "str", 1, ops, ngx_bench_nsec() - start);
+
+    start = ngx_bench_nsec();
+    for (long long i = 0; i < ops; i++)
+        total += ngx_slprintf(buf, last, "%xd", (int)i) - buf;
+    ngx_bench_report(BENCH_NAME, "hex", 1, ops, ngx_bench_nsec() - start);
+
+    start = ngx_bench_nsec();
+    for (long long i = 0; i < ops; i++)
+        total += ngx_slprintf(buf, last, "%.3f", (double)i / 7) - buf;
+    ngx_bench_report(BENCH_NAME, "float", 1, ops, ngx_bench_nsec() - start);
+
+    fprintf(stderr, "共输出%zu字节\n", total);
+    return 0;
+}
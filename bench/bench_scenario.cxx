@@ -0,0 +1,610 @@
+﻿// 线上最怕的两种情形的回环测试：大量客户端同时重连（重连风暴）、客户端不收数据（慢客户端）
+// 用法：bench/bin/bench_scenario --scenario=storm|slow [--host=127.0.0.1] [--port=8080] [--admin=9145] [--probe=100]
+//   storm：[--conns=4000] [--rounds=8] [--hold=1000] [--gap=500]
+//   slow： [--slow=20] [--rate=500] [--rcvbuf=2048] [--duration=15]
+// 服务器要先启动并且打开管理端口，服务器端的数据都从管理端口的/metrics取；bench/scenarios.sh会启动专用的服务器依次跑两个场景
+// 两个场景都带一个正常的探测客户端，每秒发--probe个心跳包，统计它的延迟，看坏客户端对正常客户端的影响
+// 延迟从心跳包本该发出的时刻算起，服务器卡住期间没发出去的心跳包也算上等待时间（不受coordinated omission影响）
+// storm：--conns个客户端同时连入，保持--hold毫秒后全部以RST断开，过--gap毫秒再来，共--rounds轮
+//        断开的连接要等Sock_RecyConnectionWaitTime秒才回收，连接池一轮比一轮大，大到worker_connections的5倍后新连接被拒绝
+//        每轮一行结果：连入用时、服务器accept的速度、被拒绝的连接数（其中多少是连接池膨胀保护拒绝的）、连接池大小、待回收连接数、worker进程常驻内存
+// slow：--slow个客户端把接收缓冲区设成--rcvbuf字节，连入后每个每秒发--rate个心跳包（每100毫秒发一批），但从来不收
+//       服务器的发送缓冲区满了以后应答积压在发送消息队列里，发送线程每次都要扫过它们，每个连接积压超过400个就被踢掉
+//       服务器的发送缓冲区要用Sock_SendBufSize固定下来（比如8192），否则本机上内核会把它涨到几MB，要很久才会堵上
+//       分三段（慢客户端连入前、在线期间、断开后）各一行结果：发送消息队列最大长度、发送线程扫描一遍队列的耗时、被踢掉的慢客户端数、丢弃的应答数
+// 结果每行一个JSON对象打印到标准输出，人看的说明打印到标准错误
+// 注意：慢客户端发包很密，服务器要把Sock_FloodAttackKickEnable改成0，否则测到的是Flood攻击检测
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ngx_comm.h"
+#include "ngx_logiccomm.h"
+#include "ngx_bench.h"
+
+#define BENCH_NAME "scenario"
+
+typedef std::map<std::string, double> Metrics; // /metrics中的一项：名字（带标签）-> 值
+
+static struct sockaddr_in g_addr;  // 服务器
+static struct sockaddr_in g_admin; // 管理端口
+
+static void sleep_ms(long long ms)
+{
+    struct timespec ts = {(time_t)(ms / 1000), (long)(ms % 1000) * 1000000L};
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+// 从管理端口取一次统计信息，失败返回false
+static bool scrape(Metrics &m)
+{
+    m.clear();
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return false;
+    struct timeval tv = {2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    const char *req = "GET /metrics HTTP/1.0\r\n\r\n";
+    if (connect(fd, (struct sockaddr *)&g_admin, sizeof(g_admin)) == -1 || send(fd, req, strlen(req), MSG_NOSIGNAL) != (ssize_t)strlen(req))
+    {
+        close(fd);
+        return false;
+    }
+    std::string text;
+    char buf[16384];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+        text.append(buf, n);
+    close(fd);
+
+    size_t pos = text.find("\r\n\r\n");
+    if (pos == std::string::npos)
+        return false;
+    pos += 4;
+    while (pos < text.size())
+    {
+        size_t eol = text.find('\n', pos);
+        if (eol == std::string::npos)
+            eol = text.size();
+        if (text[pos] != '#')
+        {
+            size_t sp = text.rfind(' ', eol);
+            if (sp != std::string::npos && sp > pos)
+                m[text.substr(pos, sp - pos)] = strtod(text.c_str() + sp + 1, NULL);
+        }
+        pos = eol + 1;
+    }
+    return !m.empty();
+}
+
+// 取一项的值，name不带前缀ngx_
+static double mval(const Metrics &m, const char *name)
+{
+    Metrics::const_iterator it = m.find(std::string("ngx_") + name);
+    return (it != m.end()) ? it->second : 0.0;
+}
+
+// 两次取到的统计信息之间，直方图name的第q分位数（桶的上界），没有数据返回0
+static double hist_pct(const Metrics &a, const Metrics &b, const char *name, double q)
+{
+    std::string prefix = std::string("ngx_") + name + "_bucket{le=\"";
+    std::vector<std::pair<double, double> > v; // 上界 -> 累计个数的增量
+    for (Metrics::const_iterator it = b.lower_bound(prefix); it != b.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+    {
+        Metrics::const_iterator ia = a.find(it->first);
+        v.push_back(std::make_pair(strtod(it->first.c_str() + prefix.size(), NULL), it->second - (ia != a.end() ? ia->second : 0.0)));
+    }
+    if (v.empty())
+        return 0.0;
+    std::sort(v.begin(), v.end());
+    double total = v.back().second;
+    if (total <= 0)
+        return 0.0;
+    for (size_t i = 0; i < v.size(); i++)
+    {
+        if (v[i].second >= q * total)
+            return (i + 1 < v.size() || i == 0) ? v[i].first : v[i - 1].first; // 落在+Inf里的按最后一个有界的桶算
+    }
+    return v.back().first;
+}
+
+// 两次取到的统计信息之间，直方图name的平均值
+static double hist_mean(const Metrics &a, const Metrics &b, const char *name)
+{
+    std::string sum = std::string(name) + "_sum", count = std::string(name) + "_count";
+    double n = mval(b, count.c_str()) - mval(a, count.c_str());
+    return (n > 0) ? (mval(b, sum.c_str()) - mval(a, sum.c_str())) / n : 0.0;
+}
+
+// 计数器在两次之间的增量
+static long long mdelta(const Metrics &a, const Metrics &b, const char *name)
+{
+    return (long long)(mval(b, name) - mval(a, name));
+}
+
+// 把一个socket设成断开时发RST：大量连接一起断开时客户端不留TIME_WAIT，本地端口不会用完，也更像客户端进程崩溃或者断网
+static void set_linger_rst(int fd)
+{
+    struct linger lg = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+}
+
+// 心跳包：只有包头，crc为0
+static void build_ping(char *buf)
+{
+    LPCOMM_PKG_HEADER pHeader = (LPCOMM_PKG_HEADER)buf;
+    pHeader->pkgLen = htons(sizeof(COMM_PKG_HEADER));
+    pHeader->msgCode = htons(_CMD_PING);
+    pHeader->crc32 = 0;
+}
+
+// 探测客户端：一个正常的连接，按固定间隔发心跳包、等应答
+struct Probe
+{
+    pthread_t handle;
+    uint64_t interval; // 两个心跳包的间隔（纳秒）
+    volatile int stop;
+    pthread_mutex_t mutex;
+    std::vector<uint64_t> samples; // 延迟（纳秒）
+    long long lost;                // 没收到应答或者连接断了的次数
+};
+
+static int probe_connect()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&g_addr, sizeof(g_addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval tv = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+// 收一个完整的应答，包体不要
+static bool probe_recv(int fd)
+{
+    char buf[_PKG_MAX_LENGTH];
+    size_t got = 0, want = sizeof(COMM_PKG_HEADER);
+    while (got < want)
+    {
+        ssize_t n = recv(fd, buf + got, want - got, 0);
+        if (n <= 0)
+            return false;
+        got += n;
+        if (got == sizeof(COMM_PKG_HEADER))
+        {
+            want = ntohs(((LPCOMM_PKG_HEADER)buf)->pkgLen);
+            if (want < sizeof(COMM_PKG_HEADER) || want > sizeof(buf))
+                return false;
+        }
+    }
+    return true;
+}
+
+static void *probe_thread(void *arg)
+{
+    Probe *p = (Probe *)arg;
+    char ping[sizeof(COMM_PKG_HEADER)];
+    build_ping(ping);
+    int fd = -1;
+    uint64_t next = ngx_bench_nsec();
+    while (!p->stop)
+    {
+        uint64_t now = ngx_bench_nsec();
+        if (now < next)
+        {
+            uint64_t d = next - now;
+            struct timespec ts = {(time_t)(d / 1000000000ULL), (long)(d % 1000000000ULL)};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        if (fd == -1 && (fd = probe_connect()) == -1)
+        {
+            pthread_mutex_lock(&p->mutex);
+            ++p->lost;
+            pthread_mutex_unlock(&p->mutex);
+            next += p->interval;
+            continue;
+        }
+        bool ok = send(fd, ping, sizeof(ping), MSG_NOSIGNAL) == (ssize_t)sizeof(ping) && probe_recv(fd);
+        uint64_t lat = ngx_bench_nsec() - next;
+        pthread_mutex_lock(&p->mutex);
+        if (ok)
+            p->samples.push_back(lat);
+        else
+            ++p->lost;
+        pthread_mutex_unlock(&p->mutex);
+        if (!ok)
+        {
+            close(fd);
+            fd = -1;
+        }
+        next += p->interval; // 落后了也按原定的时刻排，下一个马上发，等待的时间算进延迟里
+    }
+    if (fd != -1)
+        close(fd);
+    return NULL;
+}
+
+// 探测客户端上次取走以来的结果
+struct ProbeStat
+{
+    size_t n;
+    long long lost;
+    uint64_t p50, p99, max;
+};
+
+static void probe_take(Probe *p, ProbeStat *s)
+{
+    std::vector<uint64_t> v;
+    pthread_mutex_lock(&p->mutex);
+    v.swap(p->samples);
+    s->lost = p->lost;
+    p->lost = 0;
+    pthread_mutex_unlock(&p->mutex);
+    std::sort(v.begin(), v.end());
+    s->n = v.size();
+    s->p50 = v.empty() ? 0 : v[v.size() / 2];
+    s->p99 = v.empty() ? 0 : v[std::min(v.size() - 1, (size_t)(v.size() * 0.99))];
+    s->max = v.empty() ? 0 : v.back();
+}
+
+// 一行结果的公共部分：探测客户端的延迟，worker进程常驻内存
+static void print_common(const char *name, double seconds, const ProbeStat *ps, const Metrics &m)
+{
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",\"seconds\":%.3f,\"probe_ops\":%zu,\"probe_lost\":%lld,\"probe_p50_ns\":%llu,\"probe_p99_ns\":%llu,"
+           "\"probe_max_ns\":%llu,\"rss_bytes\":%.0f",
+           BENCH_NAME, name, seconds, ps->n, ps->lost, (unsigned long long)ps->p50, (unsigned long long)ps->p99, (unsigned long long)ps->max,
+           mval(m, "resident_memory_bytes"));
+}
+
+// 重连风暴
+static int run_storm(Probe *probe, int conns, int rounds, long long hold, long long gap)
+{
+    // 一个进程要开这么多连接，先把文件句柄数上限提到最大
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && (rlim_t)conns + 64 > rl.rlim_cur)
+    {
+        conns = (int)rl.rlim_cur - 64;
+        fprintf(stderr, "文件句柄数上限是%llu，连接数减到%d\n", (unsigned long long)rl.rlim_cur, conns);
+    }
+
+    Metrics base, a, b;
+    ProbeStat ps;
+    if (!scrape(base))
+    {
+        fprintf(stderr, "取不到管理端口的/metrics，服务器没启动或者没开AdminPort\n");
+        return 1;
+    }
+    probe_take(probe, &ps); // 之前的不要
+    uint64_t t0 = ngx_bench_nsec();
+    sleep_ms(1000);
+    probe_take(probe, &ps);
+    scrape(a);
+    print_common("storm_baseline", (ngx_bench_nsec() - t0) / 1e9, &ps, a);
+    printf("}\n");
+    fflush(stdout);
+
+    int epfd = epoll_create1(0);
+    std::vector<int> fds(conns, -1);
+    for (int r = 1; r <= rounds; r++)
+    {
+        scrape(a);
+        probe_take(probe, &ps);
+        uint64_t start = ngx_bench_nsec();
+
+        // 所有连接一起发起，非阻塞connect()，用epoll等结果
+        int pending = 0, connected = 0, failed = 0;
+        for (int i = 0; i < conns; i++)
+        {
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (fd == -1)
+            {
+                ++failed;
+                continue;
+            }
+            set_linger_rst(fd);
+            if (connect(fd, (struct sockaddr *)&g_addr, sizeof(g_addr)) == -1 && errno != EINPROGRESS)
+            {
+                close(fd);
+                ++failed;
+                continue;
+            }
+            struct epoll_event ev;
+            ev.events = EPOLLOUT;
+            ev.data.u32 = (uint32_t)i;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+            fds[i] = fd;
+            ++pending;
+        }
+        struct epoll_event events[256];
+        while (pending > 0 && ngx_bench_nsec() - start < 10000000000ULL)
+        {
+            int n = epoll_wait(epfd, events, 256, 100);
+            for (int k = 0; k < n; k++)
+            {
+                int i = (int)events[k].data.u32;
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &err, &len);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fds[i], NULL);
+                --pending;
+                if (err == 0)
+                    ++connected;
+                else
+                {
+                    close(fds[i]);
+                    fds[i] = -1;
+                    ++failed;
+                }
+            }
+        }
+        failed += pending; // 10秒还没连上的也算失败
+        uint64_t connectNs = ngx_bench_nsec() - start;
+
+        // 服务器对每个连接要么accept要么拒绝，两者之和不再增加时认为服务器处理完了这一轮
+        uint64_t lastChange = ngx_bench_nsec();
+        long long handled = -1;
+        while (ngx_bench_nsec() - lastChange < 500000000ULL && ngx_bench_nsec() - start < 10000000000ULL)
+        {
+            scrape(b);
+            long long h = mdelta(a, b, "connections_accepted_total") + mdelta(a, b, "connections_refused_total");
+            if (h != handled)
+            {
+                handled = h;
+                lastChange = ngx_bench_nsec();
+            }
+            if (handled >= connected)
+                break;
+            sleep_ms(20);
+        }
+        uint64_t acceptNs = lastChange - start;
+
+        long long left = hold - (long long)((ngx_bench_nsec() - start) / 1000000ULL);
+        if (left > 0)
+            sleep_ms(left);
+
+        // 看看哪些连接已经被服务器关掉了（被拒绝的连接服务器accept后马上close）
+        int closedByServer = 0;
+        for (int i = 0; i < conns; i++)
+        {
+            if (fds[i] == -1)
+                continue;
+            char c;
+            ssize_t n = recv(fds[i], &c, 1, MSG_DONTWAIT);
+            if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+                ++closedByServer;
+        }
+        scrape(b);
+        probe_take(probe, &ps);
+        for (int i = 0; i < conns; i++)
+        {
+            if (fds[i] != -1)
+            {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "storm_round%d", r);
+        long long accepted = mdelta(a, b, "connections_accepted_total");
+        print_common(name, (ngx_bench_nsec() - start) / 1e9, &ps, b);
+        printf(",\"conns\":%d,\"connected\":%d,\"connect_failed\":%d,\"connect_ns\":%llu,\"accepted\":%lld,\"refused\":%lld,\"refused_churn\":%lld,"
+               "\"closed_by_server\":%d,\"accept_ns\":%llu,\"accepts_per_sec\":%.0f,\"pool_size\":%.0f,\"pool_free\":%.0f,\"recycle_pending\":%.0f,"
+               "\"rss_growth_bytes\":%.0f}\n",
+               conns, connected, failed, (unsigned long long)connectNs, accepted, mdelta(a, b, "connections_refused_total"),
+               mdelta(a, b, "connections_refused_churn_total"), closedByServer, (unsigned long long)acceptNs,
+               acceptNs ? (double)(accepted + mdelta(a, b, "connections_refused_total")) * 1e9 / (double)acceptNs : 0.0,
+               mval(b, "connection_pool_size"), mval(b, "connection_pool_free"), mval(b, "connection_recycle_pending"),
+               mval(b, "resident_memory_bytes") - mval(base, "resident_memory_bytes"));
+        fflush(stdout);
+        fprintf(stderr, "第%d轮：连上%d个，服务器accept %lld个、拒绝%lld个，连接池%.0f个（待回收%.0f个）\n", r, connected, accepted,
+                mdelta(a, b, "connections_refused_total"), mval(b, "connection_pool_size"), mval(b, "connection_recycle_pending"));
+
+        sleep_ms(gap);
+    }
+    close(epfd);
+    return 0;
+}
+
+// 慢客户端的一段：持续seconds秒，每100毫秒给还连着的慢客户端各发一批心跳包（每秒共rate个），顺便取一次统计信息记下发送消息队列的最大长度
+static void slow_phase(const char *name, Probe *probe, std::vector<int> &slow, int rate, double seconds)
+{
+    Metrics a, b, m;
+    ProbeStat ps;
+    int batch = rate / 10;
+    std::vector<char> pings(sizeof(COMM_PKG_HEADER) * (batch > 0 ? batch : 1));
+    for (int k = 0; k < batch; k++)
+        build_ping(&pings[k * sizeof(COMM_PKG_HEADER)]);
+    int kicked = 0;
+
+    scrape(a);
+    probe_take(probe, &ps);
+    uint64_t start = ngx_bench_nsec();
+    uint64_t end = start + (uint64_t)(seconds * 1e9);
+    double sendqMax = 0, rssMax = 0;
+    while (ngx_bench_nsec() < end)
+    {
+        for (size_t i = 0; batch > 0 && i < slow.size(); i++)
+        {
+            if (slow[i] == -1)
+                continue;
+            // 服务器一直在收，这里不会堵；出错说明被服务器踢掉了
+            if (send(slow[i], &pings[0], pings.size(), MSG_NOSIGNAL | MSG_DONTWAIT) == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                close(slow[i]);
+                slow[i] = -1;
+                ++kicked;
+            }
+        }
+        if (scrape(m))
+        {
+            sendqMax = std::max(sendqMax, mval(m, "send_queue_depth"));
+            rssMax = std::max(rssMax, mval(m, "resident_memory_bytes"));
+        }
+        sleep_ms(100);
+    }
+    scrape(b);
+    probe_take(probe, &ps);
+
+    // 不读数据，只看对方是不是已经关了连接
+    int alive = 0;
+    for (size_t i = 0; i < slow.size(); i++)
+    {
+        if (slow[i] == -1)
+            continue;
+        struct pollfd pfd = {slow[i], POLLRDHUP, 0};
+        if (poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)))
+        {
+            close(slow[i]);
+            slow[i] = -1;
+            ++kicked;
+            continue;
+        }
+        ++alive;
+    }
+
+    print_common(name, (ngx_bench_nsec() - start) / 1e9, &ps, b);
+    printf(",\"slow_conns\":%zu,\"slow_alive\":%d,\"slow_kicked\":%d,\"send_queue_max\":%.0f,\"send_blocked\":%lld,\"send_discarded\":%lld,\"send_queue_kicks\":%lld,"
+           "\"scan_count\":%lld,\"scan_mean_us\":%.1f,\"scan_p99_us\":%.0f,\"rss_max_bytes\":%.0f}\n",
+           slow.size(), alive, kicked, sendqMax, mdelta(a, b, "send_blocked_total"), mdelta(a, b, "send_discarded_total"),
+           mdelta(a, b, "send_queue_kicks_total"), mdelta(a, b, "send_queue_scan_us_count"), hist_mean(a, b, "send_queue_scan_us"),
+           hist_pct(a, b, "send_queue_scan_us", 0.99), rssMax);
+    fflush(stdout);
+    fprintf(stderr, "%s：发送消息队列最长%.0f，慢客户端还剩%d个，探测客户端p99 %.3f毫秒\n", name, sendqMax, alive, ps.p99 / 1e6);
+}
+
+// 慢客户端
+static int run_slow(Probe *probe, int nslow, int rate, int rcvbuf, long long duration)
+{
+    Metrics m;
+    if (!scrape(m))
+    {
+        fprintf(stderr, "取不到管理端口的/metrics，服务器没启动或者没开AdminPort\n");
+        return 1;
+    }
+    std::vector<int> slow;
+    slow_phase("slow_before", probe, slow, 0, 2.0);
+
+    for (int i = 0; i < nslow; i++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1)
+            break;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)); // connect()之前设，窗口才会小
+        set_linger_rst(fd);
+        if (connect(fd, (struct sockaddr *)&g_addr, sizeof(g_addr)) == -1)
+        {
+            fprintf(stderr, "慢客户端%d connect()失败: %s\n", i, strerror(errno));
+            close(fd);
+            continue;
+        }
+        slow.push_back(fd);
+    }
+    slow_phase("slow_during", probe, slow, rate, (double)duration);
+
+    for (size_t i = 0; i < slow.size(); i++)
+    {
+        if (slow[i] != -1)
+            close(slow[i]);
+    }
+    slow.clear();
+    slow_phase("slow_after", probe, slow, 0, 3.0);
+    return 0;
+}
+
+static bool make_addr(struct sockaddr_in *addr, const char *host, int port)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((unsigned short)port);
+    return inet_pton(AF_INET, host, &addr->sin_addr) == 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *scenario = ngx_bench_arg_str(argc, argv, "scenario", "storm");
+    const char *host = ngx_bench_arg_str(argc, argv, "host", "127.0.0.1");
+    int port = (int)ngx_bench_arg(argc, argv, "port", 8080);
+    int admin = (int)ngx_bench_arg(argc, argv, "admin", 9145);
+    long long probeRate = ngx_bench_arg(argc, argv, "probe", 100);
+
+    if (!make_addr(&g_addr, host, port) || !make_addr(&g_admin, host, admin))
+    {
+        fprintf(stderr, "host=%s不是合法的IPv4地址\n", host);
+        return 1;
+    }
+    if (probeRate <= 0)
+        probeRate = 1;
+
+    Probe probe;
+    probe.interval = 1000000000ULL / probeRate;
+    probe.stop = 0;
+    probe.lost = 0;
+    pthread_mutex_init(&probe.mutex, NULL);
+    pthread_create(&probe.handle, NULL, probe_thread, &probe);
+    // 等探测客户端收到第一个应答（服务器刚启动时worker进程可能还没准备好），之前的都不算
+    ProbeStat ps;
+    for (int i = 0; i < 50; i++)
+    {
+        sleep_ms(100);
+        pthread_mutex_lock(&probe.mutex);
+        bool ready = !probe.samples.empty();
+        pthread_mutex_unlock(&probe.mutex);
+        if (ready)
+            break;
+    }
+    sleep_ms(200);
+    probe_take(&probe, &ps);
+
+    int ret;
+    if (strcmp(scenario, "storm") == 0)
+    {
+        ret = run_storm(&probe, (int)ngx_bench_arg(argc, argv, "conns", 4000), (int)ngx_bench_arg(argc, argv, "rounds", 8),
+                        ngx_bench_arg(argc, argv, "hold", 1000), ngx_bench_arg(argc, argv, "gap", 500));
+    }
+    else if (strcmp(scenario, "slow") == 0)
+    {
+        ret = run_slow(&probe, (int)ngx_bench_arg(argc, argv, "slow", 20), (int)ngx_bench_arg(argc, argv, "rate", 500),
+                       (int)ngx_bench_arg(argc, argv, "rcvbuf", 2048), ngx_bench_arg(argc, argv, "duration", 15));
+    }
+    else
+    {
+        fprintf(stderr, "--scenario只能是storm或者slow\n");
+        ret = 1;
+    }
+
+    probe.stop = 1;
+    pthread_join(probe.handle, NULL);
+    return ret;
+}
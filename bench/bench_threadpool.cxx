@@ -0,0 +1,102 @@
+﻿// 线程池的基准测试
+// 用法：bench/bin/bench_threadpool [--ops=200000] [--threads=4] [--producers=4]
+// 消息是只有包头、crc不为0的包，CLogicSocket::threadRecvProcFunc()算作crc错马上返回，测到的基本上就是线程池本身的开销
+// pingpong：入队一条消息，等线程池处理完再入下一条，每条从inMsgRecvQueueAndSignal()到处理完的延迟分布（空闲线程被唤醒的代价）
+// throughput：--producers个线程一起往里扔，所有消息处理完为止（入队加锁、出队加锁、唤醒的争用）
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
+
+#include "ngx_global.h"
+#include "ngx_comm.h"
+#include "ngx_c_memory.h"
+#include "ngx_c_metrics.h"
+#include "ngx_bench.h"
+
+#define BENCH_NAME "threadpool"
+
+// 已经处理过的消息数，线程池每处理完一条消息加一
+static inline int64_t processed()
+{
+    return ngx_metrics_self->counters[NGX_MC_MSG_PROCESSED].load(std::memory_order_acquire);
+}
+
+// 造一条消息：消息头+包头，线程池处理完由它释放
+static char *make_msg()
+{
+    size_t lenMsgHeader = sizeof(STRUC_MSG_HEADER);
+    char *pMsg = (char *)CMemory::GetInstance()->AllocMemory(lenMsgHeader + sizeof(COMM_PKG_HEADER), true);
+    LPCOMM_PKG_HEADER pPkgHeader = (LPCOMM_PKG_HEADER)(pMsg + lenMsgHeader);
+    pPkgHeader->pkgLen = htons(sizeof(COMM_PKG_HEADER));
+    pPkgHeader->crc32 = htonl(1);
+    return pMsg;
+}
+
+// 等到处理过的消息数到target为止
+static void wait_processed(int64_t target)
+{
+    while (processed() < target)
+        sched_yield(); // 让出CPU，线程池的线程可能和本线程在同一个核上
+}
+
+struct BenchThread
+{
+    pthread_t handle;
+    CThreadPool *pPool;
+    long long ops;
+};
+
+static void *producer_thread(void *arg)
+{
+    BenchThread *t = (BenchThread *)arg;
+    for (long long i = 0; i < t->ops; i++)
+        t->pPool->inMsgRecvQueueAndSignal(make_msg());
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    long long ops = ngx_bench_arg(argc, argv, "ops", 200000);
+    int threads = (int)ngx_bench_arg(argc, argv, "threads", 4);
+    int producers = (int)ngx_bench_arg(argc, argv, "producers", 4);
+
+    CThreadPool pool;
+    if (pool.Create(threads) == false)
+    {
+        fprintf(stderr, "线程池创建失败!\n");
+        return 1;
+    }
+
+    std::vector<uint64_t> samples(ops);
+    int64_t done = processed();
+    for (long long i = 0; i < ops; i++)
+    {
+        char *pMsg = make_msg();
+        uint64_t start = ngx_bench_nsec();
+        pool.inMsgRecvQueueAndSignal(pMsg);
+        wait_processed(++done);
+        samples[i] = ngx_bench_nsec() - start;
+    }
+    ngx_bench_report_pct(BENCH_NAME, "pingpong", threads, &samples[0], ops);
+
+    std::vector<BenchThread> vt(producers);
+    long long per = ops / producers;
+    uint64_t start = ngx_bench_nsec();
+    for (int i = 0; i < producers; i++)
+    {
+        vt[i].pPool = &pool;
+        vt[i].ops = per;
+        pthread_create(&vt[i].handle, NULL, producer_thread, &vt[i]);
+    }
+    for (int i = 0; i < producers; i++)
+        pthread_join(vt[i].handle, NULL);
+    wait_processed(done + per * producers);
+    ngx_bench_report(BENCH_NAME, "throughput", threads, per * producers, ngx_bench_nsec() - start);
+
+    pool.StopAll();
+    return 0;
+}
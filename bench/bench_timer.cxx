@@ -0,0 +1,103 @@
+﻿// 时间队列（心跳超时检测用的multimap）的基准测试
+// 用法：bench/bin/bench_timer [--max=1000000] [--delops=100]
+// 队列长度从1万开始，每次乘10，到--max为止，每个长度测：
+// insert_N：AddToTimerQueue()把N个连接依次加进去，就是N个用户连入时做的事
+// delete_N：队列里有N项时，DeleteFromTimerQueue()随机删掉--delops个连接，就是用户断开时做的事（它要遍历整个队列，所以次数不宜多）
+// expire_N：N项全部到期，像ServerTimerQueueMonitorThread()那样在锁内一项一项GetOverTimeTimer()取出来（Sock_TimeOutKick=0时还要重新加回去）
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+
+#include "ngx_global.h"
+#include "ngx_c_socket.h"
+#include "ngx_c_memory.h"
+#include "ngx_c_lockmutex.h"
+#include "ngx_bench.h"
+
+#define BENCH_NAME "timer"
+
+// CSocket的友元，时间队列相关的成员函数都是私有的
+class CSocketBench
+{
+public:
+    // 只做时间队列用到的那部分初始化：读配置（没有配置文件就是缺省值）、初始化互斥量，不开监听端口、不起线程
+    static void Init(CSocket *pSocket)
+    {
+        pSocket->ReadConf();
+        pthread_mutex_init(&pSocket->m_timequeueMutex, NULL);
+    }
+    static void Add(CSocket *pSocket, lpngx_connection_t pConn) { pSocket->AddToTimerQueue(pConn); }
+    static void Delete(CSocket *pSocket, lpngx_connection_t pConn) { pSocket->DeleteFromTimerQueue(pConn); }
+    // 取出所有到期的项，返回取出的个数
+    static long long ExpireAll(CSocket *pSocket, time_t cur_time)
+    {
+        CMemory *p_memory = CMemory::GetInstance();
+        LPSTRUC_MSG_HEADER ptmp;
+        long long n = 0;
+        CLock lock(&pSocket->m_timequeueMutex);
+        while ((ptmp = pSocket->GetOverTimeTimer(cur_time)) != NULL)
+        {
+            p_memory->FreeMemory(ptmp); // 服务器里是procPingTimeOutChecking()释放
+            ++n;
+        }
+        return n;
+    }
+    static void Clear(CSocket *pSocket)
+    {
+        CLock lock(&pSocket->m_timequeueMutex);
+        pSocket->clearAllFromTimerQueue();
+    }
+    static size_t Size(CSocket *pSocket) { return pSocket->m_timerQueuemap.size(); }
+};
+
+int main(int argc, char **argv)
+{
+    long long maxn = ngx_bench_arg(argc, argv, "max", 1000000);
+    long long delops = ngx_bench_arg(argc, argv, "delops", 100);
+
+    CSocketBench::Init(&g_socket);
+
+    // 连接只用到地址和iCurrsequence，但是为了和服务器里一样（每个连接在队列中各有一项），每项用一个单独的连接
+    std::vector<ngx_connection_t> conns(maxn);
+    for (long long i = 0; i < maxn; i++)
+        conns[i].GetOneToUse();
+
+    srand(12345);
+    char name[32];
+    for (long long n = 10000; n <= maxn; n *= 10)
+    {
+        uint64_t start = ngx_bench_nsec();
+        for (long long i = 0; i < n; i++)
+            CSocketBench::Add(&g_socket, &conns[i]);
+        snprintf(name, sizeof(name), "insert_%lld", n);
+        ngx_bench_report(BENCH_NAME, name, 1, n, ngx_bench_nsec() - start);
+
+        // 删掉的再加回去，保持队列长度为n，加回去的时间不算
+        long long dels = (delops < n) ? delops : n;
+        uint64_t elapsed = 0;
+        for (long long i = 0; i < dels; i++)
+        {
+            lpngx_connection_t pConn = &conns[(((long long)rand() << 16) ^ rand()) % n];
+            start = ngx_bench_nsec();
+            CSocketBench::Delete(&g_socket, pConn);
+            elapsed += ngx_bench_nsec() - start;
+            CSocketBench::Add(&g_socket, pConn);
+        }
+        snprintf(name, sizeof(name), "delete_%lld", n);
+        ngx_bench_report(BENCH_NAME, name, 1, dels, elapsed);
+
+        // 当前时间往后推一天，所有项都到期
+        start = ngx_bench_nsec();
+        long long expired = CSocketBench::ExpireAll(&g_socket, time(NULL) + 86400);
+        snprintf(name, sizeof(name), "expire_%lld", n);
+        ngx_bench_report(BENCH_NAME, name, 1, expired, ngx_bench_nsec() - start);
+
+        if (expired != n)
+            fprintf(stderr, "队列长度%lld，到期的却有%lld项!\n", n, expired);
+        CSocketBench::Clear(&g_socket);
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+﻿// 基准测试程序公用的函数声明
+#ifndef __NGX_BENCH_H__
+#define __NGX_BENCH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 取得单调时钟的纳秒数，用于计时
+uint64_t ngx_bench_nsec();
+
+// 取命令行参数：形如 --name=value，找不到返回def
+long long ngx_bench_arg(int argc, char **argv, const char *name, long long def);
+
+// 取字符串形式的命令行参数：形如 --name=value，找不到返回def
+const char *ngx_bench_arg_str(int argc, char **argv, const char *name, const char *def);
+
+// 输出一条测试结果，一行一个JSON对象，方便脚本收集并和以前的结果比较
+// bench：测试程序名，name：测试项目名，threads：线程数，ops：总操作次数，nsec：总耗时(纳秒)
+void ngx_bench_report(const char *bench, const char *name, int threads, uint64_t ops, uint64_t nsec);
+
+// 输出一条延迟分布的测试结果，格式同上，另外带上p50/p90/p99/p999/max（纳秒）
+// samples：每次操作的耗时(纳秒)，共n个，函数内会把它排序
+void ngx_bench_report_pct(const char *bench, const char *name, int threads, uint64_t *samples, size_t n);
+
+#endif
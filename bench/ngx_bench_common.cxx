@@ -0,0 +1,89 @@
+﻿// 基准测试程序公用的代码
+// 服务器的目标文件里引用了nginx.cxx中定义的全局量，基准测试程序不链接nginx.o，所以这些全局量在这里定义一份
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+
+#include "ngx_global.h"
+#include "ngx_bench.h"
+
+size_t g_argvneedmem = 0;
+size_t g_envneedmem = 0;
+int g_os_argc;
+char **g_os_argv;
+char *g_binary_path = NULL;
+char *gp_envmem = NULL;
+int g_daemonized = 0;
+
+CLogicSocket g_socket;
+CThreadPool g_threadpool;
+CThreadPool g_cpupool;
+
+pid_t ngx_pid;
+pid_t ngx_parent;
+int ngx_process;
+int g_stopEvent = 0;
+
+sig_atomic_t ngx_working_subprocess = 0;
+sig_atomic_t ngx_reap;
+sig_atomic_t ngx_reconfigure;
+sig_atomic_t ngx_quit;
+sig_atomic_t ngx_noaccept;
+sig_atomic_t ngx_change_binary;
+pid_t ngx_new_binary = 0;
+
+uint64_t ngx_bench_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+long long ngx_bench_arg(int argc, char **argv, const char *name, long long def)
+{
+    const char *p = ngx_bench_arg_str(argc, argv, name, NULL);
+    return (p != NULL) ? atoll(p) : def;
+}
+
+const char *ngx_bench_arg_str(int argc, char **argv, const char *name, const char *def)
+{
+    size_t len = strlen(name);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--", 2) == 0 && strncmp(argv[i] + 2, name, len) == 0 && argv[i][2 + len] == '=')
+        {
+            return argv[i] + 3 + len;
+        }
+    }
+    return def;
+}
+
+void ngx_bench_report(const char *bench, const char *name, int threads, uint64_t ops, uint64_t nsec)
+{
+    double nsPerOp = ops ? (double)nsec / (double)ops : 0.0;
+    double opsPerSec = nsec ? (double)ops * 1e9 / (double)nsec : 0.0;
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",\"threads\":%d,\"ops\":%llu,\"ns\":%llu,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f}\n",
+           bench, name, threads, (unsigned long long)ops, (unsigned long long)nsec, nsPerOp, opsPerSec);
+    fflush(stdout);
+}
+
+void ngx_bench_report_pct(const char *bench, const char *name, int threads, uint64_t *samples, size_t n)
+{
+    if (n == 0)
+        return;
+    std::sort(samples, samples + n);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; i++)
+        sum += samples[i];
+    // 取第q分位的值：排好序后下标为q*n的那个
+#define PCT(q) ((unsigned long long)samples[std::min(n - 1, (size_t)((q) * (double)n))])
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",\"threads\":%d,\"ops\":%llu,\"ns\":%llu,\"ns_per_op\":%.2f,"
+           "\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}\n",
+           bench, name, threads, (unsigned long long)n, (unsigned long long)sum, (double)sum / (double)n,
+           PCT(0.5), PCT(0.9), PCT(0.99), PCT(0.999), (unsigned long long)samples[n - 1]);
+#undef PCT
+    fflush(stdout);
+}
@@ -0,0 +1,151 @@
+#!/bin/bash
+# 发布版本的PGO流水线，同时和其他编译方式比较吞吐量：
+#   1. 依次从头编译：debug（缺省的，不优化）、-O2、-O2+LTO，各留一份可执行文件
+#   2. 插桩版本（-O2+LTO+PGO=gen）起一个服务器，用bench_load按线上的请求比例（心跳80%、注册10%、登录10%）压一段时间，
+#      优雅退出时master、worker进程都把运行数据写到pgo/profile下
+#   3. 用运行数据重新编译（-O2+LTO+PGO=use），这就是最终的发布版本，留在根目录的nginx和app/link_obj下
+#   4. 每个版本起一个专用的服务器，用同样的压力各测两种请求：
+#      ping：只有心跳包（网络收发、锁、CRC），压到处理不过来之前服务器就开始踢积压的连接了，所以压力固定在处理得过来的水平，
+#            看服务器进程（master+worker）每个请求用了多少CPU时间（cpu_us_per_req）
+#      hash：只有注册、登录（密码hash），压力给到耗CPU的线程池处理不过来，看每秒成功处理了多少个（ops_per_sec，回复服务器忙的不算）
+# 用法：在根目录执行 make -s pgo > pgo.json，或者 bench/pgo.sh > pgo.json
+#   环境变量：TRAIN（训练秒数，缺省20）、DURATION（每项测多少秒，缺省10）、PING_RATE（缺省30000）、HASH_RATE（缺省2000）
+#            REUSE=以前跑过的临时目录：不再编译，直接用那里的各个版本重新比较一遍
+# 结果每行一个bench_load的JSON对象，前边加上"build"（debug、o2、lto、pgo），后边加上"cpu_us_per_req"；人看的对比表打印到标准错误
+# 服务器的配置和bench/scenarios.sh一样在nginx.conf的基础上改：前台运行、关掉Flood攻击检测和按IP的限制（客户端都在本机）、端口避开正在运行的服务器
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PORT=${PORT:-18080}
+ADMIN=${ADMIN:-19145}
+TRAIN=${TRAIN:-20}
+DURATION=${DURATION:-10}
+PING_RATE=${PING_RATE:-30000}
+HASH_RATE=${HASH_RATE:-2000}
+PGO_DIR="$ROOT/pgo/profile"
+DIR=${REUSE:-$(mktemp -d /tmp/ngx_pgo.XXXXXX)}
+PID=
+
+stop_server() {
+	if [ -n "$PID" ]; then
+		kill -QUIT "$PID" 2>/dev/null || true
+		wait "$PID" 2>/dev/null || true
+		PID=
+	fi
+}
+trap stop_server EXIT
+
+# 起一个服务器，参数是可执行文件
+start_server() {
+	rm -rf "$DIR/run"
+	mkdir -p "$DIR/run"
+	sed -e "s/^Daemon *=.*/Daemon = 0/" \
+		-e "s/^Sock_FloodAttackKickEnable *=.*/Sock_FloodAttackKickEnable = 0/" \
+		-e "s/^Sock_IpMaxConns *=.*/Sock_IpMaxConns = 0/" \
+		-e "s/^Sock_IpAcceptRate *=.*/Sock_IpAcceptRate = 0/" \
+		-e "s/^ListenPortCount *=.*/ListenPortCount = 1/" \
+		-e "s/^ListenPort0 *=.*/ListenPort0 = $PORT/" \
+		-e "s/^AdminPort *=.*/AdminPort = $ADMIN/" \
+		"$ROOT/nginx.conf" > "$DIR/run/nginx.conf"
+	cp "$1" "$DIR/run/nginx"
+	(cd "$DIR/run" && exec ./nginx > nginx.out 2>&1) &
+	PID=$!
+	# 等管理端口能连上
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		sleep 0.5
+		if (exec 3<>/dev/tcp/127.0.0.1/$ADMIN) 2>/dev/null; then
+			sleep 1 # worker进程初始化时还要sleep(1)
+			return 0
+		fi
+	done
+	echo "服务器没有启动起来，见$DIR/run/nginx.out" >&2
+	exit 1
+}
+
+# 从头编译一遍，参数传给make，编译的输出在临时目录的build.log中
+build() {
+	echo "编译：make $*" >&2
+	make -C "$ROOT" clean >> "$DIR/build.log" 2>&1
+	make -C "$ROOT" "$@" >> "$DIR/build.log" 2>&1 || { echo "编译失败，见$DIR/build.log" >&2; exit 1; }
+}
+
+# 服务器的master、worker进程一共用了多少CPU时间（时钟滴答数，包括所有线程）
+server_cpu() {
+	local total=0 p
+	for p in $PID $(ps -o pid= --ppid $PID); do
+		# /proc/pid/stat的进程名中可能有空格，从最后一个')'后边数：utime、stime是第12、13个字段
+		total=$((total + $(sed 's/.*) //' /proc/$p/stat | awk '{print $12 + $13}')))
+	done
+	echo $total
+}
+
+# 压一个服务器，参数：版本名、请求种类名、bench_load的参数...
+# 不要预热（--warmup=0），CPU时间是整个压测期间的，要和发出去的请求数对得上
+load() {
+	local name=$1 kind=$2
+	shift 2
+	local cpu0=$(server_cpu)
+	local line=$("$DIR/bench_load" --port=$PORT --conns=64 --threads=2 --warmup=0 "$@" 2>/dev/null | grep '"case":"total"')
+	local cpu=$(($(server_cpu) - cpu0))
+	local sent=$(echo "$line" | sed 's/.*"sent":\([0-9]*\).*/\1/')
+	local us=$(awk -v c=$cpu -v t=$(getconf CLK_TCK) -v n=$sent 'BEGIN{ printf "%.2f", (n > 0 ? c * 1000000 / t / n : 0) }')
+	echo "$line" | sed -e "s/^{/{\"build\":\"$name\",/" -e "s/\"case\":\"total\"/\"case\":\"$kind\"/" -e "s/}$/,\"cpu_us_per_req\":$us}/"
+}
+
+echo "临时目录：$DIR" >&2
+
+if [ -z "$REUSE" ]; then
+
+# 1. 不用PGO的几种编译方式，bench_load随便用哪个版本的目标文件编译都一样，跟着debug版本编译一份
+build
+cp "$ROOT/nginx" "$DIR/nginx.debug"
+make -C "$ROOT" bench >> "$DIR/build.log" 2>&1 || { echo "编译bench失败，见$DIR/build.log" >&2; exit 1; }
+cp "$ROOT/bench/bin/bench_load" "$DIR/bench_load"
+build DEBUG=false
+cp "$ROOT/nginx" "$DIR/nginx.o2"
+build DEBUG=false LTO=true
+cp "$ROOT/nginx" "$DIR/nginx.lto"
+
+# 2. 插桩版本，训练
+rm -rf "$PGO_DIR"
+build DEBUG=false LTO=true PGO=gen
+echo "训练：插桩版本压$TRAIN秒" >&2
+start_server "$ROOT/nginx"
+"$DIR/bench_load" --port=$PORT --conns=64 --threads=2 --rate=5000 --duration=$TRAIN --warmup=0 > /dev/null 2>&1
+stop_server
+if [ -z "$(ls "$PGO_DIR" 2>/dev/null)" ]; then
+	echo "$PGO_DIR下没有运行数据" >&2
+	exit 1
+fi
+
+# 3. 用运行数据重新编译
+build DEBUG=false LTO=true PGO=use
+cp "$ROOT/nginx" "$DIR/nginx.pgo"
+
+fi
+rm -f "$DIR/result.json"
+
+# 4. 比较
+for b in debug o2 lto pgo; do
+	echo "测试：$b" >&2
+	start_server "$DIR/nginx.$b"
+	load $b ping --rate=$PING_RATE --duration=$DURATION --ping=100 --register=0 --login=0 | tee -a "$DIR/result.json"
+	load $b hash --rate=$HASH_RATE --duration=$DURATION --ping=0 --register=50 --login=50 | tee -a "$DIR/result.json"
+	stop_server
+done
+
+# 人看的对比表：每秒成功处理的请求数、每个请求的CPU时间，以及它们相对debug版本的倍数
+echo >&2
+printf "%-6s %-6s %12s %8s %14s %8s %12s\n" build case ops_per_sec x_debug cpu_us_per_req x_debug p99_us >&2
+declare -A base_ops base_cpu
+while read -r line; do
+	b=$(echo "$line" | sed 's/.*"build":"\([^"]*\)".*/\1/')
+	c=$(echo "$line" | sed 's/.*"case":"\([^"]*\)".*/\1/')
+	ops=$(echo "$line" | sed 's/.*"ops_per_sec":\([0-9.]*\).*/\1/')
+	cpu=$(echo "$line" | sed 's/.*"cpu_us_per_req":\([0-9.]*\).*/\1/')
+	p99=$(echo "$line" | sed 's/.*"lat_us":{[^}]*"p99":\([0-9.]*\).*/\1/')
+	[ -z "${base_ops[$c]}" ] && base_ops[$c]=$ops && base_cpu[$c]=$cpu
+	printf "%-6s %-6s %12s %8s %14s %8s %12s\n" "$b" "$c" "$ops" \
+		"$(awk -v a="$ops" -v b="${base_ops[$c]}" 'BEGIN{ if (b > 0) printf "%.2f", a / b; else print "-" }')" "$cpu" \
+		"$(awk -v a="$cpu" -v b="${base_cpu[$c]}" 'BEGIN{ if (b > 0) printf "%.2f", a / b; else print "-" }')" "$p99" >&2
+done < "$DIR/result.json"
@@ -0,0 +1,60 @@
+#!/bin/bash
+# 在本机回环上依次跑重连风暴、慢客户端两个场景，每个场景前重新启动一个专用的服务器（风暴留下的待回收连接要150秒才回收，会影响后边的场景）
+# 服务器的配置在nginx.conf的基础上改：前台运行、关掉Flood攻击检测和按IP的限制（客户端都在本机）、端口避开正在运行的服务器、发送缓冲区固定为8192字节（慢客户端才能很快堵上），
+# 其他配置项（连接数上限、回收等待时间等）和线上一样
+# 用法：先 make bench，然后 bench/scenarios.sh [nginx可执行文件] > scenarios.json
+# 结果每行一个JSON对象，见bench_scenario.cxx开头的说明；服务器的输出留在临时目录中，路径打印到标准错误
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BIN=${1:-$ROOT/nginx}
+PORT=${PORT:-18080}
+ADMIN=${ADMIN:-19145}
+SCENARIO="$ROOT/bench/bin/bench_scenario"
+DIR=$(mktemp -d /tmp/ngx_scenarios.XXXXXX)
+PID=
+
+stop_server() {
+	if [ -n "$PID" ]; then
+		kill -QUIT "$PID" 2>/dev/null || true
+		wait "$PID" 2>/dev/null || true
+		PID=
+	fi
+}
+trap stop_server EXIT
+
+start_server() {
+	rm -rf "$DIR/run"
+	mkdir -p "$DIR/run"
+	sed -e "s/^Daemon *=.*/Daemon = 0/" \
+		-e "s/^Sock_FloodAttackKickEnable *=.*/Sock_FloodAttackKickEnable = 0/" \
+		-e "s/^Sock_IpMaxConns *=.*/Sock_IpMaxConns = 0/" \
+		-e "s/^Sock_IpAcceptRate *=.*/Sock_IpAcceptRate = 0/" \
+		-e "s/^Sock_SendBufSize *=.*/Sock_SendBufSize = 8192/" \
+		-e "s/^ListenPortCount *=.*/ListenPortCount = 1/" \
+		-e "s/^ListenPort0 *=.*/ListenPort0 = $PORT/" \
+		-e "s/^AdminPort *=.*/AdminPort = $ADMIN/" \
+		"$ROOT/nginx.conf" > "$DIR/run/nginx.conf"
+	cp "$BIN" "$DIR/run/nginx"
+	(cd "$DIR/run" && exec ./nginx > nginx.out 2>&1) &
+	PID=$!
+	# 等管理端口能连上
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		sleep 0.5
+		if (exec 3<>/dev/tcp/127.0.0.1/$ADMIN) 2>/dev/null; then
+			return 0
+		fi
+	done
+	echo "服务器没有启动起来，见$DIR/run/nginx.out" >&2
+	exit 1
+}
+
+echo "临时目录：$DIR" >&2
+
+start_server
+"$SCENARIO" --scenario=storm --port=$PORT --admin=$ADMIN
+stop_server
+
+start_server
+"$SCENARIO" --scenario=slow --port=$PORT --admin=$ADMIN
+stop_server
@@ -2,8 +2,23 @@
 CC = g++ -std=c++11 -g 
 VERSION = debug
 else
-CC = g++ -std=c++11
+# 发布版本也带-g，不影响优化，出了问题还能看调用栈；编译和链接用的是同一个$(CC)，LTO、PGO的选项链接时也要有
+CC = g++ -std=c++11 -O2 -g
 VERSION = release
+ifeq ($(LTO),true)
+CC += -flto=auto
+VERSION := $(VERSION)+lto
+endif
+ifeq ($(PGO),gen)
+# worker进程里是多线程的，计数要用原子操作，否则数据不准
+CC += -fprofile-generate=$(PGO_DIR) -fprofile-update=atomic
+VERSION := $(VERSION)+pgo-gen
+endif
+ifeq ($(PGO),use)
+# 压测没走到的文件没有数据，照常编译就是了
+CC += -fprofile-use=$(PGO_DIR) -fprofile-correction -Wno-missing-profile
+VERSION := $(VERSION)+pgo
+endif
 endif
 
 SRCS = $(wildcard *.cxx)
@@ -11,3 +11,11 @@ BUILD_DIR = $(BUILD_ROOT)/signal/ \
 
 export DEBUG = true
 
+# 发布版本（DEBUG = false，-O2）另外的优化方式，在命令行上给，一般由根目录的 make release、make pgo 设置，换方式前要先make clean
+#   LTO = true    链接时优化：各目录是分别编译的，不开它的话CLock、CCRC32::Get_CRC()、sendproc()这些跨文件的调用没法内联
+#   PGO = gen     插桩版本，进程退出时把各个分支、函数的执行次数写到PGO_DIR下
+#   PGO = use     用PGO_DIR下收集到的数据重新编译
+export LTO ?= false
+export PGO ?=
+export PGO_DIR ?= $(BUILD_ROOT)/pgo/profile
+
@@ -0,0 +1,271 @@
+﻿// 收包状态机（CSocket::ngx_recv_advance()）的模糊测试
+// 入口是libFuzzer约定的LLVMFuzzerTestOneInput()，一个输入 = 1个字节的拆包方式 + 客户端发来的字节流
+//   拆包方式：低2位 0：每次都给够irecvlen（最大的读）  1：每次1个字节  2：1..irecvlen随机  3：1..16随机，高6位是随机数种子
+// 字节流按recv()的样子分段拷进precvbuf喂给状态机，同时用一个最简单的参考实现（按包头长度切）算出应该收到哪些包、在哪里断开，两边对不上就abort()
+// 每一步检查：irecvlen > 0，precvbuf落在dataHeadInfo或者这个包的内存里，收完的包消息头填得对；内存泄漏由ASan检查
+// 用法：
+//   make fuzz 用g++加ASan、UBSan编译，带一个简单的main()：
+//     fuzz/bin/ngx_fuzz_parser 样本文件或目录...           重放样本
+//     fuzz/bin/ngx_fuzz_parser --runs=100000 [--seed=1]    随机生成字节流（合法包中间夹着长度不对的包头、截断的包）
+//   make fuzz FUZZ_ENGINE=libfuzzer 用clang的libFuzzer驱动（覆盖率引导）：
+//     fuzz/bin/ngx_fuzz_parser -max_len=70000 语料目录
+// 语料目录里的文件也可以交给bench/bin/bench_parser --corpus=目录 测收包的速度
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+
+#include "ngx_global.h"
+#include "ngx_comm.h"
+#include "ngx_c_socket.h"
+#include "ngx_c_memory.h"
+#include "ngx_bench.h"
+
+// CSocket的友元，读配置项、收包状态机都是私有的
+class CSocketBench
+{
+public:
+    // 没有配置文件，配置项全是缺省值（Flood攻击检测不开）
+    static void Init(CSocket *pSocket) { pSocket->ReadConf(); }
+    static bool Advance(CSocket *pSocket, lpngx_connection_t pConn, size_t reco)
+    {
+        bool isflood = false;
+        return pSocket->ngx_recv_advance(pConn, reco, isflood);
+    }
+};
+
+// 收完整的包不入线程池，检查消息头后把包头+包体记下来
+class CFuzzSocket : public CSocket
+{
+public:
+    lpngx_connection_t m_pConn;
+    std::vector<std::string> m_pkgs;
+
+    virtual void inRecvMsgQueue(char *pMsgBuf)
+    {
+        LPSTRUC_MSG_HEADER pMsgHeader = (LPSTRUC_MSG_HEADER)pMsgBuf;
+        LPCOMM_PKG_HEADER pPkgHeader = (LPCOMM_PKG_HEADER)(pMsgBuf + sizeof(STRUC_MSG_HEADER));
+        if (pMsgHeader->pConn != m_pConn || pMsgHeader->iCurrsequence != m_pConn->iCurrsequence ||
+            pMsgHeader->iMsgCode != ntohs(pPkgHeader->msgCode))
+        {
+            fprintf(stderr, "消息头不对：msgCode=%u\n", pMsgHeader->iMsgCode);
+            abort();
+        }
+        m_pkgs.push_back(std::string((char *)pPkgHeader, ntohs(pPkgHeader->pkgLen)));
+        CMemory::GetInstance()->FreeMemory(pMsgBuf);
+    }
+};
+
+static CFuzzSocket *s_socket = NULL;
+static ngx_connection_t *s_conn = NULL;
+
+static void fuzz_init()
+{
+    s_socket = new CFuzzSocket();
+    CSocketBench::Init(s_socket);
+    s_conn = new ngx_connection_t();
+    s_socket->m_pConn = s_conn;
+}
+
+// 参考实现：按包头中的长度把字节流切成包，长度不对的包头收完就该断开（closeAt是断开时喂进去的字节数，-1表示不断开）
+static void fuzz_expect(const uint8_t *pData, size_t len, std::vector<std::string> &pkgs, long &closeAt)
+{
+    const size_t hdr = sizeof(COMM_PKG_HEADER);
+    size_t pos = 0;
+    closeAt = -1;
+    while (len - pos >= hdr)
+    {
+        size_t pkgLen = ((size_t)pData[pos] << 8) | pData[pos + 1];
+        if (pkgLen < hdr || pkgLen > _PKG_MAX_LENGTH - 1000)
+        {
+            closeAt = (long)(pos + hdr);
+            return;
+        }
+        if (len - pos < pkgLen)
+            return;
+        pkgs.push_back(std::string((const char *)pData + pos, pkgLen));
+        pos += pkgLen;
+    }
+}
+
+// 下一次喂多少字节
+static size_t fuzz_chunk(int mode, uint32_t &rnd, size_t irecvlen)
+{
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 17;
+    rnd ^= rnd << 5;
+    switch (mode)
+    {
+    case 0:
+        return irecvlen;
+    case 1:
+        return 1;
+    case 2:
+        return 1 + rnd % irecvlen;
+    default:
+        return 1 + rnd % 16;
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *pData, size_t size)
+{
+    if (size == 0)
+        return 0;
+    if (s_socket == NULL)
+        fuzz_init();
+
+    int mode = pData[0] & 3;
+    uint32_t rnd = (pData[0] >> 2) * 2654435761u + 1;
+    pData++;
+    size--;
+
+    lpngx_connection_t pConn = s_conn;
+    pConn->GetOneToUse();
+    s_socket->m_pkgs.clear();
+
+    long closeAt = -1;
+    size_t pos = 0;
+    while (pos < size)
+    {
+        // 状态机要的字节数和放的位置
+        bool inHeader = (pConn->curStat == _PKG_HD_INIT || pConn->curStat == _PKG_HD_RECVING);
+        char *pBegin = inHeader ? pConn->dataHeadInfo : pConn->precvMemPointer + sizeof(STRUC_MSG_HEADER);
+        size_t capacity = inHeader ? sizeof(COMM_PKG_HEADER) : ntohs(((LPCOMM_PKG_HEADER)pBegin)->pkgLen);
+        if (pConn->irecvlen == 0 || pConn->precvbuf < pBegin || pConn->precvbuf + pConn->irecvlen != pBegin + capacity ||
+            (!inHeader && pConn->precvMemPointer == NULL))
+        {
+            fprintf(stderr, "收包状态不对：curStat=%d irecvlen=%u offset=%zu\n", pConn->curStat, pConn->irecvlen, pos);
+            abort();
+        }
+
+        size_t n = fuzz_chunk(mode, rnd, pConn->irecvlen);
+        if (n > pConn->irecvlen)
+            n = pConn->irecvlen;
+        if (n > size - pos)
+            n = size - pos;
+        memcpy(pConn->precvbuf, pData + pos, n); // 相当于recv()
+        pos += n;
+        if (CSocketBench::Advance(s_socket, pConn, n) == false)
+        {
+            closeAt = (long)pos;
+            break;
+        }
+    }
+
+    std::vector<std::string> expect;
+    long expectCloseAt;
+    fuzz_expect(pData, size, expect, expectCloseAt);
+    if (closeAt != expectCloseAt || s_socket->m_pkgs != expect)
+    {
+        fprintf(stderr, "和参考实现不一致：断开位置%ld/%ld，收到的包%zu/%zu\n", closeAt, expectCloseAt, s_socket->m_pkgs.size(), expect.size());
+        abort();
+    }
+
+    pConn->PutOneToFree(); // 没收完的包的内存在这里释放
+    return 0;
+}
+
+#ifndef NGX_LIBFUZZER
+
+// 不用libFuzzer时的main()：重放样本文件，或者随机生成字节流
+static int fuzz_file(const char *pPath)
+{
+    struct stat st;
+    if (stat(pPath, &st) != 0)
+    {
+        fprintf(stderr, "打不开%s\n", pPath);
+        return 0;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        int count = 0;
+        DIR *pDir = opendir(pPath);
+        struct dirent *pEnt;
+        while (pDir != NULL && (pEnt = readdir(pDir)) != NULL)
+        {
+            if (pEnt->d_name[0] == '.')
+                continue;
+            count += fuzz_file((std::string(pPath) + "/" + pEnt->d_name).c_str());
+        }
+        if (pDir != NULL)
+            closedir(pDir);
+        return count;
+    }
+    FILE *fp = fopen(pPath, "rb");
+    if (fp == NULL)
+        return 0;
+    std::vector<uint8_t> buf(st.st_size);
+    size_t n = fread(buf.data(), 1, buf.size(), fp);
+    fclose(fp);
+    LLVMFuzzerTestOneInput(buf.data(), n);
+    return 1;
+}
+
+// 随机生成一个输入：若干个合法的包，偶尔夹一个长度不对的包头，最后一个包可能被截断
+static void fuzz_generate(std::vector<uint8_t> &buf, unsigned int &seed)
+{
+    buf.clear();
+    buf.push_back((uint8_t)rand_r(&seed));
+    int pkgs = rand_r(&seed) % 20;
+    for (int i = 0; i < pkgs; i++)
+    {
+        int r = rand_r(&seed) % 100;
+        size_t pkgLen;
+        if (r < 30)
+            pkgLen = sizeof(COMM_PKG_HEADER); // 只有包头，心跳包就是这样的
+        else if (r < 90)
+            pkgLen = sizeof(COMM_PKG_HEADER) + rand_r(&seed) % 2000;
+        else if (r < 95)
+            pkgLen = _PKG_MAX_LENGTH - 1000 - rand_r(&seed) % 2; // 最大长度附近
+        else
+            pkgLen = (rand_r(&seed) % 2) ? rand_r(&seed) % sizeof(COMM_PKG_HEADER) : _PKG_MAX_LENGTH - 999 + rand_r(&seed) % 36000; // 长度不对
+        size_t at = buf.size();
+        size_t fill = pkgLen < sizeof(COMM_PKG_HEADER) || pkgLen > _PKG_MAX_LENGTH - 1000 ? sizeof(COMM_PKG_HEADER) : pkgLen;
+        buf.resize(at + fill);
+        for (size_t j = at; j < buf.size(); j++)
+            buf[j] = (uint8_t)rand_r(&seed);
+        buf[at] = (uint8_t)(pkgLen >> 8);
+        buf[at + 1] = (uint8_t)pkgLen;
+    }
+    if (buf.size() > 1 && rand_r(&seed) % 4 == 0)
+        buf.resize(1 + rand_r(&seed) % (buf.size() - 1)); // 截断
+}
+
+int main(int argc, char **argv)
+{
+    long long runs = ngx_bench_arg(argc, argv, "runs", 0);
+    unsigned int seed = (unsigned int)ngx_bench_arg(argc, argv, "seed", 1);
+
+    int files = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--", 2) != 0)
+            files += fuzz_file(argv[i]);
+    }
+
+    std::vector<uint8_t> buf;
+    uint64_t bytes = 0;
+    uint64_t start = ngx_bench_nsec();
+    for (long long i = 0; i < runs; i++)
+    {
+        fuzz_generate(buf, seed);
+        bytes += buf.size();
+        LLVMFuzzerTestOneInput(buf.data(), buf.size());
+    }
+    fprintf(stderr, "重放样本%d个，随机生成%lld个（共%llu字节，%.1f秒），全部和参考实现一致\n", files, runs,
+            (unsigned long long)bytes, (ngx_bench_nsec() - start) / 1e9);
+
+    if (s_socket != NULL)
+    {
+        delete s_conn;
+        delete s_socket;
+    }
+    return 0;
+}
+
+#endif
@@ -21,6 +21,10 @@
 #include "ngx_c_slogic.h"
 #include "ngx_logiccomm.h"
 #include "ngx_c_lockmutex.h"
+#include "ngx_c_accountstore.h"
+#include "ngx_c_accountlog.h"
+#include "ngx_c_metrics.h"
+#include "ngx_probe.h"
 
 // 定义成员函数指针
 typedef bool (CLogicSocket::*handler)(lpngx_connection_t pConn,      // 连接池中连接的指针
@@ -28,26 +32,45 @@ typedef bool (CLogicSocket::*handler)(lpngx_connection_t pConn,      // 连接
                                       char *pPkgBody,                // 包体指针
                                       unsigned short iBodyLength);   // 包体长度
 
+// 消息在哪个线程池中处理
+#define MSG_POOL_NORMAL 0 // g_threadpool：处理快的消息，比如心跳包
+#define MSG_POOL_CPU 1    // g_cpupool：耗CPU的消息，比如要算密码hash的注册/登录
+
+// 消息在线程池中走哪个优先级通道，数字越小优先级越高
+#define MSG_LANE_HIGH 0   // 心跳包之类，回复晚了客户端会超时重连，反而加重负载
+#define MSG_LANE_NORMAL 1 // 一般的请求
+#define MSG_LANE_LOW 2    // 可以多等一会儿的请求，以及消息代码不认识的包
+
+// 消息处理表中的一项：处理函数 + 在哪个线程池中处理 + 走哪个通道 + 缺省的处理期限
+typedef struct
+{
+    handler pHandler;
+    int iPool;
+    int iLane;
+    int iDeadlineMs; // 消息入队后超过这么多毫秒还没开始处理，客户端多半已经超时重试了，不再处理，直接回复服务器忙；0表示不限
+} MsgHandlerItem;
+
 // 用来保存成员函数指针的数组
-static const handler statusHandler[] =
+static const MsgHandlerItem statusHandler[] =
     {
         // 数组前5个元素，保留，以备将来增加一些基本服务器功能
-        &CLogicSocket::_HandlePing, // 【0】：心跳包的实现
-        NULL,
-        NULL,
-        NULL,
-        NULL,
+        {&CLogicSocket::_HandlePing, MSG_POOL_NORMAL, MSG_LANE_HIGH, 0}, // 【0】：心跳包的实现，处理起来很便宜，不设期限
+        {NULL, MSG_POOL_NORMAL, MSG_LANE_LOW, 0},                        // 【1】：_CMD_SERVER_BUSY，只由服务器发出
+        {NULL, MSG_POOL_NORMAL, MSG_LANE_LOW, 0},
+        {NULL, MSG_POOL_NORMAL, MSG_LANE_LOW, 0},
+        {NULL, MSG_POOL_NORMAL, MSG_LANE_LOW, 0},
 
         // 开始处理具体的业务逻辑
-        &CLogicSocket::_HandleRegister, // 【5】：实现具体的注册功能
-        &CLogicSocket::_HandleLogIn,    // 【6】：实现具体的登录功能
-                                        // 其他待扩展
+        {&CLogicSocket::_HandleRegister, MSG_POOL_CPU, MSG_LANE_LOW, 3000}, // 【5】：实现具体的注册功能，新用户多等一会儿没关系
+        {&CLogicSocket::_HandleLogIn, MSG_POOL_CPU, MSG_LANE_NORMAL, 3000}, // 【6】：实现具体的登录功能，老用户登录优先于注册
+                                                                            // 其他待扩展
 
 };
-#define AUTH_TOTAL_COMMANDS sizeof(statusHandler) / sizeof(handler) // 整个命令有多少个，编译时即可知道
+#define AUTH_TOTAL_COMMANDS sizeof(statusHandler) / sizeof(MsgHandlerItem) // 整个命令有多少个，编译时即可知道
 
 CLogicSocket::CLogicSocket()
 {
+    m_iHashIterations = 4096;
 }
 
 CLogicSocket::~CLogicSocket()
@@ -56,12 +79,78 @@ CLogicSocket::~CLogicSocket()
 
 // 初始化函数【fork()子进程之前干这个事】
 // 成功返回true，失败返回false
-void CLogicSocket::Initialize()
+bool CLogicSocket::Initialize()
 {
     // 本类相关的初始化工作
-    // 根据需要扩展
-    CSocket::Initialize();
-    return;
+    // 账号存储用共享内存，必须在fork()之前分配，所有worker进程共用，worker进程重启也不丢
+    CConfig *p_config = CConfig::GetInstance();
+    int maxAccounts = p_config->GetIntDefault("AccountMaxCount", 100000); // 最多容纳多少个账号
+    int shardCount = p_config->GetIntDefault("AccountShardCount", 64);    // 分片数量
+    int iterations = p_config->GetIntDefault("AccountHashIterations", 4096); // 密码hash迭代次数
+    m_iHashIterations = (iterations > 0) ? iterations : 1;
+
+    // 各个消息的处理期限，配置文件中的MsgDeadlineMs+消息代码可以覆盖表中的缺省值
+    m_hDeadline.resize(AUTH_TOTAL_COMMANDS);
+    for (size_t i = 0; i < AUTH_TOTAL_COMMANDS; i++)
+    {
+        char strinfo[100];
+        sprintf(strinfo, "MsgDeadlineMs%d", (int)i);
+        m_hDeadline[i] = p_config->GetDurationHandle(strinfo, statusHandler[i].iDeadlineMs); // 负数按0算
+    }
+    if (CAccountStore::GetInstance()->Init(maxAccounts, shardCount) == false)
+    {
+        return false;
+    }
+    ngx_log_error_core(NGX_LOG_NOTICE, 0, "账号存储初始化成功，最多%d个账号，共享内存%uLKB!", maxAccounts,
+                       (uint64_t)(CAccountStore::GetInstance()->GetMemSize() / 1024));
+
+    // 账号日志：从快照+日志恢复账号，日志文件也在fork()之前打开，所有worker进程共用
+    if (p_config->GetIntDefault("AccountLogEnable", 0) == 1)
+    {
+        const char *pLogName = p_config->GetString("AccountLogFile");
+        const char *pSnapName = p_config->GetString("AccountSnapshotFile");
+        if (pLogName == NULL)
+            pLogName = "account.wal";
+        if (pSnapName == NULL)
+            pSnapName = "account.snap";
+        if (CAccountLog::GetInstance()->Open(pLogName, pSnapName) == false)
+        {
+            return false;
+        }
+    }
+
+    return CSocket::Initialize();
+}
+
+// 子进程中才需要执行的初始化函数
+bool CLogicSocket::Initialize_subproc()
+{
+    if (CSocket::Initialize_subproc() == false)
+    {
+        return false;
+    }
+
+    CAccountLog *p_accountlog = CAccountLog::GetInstance();
+    if (p_accountlog->IsOpen())
+    {
+        CConfig *p_config = CConfig::GetInstance();
+        int maxBatch = p_config->GetIntDefault("AccountLogMaxBatch", 1024);     // 一次组提交最多合并多少条记录
+        int groupWaitUs = p_config->GetIntDefault("AccountLogGroupWaitUs", 0);  // 提交前多等多少微秒攒记录
+        int timeoutMs = p_config->GetIntDefault("AccountLogTimeoutMs", 1000);   // 注册请求最多等多久落盘
+        if (p_accountlog->Start(maxBatch, groupWaitUs, timeoutMs) == false)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 关闭退出函数[子进程中执行]
+// 此时线程池已经停了，不会再有新的注册记录，把提交线程停掉
+void CLogicSocket::Shutdown_subproc()
+{
+    CSocket::Shutdown_subproc();
+    CAccountLog::GetInstance()->Stop();
 }
 
 // 处理收到的数据包，由线程池来调用本函数
@@ -77,6 +166,7 @@ void CLogicSocket::threadRecvProcFunc(char *pMsgBuf)
         // 没有包体，只有包头
         if (pPkgHeader->crc32 != 0) // 只有包头的crc值为0
         {
+            ngx_metrics_add(NGX_MC_CRC_ERRORS);
             return; // crc错，直接丢弃
         }
         pPkgBody = NULL;
@@ -90,7 +180,8 @@ void CLogicSocket::threadRecvProcFunc(char *pMsgBuf)
         int calccrc = CCRC32::GetInstance()->Get_CRC((unsigned char *)pPkgBody, pkglen - m_iLenPkgHeader); // 计算纯包体的crc值
         if (calccrc != pPkgHeader->crc32)                                                                  // 服务器端根据包体计算crc值，和客户端传递过来的包头中的crc32信息比较
         {
-            ngx_log_stderr(0, "CLogicSocket::threadRecvProcFunc()中CRC错误[服务器:%d/客户端:%d]，丢弃数据!", calccrc, pPkgHeader->crc32);
+            ngx_log_binary(NGX_BL_CRC_ERROR, 0, calccrc, pPkgHeader->crc32);
+            ngx_metrics_add(NGX_MC_CRC_ERRORS);
             return; // crc错，直接丢弃
         }
     }
@@ -106,17 +197,62 @@ void CLogicSocket::threadRecvProcFunc(char *pMsgBuf)
 
     if (imsgCode >= AUTH_TOTAL_COMMANDS) // 无符号数不可能<0
     {
-        ngx_log_stderr(0, "CLogicSocket::threadRecvProcFunc()中imsgCode=%d消息码不对!", imsgCode); // 这种有恶意倾向或者错误倾向的包，希望打印出来看看是谁干的
+        ngx_log_stderr_limited(0, "CLogicSocket::threadRecvProcFunc()中imsgCode=%d消息码不对!", imsgCode); // 这种有恶意倾向或者错误倾向的包，希望打印出来看看是谁干的
         return;                                                                                    // 丢弃包，恶意包或者错误包
     }
 
-    if (statusHandler[imsgCode] == NULL)
+    if (statusHandler[imsgCode].pHandler == NULL)
+    {
+        ngx_log_stderr_limited(0, "CLogicSocket::threadRecvProcFunc()中imsgCode=%d消息码找不到对应的处理函数!", imsgCode);
+        return;
+    }
+
+    // 在队列里等太久了，客户端多半已经超时重试了，再处理也是白费CPU，还会让后边的消息等得更久
+    // 直接回复服务器忙，把线程让给还来得及处理的消息，过载时有效吞吐量才不会垮掉
+    uint64_t deadlineUs = (uint64_t)ngx_conf_get(m_hDeadline[imsgCode]) * 1000;
+    if (deadlineUs != 0 && ngx_monotonic_usec() - pMsgHeader->iEnqueueTime > deadlineUs)
     {
-        ngx_log_stderr(0, "CLogicSocket::threadRecvProcFunc()中imsgCode=%d消息码找不到对应的处理函数!", imsgCode);
+        ++m_iShedMsgCount;
+        ngx_metrics_add(NGX_MC_MSG_SHED);
+        SendNoBodyPkgToClient(pMsgHeader, _CMD_SERVER_BUSY);
         return;
     }
 
-    (this->*statusHandler[imsgCode])(p_Conn, pMsgHeader, (char *)pPkgBody, pkglen - m_iLenPkgHeader);
+    NGX_PROBE3(handler_entry, p_Conn->fd, imsgCode, pMsgBuf);
+    bool bRet = (this->*statusHandler[imsgCode].pHandler)(p_Conn, pMsgHeader, (char *)pPkgBody, pkglen - m_iLenPkgHeader);
+    NGX_PROBE3(handler_return, p_Conn->fd, imsgCode, bRet);
+    return;
+}
+
+// 收到一个完整消息，按消息代码决定交给哪个线程池、走哪个通道，在epoll所在的线程中调用
+// 这里只看消息代码，包的合法性（crc等）还是在threadRecvProcFunc()中检查
+void CLogicSocket::inRecvMsgQueue(char *pMsgBuf)
+{
+    LPCOMM_PKG_HEADER pPkgHeader = (LPCOMM_PKG_HEADER)(pMsgBuf + m_iLenMsgHeader);
+    unsigned short imsgCode = ntohs(pPkgHeader->msgCode);
+
+    int iPool = MSG_POOL_NORMAL, iLane = MSG_LANE_LOW;
+    if (imsgCode < AUTH_TOTAL_COMMANDS)
+    {
+        iPool = statusHandler[imsgCode].iPool;
+        iLane = statusHandler[imsgCode].iLane;
+    }
+
+    if (iPool != MSG_POOL_CPU || g_cpupool.getThreadNum() == 0)
+    {
+        if (g_threadpool.inMsgRecvQueueAndSignal(pMsgBuf, iLane) == false)
+        {
+            CMemory::GetInstance()->FreeMemory(pMsgBuf);
+        }
+        return;
+    }
+
+    if (g_cpupool.inMsgRecvQueueAndSignal(pMsgBuf, iLane) == false)
+    {
+        // 耗CPU的消息积压太多了，与其让它排很久的队，不如马上告诉客户端服务器忙
+        SendNoBodyPkgToClient((LPSTRUC_MSG_HEADER)pMsgBuf, _CMD_SERVER_BUSY);
+        CMemory::GetInstance()->FreeMemory(pMsgBuf);
+    }
     return;
 }
 
@@ -129,13 +265,17 @@ void CLogicSocket::procPingTimeOutChecking(LPSTRUC_MSG_HEADER tmpmsg, time_t cur
     {
         lpngx_connection_t p_Conn = tmpmsg->pConn;
 
-        if (m_ifTimeOutKick == 1)
+        if (ngx_conf_get(m_hTimeOutKick) == 1)
         {
+            ngx_metrics_add(NGX_MC_PING_KICKS);
+            NGX_PROBE2(ping_kick, p_Conn->fd, p_Conn);
             zdClosesocketProc(p_Conn);
         }
-        else if ((cur_time - p_Conn->lastPingTime) > (m_iWaitTime * 3 + 10)) // 超时踢的判断标准就是每次检查的时间间隔*3，超过这个时间没发送心跳包，就踢出
+        else if ((cur_time - p_Conn->lastPingTime) > (ngx_conf_get(m_hWaitTime) / 1000 * 3 + 10)) // 超时踢的判断标准就是每次检查的时间间隔*3，超过这个时间没发送心跳包，就踢出
         {
             // 踢出去，如果此时此刻该用户正好断线，则这个socket可能立即被后续上来的连接复用，如果赶上这个点了，那么可能错踢，错踢就错踢
+            ngx_metrics_add(NGX_MC_PING_KICKS);
+            NGX_PROBE2(ping_kick, p_Conn->fd, p_Conn);
             zdClosesocketProc(p_Conn);
         }
 
@@ -167,6 +307,24 @@ void CLogicSocket::SendNoBodyPkgToClient(LPSTRUC_MSG_HEADER pMsgHeader, unsigned
     return;
 }
 
+// 把构造好的应答发给pConn，这时才加连接的互斥量：注册、登录的慢hash和写账号日志都在锁外做完，同一个连接上的ping不会被它们卡住
+// pSendBuf为NULL时发一个没有包体的iMsgCode包；连接已经断开（序号变了）就不发了
+void CLogicSocket::SendToClientLocked(lpngx_connection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char *pSendBuf, unsigned short iMsgCode)
+{
+    CLock lock(&pConn->logicPorcMutex);
+    if (pConn->iCurrsequence != pMsgHeader->iCurrsequence)
+    {
+        if (pSendBuf != NULL)
+            CMemory::GetInstance()->FreeMemory(pSendBuf);
+        return;
+    }
+    if (pSendBuf != NULL)
+        msgSend(pSendBuf);
+    else
+        SendNoBodyPkgToClient(pMsgHeader, iMsgCode);
+    return;
+}
+
 // 处理各种业务逻辑，以下为一些通用操作，不属于脚手架内容
 bool CLogicSocket::_HandleRegister(lpngx_connection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char *pPkgBody, unsigned short iBodyLength)
 {
@@ -182,8 +340,7 @@ bool CLogicSocket::_HandleRegister(lpngx_connection_t pConn, LPSTRUC_MSG_HEADER
         return false;
     }
 
-    // 凡是和本用户有关的访问都互斥，因为如果同一个客户端发送多个请求，可能会出现几个线程同时处理的情况
-    CLock lock(&pConn->logicPorcMutex); 
+    // 慢hash、写账号存储、写日志落盘都不碰连接，不加连接的互斥量（账号存储自己互斥），只有最后发应答时才加，见SendToClientLocked()
 
     // 取得了整个发送过来的数据
     LPSTRUCT_REGISTER p_RecvInfo = (LPSTRUCT_REGISTER)pPkgBody;
@@ -191,6 +348,20 @@ bool CLogicSocket::_HandleRegister(lpngx_connection_t pConn, LPSTRUC_MSG_HEADER
     p_RecvInfo->username[sizeof(p_RecvInfo->username) - 1] = 0; // 防止客户端发送过来畸形包，导致服务器直接使用这个数据出现错误
     p_RecvInfo->password[sizeof(p_RecvInfo->password) - 1] = 0; // 防止客户端发送过来畸形包，导致服务器直接使用这个数据出现错误
 
+    // 写入账号存储，用户名已存在或者账号满了，都回一个没有包体的包表示失败
+    time_t regTime = time(NULL);
+    // 密码加盐做慢hash，很耗CPU，所以注册消息在g_cpupool中处理
+    ngx_account_cred_t cred;
+    int iRet = NGX_ACCOUNT_IOERR; // 取不到随机盐也按注册失败回应答
+    // 开了账号日志时，注册记录落盘之后账号才能登录、才给客户端回成功，落盘之前别的线程、别的worker进程都登录不了这个账号
+    if (CAccountStore::MakeCredential(p_RecvInfo->password, m_iHashIterations, &cred))
+        iRet = CAccountLog::GetInstance()->RegisterAccount(p_RecvInfo->username, &cred, p_RecvInfo->iType, regTime);
+    if (iRet != NGX_ACCOUNT_OK)
+    {
+        SendToClientLocked(pConn, pMsgHeader, NULL, _CMD_REGISTER);
+        return true;
+    }
+
     // 给客户端返回数据时，一般也是返回一个结构，这个结构内容具体由客户端/服务器协商，这里就给客户端也返回同样的 STRUCT_REGISTER
     LPCOMM_PKG_HEADER pPkgHeader;
     CMemory *p_memory = CMemory::GetInstance();
@@ -207,13 +378,16 @@ bool CLogicSocket::_HandleRegister(lpngx_connection_t pConn, LPSTRUC_MSG_HEADER
     pPkgHeader->pkgLen = htons(m_iLenPkgHeader + iSendLen);        // 整个包的尺寸，包头+包体尺寸
     // 填充包体
     LPSTRUCT_REGISTER p_sendInfo = (LPSTRUCT_REGISTER)(p_sendbuf + m_iLenMsgHeader + m_iLenPkgHeader); // 跳过消息头，跳过包头，就是包体了
+    memcpy(p_sendInfo, p_RecvInfo, iSendLen);
+    p_sendInfo->iType = htonl(p_sendInfo->iType);
+    memset(p_sendInfo->password, 0, sizeof(p_sendInfo->password)); // 密码不回送
 
     // 包体内容全部确定好后，计算包体的crc32值
     pPkgHeader->crc32 = p_crc32->Get_CRC((unsigned char *)p_sendInfo, iSendLen);
     pPkgHeader->crc32 = htonl(pPkgHeader->crc32);
 
     // 发送数据包
-    msgSend(p_sendbuf);
+    SendToClientLocked(pConn, pMsgHeader, p_sendbuf, _CMD_REGISTER);
 
     return true;
 }
@@ -228,12 +402,18 @@ bool CLogicSocket::_HandleLogIn(lpngx_connection_t pConn, LPSTRUC_MSG_HEADER pMs
     {
         return false;
     }
-    CLock lock(&pConn->logicPorcMutex);
-
+    // 校验密码是慢hash，在锁外做，只有发应答时才加连接的互斥量
     LPSTRUCT_LOGIN p_RecvInfo = (LPSTRUCT_LOGIN)pPkgBody;
     p_RecvInfo->username[sizeof(p_RecvInfo->username) - 1] = 0;
     p_RecvInfo->password[sizeof(p_RecvInfo->password) - 1] = 0;
 
+    // 到账号存储中校验，用户名不存在或者密码不对，都回一个没有包体的包表示失败
+    if (CAccountStore::GetInstance()->Login(p_RecvInfo->username, p_RecvInfo->password, m_iHashIterations) != NGX_ACCOUNT_OK)
+    {
+        SendToClientLocked(pConn, pMsgHeader, NULL, _CMD_LOGIN);
+        return true;
+    }
+
     LPCOMM_PKG_HEADER pPkgHeader;
     CMemory *p_memory = CMemory::GetInstance();
     CCRC32 *p_crc32 = CCRC32::GetInstance();
@@ -246,9 +426,11 @@ bool CLogicSocket::_HandleLogIn(lpngx_connection_t pConn, LPSTRUC_MSG_HEADER pMs
     pPkgHeader->msgCode = htons(pPkgHeader->msgCode);
     pPkgHeader->pkgLen = htons(m_iLenPkgHeader + iSendLen);
     LPSTRUCT_LOGIN p_sendInfo = (LPSTRUCT_LOGIN)(p_sendbuf + m_iLenMsgHeader + m_iLenPkgHeader);
+    memcpy(p_sendInfo, p_RecvInfo, iSendLen);
+    memset(p_sendInfo->password, 0, sizeof(p_sendInfo->password));
     pPkgHeader->crc32 = p_crc32->Get_CRC((unsigned char *)p_sendInfo, iSendLen);
     pPkgHeader->crc32 = htonl(pPkgHeader->crc32);
-    msgSend(p_sendbuf);
+    SendToClientLocked(pConn, pMsgHeader, p_sendbuf, _CMD_LOGIN);
     return true;
 }
 
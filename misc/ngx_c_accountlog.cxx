@@ -0,0 +1,606 @@
+﻿// 和账号存储的预写日志(WAL)有关的代码
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "ngx_func.h"
+#include "ngx_macro.h"
+#include "ngx_c_crc32.h"
+#include "ngx_c_accountlog.h"
+
+static_assert(sizeof(ngx_account_logrec_t) == 128, "ngx_account_logrec_t must be 128 bytes");
+
+#define NGX_ACCOUNT_SNAP_BATCH 512 // 写快照时攒够这么多条记录write()一次
+
+// AppendAndWait()的返回值
+#define NGX_ACCOUNT_LOG_DURABLE 1  // 落盘了
+#define NGX_ACCOUNT_LOG_FAILED 0   // 没落盘，也不会再落盘了
+#define NGX_ACCOUNT_LOG_TIMEDOUT 2 // 等超时了，记录正在写，写完由提交线程发布账号或者放掉用户名
+
+// 写快照时用的缓冲区
+typedef struct
+{
+    int fd;
+    int count;
+    bool iferr;
+    ngx_account_logrec_t recs[NGX_ACCOUNT_SNAP_BATCH];
+} ngx_account_snapbuf_t;
+
+// 把一段数据完整写到文件中，处理write()只写了一部分的情况
+static bool ngx_write_full(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// 文件所在的目录，写到dirname中
+static void ngx_file_dir(const char *pFileName, char *dirname, size_t size)
+{
+    strncpy(dirname, pFileName, size - 1);
+    dirname[size - 1] = 0;
+    char *pSlash = strrchr(dirname, '/');
+    if (pSlash == NULL)
+        strcpy(dirname, ".");
+    else if (pSlash == dirname)
+        dirname[1] = 0;
+    else
+        *pSlash = 0;
+}
+
+// 新建、改名、删除文件以后，目录本身也要落盘，否则掉电后这些操作可能就像没发生过
+static void ngx_fsync_dir(const char *pFileName)
+{
+    char dirname[512];
+    ngx_file_dir(pFileName, dirname, sizeof(dirname));
+    int fdDir = open(dirname, O_RDONLY);
+    if (fdDir != -1)
+    {
+        fsync(fdDir);
+        close(fdDir);
+    }
+}
+
+CAccountLog::CAccountLog()
+{
+    m_bOpen = false;
+    m_szLogPrefix[0] = 0;
+    m_fdLog = -1;
+    m_iLogSize = 0;
+    m_iMaxBatch = 1024;
+    m_iGroupWaitUs = 0;
+    m_iTimeoutMs = 1000;
+    m_bStop = false;
+    m_bStarted = false;
+    pthread_mutex_init(&m_logMutex, NULL);
+    pthread_cond_init(&m_commitCond, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // 等落盘的超时用单调时钟，不受改系统时间的影响
+    pthread_cond_init(&m_durableCond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+CAccountLog::~CAccountLog()
+{
+    if (m_fdLog != -1)
+    {
+        close(m_fdLog);
+        m_fdLog = -1;
+    }
+    pthread_mutex_destroy(&m_logMutex);
+    pthread_cond_destroy(&m_commitCond);
+    pthread_cond_destroy(&m_durableCond);
+}
+
+// 填写一条注册日志记录，包括crc32
+void CAccountLog::FillRecord(lpngx_account_logrec_t pRec, const char *username, const lpngx_account_cred_t pCred, int iType, time_t regTime)
+{
+    memset(pRec, 0, sizeof(ngx_account_logrec_t));
+    pRec->magic = NGX_ACCOUNT_LOG_MAGIC;
+    pRec->op = NGX_ACCOUNT_LOG_REGISTER;
+    pRec->iType = iType;
+    pRec->regTime = regTime;
+    strncpy(pRec->username, username, NGX_ACCOUNT_NAME_LEN - 1);
+    memcpy(&pRec->cred, pCred, sizeof(ngx_account_cred_t));
+    pRec->crc32 = CCRC32::GetInstance()->Get_CRC((unsigned char *)&pRec->op, sizeof(ngx_account_logrec_t) - offsetof(ngx_account_logrec_t, op));
+}
+
+// 把一个日志/快照文件中的记录重放到账号存储中，文件用mmap()映射进来顺序读
+// 返回重放的记录条数，文件不存在返回0，出错返回-1
+// iftorn：文件中有不完整或者校验不过的记录时为true，这些记录被忽略；遇到坏记录不停下，逐字节往后找下一条完整的记录接着重放
+int CAccountLog::Replay(const char *pFileName, bool &iftorn)
+{
+    iftorn = false;
+    int fd = open(pFileName, O_RDONLY);
+    if (fd == -1)
+    {
+        if (errno == ENOENT)
+            return 0;
+        ngx_log_stderr(errno, "CAccountLog::Replay()中open(\"%s\")失败!", pFileName);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        ngx_log_stderr(errno, "CAccountLog::Replay()中fstat(\"%s\")失败!", pFileName);
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    char *pMem = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // 映射建立之后文件句柄就可以关了
+    if (pMem == MAP_FAILED)
+    {
+        ngx_log_stderr(errno, "CAccountLog::Replay()中mmap(\"%s\")失败!", pFileName);
+        return -1;
+    }
+    madvise(pMem, st.st_size, MADV_SEQUENTIAL);
+
+    CAccountStore *p_store = CAccountStore::GetInstance();
+    CCRC32 *p_crc32 = CCRC32::GetInstance();
+    size_t size = st.st_size;
+    size_t off = 0;
+    int count = 0;
+    ngx_account_logrec_t rec;
+
+    while (off + sizeof(ngx_account_logrec_t) <= size)
+    {
+        // 跳过坏记录以后off不一定是128的整数倍，拷出来再看，不直接按结构体访问
+        uint32_t magic;
+        memcpy(&magic, pMem + off, sizeof(magic));
+        if (magic == NGX_ACCOUNT_LOG_MAGIC)
+        {
+            memcpy(&rec, pMem + off, sizeof(rec));
+            if (rec.crc32 != p_crc32->Get_CRC((unsigned char *)&rec.op, sizeof(ngx_account_logrec_t) - offsetof(ngx_account_logrec_t, op)))
+                magic = 0;
+        }
+        if (magic != NGX_ACCOUNT_LOG_MAGIC)
+        {
+            iftorn = true; // 写了一半的记录，往后一个字节接着找
+            ++off;
+            continue;
+        }
+        off += sizeof(ngx_account_logrec_t);
+
+        if (rec.op == NGX_ACCOUNT_LOG_REGISTER)
+        {
+            rec.username[NGX_ACCOUNT_NAME_LEN - 1] = 0;
+            if (p_store->Register(rec.username, &rec.cred, rec.iType, (time_t)rec.regTime, false) == NGX_ACCOUNT_FULL)
+            {
+                // 继续往下走的话新快照会丢掉装不下的账号，只能让程序退出，调大AccountMaxCount后再启动
+                ngx_log_stderr(0, "CAccountLog::Replay()中重放\"%s\"时账号存储已满，请调大AccountMaxCount!", pFileName);
+                munmap(pMem, st.st_size);
+                return -1;
+            }
+            ++count;
+        }
+    }
+    if (off < size)
+        iftorn = true; // 最后一条记录没写完整
+    munmap(pMem, st.st_size);
+    return count;
+}
+
+// 遍历账号存储时的回调，把一个账号写到快照缓冲区中
+void CAccountLog::SnapshotOneAccount(lpngx_account_t pAccount, void *arg)
+{
+    ngx_account_snapbuf_t *pBuf = (ngx_account_snapbuf_t *)arg;
+    if (pBuf->iferr)
+        return;
+    FillRecord(&pBuf->recs[pBuf->count++], pAccount->username, &pAccount->cred, pAccount->iType, pAccount->regTime);
+    if (pBuf->count == NGX_ACCOUNT_SNAP_BATCH)
+    {
+        pBuf->iferr = !ngx_write_full(pBuf->fd, (const char *)pBuf->recs, sizeof(ngx_account_logrec_t) * pBuf->count);
+        pBuf->count = 0;
+    }
+}
+
+// 把账号存储的全部内容写成新的快照文件：先写临时文件并fsync()，再rename()覆盖旧快照，任何时候磁盘上都有一份完整的快照
+bool CAccountLog::WriteSnapshot(const char *pSnapName)
+{
+    char tmpname[512];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", pSnapName);
+
+    ngx_account_snapbuf_t *pBuf = new ngx_account_snapbuf_t;
+    pBuf->fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    pBuf->count = 0;
+    pBuf->iferr = false;
+    if (pBuf->fd == -1)
+    {
+        ngx_log_stderr(errno, "CAccountLog::WriteSnapshot()中open(\"%s\")失败!", tmpname);
+        delete pBuf;
+        return false;
+    }
+
+    CAccountStore::GetInstance()->Traverse(SnapshotOneAccount, pBuf);
+    if (!pBuf->iferr && pBuf->count > 0)
+        pBuf->iferr = !ngx_write_full(pBuf->fd, (const char *)pBuf->recs, sizeof(ngx_account_logrec_t) * pBuf->count);
+    if (!pBuf->iferr && fsync(pBuf->fd) == -1)
+        pBuf->iferr = true;
+
+    bool iferr = pBuf->iferr;
+    close(pBuf->fd);
+    delete pBuf;
+    if (iferr)
+    {
+        ngx_log_stderr(errno, "CAccountLog::WriteSnapshot()中写\"%s\"失败!", tmpname);
+        return false;
+    }
+    if (rename(tmpname, pSnapName) == -1)
+    {
+        ngx_log_stderr(errno, "CAccountLog::WriteSnapshot()中rename(\"%s\")失败!", tmpname);
+        return false;
+    }
+
+    // rename()本身也要落盘，否则掉电后可能还是旧快照，而日志段却已经被删掉了
+    ngx_fsync_dir(pSnapName);
+    return true;
+}
+
+// 找出目录中现有的日志段（文件名是"前缀.序号"），按序号从小到大排好
+void CAccountLog::ListSegments(std::vector<unsigned int> &segs)
+{
+    char dirname[512];
+    ngx_file_dir(m_szLogPrefix, dirname, sizeof(dirname));
+    const char *pBase = strrchr(m_szLogPrefix, '/');
+    pBase = (pBase != NULL) ? pBase + 1 : m_szLogPrefix;
+    size_t len = strlen(pBase);
+
+    segs.clear();
+    DIR *pDir = opendir(dirname);
+    if (pDir == NULL)
+        return;
+    struct dirent *pEnt;
+    while ((pEnt = readdir(pDir)) != NULL)
+    {
+        const char *pName = pEnt->d_name;
+        if (strncmp(pName, pBase, len) != 0 || pName[len] != '.' || pName[len + 1] < '0' || pName[len + 1] > '9')
+            continue;
+        char *pEnd;
+        unsigned long n = strtoul(pName + len + 1, &pEnd, 10);
+        if (*pEnd == 0)
+            segs.push_back((unsigned int)n);
+    }
+    closedir(pDir);
+    std::sort(segs.begin(), segs.end());
+}
+
+// 新建一个日志段给本进程用，worker进程中执行；序号从1开始试，已经有了（别的worker进程、上一代进程的）就往后找
+bool CAccountLog::OpenSegment()
+{
+    char segname[512];
+    for (unsigned int n = 1;; n++)
+    {
+        snprintf(segname, sizeof(segname), "%s.%u", m_szLogPrefix, n);
+        m_fdLog = open(segname, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+        if (m_fdLog != -1)
+            break;
+        if (errno != EEXIST)
+        {
+            ngx_log_error_core(NGX_LOG_ALERT, errno, "CAccountLog::OpenSegment()中open(\"%s\")失败!", segname);
+            return false;
+        }
+    }
+    m_iLogSize = 0;
+    ngx_fsync_dir(segname); // 新文件的目录项也要落盘，否则里边的记录fdatasync()了也可能找不到
+    ngx_log_error_core(NGX_LOG_NOTICE, 0, "本进程的账号日志写到%s", segname);
+    return true;
+}
+
+// 恢复账号存储，master进程中fork()之前执行
+// 先重放快照，再按序号重放各个日志段；日志段中有内容就生成新快照，然后删掉日志段，这样日志不会无限增长，启动时的重放量也有上限
+// 平滑升级时账号存储是从老的master进程接过来的，账号都已经在里边了，什么都不重放，也不能动日志段：老的worker进程还在往各自的日志段里追加，
+// 新的worker进程用O_EXCL新建序号没用过的日志段，两代进程互不干扰，这些日志段等下次正常启动时一起合并进快照
+bool CAccountLog::Open(const char *pLogName, const char *pSnapName)
+{
+    strncpy(m_szLogPrefix, pLogName, sizeof(m_szLogPrefix) - 1);
+    m_szLogPrefix[sizeof(m_szLogPrefix) - 1] = 0;
+
+    if (CAccountStore::GetInstance()->IsInherited())
+    {
+        m_bOpen = true;
+        ngx_log_error_core(NGX_LOG_NOTICE, 0, "账号存储是从老的master进程接过来的，不重放账号日志!");
+        return true;
+    }
+
+    bool iftorn;
+    int nsnap = Replay(pSnapName, iftorn);
+    if (nsnap < 0)
+        return false;
+    if (iftorn)
+    {
+        // 快照是写完整并fsync()之后才rename()过来的，不应该出现不完整的记录
+        ngx_log_stderr(0, "CAccountLog::Open()中快照文件\"%s\"已损坏!", pSnapName);
+        return false;
+    }
+
+    std::vector<unsigned int> segs;
+    ListSegments(segs);
+    char segname[512];
+    int nlog = 0;
+    bool anytorn = false;
+    for (size_t i = 0; i < segs.size(); i++)
+    {
+        snprintf(segname, sizeof(segname), "%s.%u", m_szLogPrefix, segs[i]);
+        int n = Replay(segname, iftorn);
+        if (n < 0)
+            return false;
+        if (iftorn)
+        {
+            // 写日志的worker进程退出时正在写的那一批记录没写完整，这一批记录的注册请求都没有给客户端回应答，丢掉即可
+            ngx_log_error_core(NGX_LOG_WARN, 0, "CAccountLog::Open()中日志段\"%s\"中有不完整的记录，已忽略!", segname);
+            anytorn = true;
+        }
+        nlog += n;
+    }
+
+    if (nlog > 0 || anytorn)
+    {
+        if (WriteSnapshot(pSnapName) == false)
+            return false;
+    }
+
+    // 日志段里的内容已经全部进了快照，删掉
+    for (size_t i = 0; i < segs.size(); i++)
+    {
+        snprintf(segname, sizeof(segname), "%s.%u", m_szLogPrefix, segs[i]);
+        if (unlink(segname) == -1)
+            ngx_log_error_core(NGX_LOG_WARN, errno, "CAccountLog::Open()中unlink(\"%s\")失败!", segname);
+    }
+    if (!segs.empty())
+        ngx_fsync_dir(m_szLogPrefix);
+    m_bOpen = true;
+    ngx_log_error_core(NGX_LOG_NOTICE, 0, "账号日志恢复完成，快照%d条，%d个日志段%d条!", nsnap, (int)segs.size(), nlog);
+    return true;
+}
+
+// 启动提交线程，worker进程中执行
+// maxBatch：一次组提交最多合并这么多条记录，也就限定了一次写盘的耗时
+// groupWaitUs：提交线程被唤醒后再多等这么多微秒，多攒一些记录再提交
+// timeoutMs：注册请求最多等这么多毫秒，还没落盘就算失败
+bool CAccountLog::Start(int maxBatch, int groupWaitUs, int timeoutMs)
+{
+    m_iMaxBatch = (maxBatch > 0) ? maxBatch : 1;
+    m_iGroupWaitUs = (groupWaitUs > 0) ? groupWaitUs : 0;
+    m_iTimeoutMs = (timeoutMs > 0) ? timeoutMs : 1;
+    m_bStop = false;
+    m_pending.reserve(m_iMaxBatch);
+    if (OpenSegment() == false)
+        return false;
+
+    int err = pthread_create(&m_hCommitThread, NULL, ServerCommitThread, this);
+    if (err != 0)
+    {
+        ngx_log_stderr(err, "CAccountLog::Start()中pthread_create()失败!");
+        return false;
+    }
+    m_bStarted = true;
+    return true;
+}
+
+// 停止提交线程，线程退出前会把已经交过来的记录全部提交完
+void CAccountLog::Stop()
+{
+    if (!m_bStarted)
+        return;
+
+    pthread_mutex_lock(&m_logMutex);
+    m_bStop = true;
+    pthread_cond_signal(&m_commitCond);
+    pthread_mutex_unlock(&m_logMutex);
+
+    pthread_join(m_hCommitThread, NULL);
+    m_bStarted = false;
+    if (m_fdLog != -1)
+    {
+        close(m_fdLog);
+        m_fdLog = -1;
+    }
+}
+
+// 写一条注册日志并等待它落盘，由线程池中的线程调用
+// 同一时间有很多注册请求时，它们的记录会被提交线程合并成一次写盘，每个请求等待的时间最多是一到两次写盘的时间；
+// 磁盘卡住了也最多等m_iTimeoutMs毫秒。一批写失败了只影响这一批，后边的照常提交
+// 返回NGX_ACCOUNT_LOG_DURABLE、NGX_ACCOUNT_LOG_FAILED或NGX_ACCOUNT_LOG_TIMEDOUT
+int CAccountLog::AppendAndWait(const char *username, const lpngx_account_cred_t pCred, int iType, time_t regTime)
+{
+    ngx_account_pending_t item;
+    FillRecord(&item.rec, username, pCred, iType, regTime); // 在锁外算好crc
+    int iResult = 0;
+    item.pResult = &iResult;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += m_iTimeoutMs / 1000;
+    deadline.tv_nsec += (long)(m_iTimeoutMs % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&m_logMutex);
+    if (!m_bStarted || m_bStop)
+    {
+        pthread_mutex_unlock(&m_logMutex);
+        return NGX_ACCOUNT_LOG_FAILED;
+    }
+
+    m_pending.push_back(item);
+    pthread_cond_signal(&m_commitCond);
+
+    while (iResult == 0)
+    {
+        if (pthread_cond_timedwait(&m_durableCond, &m_logMutex, &deadline) != ETIMEDOUT || iResult != 0)
+            continue;
+
+        // 超时了：还在队列里就拿出来，就当没写过
+        for (size_t i = 0; i < m_pending.size(); i++)
+        {
+            if (m_pending[i].pResult == &iResult)
+            {
+                m_pending.erase(m_pending.begin() + i);
+                pthread_mutex_unlock(&m_logMutex);
+                return NGX_ACCOUNT_LOG_FAILED;
+            }
+        }
+        // 已经在写了，本线程不等了，结果不要再往本线程的栈上写
+        for (size_t i = 0; i < m_inflight.size(); i++)
+        {
+            if (m_inflight[i] == &iResult)
+                m_inflight[i] = NULL;
+        }
+        pthread_mutex_unlock(&m_logMutex);
+        return NGX_ACCOUNT_LOG_TIMEDOUT;
+    }
+    pthread_mutex_unlock(&m_logMutex);
+    return (iResult == 1) ? NGX_ACCOUNT_LOG_DURABLE : NGX_ACCOUNT_LOG_FAILED;
+}
+
+// 注册一个账号，由线程池中的线程调用
+// 开了账号日志时先在账号存储中占住用户名，这时别的注册请求会得到NGX_ACCOUNT_EXISTS，但登录还看不到这个账号；
+// 注册记录落盘之后才发布，落盘失败就把占住的用户名放掉；没开账号日志时直接注册
+// 等落盘超时了也返回NGX_ACCOUNT_IOERR，这时记录正在写，写成了账号照样由提交线程发布，和客户端等应答超时是一回事
+// 返回NGX_ACCOUNT_OK、NGX_ACCOUNT_EXISTS、NGX_ACCOUNT_FULL或NGX_ACCOUNT_IOERR
+int CAccountLog::RegisterAccount(const char *username, const lpngx_account_cred_t pCred, int iType, time_t regTime)
+{
+    CAccountStore *p_store = CAccountStore::GetInstance();
+    if (!IsOpen())
+        return p_store->Register(username, pCred, iType, regTime, false);
+
+    int iRet = p_store->Register(username, pCred, iType, regTime, true);
+    if (iRet != NGX_ACCOUNT_OK)
+        return iRet;
+    iRet = AppendAndWait(username, pCred, iType, regTime);
+    if (iRet == NGX_ACCOUNT_LOG_DURABLE)
+    {
+        p_store->Publish(username);
+        return NGX_ACCOUNT_OK;
+    }
+    if (iRet == NGX_ACCOUNT_LOG_FAILED)
+        p_store->Unregister(username);
+    return NGX_ACCOUNT_IOERR;
+}
+
+// 提交线程：每次把攒下的记录一次write()写进日志文件，再fdatasync()落盘，然后唤醒所有等待的注册线程
+void *CAccountLog::ServerCommitThread(void *threadData)
+{
+    CAccountLog *pThis = static_cast<CAccountLog *>(threadData);
+    ngx_log_thread_init(); // 本线程写日志用自己的环形缓冲区
+    CAccountStore *p_store = CAccountStore::GetInstance();
+    std::vector<ngx_account_logrec_t> batch;
+    std::vector<size_t> abandoned; // 这一批中等超时了的记录，账号由本线程发布或者放掉
+    batch.reserve(pThis->m_iMaxBatch);
+    pThis->m_inflight.reserve(pThis->m_iMaxBatch);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pThis->m_logMutex);
+        while (pThis->m_pending.empty() && !pThis->m_bStop)
+        {
+            pthread_cond_wait(&pThis->m_commitCond, &pThis->m_logMutex);
+        }
+        if (pThis->m_pending.empty()) // 要退出，并且没有要提交的了
+        {
+            pthread_mutex_unlock(&pThis->m_logMutex);
+            break;
+        }
+
+        if (pThis->m_iGroupWaitUs > 0 && (int)pThis->m_pending.size() < pThis->m_iMaxBatch && !pThis->m_bStop)
+        {
+            // 多等一小会儿，让更多的注册请求搭上这一班车
+            pthread_mutex_unlock(&pThis->m_logMutex);
+            usleep(pThis->m_iGroupWaitUs);
+            pthread_mutex_lock(&pThis->m_logMutex);
+        }
+
+        size_t n = pThis->m_pending.size();
+        if (n > (size_t)pThis->m_iMaxBatch)
+            n = pThis->m_iMaxBatch;
+        if (n == 0) // 多等的这一会儿里，队列中的记录都等超时拿走了
+        {
+            pthread_mutex_unlock(&pThis->m_logMutex);
+            continue;
+        }
+        batch.clear();
+        for (size_t i = 0; i < n; i++)
+        {
+            batch.push_back(pThis->m_pending[i].rec);
+            pThis->m_inflight.push_back(pThis->m_pending[i].pResult);
+        }
+        pThis->m_pending.erase(pThis->m_pending.begin(), pThis->m_pending.begin() + n);
+        pthread_mutex_unlock(&pThis->m_logMutex);
+
+        // 写盘期间不持有锁，新来的注册请求可以继续入队，它们会合并到下一批
+        // 上一批截断失败把日志段扔掉了，先换一个新的，换不成这一批就算失败，下一批再试
+        if (pThis->m_fdLog == -1)
+            pThis->OpenSegment();
+        size_t len = sizeof(ngx_account_logrec_t) * n;
+        bool ifok = (pThis->m_fdLog != -1);
+        if (ifok)
+            ifok = ngx_write_full(pThis->m_fdLog, (const char *)&batch[0], len) && fdatasync(pThis->m_fdLog) == 0;
+        if (ifok)
+        {
+            pThis->m_iLogSize += len;
+        }
+        else if (pThis->m_fdLog != -1)
+        {
+            ngx_log_error_core(NGX_LOG_ALERT, errno, "CAccountLog::ServerCommitThread()中写账号日志失败，这一批%d条注册失败!", (int)n);
+            // 这一批可能写进去了一部分，也可能全写进去了只是没落盘：截回写之前的长度，
+            // 否则下次启动时这些已经告诉客户端注册失败了的账号又回来了
+            if (ftruncate(pThis->m_fdLog, pThis->m_iLogSize) == -1 || fdatasync(pThis->m_fdLog) == -1)
+            {
+                ngx_log_error_core(NGX_LOG_ALERT, errno, "CAccountLog::ServerCommitThread()中截断账号日志失败，这一批%d条记录下次启动时可能还会出现!", (int)n);
+                close(pThis->m_fdLog);
+                pThis->m_fdLog = -1;
+            }
+        }
+
+        pthread_mutex_lock(&pThis->m_logMutex);
+        abandoned.clear();
+        for (size_t i = 0; i < n; i++)
+        {
+            if (pThis->m_inflight[i] != NULL)
+                *pThis->m_inflight[i] = ifok ? 1 : -1;
+            else
+                abandoned.push_back(i);
+        }
+        pThis->m_inflight.clear();
+        pthread_cond_broadcast(&pThis->m_durableCond);
+        pthread_mutex_unlock(&pThis->m_logMutex);
+
+        for (size_t i = 0; i < abandoned.size(); i++)
+        {
+            if (ifok)
+                p_store->Publish(batch[abandoned[i]].username);
+            else
+                p_store->Unregister(batch[abandoned[i]].username);
+        }
+    }
+    return (void *)0;
+}
@@ -0,0 +1,430 @@
+﻿// 和账号/会话存储有关的代码
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+
+#include "ngx_func.h"
+#include "ngx_macro.h"
+#include "ngx_c_sha256.h"
+#include "ngx_c_accountstore.h"
+
+static_assert(sizeof(ngx_account_t) == 128, "ngx_account_t must be 128 bytes");
+static_assert(sizeof(ngx_account_shard_t) <= 128, "ngx_account_shard_t too large");
+
+#define NGX_ACCOUNT_TAG_DEAD 2    // 墓碑：账号被删掉了，探测时跳过，槽位不复用；正常的tag最低位总是1，不会和它相同
+#define NGX_ACCOUNT_TAG_PENDING 2 // 和正常的tag或上这一位：用户名占住了，账号还没落盘，登录看不到
+
+#define NGX_ACCOUNT_SHM_MAGIC 0x314d48534e434341ULL // "ACCNSHM1"，布局变了要换，新版本不认老布局就不接，自己重新分配
+#define NGX_ACCOUNT_SHM_HDR_SIZE 128                // 头部占一个缓存行，分片数组从这里开始
+
+// 共享内存开头的头部：平滑升级时新的master进程按这里的尺寸接着用，不按新配置文件里的
+typedef struct
+{
+    uint64_t magic;        // NGX_ACCOUNT_SHM_MAGIC
+    uint64_t memSize;      // 共享内存总大小
+    uint32_t shardCount;   // 分片数量
+    uint32_t accountSize;  // sizeof(ngx_account_t)
+} ngx_account_shm_hdr_t;
+static_assert(sizeof(ngx_account_shm_hdr_t) <= NGX_ACCOUNT_SHM_HDR_SIZE, "ngx_account_shm_hdr_t too large");
+
+// 用户名hash值对应的正常状态的tag：最低位置1保证不为0，第1位留给状态
+static inline uint32_t ngx_account_tag(uint64_t hash)
+{
+    return ((uint32_t)(hash >> 32) | 1) & ~(uint32_t)NGX_ACCOUNT_TAG_PENDING;
+}
+
+CAccountStore::CAccountStore()
+{
+    m_pMem = NULL;
+    m_iMemSize = 0;
+    m_fd = -1;
+    m_bInherited = false;
+    m_iShardCount = 0;
+    m_pShards = NULL;
+}
+
+CAccountStore::~CAccountStore()
+{
+    // 共享内存随进程退出释放，这里只销毁master进程中的映射
+    if (m_pMem != NULL)
+    {
+        munmap(m_pMem, m_iMemSize);
+        m_pMem = NULL;
+    }
+    if (m_fd != -1)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+// 映射平滑升级时老的master进程交过来的memfd，尺寸、分片数量都按头部里记的
+// 成功返回true；对不上（老版本的布局不一样）返回false，这时fd已经关掉了，调用者自己重新分配
+bool CAccountStore::Attach(int fd)
+{
+    struct stat st;
+    ngx_account_shm_hdr_t hdr;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < NGX_ACCOUNT_SHM_HDR_SIZE || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        hdr.magic != NGX_ACCOUNT_SHM_MAGIC || hdr.memSize != (uint64_t)st.st_size || hdr.accountSize != sizeof(ngx_account_t) ||
+        hdr.shardCount == 0 || NGX_ACCOUNT_SHM_HDR_SIZE + sizeof(ngx_account_shard_t) * hdr.shardCount > hdr.memSize)
+    {
+        ngx_log_stderr(0, "CAccountStore::Attach()中老的master进程交过来的账号存储(fd=%d)不能用，重新分配!", fd);
+        close(fd);
+        return false;
+    }
+
+    m_pMem = mmap(NULL, hdr.memSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (m_pMem == MAP_FAILED)
+    {
+        ngx_log_stderr(errno, "CAccountStore::Attach()中mmap(%uL)失败，重新分配!", hdr.memSize);
+        m_pMem = NULL;
+        close(fd);
+        return false;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC); // 交接时清掉了，这里恢复
+    m_fd = fd;
+    m_iMemSize = hdr.memSize;
+    m_iShardCount = hdr.shardCount;
+    m_pShards = (lpngx_account_shard_t)((char *)m_pMem + NGX_ACCOUNT_SHM_HDR_SIZE);
+    m_bInherited = true;
+    return true;
+}
+
+// 分配共享内存并初始化各个分片，必须在fork()子进程之前调用，这样所有worker进程才能共用同一份数据
+// 平滑升级时直接接过老的master进程的共享内存，两代进程共用，尺寸按老的，maxAccounts、shardCount不起作用
+// maxAccounts：最多容纳的账号数量，决定了内存上限
+// shardCount：分片数量，会被向上调整为2的幂
+// 成功返回true，失败返回false
+bool CAccountStore::Init(unsigned int maxAccounts, unsigned int shardCount)
+{
+    if (m_pMem != NULL) // 已经初始化过
+        return true;
+
+    const char *penv = getenv(NGX_ACCOUNT_STORE_ENV);
+    if (penv != NULL)
+    {
+        int fd = atoi(penv);
+        unsetenv(NGX_ACCOUNT_STORE_ENV); // 再升级时会重新设置，不要带下去
+        if (fd >= 0 && Attach(fd))
+        {
+            ngx_log_error_core(NGX_LOG_NOTICE, 0, "账号存储接过了老的master进程的共享内存(fd=%d)，%d个分片，%d个账号!", fd, m_iShardCount, GetCount());
+            return true;
+        }
+    }
+
+    if (maxAccounts == 0)
+        maxAccounts = 1;
+    m_iShardCount = 1;
+    while (m_iShardCount < shardCount && m_iShardCount < 65536)
+        m_iShardCount <<= 1;
+
+    // 每个分片的记录数上限：平均值再留一点余量，防止hash分布不均时个别分片过早装满
+    unsigned int perShard = (maxAccounts + m_iShardCount - 1) / m_iShardCount;
+    unsigned int limit = perShard + perShard / 8 + 16;
+    // 槽位数量取2的幂，并保证装载因子不超过0.75，线性探测的平均探测长度才能足够短
+    unsigned int capacity = 16;
+    while ((uint64_t)capacity * 3 < (uint64_t)limit * 4)
+        capacity <<= 1;
+
+    size_t shardsSize = NGX_ACCOUNT_SHM_HDR_SIZE + sizeof(ngx_account_shard_t) * m_iShardCount;
+    shardsSize = (shardsSize + 4095) & ~((size_t)4095);
+    m_iMemSize = shardsSize + (size_t)capacity * sizeof(ngx_account_t) * m_iShardCount;
+
+    // 用memfd而不是匿名共享内存：平滑升级时可以把fd交给新的master进程；ftruncate()出来的是空洞，和匿名内存一样用到才分配
+    m_fd = memfd_create("ngx_account_store", MFD_CLOEXEC);
+    if (m_fd == -1 || ftruncate(m_fd, m_iMemSize) == -1)
+    {
+        ngx_log_stderr(errno, "CAccountStore::Init()中memfd_create()/ftruncate(%uL)失败!", (uint64_t)m_iMemSize);
+        return false;
+    }
+    // MAP_NORESERVE：只有真正写到的页才占用物理内存，上限配得大一些也不会一启动就吃掉全部内存
+    m_pMem = mmap(NULL, m_iMemSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, m_fd, 0);
+    if (m_pMem == MAP_FAILED)
+    {
+        ngx_log_stderr(errno, "CAccountStore::Init()中mmap(%uL)失败!", (uint64_t)m_iMemSize);
+        m_pMem = NULL;
+        return false;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED); // 锁放在共享内存里，多个worker进程之间也要互斥
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);    // worker进程持有锁时崩溃了，别的进程还能接着加锁
+
+    m_pShards = (lpngx_account_shard_t)((char *)m_pMem + NGX_ACCOUNT_SHM_HDR_SIZE);
+    for (unsigned int i = 0; i < m_iShardCount; i++)
+    {
+        lpngx_account_shard_t pShard = &m_pShards[i];
+        if (pthread_mutex_init(&pShard->mutex, &attr) != 0)
+        {
+            ngx_log_stderr(0, "CAccountStore::Init()中pthread_mutex_init()失败!");
+            pthread_mutexattr_destroy(&attr);
+            return false;
+        }
+        pShard->mask = capacity - 1;
+        pShard->count = 0;
+        pShard->limit = limit;
+        pShard->dead = 0;
+        pShard->slotsOffset = shardsSize + (uint64_t)i * capacity * sizeof(ngx_account_t); // memfd本身就是全0，全0就是空槽位
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    ngx_account_shm_hdr_t *pHdr = (ngx_account_shm_hdr_t *)m_pMem;
+    pHdr->memSize = m_iMemSize;
+    pHdr->shardCount = m_iShardCount;
+    pHdr->accountSize = sizeof(ngx_account_t);
+    pHdr->magic = NGX_ACCOUNT_SHM_MAGIC;
+    return true;
+}
+
+// 64位FNV-1a，用户名最多取NGX_ACCOUNT_NAME_LEN个字符
+uint64_t CAccountStore::Hash(const char *username)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < NGX_ACCOUNT_NAME_LEN && username[i] != 0; i++)
+    {
+        h ^= (unsigned char)username[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// 加分片锁；上一个持有者（某个worker进程）在注册/删除的中途死了，就接手这把锁
+// 槽位的tag是最后一次写上的，没写上就还是空槽位，写上了就是完整的记录，所以接手以后什么都不用修
+void CAccountStore::LockShard(lpngx_account_shard_t pShard)
+{
+    if (pthread_mutex_lock(&pShard->mutex) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&pShard->mutex);
+        ngx_log_error_core(NGX_LOG_ALERT, 0, "CAccountStore::LockShard()中分片锁的持有者已经退出，接手这把锁!");
+    }
+}
+
+// 在分片中查找用户名，不用加锁：tag用acquire读，读到了tag，用户名和凭据就是写完整了的
+// 找到了：iffind = true，返回该记录
+// 没找到：iffind = false，返回可以插入的空槽位（只在加了分片锁时才能往里写）
+// 占住了还没落盘的账号也算找到，调用者自己看tag
+lpngx_account_t CAccountStore::FindSlot(lpngx_account_shard_t pShard, uint64_t hash, const char *username, bool &iffind)
+{
+    uint32_t tag = ngx_account_tag(hash);
+    uint32_t pos = (uint32_t)(hash >> 16) & pShard->mask; // 低位已经用来选分片了，这里用中间的位
+    lpngx_account_t p;
+
+    for (;;)
+    {
+        p = &Slots(pShard)[pos];
+        uint32_t t = __atomic_load_n(&p->tag, __ATOMIC_ACQUIRE);
+        if (t == 0)
+        {
+            iffind = false;
+            return p;
+        }
+        if ((t & ~(uint32_t)NGX_ACCOUNT_TAG_PENDING) == tag && strncmp(p->username, username, NGX_ACCOUNT_NAME_LEN) == 0)
+        {
+            iffind = true;
+            return p;
+        }
+        pos = (pos + 1) & pShard->mask; // 装载因子（墓碑也算）不超过0.75，一定能找到空槽位
+    }
+}
+
+// 注册一个账号
+// ifreserve：true表示只占住用户名，别的注册请求会得到NGX_ACCOUNT_EXISTS，登录却还看不到，记录落盘之后调用Publish()，落盘失败调用Unregister()
+// 返回NGX_ACCOUNT_OK、NGX_ACCOUNT_EXISTS或NGX_ACCOUNT_FULL
+int CAccountStore::Register(const char *username, const lpngx_account_cred_t pCred, int iType, time_t regTime, bool ifreserve)
+{
+    uint64_t hash = Hash(username);
+    lpngx_account_shard_t pShard = &m_pShards[hash & (m_iShardCount - 1)];
+    bool iffind;
+    int iRet;
+
+    LockShard(pShard);
+    lpngx_account_t p = FindSlot(pShard, hash, username, iffind);
+    if (iffind)
+    {
+        iRet = NGX_ACCOUNT_EXISTS;
+    }
+    else if (pShard->count >= pShard->limit)
+    {
+        iRet = NGX_ACCOUNT_FULL;
+    }
+    else
+    {
+        strncpy(p->username, username, NGX_ACCOUNT_NAME_LEN);
+        p->username[NGX_ACCOUNT_NAME_LEN - 1] = 0;
+        memcpy(&p->cred, pCred, sizeof(ngx_account_cred_t));
+        p->iType = iType;
+        p->regTime = regTime;
+        p->lastLoginTime = 0;
+        ++pShard->count; // 先加计数，进程在下一句之前死了也只是多算一个
+        uint32_t tag = ngx_account_tag(hash) | (ifreserve ? NGX_ACCOUNT_TAG_PENDING : 0);
+        __atomic_store_n(&p->tag, tag, __ATOMIC_RELEASE); // 最后写tag，不加锁查找的线程读到tag时记录已经是完整的了
+        iRet = NGX_ACCOUNT_OK;
+    }
+    pthread_mutex_unlock(&pShard->mutex);
+    return iRet;
+}
+
+// 占住的账号已经落盘了，改成正常状态，从这以后登录才能看到它
+// 找到占住的账号返回true
+bool CAccountStore::Publish(const char *username)
+{
+    uint64_t hash = Hash(username);
+    lpngx_account_shard_t pShard = &m_pShards[hash & (m_iShardCount - 1)];
+    bool iffind;
+
+    LockShard(pShard);
+    lpngx_account_t p = FindSlot(pShard, hash, username, iffind);
+    iffind = iffind && (p->tag & NGX_ACCOUNT_TAG_PENDING) != 0;
+    if (iffind)
+        __atomic_store_n(&p->tag, ngx_account_tag(hash), __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pShard->mutex);
+    return iffind;
+}
+
+// 登录校验，不加任何锁，所有线程池中的线程、所有worker进程可以并发登录
+// 发布了的槽位中用户名和凭据不会再变，直接拿来算hash
+// iterations：用户名不存在时也按这个迭代次数空算一次hash，否则从应答快慢就能试出哪些用户名存在，一般给注册时用的迭代次数
+// 返回NGX_ACCOUNT_OK、NGX_ACCOUNT_NOTFOUND或NGX_ACCOUNT_BADPASS
+int CAccountStore::Login(const char *username, const char *password, unsigned int iterations)
+{
+    uint64_t hash = Hash(username);
+    lpngx_account_shard_t pShard = &m_pShards[hash & (m_iShardCount - 1)];
+    bool iffind;
+
+    lpngx_account_t p = FindSlot(pShard, hash, username, iffind);
+    if (!iffind || __atomic_load_n(&p->tag, __ATOMIC_ACQUIRE) != ngx_account_tag(hash)) // 还没落盘的账号当作不存在
+    {
+        ngx_account_cred_t dummy;
+        memset(&dummy, 0, sizeof(dummy));
+        dummy.iterations = (iterations > 0) ? iterations : 1;
+        CheckCredential(&dummy, password); // 结果不用，只为了花掉同样的时间
+        return NGX_ACCOUNT_NOTFOUND;
+    }
+    if (!CheckCredential(&p->cred, password))
+        return NGX_ACCOUNT_BADPASS;
+
+    // 校验期间账号可能被删掉了（注册后写日志失败）：删除只是把这个槽位改成墓碑，
+    // 同名账号再注册会放到别的槽位上，所以只要这个槽位的tag没变，校验过的就还是这个账号
+    if (__atomic_load_n(&p->tag, __ATOMIC_ACQUIRE) != ngx_account_tag(hash))
+        return NGX_ACCOUNT_NOTFOUND;
+    __atomic_store_n(&p->lastLoginTime, time(NULL), __ATOMIC_RELAXED);
+    return NGX_ACCOUNT_OK;
+}
+
+// 删除一个账号，找到并删除返回true
+// 不加锁的查找可能正在读这个槽位，所以不能挪动别的记录来补位，只把它改成墓碑，墓碑到下次启动写快照时才清掉
+bool CAccountStore::Unregister(const char *username)
+{
+    uint64_t hash = Hash(username);
+    lpngx_account_shard_t pShard = &m_pShards[hash & (m_iShardCount - 1)];
+    bool iffind;
+
+    LockShard(pShard);
+    lpngx_account_t p = FindSlot(pShard, hash, username, iffind);
+    if (iffind)
+    {
+        __atomic_store_n(&p->tag, (uint32_t)NGX_ACCOUNT_TAG_DEAD, __ATOMIC_RELEASE);
+        ++pShard->dead;
+    }
+    pthread_mutex_unlock(&pShard->mutex);
+    return iffind;
+}
+
+// 遍历所有账号，对每个账号调用pfn，不加锁，遍历期间新注册的账号可能遍历到也可能遍历不到，占住了还没落盘的不算
+void CAccountStore::Traverse(void (*pfn)(lpngx_account_t pAccount, void *arg), void *arg)
+{
+    for (unsigned int i = 0; i < m_iShardCount; i++)
+    {
+        lpngx_account_shard_t pShard = &m_pShards[i];
+        lpngx_account_t pSlots = Slots(pShard);
+        for (uint32_t j = 0; j <= pShard->mask; j++)
+        {
+            uint32_t t = __atomic_load_n(&pSlots[j].tag, __ATOMIC_ACQUIRE);
+            if ((t & 3) == 1) // 正常状态
+                pfn(&pSlots[j], arg);
+        }
+    }
+}
+
+// 当前账号数量，不加锁，只用于统计显示
+unsigned int CAccountStore::GetCount()
+{
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < m_iShardCount; i++)
+    {
+        n += m_pShards[i].count - m_pShards[i].dead;
+    }
+    return n;
+}
+
+// 从内核取len个随机字节：先用getrandom()，内核太老没有这个系统调用时读/dev/urandom，都不行返回false
+static bool ngx_random_bytes(unsigned char *buf, size_t len)
+{
+    ssize_t n;
+    do
+    {
+        n = getrandom(buf, len, 0); // 不超过256字节时不会只返回一部分，但等熵池初始化时可能被信号打断
+    } while (n == -1 && errno == EINTR);
+    if (n == (ssize_t)len)
+        return true;
+    ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_random_bytes()中getrandom()失败，改读/dev/urandom!");
+
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_random_bytes()中open(\"/dev/urandom\")失败!");
+        return false;
+    }
+    size_t got = 0;
+    while (got < len)
+    {
+        n = read(fd, buf + got, len - got);
+        if (n > 0)
+            got += n;
+        else if (n == -1 && errno == EINTR)
+            continue;
+        else
+            break;
+    }
+    close(fd);
+    if (got < len)
+    {
+        ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_random_bytes()中read(\"/dev/urandom\")失败!");
+        return false;
+    }
+    return true;
+}
+
+// 生成随机盐并计算密码的hash，注册时调用
+// 取不到随机数返回false，这时不能注册：可预测的盐让预先算好的hash表又能用了
+bool CAccountStore::MakeCredential(const char *password, unsigned int iterations, lpngx_account_cred_t pCred)
+{
+    if (iterations == 0)
+        iterations = 1;
+    memset(pCred, 0, sizeof(ngx_account_cred_t));
+    pCred->iterations = iterations;
+    if (ngx_random_bytes(pCred->salt, NGX_ACCOUNT_SALT_LEN) == false)
+        return false;
+    CSHA256::Pbkdf2(password, strnlen(password, NGX_ACCOUNT_PASS_LEN), pCred->salt, NGX_ACCOUNT_SALT_LEN, iterations, pCred->hash);
+    return true;
+}
+
+// 校验密码，比较hash时不提前退出，比较耗时和密码对了多少位无关
+bool CAccountStore::CheckCredential(const lpngx_account_cred_t pCred, const char *password)
+{
+    unsigned char hash[NGX_ACCOUNT_HASH_LEN];
+    CSHA256::Pbkdf2(password, strnlen(password, NGX_ACCOUNT_PASS_LEN), pCred->salt, NGX_ACCOUNT_SALT_LEN, pCred->iterations, hash);
+
+    unsigned char diff = 0;
+    for (int i = 0; i < NGX_ACCOUNT_HASH_LEN; i++)
+        diff |= hash[i] ^ pCred->hash[i];
+    return diff == 0;
+}
@@ -0,0 +1,159 @@
+﻿// 和流量录制有关的代码
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "ngx_func.h"
+#include "ngx_macro.h"
+#include "ngx_global.h"
+#include "ngx_comm.h"
+#include "ngx_c_socket.h"
+#include "ngx_c_metrics.h"
+#include "ngx_c_capture.h"
+
+static_assert(sizeof(ngx_capture_filehdr_t) == 64, "ngx_capture_filehdr_t must be 64 bytes");
+static_assert(sizeof(ngx_capture_rec_t) == 24, "ngx_capture_rec_t must be 24 bytes");
+
+CCapture::CCapture()
+{
+    m_fd = -1;
+    m_pHdr = NULL;
+    m_pRecs = NULL;
+    m_iUsed = 0;
+    m_iWindowStart = 0;
+    m_iWindowBytes = 0;
+    m_hEnable = NULL;
+    m_hRateLimit = NULL;
+}
+
+CCapture::~CCapture()
+{
+    Close();
+}
+
+// master进程中fork()之前调用：CaptureEnable、CaptureRateLimit放在共享内存中，worker进程里读的是master进程登记的那一份
+void CCapture::Init()
+{
+    CConfig *p_config = CConfig::GetInstance();
+    m_hEnable = p_config->GetBoolHandle("CaptureEnable", false);
+    m_hRateLimit = p_config->GetSizeHandle("CaptureRateLimit", 8 * 1024 * 1024);
+}
+
+// worker进程中执行：建录制文件并映射
+// 没配置CaptureFile时什么也不做；建文件失败只写日志，不录就是了，不影响服务
+bool CCapture::Open()
+{
+    CConfig *p_config = CConfig::GetInstance();
+    const char *pPrefix = p_config->GetString("CaptureFile");
+    if (pPrefix == NULL || pPrefix[0] == 0)
+        return true;
+    int64_t capacity = p_config->GetSize("CaptureSize", 64 * 1024 * 1024);
+    if (capacity < 1024 * 1024)
+        capacity = 1024 * 1024;
+
+    char fileName[512];
+    snprintf(fileName, sizeof(fileName), "%s.%d", pPrefix, (int)ngx_pid);
+    m_fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m_fd == -1)
+    {
+        ngx_log_error_core(NGX_LOG_ERR, errno, "CCapture::Open()中open(\"%s\")失败，不录制流量!", fileName);
+        return false;
+    }
+    // 文件一次开到最大，没写到的地方是空洞，不占磁盘
+    size_t mapLen = sizeof(ngx_capture_filehdr_t) + capacity;
+    if (ftruncate(m_fd, mapLen) == -1)
+    {
+        ngx_log_error_core(NGX_LOG_ERR, errno, "CCapture::Open()中ftruncate(\"%s\")失败，不录制流量!", fileName);
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    void *pMem = mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (pMem == MAP_FAILED)
+    {
+        ngx_log_error_core(NGX_LOG_ERR, errno, "CCapture::Open()中mmap(\"%s\")失败，不录制流量!", fileName);
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    ngx_capture_filehdr_t *pHdr = (ngx_capture_filehdr_t *)pMem;
+    memcpy(pHdr->magic, NGX_CAPTURE_MAGIC, sizeof(pHdr->magic));
+    pHdr->version = NGX_CAPTURE_VERSION;
+    pHdr->hdrsize = sizeof(ngx_capture_filehdr_t);
+    pHdr->recsize = sizeof(ngx_capture_rec_t);
+    pHdr->pid = ngx_pid;
+    pHdr->capacity = capacity;
+    pHdr->used = 0;
+    pHdr->dropped = 0;
+    pHdr->startUsec = ngx_monotonic_usec();
+    pHdr->startRealUsec = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+    m_pRecs = (char *)pMem + sizeof(ngx_capture_filehdr_t);
+    m_iUsed = 0;
+    m_pHdr = pHdr; // 最后才赋值，Record()看到它不为NULL时文件已经准备好了
+    ngx_log_error_core(NGX_LOG_NOTICE, 0, "流量录制文件%s已经准备好，大小上限%L字节", fileName, capacity);
+    return true;
+}
+
+// worker进程中执行，其他线程都停了以后调用：解除映射，把文件截到实际用到的长度
+void CCapture::Close()
+{
+    if (m_pHdr == NULL)
+        return;
+    size_t mapLen = sizeof(ngx_capture_filehdr_t) + m_pHdr->capacity;
+    m_pHdr->capacity = m_iUsed; // 截短以后记录区就这么大了
+    munmap(m_pHdr, mapLen);
+    m_pHdr = NULL;
+    m_pRecs = NULL;
+    if (ftruncate(m_fd, sizeof(ngx_capture_filehdr_t) + m_iUsed) == -1)
+    {
+        ngx_log_error_core(NGX_LOG_ERR, errno, "CCapture::Close()中ftruncate()失败!");
+    }
+    close(m_fd);
+    m_fd = -1;
+}
+
+// 写一条记录，只在epoll线程中调用
+void CCapture::Write(const char *pMsgBuf)
+{
+    LPSTRUC_MSG_HEADER pMsgHeader = (LPSTRUC_MSG_HEADER)pMsgBuf;
+    LPCOMM_PKG_HEADER pPkgHeader = (LPCOMM_PKG_HEADER)(pMsgBuf + sizeof(STRUC_MSG_HEADER));
+    uint32_t len = ntohs(pPkgHeader->pkgLen);
+    uint64_t recLen = ngx_capture_reclen(len);
+
+    // 限速按一秒一个窗口算，用收包时已经取好的时间，不再读时钟
+    uint64_t now = pMsgHeader->iRecvTime;
+    if (now - m_iWindowStart >= 1000000)
+    {
+        m_iWindowStart = now;
+        m_iWindowBytes = 0;
+    }
+    int64_t limit = ngx_conf_get(m_hRateLimit);
+    if ((limit > 0 && m_iWindowBytes + len > limit) || m_iUsed + recLen > m_pHdr->capacity)
+    {
+        m_pHdr->dropped++;
+        ngx_metrics_add(NGX_MC_CAPTURE_DROPPED);
+        return;
+    }
+    m_iWindowBytes += len;
+
+    ngx_capture_rec_t *pRec = (ngx_capture_rec_t *)(m_pRecs + m_iUsed);
+    pRec->usec = now;
+    pRec->conn = (uint64_t)(uintptr_t)pMsgHeader->pConn;
+    pRec->seq = (uint32_t)pMsgHeader->iCurrsequence;
+    pRec->len = len;
+    memcpy(pRec + 1, pPkgHeader, len);
+
+    m_iUsed += recLen;
+    __atomic_store_n(&m_pHdr->used, m_iUsed, __ATOMIC_RELEASE); // 记录写完再发布，边录边读的工具看到的都是完整记录
+    ngx_metrics_add(NGX_MC_CAPTURED_PKGS);
+}
@@ -0,0 +1,274 @@
+﻿// 按来源IP限制连接有关的代码
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+#include "ngx_macro.h"
+#include "ngx_func.h"
+#include "ngx_c_iplimit.h"
+
+static_assert(sizeof(ngx_iplimit_slot_t) == 32, "ngx_iplimit_slot_t must be 32 bytes");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "atomics in shared memory must be lock-free");
+
+CIpLimit::CIpLimit()
+{
+    m_pMem = NULL;
+    m_iMemSize = 0;
+    m_iMask = 0;
+    m_pSlots = NULL;
+    m_pWorkerConns = NULL;
+    m_pMyConns = NULL;
+    m_pWorkerChunks = NULL;
+    m_pMyChunks = NULL;
+    m_iChunkWords = 0;
+}
+
+CIpLimit::~CIpLimit()
+{
+    // 共享内存随进程退出释放，这里只销毁本进程中的映射
+    if (m_pMem != NULL)
+    {
+        munmap(m_pMem, m_iMemSize);
+        m_pMem = NULL;
+    }
+}
+
+// 分配共享内存，必须在fork()子进程之前调用，这样所有worker进程才能共用同一张表
+// 成功返回true，失败返回false
+bool CIpLimit::Init(unsigned int slotCount)
+{
+    if (m_pMem != NULL) // 已经初始化过
+        return true;
+
+    uint32_t capacity = 64;
+    while (capacity < slotCount && capacity < (1u << 24))
+        capacity <<= 1;
+
+    size_t slotsSize = sizeof(ngx_iplimit_slot_t) * capacity;
+    slotsSize = (slotsSize + 4095) & ~((size_t)4095);
+    size_t connsSize = sizeof(std::atomic<uint32_t>) * capacity * NGX_MAX_PROCESSES;
+    uint32_t chunks = (capacity + (1u << NGX_IPLIMIT_CHUNK_SHIFT) - 1) >> NGX_IPLIMIT_CHUNK_SHIFT;
+    m_iChunkWords = (chunks + 63) / 64;
+    m_iMemSize = slotsSize + connsSize + sizeof(std::atomic<uint64_t>) * m_iChunkWords * NGX_MAX_PROCESSES;
+
+    // 每个worker进程一行，MAP_NORESERVE：用不到的行不占物理内存（读一下也会分配，所以回收时要靠位图跳过没用过的块）
+    m_pMem = mmap(NULL, m_iMemSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (m_pMem == MAP_FAILED)
+    {
+        ngx_log_stderr(errno, "CIpLimit::Init()中mmap(%uL)失败!", (uint64_t)m_iMemSize);
+        m_pMem = NULL;
+        return false;
+    }
+    // 匿名共享内存本身就是全0，全0就是空槽位
+    m_iMask = capacity - 1;
+    m_pSlots = (lpngx_iplimit_slot_t)m_pMem;
+    m_pWorkerConns = (std::atomic<uint32_t> *)((char *)m_pMem + slotsSize);
+    m_pWorkerChunks = (std::atomic<uint64_t> *)((char *)m_pMem + slotsSize + connsSize);
+    return true;
+}
+
+void CIpLimit::AttachWorker(int slot)
+{
+    if (m_pSlots == NULL || slot < 0 || slot >= NGX_MAX_PROCESSES)
+        return;
+    m_pMyConns = m_pWorkerConns + (size_t)slot * (m_iMask + 1);
+    m_pMyChunks = m_pWorkerChunks + (size_t)slot * m_iChunkWords;
+}
+
+// 在信号处理函数中执行，只用原子操作
+// 只看这个worker进程用过的块，块里也只改不是0的：行是MAP_NORESERVE的，读写没碰过的页都会分配物理内存，16M个槽位时一行就是64MB
+void CIpLimit::WorkerExited(int slot)
+{
+    if (m_pSlots == NULL || slot < 0 || slot >= NGX_MAX_PROCESSES)
+        return;
+    std::atomic<uint32_t> *pRow = m_pWorkerConns + (size_t)slot * (m_iMask + 1);
+    std::atomic<uint64_t> *pChunks = m_pWorkerChunks + (size_t)slot * m_iChunkWords;
+    for (uint32_t w = 0; w < m_iChunkWords; w++)
+    {
+        uint64_t bits = pChunks[w].exchange(0, std::memory_order_relaxed); // 这个worker槽位以后给新的worker进程用，位图从头记
+        while (bits != 0)
+        {
+            uint32_t chunk = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            uint32_t begin = chunk << NGX_IPLIMIT_CHUNK_SHIFT;
+            uint32_t end = std::min(begin + (1u << NGX_IPLIMIT_CHUNK_SHIFT), m_iMask + 1);
+            for (uint32_t i = begin; i < end; i++)
+            {
+                if (pRow[i].load(std::memory_order_relaxed) == 0)
+                    continue;
+                uint32_t n = pRow[i].exchange(0, std::memory_order_relaxed);
+                if (n != 0)
+                    m_pSlots[i].key.fetch_sub(n, std::memory_order_acq_rel); // 有连接的槽位不会被淘汰，地址还是原来那个
+            }
+        }
+    }
+}
+
+// 令牌桶：按速度补充令牌，扣一个，格式见ngx_iplimit_slot_t
+bool CIpLimit::Take(std::atomic<uint64_t> &bucket, uint64_t nowMs, int64_t rate, int64_t burst, bool owe, int64_t *pWait)
+{
+    uint32_t now32 = (uint32_t)nowMs;
+    int64_t full = burst * 1000;
+    int64_t tokens;
+    bool ok;
+    uint64_t oldv = bucket.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        uint32_t t = now32;
+        if (oldv == 0)
+        {
+            tokens = full;
+        }
+        else
+        {
+            tokens = (int32_t)(uint32_t)oldv;
+            int32_t elapsed = (int32_t)(now32 - (uint32_t)(oldv >> 32));
+            if (elapsed > 0)
+                tokens = std::min(full, tokens + (int64_t)elapsed * rate);
+            else
+                t = (uint32_t)(oldv >> 32); // 别的进程刚用稍晚一点的时间更新过，时间不往回退
+        }
+        ok = (tokens >= 1000);
+        if (ok || owe)
+            tokens = std::max(tokens - 1000, -full); // 最多欠一桶
+        uint64_t newv = ((uint64_t)t << 32) | (uint32_t)(int32_t)tokens;
+        if (newv == 0)
+            newv = 1; // 0表示新的桶，差千分之一个令牌无所谓
+        if (bucket.compare_exchange_weak(oldv, newv, std::memory_order_relaxed))
+            break;
+    }
+    if (pWait != NULL)
+        *pWait = tokens < 0 ? (-tokens + rate - 1) / rate : 0;
+    return ok;
+}
+
+// 在hash位置起NGX_IPLIMIT_PROBE个槽位里找这个地址，找不到就占一个空槽位，没有空槽位就淘汰其中没有连接、最久没动静的一个
+int CIpLimit::FindOrInsert(uint32_t addr, uint32_t nowSec)
+{
+    uint32_t pos = (uint32_t)(((uint64_t)addr * 0x9E3779B97F4A7C15ULL) >> 32);
+    for (int retry = 0; retry < 4; retry++)
+    {
+        int empty = -1, oldest = -1;
+        uint32_t oldestSeen = 0;
+        uint64_t oldestKey = 0;
+        for (int i = 0; i < NGX_IPLIMIT_PROBE; i++)
+        {
+            int idx = (int)((pos + i) & m_iMask);
+            uint64_t key = m_pSlots[idx].key.load(std::memory_order_acquire);
+            if ((uint32_t)(key >> 32) == addr)
+                return idx;
+            if (key == 0)
+            {
+                if (empty < 0)
+                    empty = idx;
+            }
+            else if ((uint32_t)key == 0)
+            {
+                uint32_t seen = m_pSlots[idx].lastSeen.load(std::memory_order_relaxed);
+                if (oldest < 0 || (int32_t)(seen - oldestSeen) < 0)
+                {
+                    oldest = idx;
+                    oldestSeen = seen;
+                    oldestKey = key;
+                }
+            }
+        }
+
+        int idx = empty >= 0 ? empty : oldest;
+        if (idx < 0)
+            return -1; // 这几个槽位上都还有连接
+        uint64_t expect = empty >= 0 ? 0 : oldestKey;
+        if (m_pSlots[idx].key.compare_exchange_strong(expect, (uint64_t)addr << 32, std::memory_order_acq_rel))
+        {
+            m_pSlots[idx].acceptBucket.store(0, std::memory_order_relaxed);
+            m_pSlots[idx].pktBucket.store(0, std::memory_order_relaxed);
+            m_pSlots[idx].lastSeen.store(nowSec, std::memory_order_relaxed);
+            return idx;
+        }
+        // 被别的进程抢先了，重新找
+    }
+    return -1;
+}
+
+int CIpLimit::Acquire(uint32_t addr, uint64_t nowMs, int64_t maxConns, int64_t acceptRate, int64_t acceptBurst, int *pSlot)
+{
+    *pSlot = -1;
+    if (m_pSlots == NULL)
+        return NGX_IPLIMIT_OK;
+    if (addr == 0)
+        return NGX_IPLIMIT_FULL; // 地址0当空槽位用，不可能真有这样的来源地址
+
+    uint32_t nowSec = (uint32_t)(nowMs / 1000);
+    for (int retry = 0; retry < 4; retry++)
+    {
+        int idx = FindOrInsert(addr, nowSec);
+        if (idx < 0)
+            return NGX_IPLIMIT_FULL;
+        lpngx_iplimit_slot_t p = &m_pSlots[idx];
+        p->lastSeen.store(nowSec, std::memory_order_relaxed);
+        if (acceptRate > 0 && Take(p->acceptBucket, nowMs, acceptRate, acceptBurst, false, NULL) == false)
+            return NGX_IPLIMIT_RATE;
+
+        // 连接数+1，到上限了就不加；地址变了说明槽位刚被淘汰给了别的地址，重新找
+        uint64_t key = p->key.load(std::memory_order_acquire);
+        while ((uint32_t)(key >> 32) == addr)
+        {
+            if (maxConns > 0 && (int64_t)(uint32_t)key >= maxConns)
+                return NGX_IPLIMIT_CONNS;
+            if (p->key.compare_exchange_weak(key, key + 1, std::memory_order_acq_rel))
+            {
+                if (m_pMyConns != NULL)
+                {
+                    // 先记下这一块用过了，再记连接数，master进程回收时才不会漏掉
+                    std::atomic<uint64_t> &word = m_pMyChunks[(uint32_t)idx >> (NGX_IPLIMIT_CHUNK_SHIFT + 6)];
+                    uint64_t bit = 1ull << (((uint32_t)idx >> NGX_IPLIMIT_CHUNK_SHIFT) & 63);
+                    if ((word.load(std::memory_order_relaxed) & bit) == 0)
+                        word.fetch_or(bit, std::memory_order_relaxed);
+                    m_pMyConns[idx].fetch_add(1, std::memory_order_relaxed);
+                }
+                *pSlot = idx;
+                return NGX_IPLIMIT_OK;
+            }
+        }
+    }
+    return NGX_IPLIMIT_FULL;
+}
+
+void CIpLimit::Release(int slot)
+{
+    if (m_pSlots == NULL || slot < 0)
+        return;
+    if (m_pMyConns != NULL)
+        m_pMyConns[slot].fetch_sub(1, std::memory_order_relaxed);
+    m_pSlots[slot].lastSeen.store((uint32_t)(ngx_monotonic_coarse_msec() / 1000), std::memory_order_relaxed);
+    m_pSlots[slot].key.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+bool CIpLimit::TakePkt(int slot, uint64_t nowMs, int64_t rate, int64_t burst, bool owe, int64_t *pWait)
+{
+    if (m_pSlots == NULL || slot < 0)
+    {
+        *pWait = 0;
+        return true;
+    }
+    return Take(m_pSlots[slot].pktBucket, nowMs, rate, burst, owe, pWait);
+}
+
+unsigned int CIpLimit::GetUsed(unsigned int *pConns)
+{
+    unsigned int used = 0, conns = 0;
+    for (uint32_t i = 0; m_pSlots != NULL && i <= m_iMask; i++)
+    {
+        uint64_t key = m_pSlots[i].key.load(std::memory_order_relaxed);
+        if (key != 0)
+        {
+            used++;
+            conns += (uint32_t)key;
+        }
+    }
+    *pConns = conns;
+    return used;
+}
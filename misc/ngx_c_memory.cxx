@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "ngx_c_memory.h"
+#include "ngx_c_metrics.h"
 
 // 分配内存
 // memCount：分配的字节大小
@@ -10,6 +11,8 @@
 void *CMemory::AllocMemory(int memCount, bool ifmemset)
 {
     void *tmpData = (void *)new char[memCount]; // 并不会判断new是否成功，如果new失败，程序根本不应该继续运行，崩溃
+    ngx_metrics_add(NGX_MC_MEM_ALLOCS);
+    ngx_metrics_add(NGX_MC_MEM_ALLOC_BYTES, memCount);
     if (ifmemset)
     {
         memset(tmpData, 0, memCount);
@@ -20,5 +23,6 @@ void *CMemory::AllocMemory(int memCount, bool ifmemset)
 // 内存释放函数
 void CMemory::FreeMemory(void *point)
 {
+    ngx_metrics_add(NGX_MC_MEM_FREES);
     delete[] ((char *)point);
 }
@@ -0,0 +1,221 @@
+﻿// 和统计信息共享内存有关的代码
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "ngx_func.h"
+#include "ngx_global.h"
+#include "ngx_c_metrics.h"
+
+static_assert(sizeof(ngx_metrics_block_t) % NGX_METRICS_CACHELINE == 0, "ngx_metrics_block_t must be cache line aligned");
+static_assert(sizeof(ngx_metrics_shm_t) == NGX_METRICS_CACHELINE, "ngx_metrics_shm_t must be one cache line");
+
+static ngx_metrics_block_t ngx_metrics_local; // 还没有用上共享内存时写这里
+lpngx_metrics_block_t ngx_metrics_self = &ngx_metrics_local;
+
+CMetrics::CMetrics()
+{
+    m_pShm = NULL;
+    m_iMemSize = 0;
+    m_pSnap = new ngx_metrics_snap_t;
+    m_pOne = new ngx_metrics_snap_t;
+}
+
+CMetrics::~CMetrics()
+{
+    // 共享内存随进程退出释放，不在这里munmap()：master进程退出时管理端口的线程可能还在读
+}
+
+// 创建共享内存，必须在fork()子进程之前调用，pFileName为NULL或者空串时用匿名共享内存（基准测试程序用）
+// pFileName：映射到这个文件上，外边的工具可以读；先unlink()再新建，平滑升级时新的master进程建的是新文件，
+//            老的一代还映射着原来那个（已经删掉的）文件，两代互不干扰，文件也不会被截短让老的一代访问出错
+// 成功返回true，失败返回false
+bool CMetrics::Init(const char *pFileName)
+{
+    if (m_pShm != NULL) // 已经初始化过
+        return true;
+
+    m_iMemSize = ngx_metrics_shm_size(NGX_METRICS_MAX_WORKERS);
+    int fd = -1;
+    if (pFileName != NULL && pFileName[0] != 0)
+    {
+        unlink(pFileName);
+        fd = open(pFileName, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            ngx_log_stderr(errno, "CMetrics::Init()中open(\"%s\")失败!", pFileName);
+            return false;
+        }
+        if (ftruncate(fd, m_iMemSize) == -1)
+        {
+            ngx_log_stderr(errno, "CMetrics::Init()中ftruncate(\"%s\", %uL)失败!", pFileName, (uint64_t)m_iMemSize);
+            close(fd);
+            return false;
+        }
+    }
+
+    void *pMem = mmap(NULL, m_iMemSize, PROT_READ | PROT_WRITE, MAP_SHARED | (fd == -1 ? MAP_ANONYMOUS : 0), fd, 0);
+    if (fd != -1)
+        close(fd); // 映射建立以后文件句柄就不需要了
+    if (pMem == MAP_FAILED)
+    {
+        ngx_log_stderr(errno, "CMetrics::Init()中mmap(%uL)失败!", (uint64_t)m_iMemSize);
+        return false;
+    }
+
+    // 新建的文件和匿名共享内存都是全0，atomic全0就是值为0，只需要填文件头
+    m_pShm = (lpngx_metrics_shm_t)pMem;
+    m_pShm->version = NGX_METRICS_VERSION;
+    m_pShm->blockSize = sizeof(ngx_metrics_block_t);
+    m_pShm->maxWorkers = NGX_METRICS_MAX_WORKERS;
+    m_pShm->counters = NGX_MC_MAX;
+    m_pShm->gauges = NGX_MG_MAX;
+    m_pShm->hists = NGX_MH_MAX;
+    m_pShm->msgcodes = NGX_METRICS_MSGCODES;
+    m_pShm->stages = NGX_MS_MAX;
+    m_pShm->masterPid = ngx_pid;
+    m_pShm->startTime = time(NULL);
+    memcpy(m_pShm->magic, NGX_METRICS_MAGIC, sizeof(m_pShm->magic)); // 最后写，工具看到magic对了其他字段也都填好了
+    return true;
+}
+
+// worker进程启动时调用，slot是master进程分给它的槽位号
+// 同一个槽位上重启的worker进程接着用原来那块，计数器接着累加，当前值从0开始
+void CMetrics::AttachWorker(int slot)
+{
+    if (m_pShm == NULL)
+        return;
+    if (slot < 0 || slot >= NGX_METRICS_MAX_WORKERS)
+    {
+        ngx_log_error_core(NGX_LOG_WARN, 0, "CMetrics::AttachWorker()中槽位号%d超过了%d，本worker进程的统计信息不进共享内存!", slot, NGX_METRICS_MAX_WORKERS);
+        return;
+    }
+    lpngx_metrics_block_t pBlock = ngx_metrics_block(m_pShm, slot);
+    for (int i = 0; i < NGX_MG_MAX; i++)
+        pBlock->gauges[i].store(0, std::memory_order_relaxed);
+    pBlock->spawns.fetch_add(1, std::memory_order_relaxed);
+    pBlock->startTime.store(time(NULL), std::memory_order_relaxed);
+    pBlock->pid.store(ngx_pid, std::memory_order_relaxed);
+    ngx_metrics_self = pBlock;
+}
+
+// master进程在信号处理函数中调用，只有原子写，可以在信号处理函数中用
+void CMetrics::WorkerExited(int slot)
+{
+    if (m_pShm == NULL || slot < 0 || slot >= NGX_METRICS_MAX_WORKERS)
+        return;
+    lpngx_metrics_block_t pBlock = ngx_metrics_block(m_pShm, slot);
+    pBlock->pid.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < NGX_MG_MAX; i++)
+        pBlock->gauges[i].store(0, std::memory_order_relaxed);
+}
+
+void CMetrics::Aggregate(ngx_metrics_snap_t *pSnap)
+{
+    if (m_pShm == NULL)
+    {
+        ngx_metrics_read_block(ngx_metrics_self, pSnap);
+        return;
+    }
+    ngx_metrics_aggregate(m_pShm, pSnap, m_pOne);
+}
+
+// 输出一个直方图的各行（HELP和TYPE由调用者输出）：只输出2的幂那些边界（le=1,3,7,15...，单位微秒，值都是整数所以上界是2^k-1），Prometheus那边桶太多了没用
+// labels：除le以外的标签，比如code="1",stage="queue"，没有就给空串
+u_char *CMetrics::WriteHist(u_char *buf, u_char *last, const char *name, const char *labels, const ngx_metrics_hist_snap_t *pHist)
+{
+    const char *sep = (labels[0] != 0) ? "," : "";
+    uint64_t cumulative = 0;
+    for (int b = 0; b < NGX_METRICS_HIST_BUCKETS; b++)
+    {
+        cumulative += pHist->buckets[b];
+        uint64_t upper = ngx_metrics_hist_upper(b);
+        if (b + 1 < NGX_METRICS_HIST_BUCKETS && ((upper + 1) & upper) == 0) // 上界+1是2的幂
+        {
+            buf = ngx_slcat(buf, last, "ngx_", name, "_bucket{", labels, sep, "le=\"", upper, "\"} ", cumulative, "\n");
+        }
+    }
+    // 读的时候worker进程还在写，count可能和各个桶加起来对不上，都用桶的合计，保证+Inf和_count一致
+    buf = ngx_slcat(buf, last, "ngx_", name, "_bucket{", labels, sep, "le=\"+Inf\"} ", cumulative, "\n");
+    if (labels[0] != 0)
+    {
+        buf = ngx_slcat(buf, last, "ngx_", name, "_sum{", labels, "} ", pHist->sum, "\n");
+        buf = ngx_slcat(buf, last, "ngx_", name, "_count{", labels, "} ", cumulative, "\n");
+    }
+    else
+    {
+        buf = ngx_slcat(buf, last, "ngx_", name, "_sum ", pHist->sum, "\n");
+        buf = ngx_slcat(buf, last, "ngx_", name, "_count ", cumulative, "\n");
+    }
+    return buf;
+}
+
+// 按Prometheus的文本格式(text exposition format 0.0.4)输出，名字前边都加ngx_
+// 计数器、当前值、直方图都是所有worker进程的合计；每个worker进程再输出一行是否在运行和重启次数
+u_char *CMetrics::WriteText(u_char *buf, u_char *last)
+{
+    ngx_metrics_snap_t &snap = *m_pSnap;
+    Aggregate(&snap);
+
+    for (int i = 0; i < NGX_MC_MAX; i++)
+    {
+        const ngx_metrics_desc_t &d = ngx_metrics_counter_desc[i];
+        buf = ngx_slcat(buf, last, "# HELP ngx_", d.name, " ", d.help, "\n# TYPE ngx_", d.name, " counter\nngx_", d.name, " ", snap.counters[i], "\n");
+    }
+    for (int i = 0; i < NGX_MG_MAX; i++)
+    {
+        const ngx_metrics_desc_t &d = ngx_metrics_gauge_desc[i];
+        buf = ngx_slcat(buf, last, "# HELP ngx_", d.name, " ", d.help, "\n# TYPE ngx_", d.name, " gauge\nngx_", d.name, " ", snap.gauges[i], "\n");
+    }
+    for (int i = 0; i < NGX_MH_MAX; i++)
+    {
+        const ngx_metrics_desc_t &d = ngx_metrics_hist_desc[i];
+        buf = ngx_slcat(buf, last, "# HELP ngx_", d.name, " ", d.help, "\n# TYPE ngx_", d.name, " histogram\n");
+        buf = WriteHist(buf, last, d.name, "", &snap.hists[i]);
+    }
+
+    // 按消息代码、按阶段的延迟，没有数据的组合不输出，否则大部分都是全0的桶
+    buf = ngx_slcat(buf, last, "# HELP ngx_msg_stage_us 按消息代码(code，", NGX_METRICS_MSGCODES - 1, "表示", NGX_METRICS_MSGCODES - 1,
+                    "及以上)分阶段的延迟(微秒)，stage:");
+    for (int s = 0; s < NGX_MS_MAX; s++)
+        buf = ngx_slcat(buf, last, " ", ngx_metrics_stage_desc[s].name, "=", ngx_metrics_stage_desc[s].help, (s + 1 < NGX_MS_MAX) ? "；" : "");
+    buf = ngx_slcat(buf, last, "\n# TYPE ngx_msg_stage_us histogram\n");
+    for (int c = 0; c < NGX_METRICS_MSGCODES; c++)
+    {
+        for (int s = 0; s < NGX_MS_MAX; s++)
+        {
+            if (snap.stages[c][s].count == 0)
+                continue;
+            u_char labels[64];
+            *ngx_slcat(labels, labels + sizeof(labels) - 1, "code=\"", c, "\",stage=\"", ngx_metrics_stage_desc[s].name, "\"") = 0;
+            buf = WriteHist(buf, last, "msg_stage_us", (const char *)labels, &snap.stages[c][s]);
+        }
+    }
+
+    buf = ngx_slcat(buf, last, "# HELP ngx_workers 正在运行的worker进程数\n# TYPE ngx_workers gauge\nngx_workers ", snap.workers, "\n");
+    if (m_pShm == NULL)
+        return buf;
+    buf = ngx_slcat(buf, last, "# HELP ngx_start_time_seconds master进程的启动时间\n# TYPE ngx_start_time_seconds gauge\nngx_start_time_seconds ",
+                    m_pShm->startTime, "\n");
+    buf = ngx_slcat(buf, last, "# HELP ngx_worker_spawns_total 每个槽位上先后启动过几个worker进程，增加了说明worker进程重启过\n# TYPE ngx_worker_spawns_total counter\n");
+    for (int w = 0; w < (int)m_pShm->maxWorkers; w++)
+    {
+        lpngx_metrics_block_t pBlock = ngx_metrics_block(m_pShm, w);
+        uint32_t spawns = pBlock->spawns.load(std::memory_order_relaxed);
+        if (spawns != 0)
+            buf = ngx_slcat(buf, last, "ngx_worker_spawns_total{slot=\"", w, "\"} ", spawns, "\n");
+    }
+    buf = ngx_slcat(buf, last, "# HELP ngx_worker_up 槽位上的worker进程是否在运行\n# TYPE ngx_worker_up gauge\n");
+    for (int w = 0; w < (int)m_pShm->maxWorkers; w++)
+    {
+        lpngx_metrics_block_t pBlock = ngx_metrics_block(m_pShm, w);
+        if (pBlock->spawns.load(std::memory_order_relaxed) != 0)
+            buf = ngx_slcat(buf, last, "ngx_worker_up{slot=\"", w, "\"} ", pBlock->pid.load(std::memory_order_relaxed) != 0 ? 1 : 0, "\n");
+    }
+    return buf;
+}
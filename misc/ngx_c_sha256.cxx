@@ -0,0 +1,218 @@
+﻿// 和SHA-256有关的代码，实现参照FIPS 180-4，HMAC参照RFC 2104，PBKDF2参照RFC 8018
+#include <string.h>
+
+#include "ngx_c_sha256.h"
+
+static const uint32_t K256[64] =
+    {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void CSHA256::Init()
+{
+    m_state[0] = 0x6a09e667;
+    m_state[1] = 0xbb67ae85;
+    m_state[2] = 0x3c6ef372;
+    m_state[3] = 0xa54ff53a;
+    m_state[4] = 0x510e527f;
+    m_state[5] = 0x9b05688c;
+    m_state[6] = 0x1f83d9ab;
+    m_state[7] = 0x5be0cd19;
+    m_iTotalLen = 0;
+    m_iBufLen = 0;
+}
+
+// 处理一个64字节的分组
+void CSHA256::Transform(const unsigned char *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) | ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t S1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + S1 + ch + K256[i] + w[i];
+        uint32_t S0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = S0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    m_state[0] += a;
+    m_state[1] += b;
+    m_state[2] += c;
+    m_state[3] += d;
+    m_state[4] += e;
+    m_state[5] += f;
+    m_state[6] += g;
+    m_state[7] += h;
+}
+
+void CSHA256::Update(const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    m_iTotalLen += len;
+
+    if (m_iBufLen > 0)
+    {
+        size_t n = NGX_SHA256_BLOCK_LEN - m_iBufLen;
+        if (n > len)
+            n = len;
+        memcpy(m_buf + m_iBufLen, p, n);
+        m_iBufLen += n;
+        p += n;
+        len -= n;
+        if (m_iBufLen < NGX_SHA256_BLOCK_LEN)
+            return;
+        Transform(m_buf);
+        m_iBufLen = 0;
+    }
+    while (len >= NGX_SHA256_BLOCK_LEN)
+    {
+        Transform(p);
+        p += NGX_SHA256_BLOCK_LEN;
+        len -= NGX_SHA256_BLOCK_LEN;
+    }
+    if (len > 0)
+    {
+        memcpy(m_buf, p, len);
+        m_iBufLen = len;
+    }
+}
+
+void CSHA256::Final(unsigned char digest[NGX_SHA256_DIGEST_LEN])
+{
+    uint64_t bits = m_iTotalLen * 8;
+    unsigned char pad[NGX_SHA256_BLOCK_LEN * 2];
+    // 补一个0x80，再补0，直到长度模64余56，最后8字节是大端的位长度
+    size_t padlen = (m_iBufLen < 56) ? (56 - m_iBufLen) : (120 - m_iBufLen);
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (int i = 0; i < 8; i++)
+    {
+        pad[padlen + i] = (unsigned char)(bits >> (56 - i * 8));
+    }
+    Update(pad, padlen + 8);
+
+    for (int i = 0; i < 8; i++)
+    {
+        digest[i * 4] = (unsigned char)(m_state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(m_state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(m_state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)m_state[i];
+    }
+}
+
+void CSHA256::Hmac(const void *key, size_t keylen, const void *data, size_t datalen, unsigned char mac[NGX_SHA256_DIGEST_LEN])
+{
+    unsigned char k[NGX_SHA256_BLOCK_LEN];
+    unsigned char ipad[NGX_SHA256_BLOCK_LEN], opad[NGX_SHA256_BLOCK_LEN];
+    CSHA256 sha;
+
+    memset(k, 0, sizeof(k));
+    if (keylen > NGX_SHA256_BLOCK_LEN)
+    {
+        sha.Update(key, keylen);
+        sha.Final(k);
+        sha.Init();
+    }
+    else
+    {
+        memcpy(k, key, keylen);
+    }
+    for (int i = 0; i < NGX_SHA256_BLOCK_LEN; i++)
+    {
+        ipad[i] = k[i] ^ 0x36;
+        opad[i] = k[i] ^ 0x5c;
+    }
+
+    unsigned char inner[NGX_SHA256_DIGEST_LEN];
+    sha.Update(ipad, sizeof(ipad));
+    sha.Update(data, datalen);
+    sha.Final(inner);
+
+    sha.Init();
+    sha.Update(opad, sizeof(opad));
+    sha.Update(inner, sizeof(inner));
+    sha.Final(mac);
+}
+
+// PBKDF2-HMAC-SHA256，只算第一个分组
+// 每一轮的HMAC中ipad/opad两个分组是固定的，先算好这两个分组之后的中间状态，每一轮只需要再算两次Transform
+void CSHA256::Pbkdf2(const void *pass, size_t passlen, const void *salt, size_t saltlen, unsigned int iterations,
+                     unsigned char out[NGX_SHA256_DIGEST_LEN])
+{
+    unsigned char k[NGX_SHA256_BLOCK_LEN];
+    unsigned char ipad[NGX_SHA256_BLOCK_LEN], opad[NGX_SHA256_BLOCK_LEN];
+
+    memset(k, 0, sizeof(k));
+    if (passlen > NGX_SHA256_BLOCK_LEN)
+    {
+        CSHA256 sha;
+        sha.Update(pass, passlen);
+        sha.Final(k);
+    }
+    else
+    {
+        memcpy(k, pass, passlen);
+    }
+    for (int i = 0; i < NGX_SHA256_BLOCK_LEN; i++)
+    {
+        ipad[i] = k[i] ^ 0x36;
+        opad[i] = k[i] ^ 0x5c;
+    }
+    CSHA256 innerBase, outerBase;
+    innerBase.Update(ipad, sizeof(ipad));
+    outerBase.Update(opad, sizeof(opad));
+
+    // U1 = HMAC(pass, salt || INT(1))
+    unsigned char u[NGX_SHA256_DIGEST_LEN];
+    static const unsigned char blockIndex[4] = {0, 0, 0, 1};
+    CSHA256 sha = innerBase;
+    sha.Update(salt, saltlen);
+    sha.Update(blockIndex, sizeof(blockIndex));
+    sha.Final(u);
+    sha = outerBase;
+    sha.Update(u, sizeof(u));
+    sha.Final(u);
+    memcpy(out, u, sizeof(u));
+
+    // Ui = HMAC(pass, Ui-1)，结果是所有Ui的异或
+    for (unsigned int it = 1; it < iterations; it++)
+    {
+        sha = innerBase;
+        sha.Update(u, sizeof(u));
+        sha.Final(u);
+        sha = outerBase;
+        sha.Update(u, sizeof(u));
+        sha.Final(u);
+        for (int i = 0; i < NGX_SHA256_DIGEST_LEN; i++)
+            out[i] ^= u[i];
+    }
+}
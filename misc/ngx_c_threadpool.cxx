@@ -1,19 +1,33 @@
 ﻿
 #include <stdarg.h>
+#include <string.h>
 #include <unistd.h> //usleep
+#include <signal.h>
 
 #include "ngx_global.h"
 #include "ngx_func.h"
 #include "ngx_c_threadpool.h"
 #include "ngx_c_memory.h"
+#include "ngx_c_metrics.h"
+#include "ngx_probe.h"
 #include "ngx_macro.h"
 
-pthread_mutex_t CThreadPool::m_pthreadMutex = PTHREAD_MUTEX_INITIALIZER; 
-pthread_cond_t CThreadPool::m_pthreadCond = PTHREAD_COND_INITIALIZER;
-bool CThreadPool::m_shutdown = false;                                    // 刚开始标记整个线程池的线程是不退出的
-
 CThreadPool::CThreadPool()
 {
+    pthread_mutex_init(&m_pthreadMutex, NULL);
+    pthread_cond_init(&m_pthreadCond, NULL);
+    m_shutdown = false;      // 刚开始标记整个线程池的线程是不退出的
+    m_iThreadNum = 0;
+    m_iMaxQueueSize = 0;
+    m_iRejectCount = 0;
+    m_iLaneMode = NGX_LANE_STRICT;
+    for (int i = 0; i < NGX_THREADPOOL_LANES; i++)
+    {
+        m_lanes[i].size = 0;
+        m_lanes[i].weight = 1;
+        m_lanes[i].credit = 1;
+        memset(&m_lanes[i].stat, 0, sizeof(ThreadPoolLaneStat));
+    }
     m_iRunningThreadNum = 0; // 正在运行的线程，开始给个0，注意原子的对象给0也可以直接赋值，当整型变量来用
     m_iLastEmgTime = 0;      // 上次报告线程不够用了的时间；
     m_iRecvMsgQueueCount = 0; // 收消息队列
@@ -36,22 +50,71 @@ void CThreadPool::clearMsgRecvQueue()
     CMemory *p_memory = CMemory::GetInstance();
 
     // 尾声阶段，不需要互斥
-    while (!m_MsgRecvQueue.empty())
+    for (int i = 0; i < NGX_THREADPOOL_LANES; i++)
+    {
+        std::list<char *> &queue = m_lanes[i].queue;
+        while (!queue.empty())
+        {
+            sTmpMempoint = queue.front();
+            queue.pop_front();
+            p_memory->FreeMemory(sTmpMempoint);
+        }
+        m_lanes[i].size = 0;
+    }
+}
+
+// 设置通道的出队方式和各通道的权重，Create()之前调用
+// weights：NGX_THREADPOOL_LANES个元素，只在NGX_LANE_WEIGHTED方式下有用，<=0的按1算
+void CThreadPool::SetLanePolicy(int mode, const int *weights)
+{
+    m_iLaneMode = (mode == NGX_LANE_WEIGHTED) ? NGX_LANE_WEIGHTED : NGX_LANE_STRICT;
+    for (int i = 0; i < NGX_THREADPOOL_LANES; i++)
+    {
+        m_lanes[i].weight = (weights != NULL && weights[i] > 0) ? weights[i] : 1;
+        m_lanes[i].credit = m_lanes[i].weight;
+    }
+}
+
+// 选一个有消息的通道，调用者负责加锁，并保证至少有一个通道有消息
+int CThreadPool::selectLane()
+{
+    if (m_iLaneMode == NGX_LANE_WEIGHTED)
+    {
+        // 按优先级顺序找一个还有额度的非空通道；都没有额度了，就开始新的一轮
+        for (int round = 0; round < 2; round++)
+        {
+            for (int i = 0; i < NGX_THREADPOOL_LANES; i++)
+            {
+                if (m_lanes[i].size > 0 && m_lanes[i].credit > 0)
+                {
+                    --m_lanes[i].credit;
+                    return i;
+                }
+            }
+            for (int i = 0; i < NGX_THREADPOOL_LANES; i++)
+                m_lanes[i].credit = m_lanes[i].weight;
+        }
+    }
+
+    // 严格优先级：第一个非空通道
+    for (int i = 0; i < NGX_THREADPOOL_LANES; i++)
     {
-        sTmpMempoint = m_MsgRecvQueue.front();
-        m_MsgRecvQueue.pop_front();
-        p_memory->FreeMemory(sTmpMempoint);
+        if (m_lanes[i].size > 0)
+            return i;
     }
+    return 0; // 不会走到这里
 }
 
 // 创建线程池中的线程，手工调用，不在构造函数里调用
+// maxQueueSize：消息队列最大长度，超过了新消息直接拒绝，0表示不限制
 // 返回值：所有线程都创建成功则返回true，出现错误则返回false
-bool CThreadPool::Create(int threadNum)
+bool CThreadPool::Create(int threadNum, int maxQueueSize)
 {
     ThreadItem *pNew;
     int err;
 
     m_iThreadNum = threadNum; // 保存要创建的线程数量
+    m_iMaxQueueSize = maxQueueSize;
 
     for (int i = 0; i < m_iThreadNum; ++i)
     {
@@ -88,40 +151,64 @@ void *CThreadPool::ThreadFunc(void *threadData)
     CMemory *p_memory = CMemory::GetInstance();
     int err;
 
+    // 信号只由主线程处理（信号处理函数中也写日志，只有主线程预先分配了写日志的缓冲区），本线程不接收任何信号
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    ngx_log_thread_init(); // 本线程写日志用自己的环形缓冲区
+
     pthread_t tid = pthread_self();
     while (true)
     {
-        err = pthread_mutex_lock(&m_pthreadMutex);
+        err = pthread_mutex_lock(&pThreadPoolObj->m_pthreadMutex);
         if (err != 0)
             ngx_log_stderr(err, "CThreadPool::ThreadFunc()中pthread_mutex_lock()失败，返回的错误码为%d!", err);
 
-        while ((pThreadPoolObj->m_MsgRecvQueue.size() == 0) && m_shutdown == false)
+        while ((pThreadPoolObj->m_iRecvMsgQueueCount == 0) && pThreadPoolObj->m_shutdown == false)
         {
             if (pThread->ifrunning == false)
                 pThread->ifrunning = true;                      // 标记为true了才允许调用StopAll()：测试中发现如果Create()和StopAll()紧挨着调用，就会导致线程混乱，所以每个线程必须执行到这里，才认为是启动成功了
             //pthread_cond_wait()函数一进入wait状态就会自动release mutex。当其他线程通过pthread_cond_signal()或pthread_cond_broadcast，把该线程唤醒，使pthread_cond_wait()通过（返回）时，该线程又自动获得该mutex
-            pthread_cond_wait(&m_pthreadCond, &m_pthreadMutex); // 整个服务器程序刚初始化的时候，所有线程必然是卡在这里等待的
+            pthread_cond_wait(&pThreadPoolObj->m_pthreadCond, &pThreadPoolObj->m_pthreadMutex); // 整个服务器程序刚初始化的时候，所有线程必然是卡在这里等待的
         }
 
-        if (m_shutdown)
+        if (pThreadPoolObj->m_shutdown)
         {   
-            pthread_mutex_unlock(&m_pthreadMutex); 
+            pthread_mutex_unlock(&pThreadPoolObj->m_pthreadMutex); 
             break;
         }
 
         // 取得消息进行处理, 注意，目前还是互斥
-        char *jobbuf = pThreadPoolObj->m_MsgRecvQueue.front();
-        pThreadPoolObj->m_MsgRecvQueue.pop_front();            
+        Lane &lane = pThreadPoolObj->m_lanes[pThreadPoolObj->selectLane()];
+        char *jobbuf = lane.queue.front();
+        lane.queue.pop_front();
+        --lane.size;
         --pThreadPoolObj->m_iRecvMsgQueueCount;                
 
-        err = pthread_mutex_unlock(&m_pthreadMutex);
+        uint64_t waitTime = ngx_monotonic_usec() - ((LPSTRUC_MSG_HEADER)jobbuf)->iEnqueueTime;
+        ++lane.stat.count;
+        lane.stat.waitSum += waitTime;
+        if (waitTime > lane.stat.waitMax)
+            lane.stat.waitMax = waitTime;
+
+        err = pthread_mutex_unlock(&pThreadPoolObj->m_pthreadMutex);
         if (err != 0)
             ngx_log_stderr(err, "CThreadPool::ThreadFunc()中pthread_mutex_unlock()失败，返回的错误码为%d!", err); 
 
+        ngx_metrics_observe(NGX_MH_QUEUE_WAIT, waitTime);
+        unsigned short msgCode = ((LPSTRUC_MSG_HEADER)jobbuf)->iMsgCode;
+        ngx_metrics_stage(msgCode, NGX_MS_QUEUE, waitTime);
+        NGX_PROBE3(dequeue, jobbuf, msgCode, waitTime);
+
         // 开始处理
         ++pThreadPoolObj->m_iRunningThreadNum; // 记录正在干活的线程数量增加1（原子性，比加锁快）
 
+        uint64_t procStart = ngx_monotonic_usec();
         g_socket.threadRecvProcFunc(jobbuf); // 处理消息队列中来的消息
+        uint64_t procTime = ngx_monotonic_usec() - procStart;
+        ngx_metrics_observe(NGX_MH_PROCESS, procTime);
+        ngx_metrics_stage(msgCode, NGX_MS_HANDLER, procTime);
+        ngx_metrics_add(NGX_MC_MSG_PROCESSED);
 
         p_memory->FreeMemory(jobbuf);          // 释放消息内存
         --pThreadPoolObj->m_iRunningThreadNum; // 记录正在干活的线程数量减少1
@@ -131,6 +218,17 @@ void *CThreadPool::ThreadFunc(void *threadData)
     return (void *)0;
 }
 
+// 取一个通道的统计信息，统计周期内的计数取完清零，printTDInfo()每隔一段时间调用一次
+void CThreadPool::GetLaneStat(int lane, ThreadPoolLaneStat *pStat)
+{
+    pthread_mutex_lock(&m_pthreadMutex);
+    Lane &rLane = m_lanes[lane];
+    rLane.stat.depth = rLane.size;
+    memcpy(pStat, &rLane.stat, sizeof(ThreadPoolLaneStat));
+    memset(&rLane.stat, 0, sizeof(ThreadPoolLaneStat));
+    pthread_mutex_unlock(&m_pthreadMutex);
+}
+
 // 停止所有线程
 void CThreadPool::StopAll()
 {
@@ -172,16 +270,36 @@ void CThreadPool::StopAll()
 }
 
 // 收到一个完整消息后，入消息队列，并触发线程池中线程来处理该消息
-void CThreadPool::inMsgRecvQueueAndSignal(char *buf)
+// lane：入哪个通道，0号通道优先级最高
+// 通道已满时不入队，返回false，buf仍由调用者负责释放
+bool CThreadPool::inMsgRecvQueueAndSignal(char *buf, int lane)
 {
+    if (lane < 0 || lane >= NGX_THREADPOOL_LANES)
+        lane = NGX_THREADPOOL_LANES - 1;
+    ((LPSTRUC_MSG_HEADER)buf)->iEnqueueTime = ngx_monotonic_usec(); // 记下入队时间，出队时统计等了多久
+
     int err = pthread_mutex_lock(&m_pthreadMutex);
     if (err != 0)
     {
         ngx_log_stderr(err, "CThreadPool::inMsgRecvQueueAndSignal()pthread_mutex_lock()失败，返回的错误码为%d!", err);
     }
 
-    m_MsgRecvQueue.push_back(buf); 
+    Lane &rLane = m_lanes[lane];
+    if (m_iMaxQueueSize > 0 && rLane.size >= m_iMaxQueueSize)
+    {
+        // 队列满了，说明线程处理不过来了，再入队只会让排在后边的消息等得更久，不如直接拒绝
+        // 每个通道单独限制，低优先级通道满了不影响高优先级的消息入队
+        ++rLane.stat.rejected;
+        pthread_mutex_unlock(&m_pthreadMutex);
+        ++m_iRejectCount;
+        ngx_metrics_add(NGX_MC_MSG_REJECTED);
+        return false;
+    }
+
+    rLane.queue.push_back(buf);
+    ++rLane.size;
     ++m_iRecvMsgQueueCount; 
+    NGX_PROBE4(enqueue, buf, ((LPSTRUC_MSG_HEADER)buf)->iMsgCode, lane, (int)m_iRecvMsgQueueCount);
     err = pthread_mutex_unlock(&m_pthreadMutex);
     if (err != 0)
     {
@@ -190,7 +308,7 @@ void CThreadPool::inMsgRecvQueueAndSignal(char *buf)
 
     // 激发一个线程
     Call();
-    return;
+    return true;
 }
 
 // 调一个线程池中的线程干活
@@ -0,0 +1,204 @@
+﻿// 和管理端口有关的代码
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ngx_func.h"
+#include "ngx_global.h"
+#include "ngx_c_conf.h"
+#include "ngx_c_metrics.h"
+#include "ngx_c_admin.h"
+
+CAdminServer::CAdminServer()
+{
+    m_fd = -1;
+    m_iPort = 0;
+    m_pBuf = NULL;
+}
+
+CAdminServer::~CAdminServer()
+{
+    // 线程随master进程退出结束，socket和缓冲区也随进程释放
+}
+
+// 取平滑升级时老的master进程交过来的管理端口socket，返回fd，没有交过来或者和配置的地址对不上返回-1
+// 管理端口和监听端口一样直接接过来用，不用SO_REUSEPORT让两代进程各绑一个：那样同一用户的任何进程都能绑上来抢请求
+int CAdminServer::TakeInherited(const struct sockaddr_in *pAddr)
+{
+    const char *penv = getenv(NGX_ADMIN_FD_ENV);
+    if (penv == NULL)
+        return -1;
+    int fd = atoi(penv);
+    unsetenv(NGX_ADMIN_FD_ENV); // 再升级时会重新设置，不要带下去
+
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (fd < 0 || getsockname(fd, (struct sockaddr *)&addr, &len) == -1 || addr.sin_family != AF_INET ||
+        addr.sin_port != pAddr->sin_port || addr.sin_addr.s_addr != pAddr->sin_addr.s_addr)
+    {
+        // 新版本改了管理端口的配置，老的socket不要了
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC); // 交接时清掉了，这里恢复
+    ngx_log_error_core(NGX_LOG_NOTICE, 0, "【master进程】继承了管理端口的socket(fd=%d)!", fd);
+    return fd;
+}
+
+// 按配置打开管理端口并启动线程
+// AdminPort为0或者没配置表示不开管理端口；打开失败只写日志，不影响服务器本身启动
+// 返回值：开了管理端口返回true
+bool CAdminServer::Start()
+{
+    CConfig *p_config = CConfig::GetInstance();
+    m_iPort = p_config->GetIntDefault("AdminPort", 0);
+    if (m_iPort <= 0)
+        return false;
+    const char *pAddr = p_config->GetString("AdminAddr");
+    if (pAddr == NULL)
+        pAddr = "127.0.0.1"; // 缺省只允许本机访问
+
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons((in_port_t)m_iPort);
+    if (inet_pton(AF_INET, pAddr, &serv_addr.sin_addr) != 1)
+    {
+        ngx_log_error_core(NGX_LOG_ERR, 0, "CAdminServer::Start()中AdminAddr=%s不是合法的IPv4地址，不开管理端口!", pAddr);
+        return false;
+    }
+
+    // 平滑升级时接着用老的master进程的socket，端口一刻也没有关过；两代同时运行期间谁accept到谁回答
+    m_fd = TakeInherited(&serv_addr);
+    if (m_fd == -1)
+        m_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0); // SOCK_CLOEXEC：exec新版本时只有明确交过去才带过去
+    if (m_fd == -1)
+    {
+        ngx_log_error_core(NGX_LOG_ERR, errno, "CAdminServer::Start()中socket()失败，不开管理端口!");
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in bound;
+    socklen_t boundLen = sizeof(bound);
+    bool ifbound = (getsockname(m_fd, (struct sockaddr *)&bound, &boundLen) == 0 && bound.sin_port != 0); // 继承来的已经绑好、在监听了
+    if (!ifbound && (bind(m_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1 || listen(m_fd, 16) == -1))
+    {
+        ngx_log_error_core(NGX_LOG_ERR, errno, "CAdminServer::Start()中bind()/listen()%s:%d失败，不开管理端口!", pAddr, m_iPort);
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    m_pBuf = new u_char[NGX_ADMIN_BUFSIZE];
+    int err = pthread_create(&m_hThread, NULL, ServerAdminThread, this);
+    if (err != 0)
+    {
+        ngx_log_error_core(NGX_LOG_ERR, err, "CAdminServer::Start()中pthread_create()失败，不开管理端口!");
+        close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+    ngx_log_error_core(NGX_LOG_NOTICE, 0, "管理端口%s:%d已经打开，GET /metrics取统计信息!", pAddr, m_iPort);
+    return true;
+}
+
+// worker进程不用管理端口，fork()时继承下来的关掉
+void CAdminServer::CloseInChild()
+{
+    if (m_fd != -1)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+// 管理端口线程：一次只处理一个连接，抓取统计信息的请求不多，没必要用epoll
+// 线程继承了master进程屏蔽信号的设置，信号都由master进程的主线程在sigsuspend()中处理
+void *CAdminServer::ServerAdminThread(void *threadData)
+{
+    CAdminServer *pThis = static_cast<CAdminServer *>(threadData);
+    while (g_stopEvent == 0)
+    {
+        int fd = accept4(pThis->m_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                ngx_log_error_limited(NGX_LOG_ERR, errno, "CAdminServer::ServerAdminThread()中accept4()失败!");
+                usleep(100 * 1000); // 比如文件句柄用完了，歇一下再试，不要空转
+            }
+            continue;
+        }
+        pThis->HandleRequest(fd);
+        close(fd);
+    }
+    return (void *)0;
+}
+
+// 读请求行，GET /metrics（或者GET /）回答统计信息，其他路径回答404
+void CAdminServer::HandleRequest(int fd)
+{
+    struct timeval tv = {NGX_ADMIN_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    // 只要请求头，读到空行为止，请求体不管
+    char req[4096];
+    size_t len = 0;
+    while (len < sizeof(req) - 1)
+    {
+        ssize_t n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+        if (n <= 0)
+            return; // 超时、出错或者对方关闭，什么都不回
+        len += n;
+        req[len] = 0;
+        if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+            break;
+    }
+
+    u_char *body = m_pBuf + 256; // 前边留着写应答头
+    u_char *last = m_pBuf + NGX_ADMIN_BUFSIZE;
+    u_char *p;
+    const char *status;
+    const char *ctype;
+    if (strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET /metrics?", 13) == 0 || strncmp(req, "GET / ", 6) == 0)
+    {
+        status = "200 OK";
+        ctype = "text/plain; version=0.0.4; charset=utf-8";
+        p = CMetrics::GetInstance()->WriteText(body, last);
+    }
+    else
+    {
+        status = "404 Not Found";
+        ctype = "text/plain; charset=utf-8";
+        p = ngx_slcat(body, last, "only GET /metrics is supported\n");
+    }
+
+    // 应答头写在缓冲区开头，和应答体一起一次发出去
+    u_char hdr[256];
+    u_char *h = ngx_slcat(hdr, hdr + sizeof(hdr), "HTTP/1.0 ", status, "\r\nContent-Type: ", ctype, "\r\nContent-Length: ", (size_t)(p - body),
+                          "\r\nConnection: close\r\n\r\n");
+    u_char *start = body - (h - hdr);
+    memcpy(start, hdr, h - hdr);
+
+    while (start < p)
+    {
+        ssize_t n = send(fd, start, p - start, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            if (n == -1 && errno == EINTR)
+                continue;
+            return;
+        }
+        start += n;
+    }
+}
@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
+#include <algorithm>
 
 #include "ngx_c_conf.h"
 #include "ngx_macro.h"
@@ -18,6 +19,9 @@
 #include "ngx_c_socket.h"
 #include "ngx_c_memory.h"
 #include "ngx_c_lockmutex.h"
+#include "ngx_c_metrics.h"
+#include "ngx_c_iplimit.h"
+#include "ngx_probe.h"
 
 CSocket::CSocket()
 {
@@ -25,6 +29,7 @@ CSocket::CSocket()
     m_worker_connections = 1;      // epoll连接最大项数
     m_ListenPortCount = 1;         // 监听一个端口
     m_RecyConnectionWaitTime = 60; // 等待后才回收连接
+    m_iSendBufSize = 0;            // 发送缓冲区由内核自动调整
 
     // epoll相关
     m_epollhandle = -1; // epoll返回的句柄
@@ -39,19 +44,29 @@ CSocket::CSocket()
     m_cur_size_ = 0;              // 当前计时队列尺寸
     m_timer_value_ = 0;           // 当前计时队列头部的时间值
     m_iDiscardSendPkgCount = 0;   // 丢弃的发送数据包数量
+    m_iShedMsgCount = 0;          // 超期没处理的消息数量
 
     // 在线用户相关
     m_onlineUserCount = 0; // 在线用户数量统计，先给0
     m_lastprintTime = 0;   // 上次打印统计信息的时间，先给0
+    m_iNowMsec = 0;        // epoll_wait()返回时才取
     return;
 }
 
 // 初始化函数
 // 成功返回true，失败返回false
-void CSocket::Initialize()
+bool CSocket::Initialize()
 {
     ReadConf();                                // 读配置项
-    return;
+    if (ngx_open_listening_sockets() == false) // 打开监听端口，master进程中打开，worker进程继承
+    {
+        return false;
+    }
+    if (CIpLimit::GetInstance()->Init(m_iIpLimitSlots) == false) // 按来源IP限制连接的表，所有worker进程共用，也在master进程中分配
+    {
+        return false;
+    }
+    return true;
 }
 
 // 子进程中才需要执行的初始化函数
@@ -81,6 +96,12 @@ bool CSocket::Initialize_subproc()
         ngx_log_stderr(0, "CSocket::Initialize_subproc()中pthread_mutex_init(&m_timequeueMutex)失败.");
         return false;
     }
+    // 修改连接的epoll事件用的互斥量初始化
+    if (pthread_mutex_init(&m_epollEventMutex, NULL) != 0)
+    {
+        ngx_log_stderr(0, "CSocket::Initialize_subproc()中pthread_mutex_init(&m_epollEventMutex)失败.");
+        return false;
+    }
 
     // 初始化发消息相关信号量
     if (sem_init(&m_semEventSendQueue, 0, 0) == -1)
@@ -131,8 +152,11 @@ CSocket::~CSocket()
     std::vector<lpngx_listening_t>::iterator pos;
     for (pos = m_ListenSocketList.begin(); pos != m_ListenSocketList.end(); ++pos) // vector
     {
-        ngx_log_error_core(NGX_LOG_INFO, 0, "【worker进程】监听端口%d关闭!", (*pos)->port);
-        close((*pos)->fd);
+        if ((*pos)->fd != -1) // 优雅退出时已经关过了
+        {
+            ngx_log_error_core(NGX_LOG_INFO, 0, "监听端口%d关闭!", (*pos)->port);
+            close((*pos)->fd);
+        }
         delete (*pos);
     }
     m_ListenSocketList.clear();
@@ -171,6 +195,7 @@ void CSocket::Shutdown_subproc()
     pthread_mutex_destroy(&m_sendMessageQueueMutex);
     pthread_mutex_destroy(&m_recyconnqueueMutex);
     pthread_mutex_destroy(&m_timequeueMutex);
+    pthread_mutex_destroy(&m_epollEventMutex);
     sem_destroy(&m_semEventSendQueue);
 
     ngx_log_error_core(NGX_LOG_NOTICE, 0, "%P 【worker进程】关闭成功......!", ngx_pid);
@@ -197,20 +222,33 @@ void CSocket::ReadConf()
     m_worker_connections = p_config->GetIntDefault("worker_connections", m_worker_connections);                  // epoll连接的最大项数
     m_ListenPortCount = p_config->GetIntDefault("ListenPortCount", m_ListenPortCount);                           // 取得要监听的端口数量
     m_RecyConnectionWaitTime = p_config->GetIntDefault("Sock_RecyConnectionWaitTime", m_RecyConnectionWaitTime); // 等待这么些秒后才回收连接
+    m_iSendBufSize = p_config->GetIntDefault("Sock_SendBufSize", 0);                                              // 新连接的发送缓冲区大小，0表示由内核自动调整
 
     m_ifkickTimeCount = p_config->GetIntDefault("Sock_WaitTimeEnable", 0);  // 是否开启踢人时钟，1：开启   0：不开启
-    m_iWaitTime = p_config->GetIntDefault("Sock_MaxWaitTime", m_iWaitTime); // 多少秒检测一次是否 心跳超时，只有当Sock_WaitTimeEnable = 1时，本项才有用
-    m_iWaitTime = (m_iWaitTime > 5) ? m_iWaitTime : 5;                      // 不建议低于5秒钟，因为无需太频繁
-    m_ifTimeOutKick = p_config->GetIntDefault("Sock_TimeOutKick", 0);       // 当时间到达Sock_MaxWaitTime指定的时间时，直接把客户端踢出去，只有当Sock_WaitTimeEnable = 1时，本项才有用
 
-    m_floodAkEnable = p_config->GetIntDefault("Sock_FloodAttackKickEnable", 0);   // Flood攻击检测是否开启,1：开启   0：不开启
-    m_floodTimeInterval = p_config->GetIntDefault("Sock_FloodTimeInterval", 100); // 表示每次收到数据包的时间间隔是100(毫秒)
-    m_floodKickCount = p_config->GetIntDefault("Sock_FloodKickCounter", 10);      // 累积多少次踢出此人
+    // 下边这些在运行中随时可能被调整，存的是句柄，用的时候再用ngx_conf_get()读当前值
+    m_hWaitTime = p_config->GetDurationHandle("Sock_MaxWaitTime", 20 * 1000, 1000, 5 * 1000); // 多久检测一次是否心跳超时，不带单位是秒，不建议低于5秒钟，因为无需太频繁
+    m_hTimeOutKick = p_config->GetBoolHandle("Sock_TimeOutKick", false);                     // 当时间到达Sock_MaxWaitTime指定的时间时，直接把客户端踢出去，只有当Sock_WaitTimeEnable = 1时，本项才有用
+
+    m_hFloodAkEnable = p_config->GetBoolHandle("Sock_FloodAttackKickEnable", false);          // Flood攻击检测是否开启,1：开启   0：不开启
+    m_hFloodPktRate = p_config->GetIntHandle("Sock_FloodPktRate", 10, 0, 1000000);            // 每个连接每秒最多收多少个包，0表示不限
+    m_hFloodPktBurst = p_config->GetIntHandle("Sock_FloodPktBurst", 20, 1, 1000000);          // 最多能连着收多少个包
+    m_hFloodByteRate = p_config->GetSizeHandle("Sock_FloodByteRate", 0, 0, 1LL << 30);        // 每个连接每秒最多收多少字节，0表示不限
+    m_hFloodByteBurst = p_config->GetSizeHandle("Sock_FloodByteBurst", 64 * 1024, _PKG_MAX_LENGTH, 1LL << 30); // 至少要装得下一个最大的包
+    m_hFloodAction = p_config->GetIntHandle("Sock_FloodAction", NGX_FLOOD_KICK, NGX_FLOOD_DELAY, NGX_FLOOD_KICK); // 超限了怎么办，0：推迟读 1：丢包 2：踢人
+
+    m_iIpLimitSlots = p_config->GetIntDefault("Sock_IpLimitSlots", 4096);                  // 按来源IP限制的表有多少个槽位
+    m_hIpMaxConns = p_config->GetIntHandle("Sock_IpMaxConns", 0, 0, 1000000);              // 同一个来源IP最多同时有多少个连接，0表示不限
+    m_hIpAcceptRate = p_config->GetIntHandle("Sock_IpAcceptRate", 0, 0, 1000000);          // 同一个来源IP每秒最多接受多少个新连接，0表示不限
+    m_hIpAcceptBurst = p_config->GetIntHandle("Sock_IpAcceptBurst", 50, 1, 1000000);       // 最多能连着接受多少个新连接
+    m_hIpPktRate = p_config->GetIntHandle("Sock_IpPktRate", 0, 0, 1000000);                // 同一个来源IP的所有连接每秒最多收多少个包，0表示不限
+    m_hIpPktBurst = p_config->GetIntHandle("Sock_IpPktBurst", 200, 1, 1000000);            // 最多能连着收多少个包
 
     return;
 }
 
-// 监听端口，支持多个端口
+// 监听端口，支持多个端口，master进程中执行，worker进程继承
+// 平滑升级时由老的master进程exec起来的，环境变量中有老的master进程的监听socket，端口对得上的直接拿来用
 bool CSocket::ngx_open_listening_sockets()
 {
     int isock; // socket
@@ -222,9 +260,40 @@ bool CSocket::ngx_open_listening_sockets()
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
+    // 继承来的监听socket，格式"fd;fd;"
+    std::vector<int> inherited;
+    const char *penv = getenv(NGX_LISTEN_FDS_ENV);
+    if (penv != NULL)
+    {
+        char *pend;
+        for (const char *p = penv; *p; p = pend + (*pend == ';'))
+        {
+            long fd = strtol(p, &pend, 10);
+            if (pend == p)
+                break;
+            inherited.push_back((int)fd);
+        }
+        unsetenv(NGX_LISTEN_FDS_ENV); // 再升级时会重新设置，不要带下去
+    }
+
     CConfig *p_config = CConfig::GetInstance();
     for (int i = 0; i < m_ListenPortCount; i++) // 监听端口数量
     {
+        strinfo[0] = 0;
+        sprintf(strinfo, "ListenPort%d", i);
+        iport = p_config->GetIntDefault(strinfo, 10000);
+
+        isock = ngx_take_inherited_socket(inherited, iport);
+        if (isock != -1)
+        {
+            lpngx_listening_t p_listensocketitem = new ngx_listening_t;
+            memset(p_listensocketitem, 0, sizeof(ngx_listening_t));
+            p_listensocketitem->port = iport;
+            p_listensocketitem->fd = isock;
+            ngx_log_error_core(NGX_LOG_NOTICE, 0, "【master进程】继承了监听%d端口的socket(fd=%d)!", iport, isock);
+            m_ListenSocketList.push_back(p_listensocketitem);
+            continue;
+        }
 
         isock = socket(AF_INET, SOCK_STREAM, 0);
         if (isock == -1)
@@ -242,15 +311,9 @@ bool CSocket::ngx_open_listening_sockets()
             return false;
         }
 
-        // 为处理惊群问题使用reuseport
-        // SO_REUSEPORT允许多个监听套接字绑定到同一个端口
-
-        int reuseport = 1;
-        if (setsockopt(isock, SOL_SOCKET, SO_REUSEPORT, (const void *)&reuseport, sizeof(int)) == -1) // 端口复用需要内核支持
-        {
-            ngx_log_stderr(errno, "CSocket::Initialize()中setsockopt(SO_REUSEPORT)失败", i);
-            return false;
-        }
+        // 监听socket在master进程中打开，所有worker进程共用一个，不再用SO_REUSEPORT每个worker进程各开一个：
+        // 那样worker进程退出时它那个socket的已完成连接队列里排队的连接会被内核直接reset掉
+        // 惊群问题由worker进程往epoll中加监听socket时带EPOLLEXCLUSIVE来解决
 
         // 设置socket为非阻塞
         if (setnonblocking(isock) == false)
@@ -260,9 +323,6 @@ bool CSocket::ngx_open_listening_sockets()
             return false;
         }
 
-        strinfo[0] = 0;
-        sprintf(strinfo, "ListenPort%d", i);
-        iport = p_config->GetIntDefault(strinfo, 10000);
         serv_addr.sin_port = htons((in_port_t)iport);
 
         if (bind(isock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1)
@@ -287,12 +347,43 @@ bool CSocket::ngx_open_listening_sockets()
         ngx_log_error_core(NGX_LOG_INFO, 0, "【master进程】监听%d端口成功!", iport);
         m_ListenSocketList.push_back(p_listensocketitem);
     }
+
+    // 新配置中已经不监听的端口，继承来的socket关掉
+    for (size_t i = 0; i < inherited.size(); i++)
+    {
+        if (inherited[i] != -1)
+        {
+            ngx_log_error_core(NGX_LOG_NOTICE, 0, "【master进程】继承来的监听socket(fd=%d)不在配置中，关闭!", inherited[i]);
+            close(inherited[i]);
+        }
+    }
     if (m_ListenSocketList.size() <= 0) // 不可能一个端口都不监听
         return false;
 
     return true;
 }
 
+// 从继承来的监听socket中找出监听iport端口的那个，找到了就从inherited中拿走（置为-1），找不到返回-1
+int CSocket::ngx_take_inherited_socket(std::vector<int> &inherited, int iport)
+{
+    for (size_t i = 0; i < inherited.size(); i++)
+    {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        if (inherited[i] == -1)
+            continue;
+        if (getsockname(inherited[i], (struct sockaddr *)&addr, &len) == -1 || addr.sin_family != AF_INET)
+            continue;
+        if (ntohs(addr.sin_port) == iport)
+        {
+            int fd = inherited[i];
+            inherited[i] = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
 // 设置socket连接为非阻塞模式
 bool CSocket::setnonblocking(int sockfd)
 {
@@ -304,6 +395,42 @@ bool CSocket::setnonblocking(int sockfd)
     return true;
 }
 
+// worker进程优雅退出时调用：监听socket从epoll中去掉并关闭，不再接受新连接，已有连接照常处理
+// master进程和其他worker进程中这个socket还开着，已完成连接队列里排队的连接由它们去accept，不会丢
+void CSocket::ngx_stop_accepting()
+{
+    std::vector<lpngx_listening_t>::iterator pos;
+    for (pos = m_ListenSocketList.begin(); pos != m_ListenSocketList.end(); ++pos)
+    {
+        if ((*pos)->fd == -1)
+            continue;
+        if (epoll_ctl(m_epollhandle, EPOLL_CTL_DEL, (*pos)->fd, NULL) == -1)
+        {
+            ngx_log_error_core(NGX_LOG_ALERT, errno, "CSocket::ngx_stop_accepting()中epoll_ctl(%d)失败!", (*pos)->fd);
+        }
+        if ((*pos)->connection != NULL)
+        {
+            (*pos)->connection->fd = -1; // 已经取出来的这个socket上的事件就当过期事件不处理了
+        }
+        close((*pos)->fd);
+        (*pos)->fd = -1;
+        ngx_log_error_core(NGX_LOG_INFO, 0, "%P 【worker进程】不再监听%d端口!", ngx_pid, (*pos)->port);
+    }
+}
+
+// 取得所有监听套接字
+int CSocket::GetListenFds(int *fds, int max)
+{
+    int n = 0;
+    std::vector<lpngx_listening_t>::iterator pos;
+    for (pos = m_ListenSocketList.begin(); pos != m_ListenSocketList.end() && n < max; ++pos)
+    {
+        if ((*pos)->fd != -1)
+            fds[n++] = (*pos)->fd;
+    }
+    return n;
+}
+
 // 关闭socket
 void CSocket::ngx_close_listening_sockets()
 {
@@ -328,6 +455,7 @@ void CSocket::msgSend(char *psendbuf)
         // 发送队列过大，比如客户端恶意不接受数据，就会导致这个队列越来越大
         // 为了服务器安全，干掉一些数据的发送，虽然有可能导致客户端出现问题，但总比服务器不稳定要好很多
         m_iDiscardSendPkgCount++;
+        ngx_metrics_add(NGX_MC_SEND_DISCARDED);
         p_memory->FreeMemory(psendbuf);
         return;
     }
@@ -338,20 +466,25 @@ void CSocket::msgSend(char *psendbuf)
     if (p_Conn->iSendCount > 400)
     {
         // 该用户收消息太慢或者干脆不收消息，累积的该用户的发送队列中有的数据条目数过大，认为是恶意用户，直接切断
-        ngx_log_stderr(0, "CSocket::msgSend()中发现某用户%d积压了大量待发送数据包，切断与他的连接！", p_Conn->fd);
+        ngx_log_binary(NGX_BL_KICK_SENDQUEUE, 0, p_Conn->fd);
         m_iDiscardSendPkgCount++;
+        ngx_metrics_add(NGX_MC_SEND_DISCARDED);
+        ngx_metrics_add(NGX_MC_SENDQ_KICKS);
         p_memory->FreeMemory(psendbuf);
         zdClosesocketProc(p_Conn); // 直接关闭
         return;
     }
 
     ++p_Conn->iSendCount; // 发送队列中有的数据条目数+1
+    pMsgHeader->iSendQueueTime = ngx_monotonic_usec();
+    pMsgHeader->iSendStartTime = 0;
+    NGX_PROBE4(msg_send, p_Conn->fd, psendbuf, pMsgHeader->iMsgCode, (int)m_iSendMsgQueueCount);
     m_MsgSendQueue.push_back(psendbuf);
     ++m_iSendMsgQueueCount; // 原子操作
 
     if (sem_post(&m_semEventSendQueue) == -1) // 让ServerSendQueueThread()流程走下来干活
     {
-        ngx_log_stderr(0, "CSocket::msgSend()中sem_post(&m_semEventSendQueue)失败.");
+        ngx_log_stderr_limited(0, "CSocket::msgSend()中sem_post(&m_semEventSendQueue)失败.");
     }
     return;
 }
@@ -360,6 +493,7 @@ void CSocket::msgSend(char *psendbuf)
 // 这个函数是可能被多线程调用的，但是即便被多线程调用，也没关系，不影响本服务器程序的稳定性和正确运行性
 void CSocket::zdClosesocketProc(lpngx_connection_t p_Conn)
 {
+    NGX_PROBE2(close, p_Conn->fd, p_Conn);
     if (m_ifkickTimeCount == 1)
     {
         DeleteFromTimerQueue(p_Conn); // 从时间队列中把连接干掉
@@ -369,6 +503,7 @@ void CSocket::zdClosesocketProc(lpngx_connection_t p_Conn)
         close(p_Conn->fd); // 调用close函数后，内核会自动将fd从epoll中删除
         p_Conn->fd = -1;
     }
+    CIpLimit::GetInstance()->Release(p_Conn->iIpSlot.exchange(-1)); // 这个来源地址的连接数-1，这个函数可能被调用不止一次，只减一次
 
     if (p_Conn->iThrowsendCount > 0)
         --p_Conn->iThrowsendCount; // 归0
@@ -377,34 +512,106 @@ void CSocket::zdClosesocketProc(lpngx_connection_t p_Conn)
     return;
 }
 
-// 测试是否flood攻击成立，成立则返回true，否则返回false
-bool CSocket::TestFlood(lpngx_connection_t pConn)
+// Flood攻击检测：每个连接一个包数令牌桶、一个字节数令牌桶，按配置的速度补充令牌，最多攒到桶的容量，收完一个包（pkgLen是包头+包体的长度）时各扣一份
+// 不是只看相邻两个包的间隔，快发一阵、偶尔慢一下的连接也能按平均速度被限住；时间用epoll每轮取一次的m_iNowMsec，不用每个包都取时间
+// 返回true表示这个包超限了，要丢掉（Sock_FloodAction为丢包、踢人时）；推迟读时包照收，令牌欠着，记下令牌补回来的时间，返回false，由调用者暂停读
+bool CSocket::TestFlood(lpngx_connection_t pConn, unsigned int pkgLen)
 {
-    struct timeval sCurrTime;
-    uint64_t iCurrTime; // 当前时间（单位：毫秒）
-    bool reco = false;
+    int64_t pktRate = ngx_conf_get(m_hFloodPktRate);
+    int64_t byteRate = ngx_conf_get(m_hFloodByteRate);
+    int64_t pktBurst = ngx_conf_get(m_hFloodPktBurst) * 1000;
+    int64_t byteBurst = ngx_conf_get(m_hFloodByteBurst) * 1000;
+    uint64_t now = m_iNowMsec;
 
-    gettimeofday(&sCurrTime, NULL);                                   // 取得当前时间
-    iCurrTime = (sCurrTime.tv_sec * 1000 + sCurrTime.tv_usec / 1000); // 毫秒
-    if ((iCurrTime - pConn->FloodkickLastTime) < m_floodTimeInterval) // 两次收到包的时间 < 100毫秒
+    if (pConn->iFloodTokenTime == 0)
     {
-        // 发包太频繁记录
-        pConn->FloodAttackCount++;
-        pConn->FloodkickLastTime = iCurrTime;
+        // 第一个包，桶是满的
+        pConn->iFloodPktTokens = pktBurst;
+        pConn->iFloodByteTokens = byteBurst;
     }
-    else
+    else if (now > pConn->iFloodTokenTime)
+    {
+        // 速度是每秒多少个，令牌以千分之一为单位，每毫秒正好补rate个
+        int64_t elapsed = (int64_t)(now - pConn->iFloodTokenTime);
+        if (elapsed > 3600 * 1000)
+            elapsed = 3600 * 1000; // 一小时足够把任何桶装满，再多乘起来可能溢出
+        pConn->iFloodPktTokens = std::min(pktBurst, pConn->iFloodPktTokens + elapsed * pktRate);
+        pConn->iFloodByteTokens = std::min(byteBurst, pConn->iFloodByteTokens + elapsed * byteRate);
+    }
+    pConn->iFloodTokenTime = now;
+
+    int64_t pktCost = 1000, byteCost = (int64_t)pkgLen * 1000;
+    bool delay = (ngx_conf_get(m_hFloodAction) == NGX_FLOOD_DELAY);
+    bool over = (pktRate > 0 && pConn->iFloodPktTokens < pktCost) || (byteRate > 0 && pConn->iFloodByteTokens < byteCost);
+
+    // 同一个来源IP的所有连接合起来还有一个收包速度的限制，桶在CIpLimit的共享内存里；连接自己已经超限（不推迟读时）就不用再扣了
+    int64_t ipWait = 0;
+    int64_t ipPktRate = ngx_conf_get(m_hIpPktRate);
+    if ((over == false || delay) && ipPktRate > 0 && pConn->iIpSlot >= 0)
+    {
+        if (CIpLimit::GetInstance()->TakePkt(pConn->iIpSlot, now, ipPktRate, ngx_conf_get(m_hIpPktBurst), delay, &ipWait) == false)
+            over = true;
+    }
+
+    if (over == false || delay)
+    {
+        pConn->iFloodPktTokens -= pktCost;
+        pConn->iFloodByteTokens -= byteCost;
+    }
+    if (over == false)
+        return false;
+    if (delay == false)
+        return true;
+
+    // 推迟读：等欠的令牌补回来，至少等1毫秒；不限速的那个桶不用等（它的令牌数也不再有意义，重新开启限速时最多一小时就补满了）
+    int64_t wait = std::max((int64_t)1, ipWait);
+    if (pktRate > 0 && pConn->iFloodPktTokens < 0)
+        wait = std::max(wait, (-pConn->iFloodPktTokens + pktRate - 1) / pktRate);
+    if (byteRate > 0 && pConn->iFloodByteTokens < 0)
+        wait = std::max(wait, (-pConn->iFloodByteTokens + byteRate - 1) / byteRate);
+    pConn->iFloodResumeTime = now + wait;
+    return false;
+}
+
+// 超限后暂停读这个连接：epoll中去掉EPOLLIN（还有EPOLLRDHUP，否则对端关闭时这个事件一直报），到pConn->iFloodResumeTime由ngx_flood_resume()加回来
+// 暂停期间对端断开只会报EPOLLERR/EPOLLHUP，ngx_epoll_process_events()中直接关闭
+void CSocket::ngx_flood_pause(lpngx_connection_t pConn)
+{
+    if (ngx_epoll_oper_event(pConn->fd, EPOLL_CTL_MOD, EPOLLIN | EPOLLRDHUP, 1, pConn) == -1)
     {
-        // 既然发布不这么频繁，则恢复计数值
-        pConn->FloodAttackCount = 0;
-        pConn->FloodkickLastTime = iCurrTime;
+        pConn->iFloodResumeTime = 0; // 暂停不了就接着读
+        return;
     }
+    ngx_flood_paused_t item;
+    item.pConn = pConn;
+    item.iCurrsequence = pConn->iCurrsequence;
+    m_floodPaused.push_back(item);
+    ngx_metrics_add(NGX_MC_FLOOD_DELAYS);
+    return;
+}
 
-    if (pConn->FloodAttackCount >= m_floodKickCount)
+// 恢复到时间了的暂停读的连接，暂停期间已经关闭（或者又被复用）的连接序号对不上，直接扔掉
+void CSocket::ngx_flood_resume()
+{
+    size_t i = 0;
+    while (i < m_floodPaused.size())
     {
-        // 可以踢此人的标志
-        reco = true;
+        lpngx_connection_t pConn = m_floodPaused[i].pConn;
+        if (pConn->iCurrsequence == m_floodPaused[i].iCurrsequence && pConn->fd != -1)
+        {
+            if (pConn->iFloodResumeTime > m_iNowMsec)
+            {
+                ++i; // 还没到时间
+                continue;
+            }
+            pConn->iFloodResumeTime = 0;
+            ngx_epoll_oper_event(pConn->fd, EPOLL_CTL_MOD, EPOLLIN | EPOLLRDHUP, 0, pConn); // 失败了这个连接就收不到数据了，等心跳超时踢掉
+        }
+        // 顺序无所谓，拿最后一个填过来
+        m_floodPaused[i] = m_floodPaused.back();
+        m_floodPaused.pop_back();
     }
-    return reco;
+    return;
 }
 
 // 打印统计信息
@@ -423,7 +630,26 @@ void CSocket::printTDInfo()
         ngx_log_stderr(0, "当前在线人数/总人数(%d/%d)。", tmpoLUC, m_worker_connections);
         ngx_log_stderr(0, "连接池中空闲连接/总连接/要释放的连接(%d/%d/%d)。", m_freeconnectionList.size(), m_connectionList.size(), m_recyconnectionList.size());
         ngx_log_stderr(0, "当前时间队列大小(%d)。", m_timerQueuemap.size());
+        unsigned int tmpipconns;
+        unsigned int tmpipused = CIpLimit::GetInstance()->GetUsed(&tmpipconns);
+        ngx_log_stderr(0, "按IP限制的表中用着的槽位/总槽位(%ud/%ud)，这些地址共有%ud个连接（所有worker进程）。", tmpipused, CIpLimit::GetInstance()->GetSlotCount(), tmpipconns);
         ngx_log_stderr(0, "当前收消息队列/发消息队列大小分别为(%d/%d)，丢弃的待发送数据包数量为%d。", tmprmqc, tmpsmqc, m_iDiscardSendPkgCount);
+        uint64_t tmpdropped = ngx_log_dropped_count();
+        if (tmpdropped > 0)
+        {
+            ngx_log_stderr(0, "因为日志缓冲区满而丢弃的日志行数为%uL。", tmpdropped);
+        }
+        int tmpshed = m_iShedMsgCount;
+        if (tmpshed > 0)
+        {
+            ngx_log_stderr(0, "因为排队超过处理期限而回复服务器忙的消息数量为%d。", tmpshed);
+        }
+        printLaneInfo("线程池", &g_threadpool);
+        if (g_cpupool.getThreadNum() > 0)
+        {
+            ngx_log_stderr(0, "耗CPU消息线程池队列大小(%d)，因队列满拒绝的消息数量为%d。", g_cpupool.getRecvMsgQueueCount(), g_cpupool.getRejectCount());
+            printLaneInfo("耗CPU消息线程池", &g_cpupool);
+        }
         if (tmprmqc > 100000)
         {
             // 接收队列过大，报一下，这个应该引起警觉，考虑限速等等手段
@@ -434,6 +660,61 @@ void CSocket::printTDInfo()
     return;
 }
 
+// 把当前值写到统计信息共享内存中，回收连接的线程每200毫秒调用一次，服务器空闲时也照样刷新
+// 只读各个计数，不加锁，差几个无所谓
+void CSocket::publishMetrics()
+{
+    ngx_metrics_set(NGX_MG_ONLINE, m_onlineUserCount);
+    ngx_metrics_set(NGX_MG_CONN_POOL, m_total_connection_n);
+    ngx_metrics_set(NGX_MG_CONN_FREE, m_free_connection_n);
+    ngx_metrics_set(NGX_MG_CONN_RECY, m_totol_recyconnection_n);
+    ngx_metrics_set(NGX_MG_TIMER_QUEUE, m_cur_size_);
+    ngx_metrics_set(NGX_MG_RECV_QUEUE, g_threadpool.getRecvMsgQueueCount());
+    ngx_metrics_set(NGX_MG_CPU_QUEUE, g_cpupool.getRecvMsgQueueCount());
+    ngx_metrics_set(NGX_MG_SEND_QUEUE, m_iSendMsgQueueCount);
+
+    // 常驻内存：/proc/self/statm的第二项，单位是页
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd != -1)
+    {
+        char buf[128];
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        long size, resident;
+        if (n > 0)
+        {
+            buf[n] = 0;
+            if (sscanf(buf, "%ld %ld", &size, &resident) == 2)
+                ngx_metrics_set(NGX_MG_RSS, (int64_t)resident * sysconf(_SC_PAGESIZE));
+        }
+    }
+
+    // 日志丢弃的条数本来就是累计值，把增加的部分加到计数器上，worker进程重启后也能接着累加
+    static uint64_t lastDropped = 0;
+    uint64_t dropped = ngx_log_dropped_count();
+    if (dropped != lastDropped)
+    {
+        ngx_metrics_add(NGX_MC_LOG_DROPPED, (int64_t)(dropped - lastDropped));
+        lastDropped = dropped;
+    }
+    return;
+}
+
+// 打印一个线程池各个通道的统计信息，统计的是上次打印以来的情况
+void CSocket::printLaneInfo(const char *pName, CThreadPool *pPool)
+{
+    ThreadPoolLaneStat stat;
+    for (int i = 0; i < NGX_THREADPOOL_LANES; i++)
+    {
+        pPool->GetLaneStat(i, &stat);
+        if (stat.depth == 0 && stat.count == 0 && stat.rejected == 0)
+            continue; // 没动静的通道不打印
+        ngx_log_stderr(0, "%s通道%d：排队%d，出队%uL，平均等待%uLus，最长等待%uLus，拒绝%uL。", pName, i, stat.depth, stat.count,
+                       stat.count ? stat.waitSum / stat.count : 0, stat.waitMax, stat.rejected);
+    }
+    return;
+}
+
 // epoll功能初始化，子进程中进行，本函数被ngx_worker_process_init()所调用
 int CSocket::ngx_epoll_init()
 {
@@ -468,7 +749,7 @@ int CSocket::ngx_epoll_init()
         if (ngx_epoll_oper_event(
                 (*pos)->fd,
                 EPOLL_CTL_ADD,
-                EPOLLIN | EPOLLRDHUP,
+                EPOLLIN | EPOLLEXCLUSIVE, // 所有worker进程共用一个监听socket，EPOLLEXCLUSIVE让来一个连接只唤醒一个进程，不惊群
                 0,
                 p_Conn) == -1)
         {
@@ -498,6 +779,9 @@ int CSocket::ngx_epoll_oper_event(
     }
     else if (eventtype == EPOLL_CTL_MOD)
     {
+        // 发送线程（加EPOLLOUT）和epoll线程（去EPOLLOUT、Flood限速暂停/恢复读）都会改同一个连接的events，
+        // 取events、改、epoll_ctl()要一起互斥，否则后做的会把先做的改动盖掉
+        CLock lock(&m_epollEventMutex);
         ev.events = pConn->events;
         if (bcaction == 0)
         {
@@ -515,6 +799,13 @@ int CSocket::ngx_epoll_oper_event(
             ev.events = flag;
         }
         pConn->events = ev.events;
+        ev.data.ptr = (void *)pConn;
+        if (epoll_ctl(m_epollhandle, eventtype, fd, &ev) == -1)
+        {
+            ngx_log_stderr_limited(errno, "CSocket::ngx_epoll_oper_event()中epoll_ctl(%d,%ud,%ud,%d)失败.", fd, eventtype, flag, bcaction);
+            return -1;
+        }
+        return 1;
     }
     else
     {
@@ -526,7 +817,7 @@ int CSocket::ngx_epoll_oper_event(
 
     if (epoll_ctl(m_epollhandle, eventtype, fd, &ev) == -1)
     {
-        ngx_log_stderr(errno, "CSocket::ngx_epoll_oper_event()中epoll_ctl(%d,%ud,%ud,%d)失败.", fd, eventtype, flag, bcaction);
+        ngx_log_stderr_limited(errno, "CSocket::ngx_epoll_oper_event()中epoll_ctl(%d,%ud,%ud,%d)失败.", fd, eventtype, flag, bcaction);
         return -1;
     }
     return 1;
@@ -538,19 +829,36 @@ int CSocket::ngx_epoll_oper_event(
 // 本函数被ngx_process_events_and_timers()调用，而ngx_process_events_and_timers()是在子进程的死循环中被反复调用
 int CSocket::ngx_epoll_process_events(int timer)
 {
+    if (!m_floodPaused.empty())
+    {
+        // 有暂停读的连接，最晚到最早的恢复时间就要回来
+        uint64_t earliest = UINT64_MAX;
+        for (size_t i = 0; i < m_floodPaused.size(); ++i)
+        {
+            if (m_floodPaused[i].pConn->iCurrsequence == m_floodPaused[i].iCurrsequence)
+                earliest = std::min(earliest, m_floodPaused[i].pConn->iFloodResumeTime);
+        }
+        int wait = earliest > m_iNowMsec ? (int)std::min(earliest - m_iNowMsec, (uint64_t)1000) : 0;
+        if (timer == -1 || wait < timer)
+            timer = wait;
+    }
+
     int events = epoll_wait(m_epollhandle, m_events, NGX_MAX_EVENTS, timer);
+    m_iNowMsec = ngx_monotonic_coarse_msec();
+    if (!m_floodPaused.empty())
+        ngx_flood_resume();
 
     if (events == -1)
     {
         // #define EINTR  4，EINTR错误的产生：当阻塞于某个慢系统调用的一个进程捕获某个信号且相应信号处理函数返回时，该系统调用可能返回一个EINTR错误。
         if (errno == EINTR)
         {
-            ngx_log_error_core(NGX_LOG_INFO, errno, "CSocket::ngx_epoll_process_events()中epoll_wait()失败!");
+            ngx_log_error(NGX_LOG_INFO, errno, "CSocket::ngx_epoll_process_events()中epoll_wait()失败!");
             return 1; // 正常返回
         }
         else
         {
-            ngx_log_error_core(NGX_LOG_ALERT, errno, "CSocket::ngx_epoll_process_events()中epoll_wait()失败!");
+            ngx_log_error_limited(NGX_LOG_ALERT, errno, "CSocket::ngx_epoll_process_events()中epoll_wait()失败!");
             return 0; // 非正常返回
         }
     }
@@ -563,7 +871,7 @@ int CSocket::ngx_epoll_process_events(int timer)
             return 1;
         }
         // 无限等待，但却没返回任何事件，这应该有问题
-        ngx_log_error_core(NGX_LOG_ALERT, 0, "CSocket::ngx_epoll_process_events()中epoll_wait()没超时却没返回任何事件!");
+        ngx_log_error_limited(NGX_LOG_ALERT, 0, "CSocket::ngx_epoll_process_events()中epoll_wait()没超时却没返回任何事件!");
         return 0; // 非正常返回
     }
 
@@ -577,12 +885,19 @@ int CSocket::ngx_epoll_process_events(int timer)
         // 事件2通过fd得知连接已经断开了，不处理
         if (p_Conn->fd == -1)
         {
-            ngx_log_error_core(NGX_LOG_DEBUG, 0, "CSocket::ngx_epoll_process_events()中遇到了fd=-1的过期事件: %p", p_Conn);
+            ngx_log_error(NGX_LOG_DEBUG, 0, "CSocket::ngx_epoll_process_events()中遇到了fd=-1的过期事件: %p", p_Conn);
             continue;
         }
 
         revents = m_events[i].events;
 
+        if (p_Conn->iFloodResumeTime != 0 && (revents & (EPOLLERR | EPOLLHUP)))
+        {
+            // 暂停读的连接出错或者对端断开了，读不到，直接关闭
+            zdClosesocketProc(p_Conn);
+            continue;
+        }
+
         if (revents & EPOLLIN)
         {
             p_Conn->lastPingTime = time(NULL);
@@ -611,6 +926,7 @@ void *CSocket::ServerSendQueueThread(void *threadData)
     ThreadItem *pThread = static_cast<ThreadItem *>(threadData);
     CSocket *pSocketObj = pThread->_pThis;
     int err;
+    ngx_log_thread_init(); // 本线程写日志用自己的环形缓冲区
     std::list<char *>::iterator pos, pos2, posend;
 
     char *pMsgBuf;
@@ -645,6 +961,7 @@ void *CSocket::ServerSendQueueThread(void *threadData)
             if (err != 0)
                 ngx_log_stderr(err, "CSocket::ServerSendQueueThread()中pthread_mutex_lock()失败，返回的错误码为%d!", err);
 
+            uint64_t scanStart = ngx_monotonic_usec(); // 发送缓冲区满的连接的消息留在队列里，每次都要从头扫一遍，慢客户端多了会越来越慢
             pos = pSocketObj->m_MsgSendQueue.begin();
             posend = pSocketObj->m_MsgSendQueue.end();
 
@@ -658,6 +975,7 @@ void *CSocket::ServerSendQueueThread(void *threadData)
                 if (p_Conn->iCurrsequence != pMsgHeader->iCurrsequence)
                 {
                     // 本包中保存的序列号与p_Conn中实际的序列号已经不同，丢弃此消息
+                    pos2 = pos;
                     ++pos;
                     pSocketObj->m_MsgSendQueue.erase(pos2);
                     --pSocketObj->m_iSendMsgQueueCount;
@@ -684,6 +1002,7 @@ void *CSocket::ServerSendQueueThread(void *threadData)
                 p_Conn->psendbuf = (char *)pPkgHeader; // 要发送的数据的缓冲区指针，因为发送数据不一定全部都能发送出去，要记录数据发送到了哪里，需要知道下次数据从哪里开始发送
                 itmp = ntohs(pPkgHeader->pkgLen);      // 包头+包体长度 ，打包时用了htons
                 p_Conn->isendlen = itmp;               // 要发送多少数据，因为发送数据不一定全部都能发送出去，需要知道剩余有多少数据还没发送
+                pMsgHeader->iSendStartTime = ngx_monotonic_usec();
 
                 sendsize = pSocketObj->sendproc(p_Conn, p_Conn->psendbuf, p_Conn->isendlen);
                 if (sendsize > 0)
@@ -691,6 +1010,7 @@ void *CSocket::ServerSendQueueThread(void *threadData)
                     if (sendsize == p_Conn->isendlen) // 成功发送出去了数据
                     {
                         // 成功发送的和要求发送的数据相等，说明数据全部发完
+                        pSocketObj->sendPkgDone(p_Conn);
                         p_memory->FreeMemory(p_Conn->psendMemPointer);
                         p_Conn->psendMemPointer = NULL;
                         p_Conn->iThrowsendCount = 0;
@@ -701,6 +1021,7 @@ void *CSocket::ServerSendQueueThread(void *threadData)
                         p_Conn->psendbuf = p_Conn->psendbuf + sendsize;
                         p_Conn->isendlen = p_Conn->isendlen - sendsize;
                         // 因为发送缓冲区满了，所以现在要依赖系统通知来发送数据
+                        ngx_metrics_add(NGX_MC_SEND_BLOCKED);
                         ++p_Conn->iThrowsendCount; // 标记发送缓冲区满了，需要通过epoll事件来驱动消息的继续发送，原子+1，且不可写成p_Conn->iThrowsendCount = p_Conn->iThrowsendCount +1 ，这种写法不是原子+1
                         // 投递此事件后，依靠epoll调用ngx_write_request_handler()函数发送数据
                         if (pSocketObj->ngx_epoll_oper_event(
@@ -710,7 +1031,7 @@ void *CSocket::ServerSendQueueThread(void *threadData)
                                 0,
                                 p_Conn) == -1)
                         {
-                            ngx_log_stderr(errno, "CSocket::ServerSendQueueThread()ngx_epoll_oper_event()失败.");
+                            ngx_log_stderr_limited(errno, "CSocket::ServerSendQueueThread()ngx_epoll_oper_event()失败.");
                         }
                     }
                     continue;
@@ -728,6 +1049,7 @@ void *CSocket::ServerSendQueueThread(void *threadData)
                 else if (sendsize == -1)
                 {
                     // 一个字节都没发出去，说明发送缓冲区当前正好是满的
+                    ngx_metrics_add(NGX_MC_SEND_BLOCKED);
                     ++p_Conn->iThrowsendCount; // 标记发送缓冲区满了，需要通过epoll事件来驱动消息的继续发送
                     // 投递此事件后，依靠epoll调用ngx_write_request_handler()函数发送数据
                     if (pSocketObj->ngx_epoll_oper_event(
@@ -737,7 +1059,7 @@ void *CSocket::ServerSendQueueThread(void *threadData)
                             0,
                             p_Conn) == -1)
                     {
-                        ngx_log_stderr(errno, "CSocket::ServerSendQueueThread()中ngx_epoll_add_event()_2失败.");
+                        ngx_log_stderr_limited(errno, "CSocket::ServerSendQueueThread()中ngx_epoll_add_event()_2失败.");
                     }
                     continue;
                 }
@@ -754,6 +1076,7 @@ void *CSocket::ServerSendQueueThread(void *threadData)
             err = pthread_mutex_unlock(&pSocketObj->m_sendMessageQueueMutex);
             if (err != 0)
                 ngx_log_stderr(err, "CSocket::ServerSendQueueThread()pthread_mutex_unlock()失败，返回的错误码为%d!", err);
+            ngx_metrics_observe(NGX_MH_SENDQ_SCAN, ngx_monotonic_usec() - scanStart);
         }
     }
 
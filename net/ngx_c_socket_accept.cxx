@@ -16,6 +16,9 @@
 #include "ngx_global.h"
 #include "ngx_func.h"
 #include "ngx_c_socket.h"
+#include "ngx_c_metrics.h"
+#include "ngx_c_iplimit.h"
+#include "ngx_probe.h"
 
 // 建立新连接专用函数，当新连接进入时，本函数会被ngx_epoll_process_events()所调用
 void CSocket::ngx_event_accept(lpngx_connection_t oldc)
@@ -27,8 +30,7 @@ void CSocket::ngx_event_accept(lpngx_connection_t oldc)
     int s;
     static int use_accept4 = 1; // 先认为能够使用accept4()函数
     lpngx_connection_t newc;    // 代表连接池中的一个连接，注意这是指针
-
-    ngx_log_error_core(NGX_LOG_NOTICE, 0, "【master进程】开始accept一个客户端连接.....");
+    int ipslot;                 // 来源地址在CIpLimit表中的槽位号
 
     socklen = sizeof(mysockaddr);
     do
@@ -82,8 +84,29 @@ void CSocket::ngx_event_accept(lpngx_connection_t oldc)
             return;
         }
 
+        // 先按来源IP限制：同一个IP连接太多或者连得太快，只关它的连接，不等到连接池膨胀时把所有人的新连接都关掉
+        ipslot = -1;
+        if (mysockaddr.sa_family == AF_INET)
+        {
+            int ipret = CIpLimit::GetInstance()->Acquire(((struct sockaddr_in *)&mysockaddr)->sin_addr.s_addr, m_iNowMsec,
+                                                         ngx_conf_get(m_hIpMaxConns), ngx_conf_get(m_hIpAcceptRate), ngx_conf_get(m_hIpAcceptBurst), &ipslot);
+            if (ipret == NGX_IPLIMIT_CONNS || ipret == NGX_IPLIMIT_RATE)
+            {
+                ngx_metrics_add(NGX_MC_REFUSED);
+                ngx_metrics_add(ipret == NGX_IPLIMIT_CONNS ? NGX_MC_REFUSED_IP_CONNS : NGX_MC_REFUSED_IP_RATE);
+                close(s);
+                return;
+            }
+            if (ipret == NGX_IPLIMIT_FULL)
+            {
+                ngx_metrics_add(NGX_MC_IPLIMIT_FULL); // 表里没位置，这个连接不受按IP的限制
+            }
+        }
+
         if (m_onlineUserCount >= m_worker_connections) // 用户连接数过多，要关闭该用户socket，因为现在没分配连接，所以直接关闭即可
         {
+            ngx_metrics_add(NGX_MC_REFUSED);
+            CIpLimit::GetInstance()->Release(ipslot);
             close(s);
             return;
         }
@@ -95,6 +118,9 @@ void CSocket::ngx_event_accept(lpngx_connection_t oldc)
             {
                 // 整个连接池这么大了，而空闲连接却这么少了，所以认为是短时间内产生大量连接，发一个包后就断开，不可能让这种情况持续发生，所以必须断开新入用户的连接
                 // 一直到m_freeconnectionList变得足够大（连接池中连接被回收的足够多）
+                ngx_metrics_add(NGX_MC_REFUSED);
+                ngx_metrics_add(NGX_MC_REFUSED_CHURN);
+                CIpLimit::GetInstance()->Release(ipslot);
                 close(s);
                 return;
             }
@@ -104,15 +130,18 @@ void CSocket::ngx_event_accept(lpngx_connection_t oldc)
         if (newc == NULL)
         {
             // 连接池中连接不够用，那么就把这个socekt直接关闭并返回，因为在ngx_get_connection()中已经写日志了，所以这里不需要写日志了
+            ngx_metrics_add(NGX_MC_REFUSED);
+            CIpLimit::GetInstance()->Release(ipslot);
             if (close(s) == -1)
             {
-                ngx_log_error_core(NGX_LOG_ALERT, errno, "CSocket::ngx_event_accept()中close(%d)失败!", s);
+                ngx_log_error_limited(NGX_LOG_ALERT, errno, "CSocket::ngx_event_accept()中close(%d)失败!", s);
             }
             return;
         }
 
         // 成功的拿到了连接池中的一个连接
         memcpy(&newc->s_sockaddr, &mysockaddr, socklen); // 拷贝客户端地址到连接对象
+        newc->iIpSlot = ipslot;                          // 之后关闭连接时由ngx_close_connection()或者zdClosesocketProc()把这个地址的连接数-1
 
         if (!use_accept4)
         {
@@ -124,6 +153,12 @@ void CSocket::ngx_event_accept(lpngx_connection_t oldc)
             }
         }
 
+        if (m_iSendBufSize > 0)
+        {
+            // 固定了发送缓冲区大小，内核就不再自动调整：客户端不收数据时每个连接最多占这么多内核内存，再多的应答留在发送消息队列中，超过限度踢人
+            setsockopt(s, SOL_SOCKET, SO_SNDBUF, &m_iSendBufSize, sizeof(m_iSendBufSize));
+        }
+
         newc->listening = oldc->listening; // 连接对象和监听对象关联，方便通过连接对象找监听对象
 
         newc->rhandler = &CSocket::ngx_read_request_handler;  // 设置数据来时的读处理函数
@@ -146,6 +181,9 @@ void CSocket::ngx_event_accept(lpngx_connection_t oldc)
             AddToTimerQueue(newc);
         }
         ++m_onlineUserCount; // 连入用户数量+1
+        ngx_metrics_add(NGX_MC_ACCEPTED);
+        NGX_PROBE2(accept, s, newc);
+        ngx_log_binary(NGX_BL_ACCEPT, 0, s, (int)m_onlineUserCount);
         break;               // 一般就是循环一次就跳出去
     } while (1);
 
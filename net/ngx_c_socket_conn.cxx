@@ -18,6 +18,9 @@
 #include "ngx_c_socket.h"
 #include "ngx_c_memory.h"
 #include "ngx_c_lockmutex.h"
+#include "ngx_c_metrics.h"
+#include "ngx_c_iplimit.h"
+#include "ngx_probe.h"
 
 // 连接池成员函数
 ngx_connection_s::ngx_connection_s()
@@ -45,8 +48,11 @@ void ngx_connection_s::GetOneToUse()
     events = 0;                // epoll事件先给0
     lastPingTime = time(NULL); // 上次ping的时间
 
-    FloodkickLastTime = 0; // Flood攻击上次收到包的时间
-    FloodAttackCount = 0;  // Flood攻击在该时间内收到包的次数统计
+    iFloodPktTokens = 0;   // 令牌桶等收第一个包时再装满
+    iFloodByteTokens = 0;
+    iFloodTokenTime = 0;
+    iFloodResumeTime = 0;  // 没有暂停读
+    iIpSlot = -1;          // accept时才记来源地址
     iSendCount = 0;        // 发送队列中有的数据条目数，若client只发不收，则可能造成此数过大，依据此数做出踢出处理
 }
 
@@ -117,6 +123,7 @@ void ngx_connection_s::PutOneToFree()
             p_Conn->GetOneToUse();
             --m_free_connection_n;
             p_Conn->fd = isock;
+            NGX_PROBE3(get_connection, isock, p_Conn, p_Conn->iCurrsequence);
             return p_Conn;
         }
 
@@ -128,6 +135,7 @@ void ngx_connection_s::PutOneToFree()
         m_connectionList.push_back(p_Conn); // 入到总表中来，但不能入到空闲表中来，因为凡是调这个函数的，肯定是要用这个连接的
         ++m_total_connection_n;
         p_Conn->fd = isock;
+        NGX_PROBE3(get_connection, isock, p_Conn, p_Conn->iCurrsequence);
         return p_Conn;
     }
 
@@ -138,6 +146,7 @@ void ngx_connection_s::PutOneToFree()
         CLock lock(&m_connectionMutex);
 
         // 所有连接全部都在m_connectionList里；
+        NGX_PROBE1(conn_free, pConn);
         pConn->PutOneToFree();
 
         // 扔到空闲连接列表里
@@ -177,6 +186,8 @@ void ngx_connection_s::PutOneToFree()
         m_recyconnectionList.push_back(pConn); // 等待ServerRecyConnectionThread线程自会处理
         ++m_totol_recyconnection_n;            
         --m_onlineUserCount;                 
+        ngx_metrics_add(NGX_MC_CLOSED);
+        NGX_PROBE2(recycle, pConn->fd, pConn);
         return;
     }
 
@@ -185,6 +196,7 @@ void ngx_connection_s::PutOneToFree()
     {
         ThreadItem *pThread = static_cast<ThreadItem *>(threadData);
         CSocket *pSocketObj = pThread->_pThis;
+        ngx_log_thread_init(); // 本线程写日志用自己的环形缓冲区
 
         time_t currtime;
         int err;
@@ -195,6 +207,7 @@ void ngx_connection_s::PutOneToFree()
         { 
             // 为简化问题，每次休息200毫秒
             usleep(200 * 1000); // 单位是微秒,又因为1毫秒=1000微妙，所以 200 *1000 = 200毫秒
+            pSocketObj->publishMetrics(); // 顺便刷新统计信息中的当前值
 
             if (pSocketObj->m_totol_recyconnection_n > 0)
             {
@@ -217,7 +230,7 @@ void ngx_connection_s::PutOneToFree()
                     }
                     if (p_Conn->iThrowsendCount > 0)
                     {
-                        ngx_log_stderr(0, "CSocket::ServerRecyConnectionThread()中到释放时间却发现p_Conn.iThrowsendCount!=0");
+                        ngx_log_stderr_limited(0, "CSocket::ServerRecyConnectionThread()中到释放时间却发现p_Conn.iThrowsendCount!=0");
                     }
 
                     // 开始释放
@@ -265,6 +278,7 @@ void ngx_connection_s::PutOneToFree()
 
     void CSocket::ngx_close_connection(lpngx_connection_t pConn)
     {
+        CIpLimit::GetInstance()->Release(pConn->iIpSlot.exchange(-1)); // 这个来源地址的连接数-1
         ngx_free_connection(pConn);
         if (pConn->fd != -1)
         {
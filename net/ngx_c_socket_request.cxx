@@ -19,6 +19,9 @@
 #include "ngx_c_socket.h"
 #include "ngx_c_memory.h"
 #include "ngx_c_lockmutex.h"
+#include "ngx_c_metrics.h"
+#include "ngx_c_capture.h"
+#include "ngx_probe.h"
 // 来数据时候的处理，当连接上有数据来的时候，本函数会被ngx_epoll_process_events()所调用
 void CSocket::ngx_read_request_handler(lpngx_connection_t pConn)
 {
@@ -31,83 +34,87 @@ void CSocket::ngx_read_request_handler(lpngx_connection_t pConn)
         return; // 该处理的上边这个recvproc()函数处理过了，<=0直接return
     }
 
-    // 成功收到了一些字节，开始判断收到了多少数据
-    if (pConn->curStat == _PKG_HD_INIT) // 连接建立起来时肯定是这个状态，因为在ngx_get_connection()中已经把curStat成员赋值成_PKG_HD_INIT了
+    if (ngx_recv_advance(pConn, (size_t)reco, isflood) == false)
     {
-        if (reco == m_iLenPkgHeader) // 正好收到完整包头，拆解包头
-        {
-            ngx_wait_request_handler_proc_p1(pConn, isflood);
-        }
-        else
-        {
-            // 收到的包头不完整--不能预料每个包的长度，也不能预料各种拆包/粘包情况，所以收到不完整包头【也算是缺包】是很可能的
-            pConn->curStat = _PKG_HD_RECVING;         // 接收包头中，包头不完整，继续接收包头中
-            pConn->precvbuf = pConn->precvbuf + reco; // 注意收后续包的内存往后走
-            pConn->irecvlen = pConn->irecvlen - reco; // 要收的内容当然要减少，以确保只收到完整的包头先
-        }
+        // 包头中的长度不对，这个连接上后边的字节已经分不清哪里是包头了，接着收只会把包体当包头拆，直接断开
+        zdClosesocketProc(pConn);
+        return;
     }
-    else if (pConn->curStat == _PKG_HD_RECVING) // 接收包头中，包头不完整，继续接收中，这个条件才会成立
+
+    if (isflood == true)
     {
-        if (pConn->irecvlen == reco) // 要求收到的宽度和我实际收到的宽度相等
+        // 超过了Flood限速，包已经丢了，配置成踢人时再把客户端踢掉
+        if (ngx_conf_get(m_hFloodAction) == NGX_FLOOD_KICK)
         {
-            // 包头收完整了
-            ngx_wait_request_handler_proc_p1(pConn, isflood); // 调用专门针对包头处理完整的函数去处理
+            ngx_log_binary(NGX_BL_FLOOD_KICK, 0, pConn->fd);
+            ngx_metrics_add(NGX_MC_FLOOD_KICKS);
+            zdClosesocketProc(pConn);
         }
         else
         {
-            pConn->precvbuf = pConn->precvbuf + reco; // 注意收后续包的内存往后走
-            pConn->irecvlen = pConn->irecvlen - reco; // 要收的内容当然要减少，以确保只收到完整的包头先
+            ngx_metrics_add(NGX_MC_FLOOD_DROPS);
         }
     }
-    else if (pConn->curStat == _PKG_BD_INIT)
+    else if (pConn->iFloodResumeTime != 0)
     {
-        // 包头刚好收完，准备接收包体
-        if (reco == pConn->irecvlen)
+        // 超过了Flood限速，配置成推迟读：包照收，这个连接先不读了，令牌补回来再接着读
+        ngx_flood_pause(pConn);
+    }
+
+    return;
+}
+
+// 收包状态机：pConn->precvbuf处刚放进来reco个字节（reco不超过pConn->irecvlen，和recv()一样），据此推进收包状态，收完整的包交给ngx_wait_request_handler_proc_plast()
+// 本函数不碰socket，字节从哪来都行，模糊测试、基准测试程序（fuzz/、bench/下）直接从内存往里喂
+// 返回false表示包头不合法，调用者应该断开连接
+bool CSocket::ngx_recv_advance(lpngx_connection_t pConn, size_t reco, bool &isflood)
+{
+    // 成功收到了一些字节，开始判断收到了多少数据
+    if (pConn->curStat == _PKG_HD_INIT) // 连接建立起来时肯定是这个状态，因为在ngx_get_connection()中已经把curStat成员赋值成_PKG_HD_INIT了
+    {
+        pConn->irecvStartTime = ngx_monotonic_usec(); // 新的一个包开始了
+        if (reco == (size_t)m_iLenPkgHeader) // 正好收到完整包头，拆解包头
         {
-            // 收到的宽度等于要收的宽度，包体也收完整了
-            if (m_floodAkEnable == 1)
-            {
-                // Flood攻击检测是否开启
-                isflood = TestFlood(pConn);
-            }
-            ngx_wait_request_handler_proc_plast(pConn, isflood);
+            return ngx_wait_request_handler_proc_p1(pConn, isflood);
         }
-        else
+        // 收到的包头不完整--不能预料每个包的长度，也不能预料各种拆包/粘包情况，所以收到不完整包头【也算是缺包】是很可能的
+        pConn->curStat = _PKG_HD_RECVING;         // 接收包头中，包头不完整，继续接收包头中
+        pConn->precvbuf = pConn->precvbuf + reco; // 注意收后续包的内存往后走
+        pConn->irecvlen = pConn->irecvlen - reco; // 要收的内容当然要减少，以确保只收到完整的包头先
+    }
+    else if (pConn->curStat == _PKG_HD_RECVING) // 接收包头中，包头不完整，继续接收中，这个条件才会成立
+    {
+        if (pConn->irecvlen == reco) // 要求收到的宽度和我实际收到的宽度相等
         {
-            // 收到的宽度小于要收的宽度
-            pConn->curStat = _PKG_BD_RECVING;
-            pConn->precvbuf = pConn->precvbuf + reco;
-            pConn->irecvlen = pConn->irecvlen - reco;
+            // 包头收完整了
+            return ngx_wait_request_handler_proc_p1(pConn, isflood); // 调用专门针对包头处理完整的函数去处理
         }
+        pConn->precvbuf = pConn->precvbuf + reco; // 注意收后续包的内存往后走
+        pConn->irecvlen = pConn->irecvlen - reco; // 要收的内容当然要减少，以确保只收到完整的包头先
     }
-    else if (pConn->curStat == _PKG_BD_RECVING)
+    else if (pConn->curStat == _PKG_BD_INIT || pConn->curStat == _PKG_BD_RECVING)
     {
-        // 接收包体中，包体不完整，继续接收中
+        // 包头刚好收完准备接收包体，或者包体不完整继续接收中
         if (pConn->irecvlen == reco)
         {
-            // 包体收完整了
-            if (m_floodAkEnable == 1)
+            // 收到的宽度等于要收的宽度，包体也收完整了
+            if (ngx_conf_get(m_hFloodAkEnable) == 1)
             {
-                // Flood攻击检测是否开启
-                isflood = TestFlood(pConn);
+                // Flood攻击检测是否开启，包头+包体的长度就是收到的最后一个字节到包头开头的距离
+                isflood = TestFlood(pConn, (unsigned int)(pConn->precvbuf + reco - (pConn->precvMemPointer + m_iLenMsgHeader)));
             }
             ngx_wait_request_handler_proc_plast(pConn, isflood);
         }
         else
         {
-            // 包体没收完整，继续收
+            // 收到的宽度小于要收的宽度，包体没收完整，继续收
+            pConn->curStat = _PKG_BD_RECVING;
             pConn->precvbuf = pConn->precvbuf + reco;
             pConn->irecvlen = pConn->irecvlen - reco;
         }
     }
 
-    if (isflood == true)
-    {
-        // 客户端flood服务器，则直接把客户端踢掉
-        zdClosesocketProc(pConn);
-    }
-
-    return;
+    return true;
 }
 
 ssize_t CSocket::recvproc(lpngx_connection_t pConn, char *buff, ssize_t buflen)
@@ -126,11 +133,11 @@ ssize_t CSocket::recvproc(lpngx_connection_t pConn, char *buff, ssize_t buflen)
     {
         if (errno == EAGAIN || errno == EWOULDBLOCK)
         {
-            ngx_log_stderr(errno, "CSocket::recvproc()中errno == EAGAIN || errno == EWOULDBLOCK成立！"); // epoll为LT模式不应该出现这个返回值
+            ngx_log_stderr_limited(errno, "CSocket::recvproc()中errno == EAGAIN || errno == EWOULDBLOCK成立！"); // epoll为LT模式不应该出现这个返回值
         }
         if (errno == EINTR)
         {
-            ngx_log_stderr(errno, "CSocket::recvproc()中errno == EINTR成立！");
+            ngx_log_stderr_limited(errno, "CSocket::recvproc()中errno == EINTR成立！");
             return -1;
         }
 
@@ -141,12 +148,13 @@ ssize_t CSocket::recvproc(lpngx_connection_t pConn, char *buff, ssize_t buflen)
     }
 
     // 收到了有效数据
+    ngx_metrics_add(NGX_MC_RECV_BYTES, n);
     return n; // 返回收到的字节数
 }
 
-// 包头收完整后的处理，称为包处理阶段1
+// 包头收完整后的处理，称为包处理阶段1，包头不合法返回false
 // 注意参数isflood是个引用
-void CSocket::ngx_wait_request_handler_proc_p1(lpngx_connection_t pConn, bool &isflood)
+bool CSocket::ngx_wait_request_handler_proc_p1(lpngx_connection_t pConn, bool &isflood)
 {
     CMemory *p_memory = CMemory::GetInstance();
 
@@ -159,9 +167,12 @@ void CSocket::ngx_wait_request_handler_proc_p1(lpngx_connection_t pConn, bool &i
     // 恶意包或者错误包的判断
     if (e_pkgLen < m_iLenPkgHeader || e_pkgLen > (_PKG_MAX_LENGTH - 1000))
     {
+        // 这个包的包体还在后边，恢复成收包头接着收的话包体会被当成下一个包头来拆，再也对不上包边界，所以让调用者断开
+        ngx_metrics_add(NGX_MC_BAD_PKGS);
         pConn->curStat = _PKG_HD_INIT;
         pConn->precvbuf = pConn->dataHeadInfo;
         pConn->irecvlen = m_iLenPkgHeader;
+        return false;
     }
     else
     {
@@ -174,16 +185,21 @@ void CSocket::ngx_wait_request_handler_proc_p1(lpngx_connection_t pConn, bool &i
         LPSTRUC_MSG_HEADER ptmpMsgHeader = (LPSTRUC_MSG_HEADER)pTmpBuffer;
         ptmpMsgHeader->pConn = pConn;
         ptmpMsgHeader->iCurrsequence = pConn->iCurrsequence; // 收到包时的连接池中连接序号记录到消息头里来，以备将来用
+        ptmpMsgHeader->iRecvTime = pConn->irecvStartTime;
+        ptmpMsgHeader->iSendQueueTime = 0;
+        ptmpMsgHeader->iSendStartTime = 0;
+        ptmpMsgHeader->iMsgCode = ntohs(pPkgHeader->msgCode);
+        NGX_PROBE4(pkg_header, pConn->fd, pConn, ptmpMsgHeader->iMsgCode, e_pkgLen);
         // 填写包头内容
         pTmpBuffer += m_iLenMsgHeader;                   // 往后跳，跳过消息头，指向包头
         memcpy(pTmpBuffer, pPkgHeader, m_iLenPkgHeader); // 把收到的包头拷贝进来
         if (e_pkgLen == m_iLenPkgHeader)
         {
             // 收完整了，则直接入消息队列待后续业务逻辑线程去处理
-            if (m_floodAkEnable == 1)
+            if (ngx_conf_get(m_hFloodAkEnable) == 1)
             {
                 // Flood攻击检测是否开启
-                isflood = TestFlood(pConn);
+                isflood = TestFlood(pConn, e_pkgLen);
             }
             ngx_wait_request_handler_proc_plast(pConn, isflood);
         }
@@ -195,16 +211,20 @@ void CSocket::ngx_wait_request_handler_proc_p1(lpngx_connection_t pConn, bool &i
         }
     }
 
-    return;
+    return true;
 }
 
 // 注意参数isflood是个引用
 void CSocket::ngx_wait_request_handler_proc_plast(lpngx_connection_t pConn, bool &isflood)
 {
+    ngx_metrics_add(NGX_MC_RECV_PKGS);
+    LPSTRUC_MSG_HEADER pMsgHeader = (LPSTRUC_MSG_HEADER)pConn->precvMemPointer;
+    ngx_metrics_stage(pMsgHeader->iMsgCode, NGX_MS_RECV, ngx_monotonic_usec() - pMsgHeader->iRecvTime);
+    CCapture::GetInstance()->Record(pConn->precvMemPointer); // 开了流量录制时录下来，flood的包也录
 
     if (isflood == false)
     {
-        g_threadpool.inMsgRecvQueueAndSignal(pConn->precvMemPointer); // 入消息队列并触发线程处理消息
+        inRecvMsgQueue(pConn->precvMemPointer); // 入消息队列并触发线程处理消息
     }
     else
     {
@@ -220,6 +240,16 @@ void CSocket::ngx_wait_request_handler_proc_plast(lpngx_connection_t pConn, bool
     return;
 }
 
+// 把收到的完整消息交给线程池，本函数接管pMsgBuf这块内存
+void CSocket::inRecvMsgQueue(char *pMsgBuf)
+{
+    if (g_threadpool.inMsgRecvQueueAndSignal(pMsgBuf) == false)
+    {
+        CMemory::GetInstance()->FreeMemory(pMsgBuf); // 入不了队列，直接丢弃
+    }
+    return;
+}
+
 // 发送数据专用函数，返回本次发送的字节数
 // 返回 > 0，成功发送了一些字节
 //=0，对方主动断开
@@ -234,6 +264,9 @@ ssize_t CSocket::sendproc(lpngx_connection_t c, char *buff, ssize_t size)
         n = send(c->fd, buff, size, 0);
         if (n > 0) // 成功发送了一些数据
         {
+            ngx_metrics_add(NGX_MC_SENT_BYTES, n);
+            if (n < size)
+                NGX_PROBE4(send_partial, c->fd, c, n, size);
             return n; // 返回本次发送的字节数
         }
 
@@ -244,12 +277,13 @@ ssize_t CSocket::sendproc(lpngx_connection_t c, char *buff, ssize_t size)
 
         if (errno == EAGAIN)
         {
+            NGX_PROBE4(send_partial, c->fd, c, 0, size);
             return -1; // 表示发送缓冲区满了
         }
 
         if (errno == EINTR)
         {
-            ngx_log_stderr(errno, "CSocket::sendproc()中send()失败.");
+            ngx_log_stderr_limited(errno, "CSocket::sendproc()中send()失败.");
         }
         else
         {
@@ -274,12 +308,13 @@ void CSocket::ngx_write_request_handler(lpngx_connection_t pConn)
     }
     else if (sendsize == -1)
     {
-        ngx_log_stderr(errno, "CSocket::ngx_write_request_handler()时if(sendsize == -1)成立");
+        ngx_log_stderr_limited(errno, "CSocket::ngx_write_request_handler()时if(sendsize == -1)成立");
         return;
     }
 
     if (sendsize > 0 && sendsize == pConn->isendlen)
     {
+        sendPkgDone(pConn);
         // 如果是成功的发送完毕数据，则把写事件通知从epoll中删除；其他情况就是断线了，等着系统内核把连接从红黑树中干掉即可
         if (ngx_epoll_oper_event(
                 pConn->fd,
@@ -289,7 +324,7 @@ void CSocket::ngx_write_request_handler(lpngx_connection_t pConn)
                 pConn) == -1)
         {
 
-            ngx_log_stderr(errno, "CSocket::ngx_write_request_handler()中ngx_epoll_oper_event()失败。");
+            ngx_log_stderr_limited(errno, "CSocket::ngx_write_request_handler()中ngx_epoll_oper_event()失败。");
         }
     }
 
@@ -297,7 +332,7 @@ void CSocket::ngx_write_request_handler(lpngx_connection_t pConn)
 
     // 数据发送完毕，或者把需要发送的数据干掉，都说明发送缓冲区可能有地方了，让发送线程往下走判断能否发送新数据
     if (sem_post(&m_semEventSendQueue) == -1)
-        ngx_log_stderr(0, "CSocket::ngx_write_request_handler()中sem_post(&m_semEventSendQueue)失败.");
+        ngx_log_stderr_limited(0, "CSocket::ngx_write_request_handler()中sem_post(&m_semEventSendQueue)失败.");
 
     p_memory->FreeMemory(pConn->psendMemPointer);
     pConn->psendMemPointer = NULL;
@@ -305,6 +340,24 @@ void CSocket::ngx_write_request_handler(lpngx_connection_t pConn)
     return;
 }
 
+// 一个应答（pConn->psendMemPointer）的最后一个字节交给了内核，在发送线程或者epoll所在的线程中调用
+// 应答的消息头是处理函数从请求拷贝过来的，收包时记的时间点都还在，这里把发送阶段和全程的延迟记上
+void CSocket::sendPkgDone(lpngx_connection_t pConn)
+{
+    ngx_metrics_add(NGX_MC_SENT_PKGS);
+    LPSTRUC_MSG_HEADER pMsgHeader = (LPSTRUC_MSG_HEADER)pConn->psendMemPointer;
+    uint64_t now = ngx_monotonic_usec();
+    ngx_metrics_stage(pMsgHeader->iMsgCode, NGX_MS_SEND_WAIT, pMsgHeader->iSendStartTime - pMsgHeader->iSendQueueTime);
+    ngx_metrics_stage(pMsgHeader->iMsgCode, NGX_MS_WIRE, now - pMsgHeader->iSendStartTime);
+    uint64_t totalUs = 0;
+    if (pMsgHeader->iRecvTime != 0) // 服务器主动发的消息没有对应的请求
+    {
+        totalUs = now - pMsgHeader->iRecvTime;
+        ngx_metrics_stage(pMsgHeader->iMsgCode, NGX_MS_TOTAL, totalUs);
+    }
+    NGX_PROBE4(send_done, pConn->fd, pConn, pMsgHeader->iMsgCode, totalUs);
+}
+
 // 消息本身格式（消息头+包头+包体）
 void CSocket::threadRecvProcFunc(char *pMsgBuf)
 {
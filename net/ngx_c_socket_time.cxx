@@ -26,7 +26,7 @@ void CSocket::AddToTimerQueue(lpngx_connection_t pConn)
 
 	// 超时时间
 	time_t futtime = time(NULL);
-	futtime += m_iWaitTime; // 20秒之后的时间
+	futtime += ngx_conf_get(m_hWaitTime) / 1000; // 20秒之后的时间
 
 	CLock lock(&m_timequeueMutex); // 互斥，因为要操作m_timeQueuemap了
 	LPSTRUC_MSG_HEADER tmpMsgHeader = (LPSTRUC_MSG_HEADER)p_memory->AllocMemory(m_iLenMsgHeader, false);
@@ -80,11 +80,11 @@ LPSTRUC_MSG_HEADER CSocket::GetOverTimeTimer(time_t cur_time)
 
 		// 如果不是要求超时就立马踢出才做这里的事
 		// 因为下次超时的时间也依然要判断，所以还要把这个节点加回来
-		if (m_ifTimeOutKick != 1)
+		if (ngx_conf_get(m_hTimeOutKick) != 1)
 		{
 			// 在一个等待时间后再次检查
 			// 若上一次ping的时间到当前时间差值大于最大等待时间时会将连接踢出，在关闭线程时从队列删除
-			time_t newinqueutime = cur_time + (m_iWaitTime);
+			time_t newinqueutime = cur_time + ngx_conf_get(m_hWaitTime) / 1000;
 			LPSTRUC_MSG_HEADER tmpMsgHeader = (LPSTRUC_MSG_HEADER)p_memory->AllocMemory(sizeof(STRUC_MSG_HEADER), false);
 			tmpMsgHeader->pConn = ptmp->pConn;
 			tmpMsgHeader->iCurrsequence = ptmp->iCurrsequence;
@@ -152,6 +152,7 @@ void *CSocket::ServerTimerQueueMonitorThread(void *threadData)
 {
 	ThreadItem *pThread = static_cast<ThreadItem *>(threadData);
 	CSocket *pSocketObj = pThread->_pThis;
+	ngx_log_thread_init(); // 本线程写日志用自己的环形缓冲区
 
 	time_t absolute_time, cur_time;
 	int err;
@@ -14,7 +14,7 @@
 // 处理网络事件和定时器事件，遵照nginx引入这个同名函数
 void ngx_process_events_and_timers()
 {
-    g_socket.ngx_epoll_process_events(-1); //-1表示等待
+    g_socket.ngx_epoll_process_events(ngx_quit ? 1000 : -1); //-1表示等待，优雅退出时每秒回来看一下已有连接是不是都断开了
 
     // 统计信息打印，考虑到测试的时候总会收到各种数据信息，所以上边的函数调用一般都不会卡住等待收数据
     g_socket.printTDInfo();
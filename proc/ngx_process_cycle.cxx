@@ -5,18 +5,31 @@
 #include <signal.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include "ngx_func.h"
 #include "ngx_macro.h"
 #include "ngx_c_conf.h"
 #include "ngx_c_slogic.h"
+#include "ngx_c_metrics.h"
+#include "ngx_c_iplimit.h"
+#include "ngx_c_admin.h"
+#include "ngx_c_capture.h"
+#include "ngx_c_accountstore.h"
 
 static void ngx_start_worker_processes(int threadnums);
 static int ngx_spawn_process(int threadnums, const char *pprocname);
-static void ngx_worker_process_cycle(int inum, const char *pprocname);
-static void ngx_worker_process_init(int inum);
+static void ngx_worker_process_cycle(int inum, int slot, const char *pprocname);
+static void ngx_worker_process_init(int inum, int slot);
+static void ngx_signal_worker_processes(int signo);
+static void ngx_drain_worker_processes();
+static void ngx_exec_new_binary();
 
 static u_char master_process[] = "master process";
+static pid_t ngx_processes[NGX_MAX_PROCESSES]; // master进程中记录的worker进程pid，0表示空位
+static bool ngx_draining[NGX_MAX_PROCESSES];   // 这个槽位上的worker进程已经让它处理完已有连接后退出了（平滑升级时的老worker进程）
+static int ngx_draining_subprocess = 0;        // 正在退出的worker进程数量，也算在ngx_working_subprocess里，只在信号处理函数和sigsuspend()返回后改，不会并发
+static lpngx_conf_tunable_t ngx_graceful_timeout; // worker进程优雅退出时最多等已有连接多久（毫秒），0表示一直等
 
 // 描述：创建worker子进程
 void ngx_master_process_cycle()
@@ -65,7 +78,11 @@ void ngx_master_process_cycle()
     // 从配置文件中读取要创建的worker进程数量
     CConfig *p_config = CConfig::GetInstance();                      // 单例类
     int workprocess = p_config->GetIntDefault("WorkerProcesses", 1); // 从配置文件中得到要创建的worker进程数量
+    ngx_graceful_timeout = p_config->GetDurationHandle("GracefulShutdownTimeout", 60 * 1000, 1000);
+    CAdminServer::GetInstance()->Start(); // 管理端口线程，上边已经屏蔽了信号，线程继承这个设置，信号还是由本线程处理
     ngx_start_worker_processes(workprocess);                         // 这里要创建worker子进程
+    bool quitting = false;    // 已经让worker进程优雅退出了
+    bool noaccepting = false; // 收到SIGWINCH之后，worker进程已经在退出或者退出了，不再重新创建
 
     // 创建子进程后，父进程的执行流程会返回到这里，子进程不会走进来
     sigemptyset(&set); // 信号屏蔽字为空，表示不屏蔽任何信号
@@ -81,14 +98,70 @@ void ngx_master_process_cycle()
             break;
         }
 
+        // 优雅退出：让worker进程不再accept、处理完已有连接再退出，都退出了master进程再退出
+        if (ngx_quit == 1)
+        {
+            if (quitting == false)
+            {
+                quitting = true;
+                ngx_log_error_core(NGX_LOG_NOTICE, 0, "【master进程】优雅退出，通知 %d 个worker进程处理完已有连接后退出......!", ngx_working_subprocess);
+                ngx_signal_worker_processes(SIGQUIT);
+            }
+            if (ngx_working_subprocess <= 0)
+            {
+                break;
+            }
+            continue; // 退出过程中不再重启worker进程，也不处理别的信号
+        }
+
         // 当master进程不退出并且有子进程结束时，重新创建子进程补上
         if (ngx_reap == 1)
         {
-            // 需要重启的子进程个数
-            int restart = workprocess - ngx_working_subprocess;
-            ngx_log_error_core(NGX_LOG_NOTICE, 0, "【master进程】重新启动 %d 个worker进程......!", restart);
-            ngx_start_worker_processes(restart);
             ngx_reap = 0;
+            if (noaccepting == false)
+            {
+                // 需要重启的子进程个数，正在退出的worker进程不算，它们退出时也不补
+                int restart = workprocess - (ngx_working_subprocess - ngx_draining_subprocess);
+                if (restart > 0)
+                {
+                    ngx_log_error_core(NGX_LOG_NOTICE, 0, "【master进程】重新启动 %d 个worker进程......!", restart);
+                    ngx_start_worker_processes(restart);
+                }
+            }
+        }
+
+        // 重新加载配置文件，只刷新共享内存中的可调整配置项，worker进程不用重启，已有的连接不受影响
+        if (ngx_reconfigure == 1)
+        {
+            ngx_reconfigure = 0;
+            ngx_log_error_core(NGX_LOG_NOTICE, 0, "【master进程】重新加载配置文件[%s]......!", NGX_CONF_PATH);
+            p_config->Reload(NGX_CONF_PATH);
+
+            // 平滑升级中老的worker进程已经让退了，这时候收到SIGHUP表示要回滚：重新创建worker进程，接着accept
+            if (noaccepting == true)
+            {
+                noaccepting = false;
+                ngx_noaccept = 0;
+                // 老的worker进程可能还在处理已有连接，它们已经不accept了，不能算数，要重新创建够workprocess个
+                int restart = workprocess - (ngx_working_subprocess - ngx_draining_subprocess);
+                ngx_log_error_core(NGX_LOG_NOTICE, 0, "【master进程】回滚，重新启动 %d 个worker进程......!", restart);
+                ngx_start_worker_processes(restart);
+            }
+        }
+
+        // 平滑升级：exec新的可执行文件，新老两代进程同时accept
+        if (ngx_change_binary == 1)
+        {
+            ngx_change_binary = 0;
+            ngx_exec_new_binary();
+        }
+
+        // 平滑升级中新的一代已经起来了，让老的worker进程处理完已有连接后退出，退出后不再重新创建
+        if (ngx_noaccept == 1 && noaccepting == false)
+        {
+            noaccepting = true;
+            ngx_log_error_core(NGX_LOG_NOTICE, 0, "【master进程】通知 %d 个worker进程处理完已有连接后退出，不再重新创建......!", ngx_working_subprocess);
+            ngx_drain_worker_processes();
         }
     }
     return;
@@ -117,6 +190,17 @@ static int ngx_spawn_process(int inum, const char *pprocname)
 {
     pid_t pid;
 
+    // 先占一个空位，位置号就是子进程的槽位号，统计信息共享内存中按它分块，重启的worker进程补到原来的空位上，接着用原来那块
+    int slot = -1;
+    for (int i = 0; i < NGX_MAX_PROCESSES; i++)
+    {
+        if (ngx_processes[i] == 0)
+        {
+            slot = i;
+            break;
+        }
+    }
+
     pid = fork();
     switch (pid)
     {
@@ -128,26 +212,152 @@ static int ngx_spawn_process(int inum, const char *pprocname)
         ngx_parent = ngx_pid;
         ngx_pid = getpid();
         usleep(100);
-        ngx_worker_process_cycle(inum, pprocname); // 所有worker子进程在这个函数里不断循环
+        ngx_worker_process_cycle(inum, slot, pprocname); // 所有worker子进程在这个函数里不断循环
         break;
 
     default:
         ++ngx_working_subprocess;
+        if (slot != -1)
+        {
+            ngx_processes[slot] = pid;
+        }
         break;
     }
     return pid;
 }
 
+// 描述：master进程中waitpid()回收了一个子进程之后调用，在信号处理函数中执行
+// 返回值：true表示是worker进程，false表示是平滑升级时的新master进程
+bool ngx_process_exited(pid_t pid)
+{
+    if (pid == ngx_new_binary)
+    {
+        ngx_new_binary = 0;
+        ngx_log_error_core(NGX_LOG_ALERT, 0, "【master进程】新版本的master进程%P退出了（升级失败或者已经回滚）!", pid);
+        return false;
+    }
+    for (int i = 0; i < NGX_MAX_PROCESSES; i++)
+    {
+        if (ngx_processes[i] == pid)
+        {
+            ngx_processes[i] = 0;
+            if (ngx_draining[i])
+            {
+                ngx_draining[i] = false;
+                --ngx_draining_subprocess;
+            }
+            CMetrics::GetInstance()->WorkerExited(i); // 计数器留着，当前值清掉
+            CIpLimit::GetInstance()->WorkerExited(i); // 它的连接都断了，按IP记的连接数减掉
+            break;
+        }
+    }
+    return true;
+}
+
+// 描述：给本master进程创建的所有worker进程发信号，不能用kill(0, ...)，那样会发给master进程自己
+static void ngx_signal_worker_processes(int signo)
+{
+    for (int i = 0; i < NGX_MAX_PROCESSES; i++)
+    {
+        if (ngx_processes[i] != 0 && kill(ngx_processes[i], signo) == -1)
+        {
+            ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_signal_worker_processes()中kill(%P, %d)失败!", ngx_processes[i], signo);
+        }
+    }
+}
+
+// 描述：让当前所有的worker进程处理完已有连接后退出，记下这些槽位，它们退出时不再补，回滚时也不算数
+static void ngx_drain_worker_processes()
+{
+    for (int i = 0; i < NGX_MAX_PROCESSES; i++)
+    {
+        if (ngx_processes[i] != 0 && ngx_draining[i] == false)
+        {
+            ngx_draining[i] = true;
+            ++ngx_draining_subprocess;
+        }
+    }
+    ngx_signal_worker_processes(SIGQUIT);
+}
+
+// 在exec新版本之前的子进程中调用：清掉fd的FD_CLOEXEC标志，fd号通过环境变量name告诉新的master进程
+static void ngx_pass_fd(const char *name, int fd)
+{
+    if (fd == -1 || fcntl(fd, F_SETFD, 0) == -1)
+        return;
+    char env[16];
+    *ngx_slcat((u_char *)env, (u_char *)env + sizeof(env) - 1, fd) = 0;
+    setenv(name, env, 1);
+}
+
+// 描述：平滑升级，fork()一个子进程，在子进程中exec新的可执行文件（部署时已经用新文件替换了启动时的那个路径）
+// 监听socket不关闭，fd号通过环境变量告诉新的master进程，新的master进程直接拿来用，监听端口一刻也没有关闭过，排队中的连接也不会丢；
+// 管理端口、账号存储的共享内存也这样交过去
+// 之后两代进程同时accept，kill -WINCH老的master进程让老的worker进程处理完已有连接后退出；
+// 新版本有问题时kill -HUP老的master进程重新创建老的worker进程，再kill -QUIT新的master进程，就回滚了
+static void ngx_exec_new_binary()
+{
+    if (ngx_new_binary != 0)
+    {
+        ngx_log_error_core(NGX_LOG_ALERT, 0, "【master进程】新版本的master进程%P还在运行，不能再次升级!", ngx_new_binary);
+        return;
+    }
+    int fds[NGX_MAX_PROCESSES];
+    int n = g_socket.GetListenFds(fds, NGX_MAX_PROCESSES);
+    char env[NGX_MAX_PROCESSES * 12];
+    u_char *p = (u_char *)env;
+    for (int i = 0; i < n; i++)
+    {
+        p = ngx_slcat(p, (u_char *)env + sizeof(env) - 1, fds[i], ";");
+    }
+    *p = 0;
+
+    pid_t pid = fork();
+    switch (pid)
+    {
+    case -1:
+        ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_exec_new_binary()中fork()失败!");
+        return;
+
+    case 0:
+    {
+        // 新的master进程自己一个进程组，老的master进程退出时kill(0, SIGTERM)不会波及新的这一代
+        setpgid(0, 0);
+        // master进程屏蔽了一堆信号，exec之后屏蔽字会保留，要清掉
+        sigset_t set;
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, NULL);
+        setenv(NGX_LISTEN_FDS_ENV, env, 1);
+        // 管理端口的socket、账号存储的memfd都是CLOEXEC的，在这里（exec之前、只影响本进程）清掉标志交过去
+        ngx_pass_fd(NGX_ADMIN_FD_ENV, CAdminServer::GetInstance()->GetFd());
+        // 账号存储交过去，两代进程共用同一份账号，同一个名字不会被两代各注册一次
+        ngx_pass_fd(NGX_ACCOUNT_STORE_ENV, CAccountStore::GetInstance()->GetFd());
+        char *argv[] = {g_binary_path, NULL};
+        execv(g_binary_path, argv);
+        ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_exec_new_binary()中execv(\"%s\")失败!", g_binary_path);
+        _exit(2);
+    }
+
+    default:
+        ngx_new_binary = pid;
+        ngx_log_error_core(NGX_LOG_NOTICE, 0, "【master进程】启动了新版本的master进程%P，监听socket[%s]已经交给它；kill -WINCH %P让老的worker进程退出，kill -QUIT %P结束老的master进程",
+                           pid, env, ngx_pid, ngx_pid);
+        break;
+    }
+}
+
 // 描述：worker子进程的功能函数，每个woker子进程就在这里无限循环（处理网络事件和定时器事件以对外提供web服务）
 // inum：进程编号，0开始
-static void ngx_worker_process_cycle(int inum, const char *pprocname)
+// slot：master进程中的槽位号，-1表示没有空位了
+static void ngx_worker_process_cycle(int inum, int slot, const char *pprocname)
 {
     ngx_process = NGX_PROCESS_WORKER; // 设置进程的类型，是worker进程
 
     // 重新为子进程设置进程名
-    ngx_worker_process_init(inum);
+    ngx_worker_process_init(inum, slot);
     ngx_setproctitle(pprocname); // 设置标题
     ngx_log_error_core(NGX_LOG_NOTICE, 0, "%s %P 【worker进程】启动并开始运行, 父进程是 %P", pprocname, ngx_pid, ngx_parent);
+    uint64_t quitDeadline = 0; // 优雅退出的最后期限（单调时钟，微秒），0表示还没开始退出
     for (;;)
     {
         ngx_process_events_and_timers(); // 处理网络事件和定时器事件
@@ -155,42 +365,96 @@ static void ngx_worker_process_cycle(int inum, const char *pprocname)
         {
             break;
         }
+
+        // 优雅退出：先不再accept，排队中的连接留给其他还在accept的进程；已有连接都断开了或者等到期限了再退出
+        if (ngx_quit == 1)
+        {
+            uint64_t now = ngx_monotonic_usec();
+            if (quitDeadline == 0)
+            {
+                int64_t timeoutMs = ngx_conf_get(ngx_graceful_timeout);
+                quitDeadline = (timeoutMs > 0) ? now + (uint64_t)timeoutMs * 1000 : UINT64_MAX;
+                g_socket.ngx_stop_accepting();
+                ngx_log_error_core(NGX_LOG_NOTICE, 0, "%P 【worker进程】不再接受新连接，等待 %d 个已有连接断开......", ngx_pid, g_socket.GetOnlineUserCount());
+            }
+            if (g_socket.GetOnlineUserCount() <= 0)
+            {
+                g_stopEvent = 1; // 其他线程看这个标志退出
+                break;
+            }
+            if (now >= quitDeadline)
+            {
+                ngx_log_error_core(NGX_LOG_WARN, 0, "%P 【worker进程】优雅退出超时，还有 %d 个连接，直接关闭!", ngx_pid, g_socket.GetOnlineUserCount());
+                g_stopEvent = 1;
+                break;
+            }
+        }
     }
     // 如果从这个循环跳出来
     g_threadpool.StopAll();      // 考虑在这里停止线程池；
+    g_cpupool.StopAll();
     g_socket.Shutdown_subproc(); // socket需要释放的东西考虑释放
+    CCapture::GetInstance()->Close(); // 收包的线程都停了，流量录制文件截到实际长度
+    ngx_log_async_stop();        // 其他线程都结束了，把没写完的日志写完，之后的日志同步写
     return;
 }
 
 // 描述：子进程创建时调用本函数进行一些初始化工作
-static void ngx_worker_process_init(int inum)
+static void ngx_worker_process_init(int inum, int slot)
 {
     sigset_t set; // 信号集
 
-    sigemptyset(&set);                              // 清空信号集
-    if (sigprocmask(SIG_SETMASK, &set, NULL) == -1) // 原来是屏蔽那10个信号，现在不再屏蔽任何信号
-    {
-        ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_worker_process_init()中sigprocmask()失败!");
-    }
+    // 统计信息先记到自己的槽位上，后边初始化过程中的统计也算进去
+    CMetrics::GetInstance()->AttachWorker(slot);
+    CIpLimit::GetInstance()->AttachWorker(slot);
+    CAdminServer::GetInstance()->CloseInChild(); // 管理端口由master进程服务
+
+    // 异步写日志，要在创建其他线程之前开始
+    ngx_log_async_start();
 
     // 线程池代码，率先创建，至少要比和socket相关的内容优先
     // 线程池里的代码是用于处理业务
     CConfig *p_config = CConfig::GetInstance();
     int tmpthreadnums = p_config->GetIntDefault("ProcMsgRecvWorkThreadCount", 5); // 处理接收到的消息的线程池中线程数量
+
+    // 消息队列分优先级通道，两个线程池用同样的出队方式和权重
+    int lanemode = p_config->GetIntDefault("ProcMsgLaneMode", NGX_LANE_WEIGHTED);
+    int laneweights[NGX_THREADPOOL_LANES];
+    for (int i = 0; i < NGX_THREADPOOL_LANES; i++)
+    {
+        char strinfo[100];
+        sprintf(strinfo, "ProcMsgLaneWeight%d", i);
+        laneweights[i] = p_config->GetIntDefault(strinfo, 1 << (2 * (NGX_THREADPOOL_LANES - 1 - i))); // 默认16:4:1
+    }
+    g_threadpool.SetLanePolicy(lanemode, laneweights);
+    g_cpupool.SetLanePolicy(lanemode, laneweights);
     if (g_threadpool.Create(tmpthreadnums) == false)                              // 创建线程池中线程
     {
         exit(-2);
     }
+    // 耗CPU的消息单独一个线程池，线程数和队列长度都有上限，队列满了的消息直接回复服务器忙
+    int cputhreadnums = p_config->GetIntDefault("ProcMsgCpuThreadCount", 2);
+    int cpuqueuemax = p_config->GetIntDefault("ProcMsgCpuQueueMax", 256);
+    if (cputhreadnums > 0 && g_cpupool.Create(cputhreadnums, cpuqueuemax) == false)
+    {
+        exit(-2);
+    }
     sleep(1);
+    CCapture::GetInstance()->Open(); // 流量录制文件，要在开始收包之前建好；建不起来只是不录，不影响服务
     if (g_socket.Initialize_subproc() == false) // 初始化子进程需要具备的一些多线程能力相关的信息
     {
         exit(-2);
     }
 
-    if (g_socket.ngx_open_listening_sockets() == false) // 打开监听端口
+    // 监听socket由master进程打开，worker进程继承，worker进程退出、重启时监听端口一直开着
+    g_socket.ngx_epoll_init(); // 初始化epoll相关内容，同时往监听socket上增加监听事件，从而开始让监听端口履行其职责
+
+    // 线程都创建完了才解除对那10个信号的屏蔽：上边创建的线程继承了屏蔽的设置，信号只会由本线程（主线程）处理，
+    // 信号处理函数中写日志用的是本线程在ngx_log_async_start()中预先分配好的缓冲区
+    sigemptyset(&set);                              // 清空信号集
+    if (sigprocmask(SIG_SETMASK, &set, NULL) == -1) // 原来是屏蔽那10个信号，现在不再屏蔽任何信号
     {
-        exit(-2);
+        ngx_log_error_core(NGX_LOG_ALERT, errno, "ngx_worker_process_init()中sigprocmask()失败!");
     }
-    g_socket.ngx_epoll_init(); // 初始化epoll相关内容，同时往监听socket上增加监听事件，从而开始让监听端口履行其职责
     return;
 }
@@ -34,6 +34,8 @@ ngx_signal_t signals[] = {
 	{SIGCHLD, "SIGCHLD", ngx_signal_handler},
 	{SIGQUIT, "SIGQUIT", ngx_signal_handler},
 	{SIGIO, "SIGIO", ngx_signal_handler},
+	{SIGWINCH, "SIGWINCH", ngx_signal_handler},
+	{SIGUSR2, "SIGUSR2", ngx_signal_handler},
 	{SIGSYS, "SIGSYS, SIG_IGN", NULL},
 	// 把handler设置为NULL，代表要求忽略这个信号，请求操作系统不要执行缺省的该信号处理动作
 	// 日后根据需要再继续增加
@@ -103,6 +105,26 @@ static void ngx_signal_handler(int signo, siginfo_t *siginfo, void *ucontext)
 			ngx_shutdown();
 			break;
 
+		case SIGHUP:
+			ngx_reconfigure = 1; // 标记要重新加载配置文件，在master主进程的for(;;)循环中处理
+			action = (char *)", reconfiguring";
+			break;
+
+		case SIGQUIT:
+			ngx_quit = 1; // 优雅退出，在master主进程的for(;;)循环中处理
+			action = (char *)", shutting down";
+			break;
+
+		case SIGWINCH:
+			ngx_noaccept = 1; // 让worker进程优雅退出，不再重新创建
+			action = (char *)", stop accepting connections";
+			break;
+
+		case SIGUSR2:
+			ngx_change_binary = 1; // 平滑升级
+			action = (char *)", changing binary";
+			break;
+
 		default:
 			break;
 		}
@@ -116,6 +138,11 @@ static void ngx_signal_handler(int signo, siginfo_t *siginfo, void *ucontext)
 			g_stopEvent = 1;
 			break;
 
+		case SIGQUIT:
+			ngx_quit = 1; // 不再accept，已有连接处理完再退出，在worker进程的for(;;)循环中处理
+			action = (char *)", shutting down";
+			break;
+
 		default:
 			break;
 		}
@@ -179,7 +206,10 @@ static void ngx_process_get_status(void)
 			ngx_log_error_core(NGX_LOG_ALERT, err, "waitpid() failed!");
 			return;
 		}
-		--ngx_working_subprocess; // 在回收子进程时记录运行中的子进程数量减一，因为信号可能丢失
+		if (ngx_process_exited(pid)) // 平滑升级时新的master进程也是本进程的子进程，不算在worker进程数量里
+		{
+			--ngx_working_subprocess; // 在回收子进程时记录运行中的子进程数量减一，因为信号可能丢失
+		}
 		one = 1;				  // 标记waitpid()返回了正常的返回值
 		if (WTERMSIG(status))	  // 获取使子进程终止的信号编号
 		{
@@ -0,0 +1,192 @@
+﻿// 账号日志CAccountLog的测试：启动时重放日志段，注册的账号必须先落盘，登录才能看到，等落盘有超时
+// 用法：在根目录执行 make test，或者 test/bin/test_accountlog，在/tmp下建临时目录放日志文件，全部检查通过返回0
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "ngx_c_accountstore.h"
+#include "ngx_c_accountlog.h"
+#include "ngx_c_crc32.h"
+
+#define TEST_LOG "account.wal"
+#define TEST_SEG "account.wal.1" // 本进程Start()时新建的日志段，启动前的日志段都已经合并进快照删掉了
+#define TEST_SNAP "account.snap"
+
+static int g_fails = 0;
+static ngx_account_cred_t g_cred;
+
+#define CHECK(cond)                                                         \
+    do                                                                      \
+    {                                                                       \
+        if (!(cond))                                                        \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: 检查失败: %s\n", __FILE__, __LINE__, #cond); \
+            g_fails++;                                                      \
+        }                                                                   \
+    } while (0)
+
+struct RegisterArg
+{
+    const char *username;
+    int iRet;
+};
+
+static void *register_thread(void *arg)
+{
+    RegisterArg *pArg = (RegisterArg *)arg;
+    pArg->iRet = CAccountLog::GetInstance()->RegisterAccount(pArg->username, &g_cred, 0, 0);
+    return NULL;
+}
+
+static off_t file_size(const char *pFileName)
+{
+    struct stat st;
+    return (stat(pFileName, &st) == 0) ? st.st_size : -1;
+}
+
+// 往文件末尾写一条注册记录
+static void append_record(int fd, const char *username)
+{
+    ngx_account_logrec_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = NGX_ACCOUNT_LOG_MAGIC;
+    rec.op = NGX_ACCOUNT_LOG_REGISTER;
+    strncpy(rec.username, username, NGX_ACCOUNT_NAME_LEN - 1);
+    memcpy(&rec.cred, &g_cred, sizeof(g_cred));
+    rec.crc32 = CCRC32::GetInstance()->Get_CRC((unsigned char *)&rec.op, sizeof(rec) - offsetof(ngx_account_logrec_t, op));
+    CHECK(write(fd, &rec, sizeof(rec)) == (ssize_t)sizeof(rec));
+}
+
+// 上次运行留下的日志段：一个日志段中间夹着写了一半的记录，后边的记录照样要重放出来，重放完日志段都删掉
+static void prepare_segments()
+{
+    int fd = open(TEST_LOG ".1", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    append_record(fd, "seg1_a");
+    char garbage[50];
+    memset(garbage, 0x5a, sizeof(garbage));
+    memcpy(garbage, "\x32\x43\x41\x4e", 4); // 像是一条记录的开头
+    CHECK(write(fd, garbage, sizeof(garbage)) == (ssize_t)sizeof(garbage));
+    append_record(fd, "seg1_b");
+    close(fd);
+    fd = open(TEST_LOG ".3", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    append_record(fd, "seg3_a");
+    close(fd);
+}
+
+static void test_replay_segments()
+{
+    CAccountStore *p_store = CAccountStore::GetInstance();
+    CHECK(p_store->Login("seg1_a", "password", 1) == NGX_ACCOUNT_OK);
+    CHECK(p_store->Login("seg1_b", "password", 1) == NGX_ACCOUNT_OK);
+    CHECK(p_store->Login("seg3_a", "password", 1) == NGX_ACCOUNT_OK);
+    CHECK(file_size(TEST_LOG ".3") == -1);
+    CHECK(file_size(TEST_SNAP) == 3 * (off_t)sizeof(ngx_account_logrec_t));
+}
+
+// 组提交在等着攒记录的时候，占住的账号登录不了，也注册不了；一登录得上，记录就已经在日志文件里了
+static void test_publish_after_commit()
+{
+    CAccountStore *p_store = CAccountStore::GetInstance();
+    RegisterArg arg = {"alice", -1};
+    pthread_t handle;
+    off_t before = file_size(TEST_SEG);
+    pthread_create(&handle, NULL, register_thread, &arg);
+
+    usleep(100 * 1000); // 提交线程要等300毫秒才写盘
+    CHECK(p_store->Login("alice", "password", 1) == NGX_ACCOUNT_NOTFOUND);
+    CHECK(p_store->Register("alice", &g_cred, 0, 0, false) == NGX_ACCOUNT_EXISTS);
+
+    while (p_store->Login("alice", "password", 1) != NGX_ACCOUNT_OK)
+        usleep(100);
+    CHECK(file_size(TEST_SEG) >= before + (off_t)sizeof(ngx_account_logrec_t));
+
+    pthread_join(handle, NULL);
+    CHECK(arg.iRet == NGX_ACCOUNT_OK);
+}
+
+// 写盘失败：注册失败，写了一半的记录截掉了，账号登录不了，用户名放掉了，可以再注册
+static void test_withdraw_on_failure()
+{
+    CAccountStore *p_store = CAccountStore::GetInstance();
+    struct rlimit rl;
+    getrlimit(RLIMIT_FSIZE, &rl);
+    struct rlimit small = rl;
+    off_t before = file_size(TEST_SEG);
+    small.rlim_cur = before + 64; // 文件只能再长64字节，一条记录只能写进去一半
+    setrlimit(RLIMIT_FSIZE, &small);
+
+    CHECK(CAccountLog::GetInstance()->RegisterAccount("bob", &g_cred, 0, 0) == NGX_ACCOUNT_IOERR);
+    CHECK(file_size(TEST_SEG) == before);
+    CHECK(p_store->Login("bob", "password", 1) == NGX_ACCOUNT_NOTFOUND);
+
+    // 磁盘恢复了，后边的注册照常落盘，不会因为前边失败过一次就一直失败
+    setrlimit(RLIMIT_FSIZE, &rl);
+    CHECK(CAccountLog::GetInstance()->RegisterAccount("bob", &g_cred, 0, 0) == NGX_ACCOUNT_OK);
+    CHECK(file_size(TEST_SEG) == before + (off_t)sizeof(ngx_account_logrec_t));
+    CHECK(p_store->Login("bob", "password", 1) == NGX_ACCOUNT_OK);
+}
+
+// 提交线程还在攒记录，注册请求先等超时了：注册失败，记录从队列里拿掉不会再写，用户名放掉了
+static void test_timeout_while_queued()
+{
+    CAccountStore *p_store = CAccountStore::GetInstance();
+    CAccountLog *p_accountlog = CAccountLog::GetInstance();
+    p_accountlog->Stop();
+    CHECK(p_accountlog->Start(1024, 500 * 1000, 100)); // 攒500毫秒才写盘，注册最多等100毫秒，新建日志段.2
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    CHECK(p_accountlog->RegisterAccount("carol", &g_cred, 0, 0) == NGX_ACCOUNT_IOERR);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+    CHECK(ms >= 90 && ms < 400);
+    CHECK(p_store->Login("carol", "password", 1) == NGX_ACCOUNT_NOTFOUND);
+    CHECK(p_store->Register("carol", &g_cred, 0, 0, false) == NGX_ACCOUNT_OK);
+
+    p_accountlog->Stop(); // 提交线程醒来发现队列空了，什么都不写
+    CHECK(file_size(TEST_LOG ".2") == 0);
+}
+
+int main()
+{
+    char dir[] = "/tmp/test_accountlog.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) == -1)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    signal(SIGXFSZ, SIG_IGN); // 超过文件大小限制时让write()返回EFBIG，不要把进程杀掉
+
+    if (CAccountStore::MakeCredential("password", 1, &g_cred) == false)
+    {
+        fprintf(stderr, "MakeCredential()失败\n");
+        return 1;
+    }
+    prepare_segments();
+    CAccountLog *p_accountlog = CAccountLog::GetInstance();
+    if (!CAccountStore::GetInstance()->Init(1000, 4) || !p_accountlog->Open(TEST_LOG, TEST_SNAP) || !p_accountlog->Start(1024, 300 * 1000, 5000))
+    {
+        fprintf(stderr, "初始化失败\n");
+        return 1;
+    }
+
+    test_replay_segments();
+    test_publish_after_commit();
+    test_withdraw_on_failure();
+    test_timeout_while_queued();
+
+    unlink(TEST_SEG);
+    unlink(TEST_LOG ".2");
+    unlink(TEST_SNAP);
+    rmdir(dir);
+    printf("{\"test\":\"accountlog\",\"fails\":%d}\n", g_fails);
+    return g_fails ? 1 : 0;
+}
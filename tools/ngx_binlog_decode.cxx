@@ -0,0 +1,153 @@
+﻿// 二进制日志解码工具：把LogBinaryFile指定的二进制日志展开成和error.log一样格式的文本行
+// 用法：tools/bin/ngx_binlog_decode [二进制日志文件，缺省为error.binlog，-表示标准输入]
+// 格式串来自ngx_binlog.h中的格式表，数字的格式化用的是服务器同一份ngx_slprintf()，解出来的行和直接写文本日志一模一样
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <vector>
+
+#include "ngx_macro.h"
+#include "ngx_binlog.h"
+
+u_char *ngx_slprintf(u_char *buf, u_char *last, const char *fmt, ...); // 在app/ngx_printf.cxx中
+
+// 和app/ngx_log.cxx中的err_levels一一对应
+static const char *err_levels[] = {"stderr", "emerg", "alert", "crit", "error", "warn", "notice", "info", "debug"};
+
+// 按格式串把参数展开，每遇到一个%格式就把这一个格式连同它前边的普通字符交给ngx_slprintf()，参数按格式要求的类型传进去
+static u_char *decode_message(u_char *p, u_char *last, const char *fmt, const int64_t *args)
+{
+	char spec[64];
+	int iarg = 0;
+	while (*fmt && p < last)
+	{
+		if (*fmt != '%')
+		{
+			*p++ = *fmt++;
+			continue;
+		}
+		const char *begin = fmt++;
+		bool sign = true;
+		while ((*fmt >= '0' && *fmt <= '9') || *fmt == 'u' || *fmt == 'x' || *fmt == 'X')
+		{
+			if (*fmt == 'u' || *fmt == 'x' || *fmt == 'X')
+				sign = false;
+			fmt++;
+		}
+		if (*fmt == 0)
+			break;
+		char conv = *fmt++;
+		size_t len = fmt - begin;
+		if (len >= sizeof(spec))
+			len = sizeof(spec) - 1;
+		memcpy(spec, begin, len);
+		spec[len] = 0;
+		if (conv == '%')
+		{
+			*p++ = '%';
+			continue;
+		}
+
+		int64_t v = args[iarg++];
+		switch (conv)
+		{
+		case 'd':
+			p = sign ? ngx_slprintf(p, last, spec, (int)v) : ngx_slprintf(p, last, spec, (u_int)v);
+			break;
+		case 'i':
+			p = sign ? ngx_slprintf(p, last, spec, (intptr_t)v) : ngx_slprintf(p, last, spec, (uintptr_t)v);
+			break;
+		case 'L':
+			p = sign ? ngx_slprintf(p, last, spec, v) : ngx_slprintf(p, last, spec, (uint64_t)v);
+			break;
+		case 'P':
+			p = ngx_slprintf(p, last, spec, (pid_t)v);
+			break;
+		case 'p':
+			p = ngx_slprintf(p, last, spec, (void *)(uintptr_t)v);
+			break;
+		default: // 格式表在编译期检查过，不会走到这里
+			break;
+		}
+	}
+	return p;
+}
+
+int main(int argc, char **argv)
+{
+	const char *pname = argc > 1 ? argv[1] : NGX_BINLOG_PATH;
+	FILE *fp = strcmp(pname, "-") == 0 ? stdin : fopen(pname, "rb");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "打开文件%s失败\n", pname);
+		return 1;
+	}
+	std::vector<char> data;
+	char chunk[65536];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+		data.insert(data.end(), chunk, chunk + n);
+	if (fp != stdin)
+		fclose(fp);
+
+	ngx_binlog_filehdr_t fhdr;
+	if (data.size() < sizeof(fhdr))
+	{
+		fprintf(stderr, "%s不是二进制日志文件\n", pname);
+		return 1;
+	}
+	memcpy(&fhdr, &data[0], sizeof(fhdr));
+	if (memcmp(fhdr.magic, NGX_BINLOG_MAGIC, sizeof(fhdr.magic)) != 0 || fhdr.version != NGX_BINLOG_VERSION || fhdr.recsize != sizeof(ngx_binlog_rec_t))
+	{
+		fprintf(stderr, "%s不是二进制日志文件，或者版本不对\n", pname);
+		return 1;
+	}
+
+	u_char line[NGX_MAX_ERROR_STR + 1];
+	u_char *last = line + NGX_MAX_ERROR_STR;
+	size_t pos = sizeof(fhdr);
+	unsigned long long count = 0;
+	while (pos + sizeof(ngx_binlog_rec_t) <= data.size())
+	{
+		ngx_binlog_rec_t rec;
+		int64_t args[NGX_BINLOG_MAX_ARGS];
+		memcpy(&rec, &data[pos], sizeof(rec));
+		if (rec.id >= NGX_BL_MAX || rec.nargs != ngx_binlog_argc(ngx_binlog_formats[rec.id].fmt) || rec.level > NGX_LOG_DEBUG)
+		{
+			fprintf(stderr, "偏移%zu处的记录不对（格式编号%d），文件坏了或者是更新版本的服务器写的，停止解码\n", pos, rec.id);
+			return 1;
+		}
+		size_t reclen = sizeof(rec) + rec.nargs * sizeof(int64_t);
+		if (pos + reclen > data.size())
+			break;
+		memcpy(args, &data[pos + sizeof(rec)], rec.nargs * sizeof(int64_t));
+		pos += reclen;
+
+		// 时间 [等级] 进程id: 内容，和ngx_log_error_core()写出来的一样
+		struct tm tm;
+		time_t sec = (time_t)(rec.usec / 1000000);
+		localtime_r(&sec, &tm);
+		u_char *p = ngx_slprintf(line, last, "%4d/%02d/%02d %02d:%02d:%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+								 tm.tm_hour, tm.tm_min, tm.tm_sec);
+		p = ngx_slprintf(p, last, " [%s] ", err_levels[rec.level]);
+		p = ngx_slprintf(p, last, "%P: ", (pid_t)rec.pid);
+		if (rec.level == NGX_LOG_STDERR)
+			p = ngx_slprintf(p, last, "nginx: "); // ngx_log_stderr()写的行都有这个前缀
+		p = decode_message(p, last, ngx_binlog_formats[rec.id].fmt, args);
+		if (rec.err)
+			p = ngx_slprintf(p, last, " (%d: %s) ", rec.err, strerror(rec.err));
+		if (p >= last)
+			p = last - 1;
+		*p++ = '\n';
+		fwrite(line, 1, p - line, stdout);
+		count++;
+	}
+	if (pos != data.size())
+		fprintf(stderr, "文件末尾有%zu字节不完整的记录，忽略\n", data.size() - pos);
+	fprintf(stderr, "共解码%llu条记录\n", count);
+	return 0;
+}
@@ -0,0 +1,360 @@
+﻿// 流量重放工具：读服务器录下的流量录制文件（CaptureFile.进程id，布局见ngx_capture.h），按原来的连接和时间间隔把同样的字节流再发给一个服务器
+// 用法：tools/bin/ngx_capture_replay [--host=127.0.0.1] [--port=8080] [--speed=1] [--linger=1000] 录制文件...
+//   几个worker进程的文件一起给出时按时间合在一起重放；--speed=2就是两倍速，--speed=0表示不等，能发多快发多快
+//   录制中的一条连接重放时也是一条连接，它的最后一个包发出去--linger毫秒后关闭，期间收到的应答读出来丢掉
+// 结果打印到标准输出，一行JSON：重放了多少包、多少字节、多少连接，收到多少应答字节，被服务器断开的连接数，
+// 实际发送时间比计划晚了多少（lag_max_us、lag_avg_us，能看出重放工具本身是不是跟不上）
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ngx_capture.h"
+
+// 要重放的一个包
+typedef struct
+{
+	uint64_t usec;	 // 录制时的时间
+	int conn;		 // 属于哪条连接，ReplayConn的下标
+	const char *pkg; // 包头+包体，在映射的文件里
+	uint32_t len;
+} ReplayPkg;
+
+// 重放时的一条连接
+typedef struct
+{
+	int fd;				 // -1表示还没连或者已经关了
+	bool closed;		 // 已经关了（包括被服务器断开），后边的包不再发
+	size_t lastPkg;		 // 这条连接的最后一个包在所有包中的下标
+	uint64_t closeAt;	 // 最后一个包发完后什么时候关（单调时钟，微秒），0表示还没到这一步
+	std::string outbuf;	 // 还没发出去的字节
+} ReplayConn;
+
+static std::vector<ReplayConn> s_conns;
+static int s_epfd;
+static struct sockaddr_in s_addr;
+static uint64_t s_recvBytes = 0;
+static int s_serverClosed = 0; // 被服务器断开的连接数
+static int s_openConns = 0;
+
+static uint64_t now_usec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const char *arg_str(int argc, char **argv, const char *name, const char *def)
+{
+	size_t len = strlen(name);
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--", 2) == 0 && strncmp(argv[i] + 2, name, len) == 0 && argv[i][2 + len] == '=')
+			return argv[i] + 3 + len;
+	}
+	return def;
+}
+
+// 映射一个录制文件，把其中的记录加到pkgs中，连接按(文件, 连接地址, 序号)区分
+static bool load_file(const char *pName, int fileIdx, std::vector<ReplayPkg> &pkgs, std::map<std::string, int> &connIds)
+{
+	int fd = open(pName, O_RDONLY);
+	if (fd == -1)
+	{
+		fprintf(stderr, "打不开录制文件%s：%s\n", pName, strerror(errno));
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ngx_capture_filehdr_t))
+	{
+		fprintf(stderr, "%s不是录制文件\n", pName);
+		close(fd);
+		return false;
+	}
+	char *pMem = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (pMem == MAP_FAILED)
+	{
+		fprintf(stderr, "映射%s失败：%s\n", pName, strerror(errno));
+		return false;
+	}
+	const ngx_capture_filehdr_t *pHdr = (const ngx_capture_filehdr_t *)pMem;
+	if (memcmp(pHdr->magic, NGX_CAPTURE_MAGIC, sizeof(pHdr->magic)) != 0 || pHdr->version != NGX_CAPTURE_VERSION ||
+		pHdr->hdrsize != sizeof(ngx_capture_filehdr_t) || pHdr->recsize != sizeof(ngx_capture_rec_t))
+	{
+		fprintf(stderr, "%s不是录制文件或者版本不对\n", pName);
+		return false;
+	}
+	// 服务器还在录的文件也能读，读到used为止
+	uint64_t used = __atomic_load_n(&pHdr->used, __ATOMIC_ACQUIRE);
+	if (used > (uint64_t)st.st_size - pHdr->hdrsize)
+		used = (uint64_t)st.st_size - pHdr->hdrsize;
+
+	const char *p = pMem + pHdr->hdrsize;
+	const char *pEnd = p + used;
+	size_t count = 0;
+	while (p + sizeof(ngx_capture_rec_t) <= pEnd)
+	{
+		const ngx_capture_rec_t *pRec = (const ngx_capture_rec_t *)p;
+		if (p + ngx_capture_reclen(pRec->len) > pEnd)
+			break;
+		char key[64];
+		snprintf(key, sizeof(key), "%d/%llx/%u", fileIdx, (unsigned long long)pRec->conn, pRec->seq);
+		std::map<std::string, int>::iterator it = connIds.find(key);
+		int conn;
+		if (it == connIds.end())
+		{
+			conn = (int)s_conns.size();
+			connIds[key] = conn;
+			ReplayConn c;
+			c.fd = -1;
+			c.closed = false;
+			c.lastPkg = 0;
+			c.closeAt = 0;
+			s_conns.push_back(c);
+		}
+		else
+		{
+			conn = it->second;
+		}
+		ReplayPkg pkg;
+		pkg.usec = pRec->usec;
+		pkg.conn = conn;
+		pkg.pkg = (const char *)(pRec + 1);
+		pkg.len = pRec->len;
+		pkgs.push_back(pkg);
+		p += ngx_capture_reclen(pRec->len);
+		count++;
+	}
+	fprintf(stderr, "%s：worker进程%d，%zu个包，录制时没录的%llu个\n", pName, pHdr->pid, count, (unsigned long long)pHdr->dropped);
+	return true;
+}
+
+static void close_conn(ReplayConn &c)
+{
+	if (c.fd != -1)
+	{
+		close(c.fd); // 关闭的fd自动从epoll中去掉
+		c.fd = -1;
+		s_openConns--;
+	}
+	c.closed = true;
+	c.outbuf.clear();
+}
+
+// 把连接上积压的字节尽量发出去，发不完的等EPOLLOUT
+static void flush_conn(ReplayConn &c, int idx)
+{
+	while (!c.outbuf.empty())
+	{
+		ssize_t n = send(c.fd, c.outbuf.data(), c.outbuf.size(), MSG_NOSIGNAL);
+		if (n > 0)
+		{
+			c.outbuf.erase(0, n);
+			continue;
+		}
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		s_serverClosed++;
+		close_conn(c);
+		return;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN | (c.outbuf.empty() ? 0 : EPOLLOUT);
+	ev.data.u32 = idx;
+	epoll_ctl(s_epfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+static bool open_conn(ReplayConn &c, int idx)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+	{
+		fprintf(stderr, "socket()失败：%s\n", strerror(errno));
+		return false;
+	}
+	if (connect(fd, (struct sockaddr *)&s_addr, sizeof(s_addr)) == -1)
+	{
+		fprintf(stderr, "connect()失败：%s\n", strerror(errno));
+		close(fd);
+		return false;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u32 = idx;
+	epoll_ctl(s_epfd, EPOLL_CTL_ADD, fd, &ev);
+	c.fd = fd;
+	s_openConns++;
+	return true;
+}
+
+// 处理网络事件，最多等timeoutMs毫秒，顺便关掉到时间的连接
+static void pump(int timeoutMs)
+{
+	struct epoll_event evs[256];
+	char buf[65536];
+	int n = epoll_wait(s_epfd, evs, 256, timeoutMs);
+	for (int i = 0; i < n; i++)
+	{
+		int idx = (int)evs[i].data.u32;
+		ReplayConn &c = s_conns[idx];
+		if (c.fd == -1)
+			continue;
+		if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		{
+			ssize_t r = recv(c.fd, buf, sizeof(buf), 0);
+			if (r > 0)
+			{
+				s_recvBytes += r;
+			}
+			else if (r == 0 || (errno != EAGAIN && errno != EINTR))
+			{
+				s_serverClosed++;
+				close_conn(c);
+				continue;
+			}
+		}
+		if (evs[i].events & EPOLLOUT)
+			flush_conn(c, idx);
+	}
+}
+
+// 关掉最后一个包已经发完、等够时间的连接
+static void close_lingering(std::vector<int> &lingering)
+{
+	uint64_t now = now_usec();
+	for (size_t j = 0; j < lingering.size();)
+	{
+		ReplayConn &c = s_conns[lingering[j]];
+		if (c.fd == -1 || (c.outbuf.empty() && now >= c.closeAt))
+		{
+			close_conn(c);
+			lingering[j] = lingering.back();
+			lingering.pop_back();
+		}
+		else
+		{
+			j++;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *pHost = arg_str(argc, argv, "host", "127.0.0.1");
+	int port = atoi(arg_str(argc, argv, "port", "8080"));
+	double speed = atof(arg_str(argc, argv, "speed", "1"));
+	uint64_t lingerUs = (uint64_t)atoll(arg_str(argc, argv, "linger", "1000")) * 1000;
+
+	std::vector<ReplayPkg> pkgs;
+	std::map<std::string, int> connIds;
+	int files = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strncmp(argv[i], "--", 2) == 0)
+			continue;
+		if (!load_file(argv[i], files++, pkgs, connIds))
+			return 1;
+	}
+	if (pkgs.empty())
+	{
+		fprintf(stderr, "用法：%s [--host=127.0.0.1] [--port=8080] [--speed=1] [--linger=1000] 录制文件...\n", argv[0]);
+		return 1;
+	}
+
+	// 几个文件的包合在一起按时间排，时间相同的保持原来的顺序，同一条连接上的包顺序不会变
+	std::stable_sort(pkgs.begin(), pkgs.end(), [](const ReplayPkg &a, const ReplayPkg &b) { return a.usec < b.usec; });
+	for (size_t i = 0; i < pkgs.size(); i++)
+		s_conns[pkgs[i].conn].lastPkg = i;
+
+	memset(&s_addr, 0, sizeof(s_addr));
+	s_addr.sin_family = AF_INET;
+	s_addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, pHost, &s_addr.sin_addr) != 1)
+	{
+		fprintf(stderr, "地址%s不对\n", pHost);
+		return 1;
+	}
+	s_epfd = epoll_create(1024);
+
+	uint64_t sentBytes = 0, sentPkgs = 0, lagSum = 0, lagMax = 0;
+	uint64_t t0 = pkgs[0].usec;
+	uint64_t start = now_usec();
+	std::vector<int> lingering; // 最后一个包已经交出去、等着关闭的连接
+	for (size_t i = 0; i < pkgs.size(); i++)
+	{
+		const ReplayPkg &pkg = pkgs[i];
+		// 等到计划的时间，等的时候照样收应答
+		if (speed > 0)
+		{
+			uint64_t due = start + (uint64_t)((pkg.usec - t0) / speed);
+			for (;;)
+			{
+				uint64_t now = now_usec();
+				if (now >= due)
+				{
+					lagSum += now - due;
+					lagMax = std::max(lagMax, now - due);
+					break;
+				}
+				pump((due - now) >= 2000 ? (int)((due - now) / 1000 - 1) : 0);
+			}
+		}
+		else
+		{
+			pump(0);
+		}
+
+		close_lingering(lingering);
+
+		ReplayConn &c = s_conns[pkg.conn];
+		if (c.closed)
+			continue; // 被服务器断开了，这条连接后边的包不发了
+		if (c.fd == -1 && !open_conn(c, pkg.conn))
+			return 1;
+		c.outbuf.append(pkg.pkg, pkg.len);
+		sentPkgs++;
+		sentBytes += pkg.len;
+		flush_conn(c, pkg.conn);
+		if (i == c.lastPkg && c.fd != -1)
+		{
+			c.closeAt = now_usec() + lingerUs;
+			lingering.push_back(pkg.conn);
+		}
+	}
+
+	// 剩下的连接发完、等够时间再关
+	while (!lingering.empty())
+	{
+		pump(10);
+		close_lingering(lingering);
+	}
+	uint64_t elapsed = now_usec() - start;
+
+	printf("{\"tool\":\"capture_replay\",\"files\":%d,\"speed\":%g,\"pkgs\":%llu,\"bytes\":%llu,\"conns\":%zu,\"recv_bytes\":%llu,"
+		   "\"server_closed\":%d,\"capture_span_us\":%llu,\"elapsed_us\":%llu,\"lag_max_us\":%llu,\"lag_avg_us\":%llu}\n",
+		   files, speed, (unsigned long long)sentPkgs, (unsigned long long)sentBytes, s_conns.size(), (unsigned long long)s_recvBytes,
+		   s_serverClosed, (unsigned long long)(pkgs.back().usec - t0), (unsigned long long)elapsed,
+		   (unsigned long long)lagMax, (unsigned long long)(sentPkgs ? lagSum / sentPkgs : 0));
+	return 0;
+}
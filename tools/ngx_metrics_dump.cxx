@@ -0,0 +1,118 @@
+﻿// 统计信息查看工具：直接映射MetricsFile指定的文件，读服务器各个worker进程的统计，不用和服务器通讯，也不加锁
+// 用法：tools/bin/ngx_metrics_dump [统计信息文件，缺省为metrics.shm] [-w]
+// 缺省只打印所有worker进程加起来的结果，-w再逐个打印每个worker进程的
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ngx_macro.h"
+#include "ngx_metrics.h"
+
+static void print_hist(const char *name, const ngx_metrics_hist_snap_t *h)
+{
+	printf("  %-32s count=%llu avg=%llu p50=%llu p90=%llu p99=%llu p999=%llu\n", name,
+		   (unsigned long long)h->count, (unsigned long long)(h->count ? h->sum / h->count : 0),
+		   (unsigned long long)ngx_metrics_hist_percentile(h, 0.5), (unsigned long long)ngx_metrics_hist_percentile(h, 0.9),
+		   (unsigned long long)ngx_metrics_hist_percentile(h, 0.99), (unsigned long long)ngx_metrics_hist_percentile(h, 0.999));
+}
+
+static void print_snap(const ngx_metrics_snap_t *pSnap)
+{
+	for (int i = 0; i < NGX_MC_MAX; i++)
+		printf("  %-32s %lld\n", ngx_metrics_counter_desc[i].name, (long long)pSnap->counters[i]);
+	for (int i = 0; i < NGX_MG_MAX; i++)
+		printf("  %-32s %lld\n", ngx_metrics_gauge_desc[i].name, (long long)pSnap->gauges[i]);
+	for (int i = 0; i < NGX_MH_MAX; i++)
+		print_hist(ngx_metrics_hist_desc[i].name, &pSnap->hists[i]);
+
+	// 按消息代码分阶段的延迟，只打印有数据的
+	for (int c = 0; c < NGX_METRICS_MSGCODES; c++)
+	{
+		for (int s = 0; s < NGX_MS_MAX; s++)
+		{
+			if (pSnap->stages[c][s].count == 0)
+				continue;
+			char name[64];
+			snprintf(name, sizeof(name), "msg%d%s/%s", c, (c == NGX_METRICS_MSGCODES - 1) ? "+" : "", ngx_metrics_stage_desc[s].name);
+			print_hist(name, &pSnap->stages[c][s]);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *pname = NGX_METRICS_PATH;
+	bool perWorker = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-w") == 0)
+			perWorker = true;
+		else
+			pname = argv[i];
+	}
+
+	int fd = open(pname, O_RDONLY);
+	if (fd == -1)
+	{
+		fprintf(stderr, "打开文件%s失败\n", pname);
+		return 1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ngx_metrics_shm_t))
+	{
+		fprintf(stderr, "%s不是统计信息文件\n", pname);
+		close(fd);
+		return 1;
+	}
+	void *pMem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pMem == MAP_FAILED)
+	{
+		fprintf(stderr, "映射文件%s失败\n", pname);
+		return 1;
+	}
+
+	lpngx_metrics_shm_t pShm = (lpngx_metrics_shm_t)pMem;
+	if (memcmp(pShm->magic, NGX_METRICS_MAGIC, sizeof(pShm->magic)) != 0 || pShm->version != NGX_METRICS_VERSION ||
+		pShm->blockSize != sizeof(ngx_metrics_block_t) || pShm->counters != NGX_MC_MAX || pShm->gauges != NGX_MG_MAX ||
+		pShm->hists != NGX_MH_MAX || pShm->msgcodes != NGX_METRICS_MSGCODES || pShm->stages != NGX_MS_MAX || (size_t)st.st_size < ngx_metrics_shm_size(pShm->maxWorkers))
+	{
+		fprintf(stderr, "%s不是统计信息文件，或者是别的版本的服务器写的\n", pname);
+		return 1;
+	}
+
+	ngx_metrics_snap_t *pSnap = new ngx_metrics_snap_t;
+	ngx_metrics_snap_t *pOne = new ngx_metrics_snap_t;
+	time_t now = time(NULL);
+	ngx_metrics_aggregate(pShm, pSnap, pOne);
+	printf("master进程%d，已运行%lld秒，%d个worker进程\n", pShm->masterPid, (long long)(now - pShm->startTime), pSnap->workers);
+	print_snap(pSnap);
+
+	if (perWorker)
+	{
+		for (uint32_t w = 0; w < pShm->maxWorkers; w++)
+		{
+			lpngx_metrics_block_t pBlock = ngx_metrics_block(pShm, (int)w);
+			uint32_t spawns = pBlock->spawns.load(std::memory_order_relaxed);
+			if (spawns == 0)
+				continue; // 没用过的槽位
+			int pid = pBlock->pid.load(std::memory_order_relaxed);
+			ngx_metrics_read_block(pBlock, pSnap);
+			if (pid != 0)
+				printf("槽位%u：worker进程%d，已运行%lld秒，本槽位启动过%u次\n", w, pid,
+					   (long long)(now - pBlock->startTime.load(std::memory_order_relaxed)), spawns);
+			else
+				printf("槽位%u：worker进程已退出，本槽位启动过%u次\n", w, spawns);
+			print_snap(pSnap);
+		}
+	}
+	delete pSnap;
+	delete pOne;
+	munmap(pMem, st.st_size);
+	return 0;
+}